@@ -0,0 +1,404 @@
+/*****************************************************************************
+ *  Written by Chris Dunlap <cdunlap@llnl.gov>.
+ *  Copyright (C) 2007-2019 Lawrence Livermore National Security, LLC.
+ *  Copyright (C) 2001-2007 The Regents of the University of California.
+ *  UCRL-CODE-2002-009.
+ *
+ *  This file is part of ConMan: The Console Manager.
+ *  For details, see <https://dun.github.io/conman/>.
+ *
+ *  ConMan is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  ConMan is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with ConMan.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+/*  The conman-bench-tpoll micro-benchmark measures the cost of a tpoll()
+ *    wakeup when a few of many file descriptors are ready, as when a daemon
+ *    muxes many mostly-idle consoles.
+ *  It is built twice: conman-bench-tpoll uses the epoll backend (where
+ *    available), and conman-bench-poll is built with TPOLL_NO_EPOLL
+ *    to force the poll() backend for comparison.
+ *  The idle fds are duplicates of the read end of a pipe that is never
+ *    written, so a large number of them can be monitored cheaply.
+ *  With -T, it instead measures timer churn: the cost of cancelling and
+ *    re-arming one of many pending timers (as when consoles reset their
+ *    reconnect or keepalive timers), and of dispatching all of them at once
+ *    (as when many consoles lose their connections together).
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "tpoll.h"
+#include "util-file.h"
+#include "util.h"
+
+
+#define BENCH_TPOLL_DEFAULT_FDS         1000
+#define BENCH_TPOLL_DEFAULT_BUSY        1
+#define BENCH_TPOLL_DEFAULT_ITERS       10000
+#define BENCH_TPOLL_MAX_TIMER_MSECS     60000
+#define BENCH_TPOLL_EXTRA_FDS           16
+
+#if defined(TPOLL_NO_EPOLL) || !HAVE_SYS_EPOLL_H
+#  define BENCH_TPOLL_BACKEND           "poll"
+#else
+#  define BENCH_TPOLL_BACKEND           "epoll"
+#endif
+
+typedef struct bench_tpoll_conf {
+    char            *prog;              /* program name                      */
+    int              numFds;            /* num fds monitored (idle + busy)   */
+    int              numBusy;           /* num fds made ready each iteration */
+    int              numIters;          /* num iterations to run             */
+    int              numTimers;         /* num timers pending, or 0 for fds  */
+} bench_tpoll_conf_t;
+
+static void parse_bench_tpoll_cmd_line(int argc, char *argv[],
+    bench_tpoll_conf_t *conf);
+static void display_bench_tpoll_help(bench_tpoll_conf_t *conf);
+static int raise_fd_limit(int numFds);
+static void run_bench_fds(bench_tpoll_conf_t *conf);
+static void run_bench_timers(bench_tpoll_conf_t *conf);
+static void count_timer(int *count);
+static double get_elapsed_secs(struct timeval *tv0);
+
+
+int main(int argc, char *argv[])
+{
+    bench_tpoll_conf_t conf;
+
+    log_set_file(stderr, LOG_WARNING, 0);
+
+    memset(&conf, 0, sizeof(conf));
+    parse_bench_tpoll_cmd_line(argc, argv, &conf);
+    if (conf.numTimers > 0) {
+        run_bench_timers(&conf);
+    }
+    else {
+        run_bench_fds(&conf);
+    }
+    return(0);
+}
+
+
+static void parse_bench_tpoll_cmd_line(int argc, char *argv[],
+    bench_tpoll_conf_t *conf)
+{
+/*  Parses the command-line of the micro-benchmark into (conf).
+ */
+    int c;
+    char *p;
+
+    conf->prog = (p = strrchr(argv[0], '/')) ? p + 1 : argv[0];
+    conf->numFds = BENCH_TPOLL_DEFAULT_FDS;
+    conf->numBusy = BENCH_TPOLL_DEFAULT_BUSY;
+    conf->numIters = BENCH_TPOLL_DEFAULT_ITERS;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "a:f:hi:T:")) != -1) {
+        switch(c) {
+        case 'a':
+            conf->numBusy = atoi(optarg);
+            break;
+        case 'f':
+            conf->numFds = atoi(optarg);
+            break;
+        case 'h':
+            display_bench_tpoll_help(conf);
+            exit(0);
+        case 'i':
+            conf->numIters = atoi(optarg);
+            break;
+        case 'T':
+            conf->numTimers = atoi(optarg);
+            if (conf->numTimers <= 0) {
+                log_err(0, "CMDLINE: number of timers must be positive");
+            }
+            break;
+        case '?':
+            log_err(0, "CMDLINE: invalid option \"%s\"", argv[optind - 1]);
+            break;
+        default:
+            log_err(0, "CMDLINE: option \"%c\" not implemented", c);
+            break;
+        }
+    }
+    if (optind < argc) {
+        log_err(0, "CMDLINE: unexpected argument \"%s\"", argv[optind]);
+    }
+    if (conf->numFds <= 0) {
+        log_err(0, "CMDLINE: number of fds must be positive");
+    }
+    if ((conf->numBusy <= 0) || (conf->numBusy > conf->numFds)) {
+        log_err(0, "CMDLINE: number of busy fds must be within 1-%d",
+            conf->numFds);
+    }
+    if (conf->numIters <= 0) {
+        log_err(0, "CMDLINE: number of iterations must be positive");
+    }
+    return;
+}
+
+
+static void display_bench_tpoll_help(bench_tpoll_conf_t *conf)
+{
+    printf("Usage: %s [OPTIONS]\n", conf->prog);
+    printf("\n");
+    printf("  -a NUM     Make NUM fds ready each iteration. [%d]\n",
+        BENCH_TPOLL_DEFAULT_BUSY);
+    printf("  -f NUM     Monitor NUM fds in total. [%d]\n",
+        BENCH_TPOLL_DEFAULT_FDS);
+    printf("  -h         Display this help.\n");
+    printf("  -i NUM     Run NUM iterations. [%d]\n",
+        BENCH_TPOLL_DEFAULT_ITERS);
+    printf("  -T NUM     Measure churn of NUM pending timers (not fds).\n");
+    printf("\n");
+    printf("This binary uses the %s backend.\n", BENCH_TPOLL_BACKEND);
+    printf("\n");
+    return;
+}
+
+
+static int raise_fd_limit(int numFds)
+{
+/*  Raises the soft limit on open files to the hard limit if needed
+ *    for (numFds) file descriptors.
+ *  Returns the resulting limit.
+ */
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+        log_err(errno, "Unable to get the open file limit");
+    }
+    if ((rlim.rlim_cur != RLIM_INFINITY)
+            && (rlim.rlim_cur < (rlim_t) numFds)) {
+        rlim.rlim_cur = rlim.rlim_max;
+        if ((rlim.rlim_cur != RLIM_INFINITY)
+                && (rlim.rlim_cur > (rlim_t) numFds)) {
+            rlim.rlim_cur = numFds;
+        }
+        if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+            log_err(errno, "Unable to raise the open file limit");
+        }
+    }
+    if (rlim.rlim_cur == RLIM_INFINITY) {
+        return(numFds);
+    }
+    return((int) MIN(rlim.rlim_cur, (rlim_t) numFds));
+}
+
+
+static void run_bench_fds(bench_tpoll_conf_t *conf)
+{
+/*  Monitors (numFds) fds for input, of which (numBusy) are made ready
+ *    before each tpoll() wakeup, and reports the mean cost of a wakeup
+ *    (ie, the tpoll() call, the tpoll_get_ready() scan, and the reads).
+ */
+    int need;
+    int idle[2];
+    int (*busy)[2];
+    int *fds;
+    tpoll_ready_t *ready;
+    tpoll_t tp;
+    struct timeval tv0;
+    double secs;
+    unsigned long numReady = 0;
+    char c = 0;
+    int i;
+    int k;
+    int n;
+
+    need = conf->numFds + conf->numBusy + BENCH_TPOLL_EXTRA_FDS;
+    if (raise_fd_limit(need) < need) {
+        printf("%-6s fds=%-7d busy=%-4d skipped (open file limit below %d)\n",
+            BENCH_TPOLL_BACKEND, conf->numFds, conf->numBusy, need);
+        return;
+    }
+    if (!(busy = malloc(conf->numBusy * sizeof(*busy)))) {
+        out_of_memory();
+    }
+    if (!(fds = malloc(conf->numFds * sizeof(int)))) {
+        out_of_memory();
+    }
+    if (!(ready = malloc(conf->numFds * sizeof(tpoll_ready_t)))) {
+        out_of_memory();
+    }
+    if (!(tp = tpoll_create(need))) {
+        log_err(errno, "Unable to create tpoll object");
+    }
+    if (pipe(idle) < 0) {
+        log_err(errno, "Unable to create idle pipe");
+    }
+    for (k = 0; k < conf->numBusy; k++) {
+        if (pipe(busy[k]) < 0) {
+            log_err(errno, "Unable to create busy pipe");
+        }
+        set_fd_nonblocking(busy[k][0]);
+        fds[k] = busy[k][0];
+    }
+    for (k = conf->numBusy; k < conf->numFds; k++) {
+        if ((fds[k] = dup(idle[0])) < 0) {
+            log_err(errno, "Unable to dup idle pipe");
+        }
+    }
+    for (k = 0; k < conf->numFds; k++) {
+        if (tpoll_set(tp, fds[k], POLLIN) < 0) {
+            log_err(errno, "Unable to set fd=%d in tpoll object", fds[k]);
+        }
+    }
+    gettimeofday(&tv0, NULL);
+    for (i = 0; i < conf->numIters; i++) {
+        for (k = 0; k < conf->numBusy; k++) {
+            if (write(busy[k][1], &c, 1) < 0) {
+                log_err(errno, "Unable to write to busy pipe");
+            }
+        }
+        while ((n = tpoll(tp, 1000)) < 0) {
+            if (errno != EINTR) {
+                log_err(errno, "Unable to multiplex I/O");
+            }
+        }
+        n = tpoll_get_ready(tp, ready, conf->numFds);
+        for (k = 0; k < n; k++) {
+            if (read(ready[k].fd, &c, 1) < 0) {
+                log_err(errno, "Unable to read from busy pipe");
+            }
+        }
+        numReady += n;
+    }
+    secs = get_elapsed_secs(&tv0);
+
+    printf("%-6s fds=%-7d busy=%-4d iters=%-7d usecs/wakeup=%.2f"
+        " ready/wakeup=%.2f\n", BENCH_TPOLL_BACKEND, conf->numFds,
+        conf->numBusy, conf->numIters, secs * 1e6 / conf->numIters,
+        (double) numReady / conf->numIters);
+
+    tpoll_destroy(tp);
+    for (k = 0; k < conf->numFds; k++) {
+        (void) close(fds[k]);
+    }
+    for (k = 0; k < conf->numBusy; k++) {
+        (void) close(busy[k][1]);
+    }
+    (void) close(idle[0]);
+    (void) close(idle[1]);
+    free(ready);
+    free(fds);
+    free(busy);
+    return;
+}
+
+
+static void run_bench_timers(bench_tpoll_conf_t *conf)
+{
+/*  Arms (numTimers) timers at pseudorandom delays of up to a minute.
+ *  Each iteration then cancels a pseudorandom one and re-arms it.
+ *  Finally, all timers are re-armed to expire immediately and dispatched
+ *    by a single tpoll().
+ *  Reports the mean cost of a cancel+arm and of dispatching a timer.
+ */
+    int *ids;
+    tpoll_t tp;
+    struct timeval tv0;
+    double churnSecs;
+    double expireSecs;
+    int count = 0;
+    int i;
+    int k;
+
+    if (!(ids = malloc(conf->numTimers * sizeof(int)))) {
+        out_of_memory();
+    }
+    if (!(tp = tpoll_create(0))) {
+        log_err(errno, "Unable to create tpoll object");
+    }
+    srand(1);
+    for (k = 0; k < conf->numTimers; k++) {
+        ids[k] = tpoll_timeout_relative(tp, (callback_f) count_timer, &count,
+            1 + (rand() % BENCH_TPOLL_MAX_TIMER_MSECS));
+        if (ids[k] < 0) {
+            log_err(errno, "Unable to arm timer");
+        }
+    }
+    gettimeofday(&tv0, NULL);
+    for (i = 0; i < conf->numIters; i++) {
+        k = rand() % conf->numTimers;
+        if (tpoll_timeout_cancel(tp, ids[k]) < 0) {
+            log_err(errno, "Unable to cancel timer");
+        }
+        ids[k] = tpoll_timeout_relative(tp, (callback_f) count_timer, &count,
+            1 + (rand() % BENCH_TPOLL_MAX_TIMER_MSECS));
+        if (ids[k] < 0) {
+            log_err(errno, "Unable to arm timer");
+        }
+    }
+    churnSecs = get_elapsed_secs(&tv0);
+
+    for (k = 0; k < conf->numTimers; k++) {
+        (void) tpoll_timeout_cancel(tp, ids[k]);
+        if (tpoll_timeout_relative(tp, (callback_f) count_timer, &count, 0)
+                < 0) {
+            log_err(errno, "Unable to arm timer");
+        }
+    }
+    gettimeofday(&tv0, NULL);
+    while (count < conf->numTimers) {
+        if ((tpoll(tp, 0) < 0) && (errno != EINTR)) {
+            log_err(errno, "Unable to dispatch timers");
+        }
+    }
+    expireSecs = get_elapsed_secs(&tv0);
+
+    printf("timers=%-8d iters=%-7d usecs/churn=%.3f usecs/expire=%.3f\n",
+        conf->numTimers, conf->numIters, churnSecs * 1e6 / conf->numIters,
+        expireSecs * 1e6 / conf->numTimers);
+
+    tpoll_destroy(tp);
+    free(ids);
+    return;
+}
+
+
+static void count_timer(int *count)
+{
+/*  Timer callback counting the number of timers dispatched.
+ */
+    (*count)++;
+    return;
+}
+
+
+static double get_elapsed_secs(struct timeval *tv0)
+{
+/*  Returns the secs elapsed since the time (tv0).
+ */
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return((tv.tv_sec - tv0->tv_sec) + ((tv.tv_usec - tv0->tv_usec) / 1e6));
+}
@@ -0,0 +1,860 @@
+/*****************************************************************************
+ *  Written by Chris Dunlap <cdunlap@llnl.gov>.
+ *  Copyright (C) 2007-2019 Lawrence Livermore National Security, LLC.
+ *  Copyright (C) 2001-2007 The Regents of the University of California.
+ *  UCRL-CODE-2002-009.
+ *
+ *  This file is part of ConMan: The Console Manager.
+ *  For details, see <https://dun.github.io/conman/>.
+ *
+ *  ConMan is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  ConMan is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with ConMan.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+/*  The conman-bench load driver opens a mix of headless client sessions to
+ *    the test consoles of a benchmark daemon (see scripts/bench/bench.sh),
+ *    reads their output as fast as it arrives, writes to the consoles at a
+ *    fixed rate, and reports the throughput of each type of session.
+ *  It can also storm the server with concurrent query connections and
+ *    report the rate and latency at which they are admitted, optionally
+ *    while slow clients trickle in their greetings to tie up the server's
+ *    client worker threads.
+ *  In replay mode, it instead writes a captured console trace to stdout in
+ *    a loop; this serves as the program of a benchmark process console.
+ *  The benchmark consoles are named by a prefix followed by a 4-digit index.
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "util-file.h"
+#include "util-net.h"
+#include "util-str.h"
+#include "util.h"
+
+
+#define BENCH_DEFAULT_PREFIX    "bench"
+#define BENCH_DEFAULT_SECS      10
+#define BENCH_TICK_MSECS        100
+#define BENCH_BUF_SIZE          65536
+#define BENCH_SLOW_MSECS        1000
+
+typedef enum bench_type {               /* type of benchmark client session  */
+    BENCH_MONITOR,                      /*  read-only session w/ 1 console   */
+    BENCH_CONNECT,                      /*  joined r/w session w/ 1 console  */
+    BENCH_BROADCAST,                    /*  broadcast session to all consoles*/
+    BENCH_MUX,                          /*  mux session reading all consoles */
+    BENCH_SLOW,                         /*  client trickling in its greeting */
+    BENCH_TYPES                         /*  num benchmark session types      */
+} bench_type_t;
+
+typedef struct bench_client {
+    int              sd;                /* socket descriptor, or -1 if closed*/
+    bench_type_t     type;              /* type of client session            */
+    int              numSent;           /* num greeting bytes sent if slow   */
+} bench_client_t;
+
+typedef struct bench_stats {
+    int              numClients;        /* num sessions opened               */
+    int              numFailed;         /* num sessions that failed to open  */
+    int              numClosed;         /* num sessions closed by the server */
+    unsigned long    numBytesIn;        /* bytes read from the server        */
+    unsigned long    numBytesOut;       /* bytes written to the server       */
+    unsigned long    numBlocked;        /* writes that would have blocked    */
+} bench_stats_t;
+
+typedef struct bench_storm {
+    struct bench_conf *conf;            /* benchmark configuration           */
+    struct timeval  *tv0;               /* time at which the run started     */
+    pthread_t        tid;               /* thread storming the server        */
+    long            *usecs;             /* latency of each handshake         */
+    int              numUsecs;          /* num handshakes completed          */
+    int              maxUsecs;          /* num handshakes usecs[] can hold   */
+    int              numFailed;         /* num handshakes that failed        */
+    double           firstSecs;         /* secs until first handshake done   */
+} bench_storm_t;
+
+typedef struct bench_conf {
+    char            *prog;              /* program name                      */
+    char            *host;              /* host name of the server           */
+    int              port;              /* port number of the server         */
+    struct sockaddr_in saddr;           /* resolved address of the server    */
+    char            *prefix;            /* prefix of benchmark console names */
+    char            *trace;             /* trace file to replay, or NULL     */
+    int              numConsoles;       /* num benchmark consoles            */
+    int              numSecs;           /* secs for which to run             */
+    int              writeRate;         /* bytes/sec written by each writer  */
+    int              numStorms;         /* num concurrent handshake loops    */
+    int              numClients[BENCH_TYPES]; /* num sessions of each type   */
+} bench_conf_t;
+
+static void parse_bench_cmd_line(int argc, char *argv[], bench_conf_t *conf);
+static void display_bench_help(bench_conf_t *conf);
+static void replay_bench_trace(const char *trace);
+static int connect_bench_socket(bench_conf_t *conf);
+static int open_bench_client(bench_conf_t *conf, bench_type_t type, int k);
+static int send_bench_line(int sd, const char *line);
+static void write_slow_greeting(bench_client_t *client, int k,
+    bench_stats_t *stats);
+static void * storm_bench_thread(void *arg);
+static int query_bench_server(bench_conf_t *conf);
+static int compare_usecs(const void *p1, const void *p2);
+static void display_storm_report(bench_conf_t *conf, bench_storm_t *storms,
+    double secs);
+static void run_bench(bench_conf_t *conf, bench_client_t *clients, int n,
+    bench_stats_t *stats);
+static void write_bench_data(bench_client_t *client, int len,
+    bench_stats_t *stats);
+static double get_elapsed_secs(struct timeval *tv0);
+static void display_bench_report(bench_conf_t *conf, bench_stats_t *stats,
+    double secs);
+
+static const char *bench_type_strs[BENCH_TYPES] = {
+    "monitor", "connect", "broadcast", "mux", "slow"
+};
+
+
+int main(int argc, char *argv[])
+{
+    bench_conf_t conf;
+    bench_client_t *clients;
+    bench_stats_t stats[BENCH_TYPES];
+    bench_storm_t *storms = NULL;
+    struct timeval tv0;
+    int n = 0;
+    int t;
+    int k;
+    int rc;
+
+    log_set_file(stderr, LOG_WARNING, 0);
+    posix_signal(SIGPIPE, SIG_IGN);
+
+    memset(&conf, 0, sizeof(conf));
+    memset(stats, 0, sizeof(stats));
+    parse_bench_cmd_line(argc, argv, &conf);
+
+    if (conf.trace) {
+        replay_bench_trace(conf.trace);
+        exit(0);
+    }
+    conf.saddr.sin_family = AF_INET;
+    conf.saddr.sin_port = htons(conf.port);
+    if (host_name_to_addr4(conf.host, &conf.saddr.sin_addr) < 0) {
+        log_err(0, "Unable to resolve host <%s>", conf.host);
+    }
+    for (t = 0; t < BENCH_TYPES; t++) {
+        n += conf.numClients[t];
+    }
+    if (!(clients = malloc(MAX(n, 1) * sizeof(bench_client_t)))) {
+        out_of_memory();
+    }
+    n = 0;
+    for (t = 0; t < BENCH_TYPES; t++) {
+        for (k = 0; k < conf.numClients[t]; k++) {
+            clients[n].type = t;
+            clients[n].numSent = 0;
+            clients[n].sd = open_bench_client(&conf, t, k);
+            if (clients[n].sd < 0) {
+                stats[t].numFailed++;
+                continue;
+            }
+            stats[t].numClients++;
+            n++;
+        }
+    }
+    gettimeofday(&tv0, NULL);
+
+    if (conf.numStorms > 0) {
+        if (!(storms = calloc(conf.numStorms, sizeof(bench_storm_t)))) {
+            out_of_memory();
+        }
+        for (k = 0; k < conf.numStorms; k++) {
+            storms[k].conf = &conf;
+            storms[k].tv0 = &tv0;
+            if ((rc = pthread_create(&storms[k].tid, NULL,
+              storm_bench_thread, &storms[k])) != 0) {
+                log_err(rc, "Unable to create handshake thread #%d", k);
+            }
+        }
+    }
+    run_bench(&conf, clients, n, stats);
+
+    for (k = 0; k < conf.numStorms; k++) {
+        if ((rc = pthread_join(storms[k].tid, NULL)) != 0) {
+            log_err(rc, "Unable to join handshake thread #%d", k);
+        }
+    }
+    display_bench_report(&conf, stats, get_elapsed_secs(&tv0));
+    if (conf.numStorms > 0) {
+        display_storm_report(&conf, storms, get_elapsed_secs(&tv0));
+        for (k = 0; k < conf.numStorms; k++) {
+            free(storms[k].usecs);
+        }
+        free(storms);
+    }
+
+    for (k = 0; k < n; k++) {
+        if (clients[k].sd >= 0) {
+            (void) close(clients[k].sd);
+        }
+    }
+    free(clients);
+    free(conf.host);
+    free(conf.prefix);
+    free(conf.trace);
+    return(0);
+}
+
+
+static void parse_bench_cmd_line(int argc, char *argv[], bench_conf_t *conf)
+{
+/*  Parses the command-line of the load driver into (conf).
+ */
+    int c;
+    char *p;
+
+    conf->prog = (p = strrchr(argv[0], '/')) ? p + 1 : argv[0];
+    conf->host = create_string(CONMAN_HOST);
+    conf->port = atoi(CONMAN_PORT);
+    conf->prefix = create_string(BENCH_DEFAULT_PREFIX);
+    conf->numConsoles = 1;
+    conf->numSecs = BENCH_DEFAULT_SECS;
+
+    opterr = 0;
+    while ((c = getopt(argc, argv, "b:c:d:hH:m:n:p:r:s:t:w:x:")) != -1) {
+        switch(c) {
+        case 'b':
+            conf->numClients[BENCH_BROADCAST] = atoi(optarg);
+            break;
+        case 'c':
+            conf->numClients[BENCH_CONNECT] = atoi(optarg);
+            break;
+        case 'd':
+            free(conf->host);
+            conf->host = create_string(optarg);
+            if ((p = strchr(conf->host, ':'))) {
+                *p++ = '\0';
+                conf->port = atoi(p);
+            }
+            break;
+        case 'h':
+            display_bench_help(conf);
+            exit(0);
+        case 'H':
+            conf->numStorms = atoi(optarg);
+            break;
+        case 'm':
+            conf->numClients[BENCH_MONITOR] = atoi(optarg);
+            break;
+        case 'n':
+            conf->numConsoles = atoi(optarg);
+            break;
+        case 'p':
+            free(conf->prefix);
+            conf->prefix = create_string(optarg);
+            break;
+        case 'r':
+            free(conf->trace);
+            conf->trace = create_string(optarg);
+            break;
+        case 's':
+            conf->numClients[BENCH_SLOW] = atoi(optarg);
+            break;
+        case 't':
+            conf->numSecs = atoi(optarg);
+            break;
+        case 'w':
+            conf->writeRate = atoi(optarg);
+            break;
+        case 'x':
+            conf->numClients[BENCH_MUX] = atoi(optarg);
+            break;
+        case '?':
+            log_err(0, "CMDLINE: invalid option \"%s\"", argv[optind - 1]);
+            break;
+        default:
+            log_err(0, "CMDLINE: option \"%c\" not implemented", c);
+            break;
+        }
+    }
+    if (optind < argc) {
+        log_err(0, "CMDLINE: unexpected argument \"%s\"", argv[optind]);
+    }
+    if ((conf->numConsoles <= 0) || (conf->numConsoles > 9999)) {
+        log_err(0, "CMDLINE: number of consoles must be within 1-9999");
+    }
+    if (conf->numSecs <= 0) {
+        log_err(0, "CMDLINE: number of secs must be positive");
+    }
+    if (conf->numStorms < 0) {
+        log_err(0, "CMDLINE: handshake concurrency must be non-negative");
+    }
+    if ((conf->port <= 0) || (conf->port > 65535)) {
+        log_err(0, "CMDLINE: invalid port number %d", conf->port);
+    }
+    return;
+}
+
+
+static void display_bench_help(bench_conf_t *conf)
+{
+    printf("Usage: %s [OPTIONS]\n", conf->prog);
+    printf("\n");
+    printf("  -b NUM     Open NUM broadcast sessions to all consoles.\n");
+    printf("  -c NUM     Open NUM joined read-write sessions.\n");
+    printf("  -d HOST[:PORT]  Specify server destination. [%s:%s]\n",
+        CONMAN_HOST, CONMAN_PORT);
+    printf("  -h         Display this help.\n");
+    printf("  -H NUM     Storm the server with NUM concurrent queries.\n");
+    printf("  -m NUM     Open NUM read-only sessions.\n");
+    printf("  -n NUM     Specify number of benchmark consoles. [1]\n");
+    printf("  -p STR     Specify prefix of console names. [%s]\n",
+        BENCH_DEFAULT_PREFIX);
+    printf("  -r FILE    Replay the trace FILE to stdout in a loop.\n");
+    printf("  -s NUM     Open NUM slow clients sending a greeting byte/sec.\n");
+    printf("  -t SECS    Run for SECS seconds. [%d]\n", BENCH_DEFAULT_SECS);
+    printf("  -w NUM     Write NUM bytes/sec from each writer. [0]\n");
+    printf("  -x NUM     Open NUM mux sessions reading all consoles.\n");
+    printf("\n");
+    printf("Single-console sessions are spread across consoles in turn.\n");
+    printf("Each query storm loop reconnects as soon as its query is done.\n");
+    printf("Consoles are named by the prefix and a 4-digit index.\n");
+    printf("\n");
+    return;
+}
+
+
+static void replay_bench_trace(const char *trace)
+{
+/*  Writes the (trace) file to stdout in a loop until stdout is closed.
+ *  The process console's end of its socketpair is non-blocking, so this
+ *    waits for stdout to become writable instead of giving up on EAGAIN.
+ */
+    struct pollfd pfd;
+    unsigned char *buf = NULL;
+    int len = 0;
+    int fd;
+    int n;
+    int i;
+
+    if ((fd = open(trace, O_RDONLY)) < 0) {
+        log_err(errno, "Unable to open trace \"%s\"", trace);
+    }
+    do {
+        if (!(buf = realloc(buf, len + BENCH_BUF_SIZE))) {
+            out_of_memory();
+        }
+        if ((n = read_n(fd, buf + len, BENCH_BUF_SIZE)) < 0) {
+            log_err(errno, "Unable to read trace \"%s\"", trace);
+        }
+        len += n;
+    } while (n > 0);
+    (void) close(fd);
+
+    if (len == 0) {
+        log_err(0, "Trace \"%s\" is empty", trace);
+    }
+    pfd.fd = STDOUT_FILENO;
+    pfd.events = POLLOUT;
+
+    for (i = 0; ; i = (i + n) % len) {
+        n = write(STDOUT_FILENO, buf + i, len - i);
+        if (n >= 0) {
+            continue;
+        }
+        n = 0;
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            (void) poll(&pfd, 1, -1);
+        }
+        else if (errno != EINTR) {
+            break;
+        }
+    }
+    free(buf);
+    return;
+}
+
+
+static int connect_bench_socket(bench_conf_t *conf)
+{
+/*  Connects a new socket to the server.
+ *  Returns the socket descriptor, or -1 on error.
+ */
+    int sd;
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        log_err(errno, "Unable to create socket");
+    }
+    if (connect(sd, (struct sockaddr *) &conf->saddr,
+      sizeof(conf->saddr)) < 0) {
+        log_msg(LOG_WARNING, "Unable to connect to <%s:%d>: %s",
+            conf->host, conf->port, strerror(errno));
+        (void) close(sd);
+        return(-1);
+    }
+    return(sd);
+}
+
+
+static int open_bench_client(bench_conf_t *conf, bench_type_t type, int k)
+{
+/*  Opens the (k)th client session of the given (type) to the server.
+ *  Returns the session's socket descriptor, or -1 on error.
+ */
+    char buf[MAX_SOCK_LINE];
+    char name[MAX_LINE];
+    int sd;
+
+    if ((sd = connect_bench_socket(conf)) < 0) {
+        return(-1);
+    }
+    /*  A slow client's greeting is written by run_bench() a byte at a time.
+     */
+    if (type == BENCH_SLOW) {
+        set_fd_nonblocking(sd);
+        return(sd);
+    }
+    snprintf(buf, sizeof(buf), "%s %s='bench' %s='%s%d'\n",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_HELLO),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_USER),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_TTY),
+        bench_type_strs[type], k);
+    if (send_bench_line(sd, buf) < 0) {
+        (void) close(sd);
+        return(-1);
+    }
+    /*  Single-console sessions are spread across the consoles; the
+     *    broadcast and mux sessions select all consoles with a regex.
+     *  Writers join existing sessions so the mix can share consoles.
+     */
+    snprintf(name, sizeof(name), "%s%04d",
+        conf->prefix, k % conf->numConsoles);
+
+    switch(type) {
+    case BENCH_MONITOR:
+        snprintf(buf, sizeof(buf), "%s %s='%s'\n",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_MONITOR),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE), name);
+        break;
+    case BENCH_CONNECT:
+        snprintf(buf, sizeof(buf), "%s %s=%s %s='%s'\n",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONNECT),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_JOIN),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE), name);
+        break;
+    case BENCH_BROADCAST:
+        snprintf(buf, sizeof(buf), "%s %s=%s %s=%s %s=%s %s='%s[0-9]+'\n",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONNECT),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_JOIN),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_BROADCAST),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_REGEX),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE), conf->prefix);
+        break;
+    case BENCH_MUX:
+        snprintf(buf, sizeof(buf), "%s %s=%s %s=%s %s='%s[0-9]+'\n",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_MONITOR),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_MUX),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_REGEX),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE), conf->prefix);
+        break;
+    default:
+        log_err(0, "INTERNAL: Invalid bench type=%d", type);
+        break;
+    }
+    if (send_bench_line(sd, buf) < 0) {
+        log_msg(LOG_WARNING, "Unable to open %s session %d",
+            bench_type_strs[type], k);
+        (void) close(sd);
+        return(-1);
+    }
+    set_fd_nonblocking(sd);
+    return(sd);
+}
+
+
+static int send_bench_line(int sd, const char *line)
+{
+/*  Sends the request (line) to the server and reads its response.
+ *  Returns 0 if the server responded OK, or -1 on error.
+ */
+    char buf[MAX_SOCK_LINE];
+    const char *ok = LEX_TOK2STR(proto_strs, CONMAN_TOK_OK);
+    ssize_t n;
+
+    if (write_n(sd, (void *) line, strlen(line)) < 0) {
+        log_msg(LOG_WARNING, "Unable to send request: %s", strerror(errno));
+        return(-1);
+    }
+    if ((n = read_line(sd, buf, sizeof(buf))) <= 0) {
+        log_msg(LOG_WARNING, "Unable to read response: %s",
+            (n < 0) ? strerror(errno) : "connection closed");
+        return(-1);
+    }
+    if (strncmp(buf, ok, strlen(ok)) != 0) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        log_msg(LOG_WARNING, "Request failed: %s", buf);
+        return(-1);
+    }
+    return(0);
+}
+
+
+static void * storm_bench_thread(void *arg)
+{
+/*  Thread routine for a query storm loop.  Each query's handshake latency
+ *    is measured from before its connection is opened until its response
+ *    has been read.  The loop runs until the run is over.
+ */
+    bench_storm_t *storm = arg;
+    struct timeval tv;
+    struct timeval tvDone;
+    long *usecs;
+
+    while (get_elapsed_secs(storm->tv0) < storm->conf->numSecs) {
+        gettimeofday(&tv, NULL);
+        if (query_bench_server(storm->conf) < 0) {
+            storm->numFailed++;
+            continue;
+        }
+        gettimeofday(&tvDone, NULL);
+        if (storm->numUsecs == 0) {
+            storm->firstSecs = get_elapsed_secs(storm->tv0);
+        }
+        if (storm->numUsecs == storm->maxUsecs) {
+            storm->maxUsecs = MAX(storm->maxUsecs * 2, 1024);
+            if (!(usecs = realloc(storm->usecs,
+              storm->maxUsecs * sizeof(long)))) {
+                out_of_memory();
+            }
+            storm->usecs = usecs;
+        }
+        storm->usecs[storm->numUsecs++] =
+            ((tvDone.tv_sec - tv.tv_sec) * 1000000)
+            + (tvDone.tv_usec - tv.tv_usec);
+    }
+    return(NULL);
+}
+
+
+static int query_bench_server(bench_conf_t *conf)
+{
+/*  Performs a handshake with the server for a query of the first console,
+ *    and reads its response until the server closes the connection.
+ *  Returns 0 if the query succeeded, or -1 on error.
+ */
+    char buf[MAX_SOCK_LINE];
+    int sd;
+    int rc = -1;
+
+    if ((sd = connect_bench_socket(conf)) < 0) {
+        return(-1);
+    }
+    snprintf(buf, sizeof(buf), "%s %s='bench' %s='query'\n",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_HELLO),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_USER),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_TTY));
+    if (send_bench_line(sd, buf) < 0) {
+        goto end;
+    }
+    snprintf(buf, sizeof(buf), "%s %s='%s0000'\n",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_QUERY),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE), conf->prefix);
+    if (send_bench_line(sd, buf) < 0) {
+        goto end;
+    }
+    while (read(sd, buf, sizeof(buf)) > 0) {
+        ;
+    }
+    rc = 0;
+
+end:
+    (void) close(sd);
+    return(rc);
+}
+
+
+static int compare_usecs(const void *p1, const void *p2)
+{
+/*  Compares two handshake latencies for qsort().
+ */
+    long u1 = *(const long *) p1;
+    long u2 = *(const long *) p2;
+
+    return((u1 > u2) - (u1 < u2));
+}
+
+
+static void run_bench(bench_conf_t *conf, bench_client_t *clients, int n,
+    bench_stats_t *stats)
+{
+/*  Reads output from the (n) client sessions until the run is over.
+ *  Writing sessions write (writeRate) bytes/sec in BENCH_TICK_MSECS ticks.
+ */
+    struct pollfd *pfds;
+    struct timeval tv0;
+    unsigned char buf[BENCH_BUF_SIZE];
+    double secs;
+    double nextTick = 0;
+    double nextSlow = 0;
+    int numTicks = 0;
+    int len;
+    int rc;
+    int k;
+    ssize_t m;
+
+    if (!(pfds = malloc(MAX(n, 1) * sizeof(struct pollfd)))) {
+        out_of_memory();
+    }
+    for (k = 0; k < n; k++) {
+        pfds[k].fd = clients[k].sd;
+        pfds[k].events = POLLIN;
+    }
+    gettimeofday(&tv0, NULL);
+
+    while ((secs = get_elapsed_secs(&tv0)) < conf->numSecs) {
+
+        if ((conf->writeRate > 0) && (secs >= nextTick)) {
+            numTicks++;
+            len = ((long) conf->writeRate * numTicks * BENCH_TICK_MSECS / 1000)
+                - ((long) conf->writeRate * (numTicks - 1) * BENCH_TICK_MSECS
+                    / 1000);
+            for (k = 0; k < n; k++) {
+                if ((clients[k].sd >= 0)
+                  && ((clients[k].type == BENCH_CONNECT)
+                    || (clients[k].type == BENCH_BROADCAST))) {
+                    write_bench_data(&clients[k], len,
+                        &stats[clients[k].type]);
+                }
+            }
+            nextTick = numTicks * BENCH_TICK_MSECS / 1000.0;
+        }
+        if ((conf->numClients[BENCH_SLOW] > 0) && (secs >= nextSlow)) {
+            for (k = 0; k < n; k++) {
+                if ((clients[k].sd >= 0) && (clients[k].type == BENCH_SLOW)) {
+                    write_slow_greeting(&clients[k], k,
+                        &stats[BENCH_SLOW]);
+                }
+            }
+            nextSlow += BENCH_SLOW_MSECS / 1000.0;
+        }
+        rc = poll(pfds, n, BENCH_TICK_MSECS / 10);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_err(errno, "Unable to poll sessions");
+        }
+        for (k = 0; (k < n) && (rc > 0); k++) {
+            if (!pfds[k].revents) {
+                continue;
+            }
+            rc--;
+            m = read(pfds[k].fd, buf, sizeof(buf));
+            if (m > 0) {
+                stats[clients[k].type].numBytesIn += m;
+            }
+            else if ((m == 0) || ((errno != EAGAIN) && (errno != EINTR))) {
+                stats[clients[k].type].numClosed++;
+                (void) close(clients[k].sd);
+                clients[k].sd = pfds[k].fd = -1;
+            }
+        }
+    }
+    free(pfds);
+    return;
+}
+
+
+static void write_bench_data(bench_client_t *client, int len,
+    bench_stats_t *stats)
+{
+/*  Writes (len) bytes of printable lines to the (client) session.
+ *  The data avoids the client escape character.
+ *  A write that would block is counted and the remainder discarded.
+ */
+    char buf[BENCH_BUF_SIZE];
+    int i;
+    ssize_t n;
+
+    len = MIN(len, (int) sizeof(buf));
+    for (i = 0; i < len; i++) {
+        buf[i] = ((i % 64) == 63) ? '\n' : 'a' + (i % 26);
+    }
+    while (len > 0) {
+        n = write(client->sd, buf, len);
+        if (n > 0) {
+            stats->numBytesOut += n;
+            len -= n;
+        }
+        else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        else {
+            stats->numBlocked++;
+            break;
+        }
+    }
+    return;
+}
+
+
+static void write_slow_greeting(bench_client_t *client, int k,
+    bench_stats_t *stats)
+{
+/*  Writes the next byte of the (k)th slow (client)'s greeting, which takes
+ *    longer to complete than the server's handshake timeout.
+ */
+    char buf[MAX_SOCK_LINE];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s %s='bench' %s='%s%d'\n",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_HELLO),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_USER),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_TTY),
+        bench_type_strs[client->type], k);
+    if ((client->numSent >= len) || (client->numSent >= (int) sizeof(buf))) {
+        return;
+    }
+    if (write(client->sd, buf + client->numSent, 1) == 1) {
+        client->numSent++;
+        stats->numBytesOut++;
+    }
+    else {
+        stats->numBlocked++;
+    }
+    return;
+}
+
+
+static double get_elapsed_secs(struct timeval *tv0)
+{
+/*  Returns the secs elapsed since the time (tv0).
+ */
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return((tv.tv_sec - tv0->tv_sec) + ((tv.tv_usec - tv0->tv_usec) / 1e6));
+}
+
+
+static void display_bench_report(bench_conf_t *conf, bench_stats_t *stats,
+    double secs)
+{
+/*  Displays the throughput of each type of client session over the
+ *    run of (secs) seconds.
+ */
+    bench_stats_t total;
+    bench_stats_t *s;
+    int t;
+
+    memset(&total, 0, sizeof(total));
+
+    printf("%-10s %7s %6s %6s %14s %10s %12s %10s %7s\n",
+        "session", "clients", "failed", "closed",
+        "bytes_in", "in_KB/s", "bytes_out", "out_KB/s", "blocked");
+
+    for (t = 0; t <= BENCH_TYPES; t++) {
+        s = (t < BENCH_TYPES) ? &stats[t] : &total;
+        if (t < BENCH_TYPES) {
+            if (!s->numClients && !s->numFailed) {
+                continue;
+            }
+            total.numClients += s->numClients;
+            total.numFailed += s->numFailed;
+            total.numClosed += s->numClosed;
+            total.numBytesIn += s->numBytesIn;
+            total.numBytesOut += s->numBytesOut;
+            total.numBlocked += s->numBlocked;
+        }
+        printf("%-10s %7d %6d %6d %14lu %10.1f %12lu %10.1f %7lu\n",
+            (t < BENCH_TYPES) ? bench_type_strs[t] : "total",
+            s->numClients, s->numFailed, s->numClosed,
+            s->numBytesIn, s->numBytesIn / secs / 1024,
+            s->numBytesOut, s->numBytesOut / secs / 1024, s->numBlocked);
+    }
+    printf("Ran %d session%s on %d console%s for %.2f secs.\n",
+        total.numClients, (total.numClients == 1 ? "" : "s"),
+        conf->numConsoles, (conf->numConsoles == 1 ? "" : "s"), secs);
+    return;
+}
+
+
+static void display_storm_report(bench_conf_t *conf, bench_storm_t *storms,
+    double secs)
+{
+/*  Displays the rate at which the query storm loops were admitted over the
+ *    run of (secs) seconds, along with the latency of their handshakes.
+ */
+    long *usecs;
+    int numUsecs = 0;
+    int numFailed = 0;
+    double firstSecs = 0;
+    int k;
+
+    for (k = 0; k < conf->numStorms; k++) {
+        if ((storms[k].numUsecs > 0)
+          && ((numUsecs == 0) || (storms[k].firstSecs < firstSecs))) {
+            firstSecs = storms[k].firstSecs;
+        }
+        numUsecs += storms[k].numUsecs;
+        numFailed += storms[k].numFailed;
+    }
+    if (!(usecs = malloc(MAX(numUsecs, 1) * sizeof(long)))) {
+        out_of_memory();
+    }
+    numUsecs = 0;
+    for (k = 0; k < conf->numStorms; k++) {
+        if (storms[k].numUsecs > 0) {
+            memcpy(usecs + numUsecs, storms[k].usecs,
+                storms[k].numUsecs * sizeof(long));
+        }
+        numUsecs += storms[k].numUsecs;
+    }
+    qsort(usecs, numUsecs, sizeof(long), compare_usecs);
+
+    printf("Handshakes: concurrency=%d conns=%d failed=%d conn/s=%.1f\n",
+        conf->numStorms, numUsecs, numFailed, numUsecs / secs);
+    if (numUsecs > 0) {
+        printf("Handshake latency_ms p50=%.2f p99=%.2f max=%.2f"
+            " first_done_secs=%.2f\n",
+            usecs[(numUsecs - 1) / 2] / 1e3,
+            usecs[(numUsecs - 1) * 99 / 100] / 1e3,
+            usecs[numUsecs - 1] / 1e3, firstSecs);
+    }
+    free(usecs);
+    return;
+}
@@ -30,6 +30,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -91,6 +92,8 @@ client_conf_t * create_client_conf(void)
     conf->escapeChar = DEFAULT_CLIENT_ESCAPE;
     conf->log = NULL;
     conf->logd = -1;
+    conf->muxDir = NULL;
+    conf->unixSock = NULL;
     conf->errnum = CONMAN_ERR_NONE;
     conf->errmsg = NULL;
     conf->enableVerbose = 0;
@@ -115,6 +118,10 @@ void destroy_client_conf(client_conf_t *conf)
             log_err(errno, "close() failed on fd=%d", conf->logd);
         conf->logd = -1;
     }
+    if (conf->muxDir)
+        free(conf->muxDir);
+    if (conf->unixSock)
+        free(conf->unixSock);
     if (conf->errmsg)
         free(conf->errmsg);
 
@@ -147,6 +154,11 @@ void process_client_env_vars(client_conf_t *conf)
     if ((p = getenv("CONMAN_ESCAPE")) && (*p)) {
         conf->escapeChar = p[0];
     }
+    if ((p = getenv("CONMAN_UNIXSOCKET"))) {
+        if (conf->unixSock)
+            free(conf->unixSock);
+        conf->unixSock = create_string(p);
+    }
     return;
 }
 
@@ -155,6 +167,7 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
 {
     int c;
     int i;
+    long l;
     char *p;
     int gotHelp = 0;
 
@@ -162,7 +175,7 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
         conf->prog = create_string(argv[0]);
 
     opterr = 0;
-    while ((c = getopt(argc, argv, "bd:e:fF:hjl:LmqQrvV")) != -1) {
+    while ((c = getopt(argc, argv, "bd:e:fF:hjl:LmMo:qQrR:SvV")) != -1) {
         switch(c) {
         case 'b':
             conf->req->enableBroadcast = 1;
@@ -207,6 +220,17 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
         case 'm':
             conf->req->command = CONMAN_CMD_MONITOR;
             break;
+        case 'M':
+            conf->req->command = CONMAN_CMD_MONITOR;
+            conf->req->enableMux = 1;
+            break;
+        case 'o':
+            if (conf->muxDir)
+                free(conf->muxDir);
+            conf->muxDir = create_string(optarg);
+            conf->req->command = CONMAN_CMD_MONITOR;
+            conf->req->enableMux = 1;
+            break;
         case 'q':
             conf->req->command = CONMAN_CMD_QUERY;
             break;
@@ -216,6 +240,24 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
         case 'r':
             conf->req->enableRegex = 1;
             break;
+        case 'S':
+            conf->req->command = CONMAN_CMD_STATS;
+            break;
+        case 'R':
+            l = strtol(optarg, &p, 10);
+            if ((p == optarg) || (l <= 0) || (l > INT_MAX)
+                    || ((*p != '\0') && (strcmp(p, "l") != 0))) {
+                log_err(0, "CMDLINE: invalid replay count \"%s\"", optarg);
+            }
+            if (*p == 'l') {
+                conf->req->replayLines = l;
+                conf->req->replayBytes = 0;
+            }
+            else {
+                conf->req->replayBytes = l;
+                conf->req->replayLines = 0;
+            }
+            break;
         case 'v':
             conf->enableVerbose = 1;
             break;
@@ -238,6 +280,9 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
         conf->req->enableForce = 0;
         conf->req->enableJoin = 0;
     }
+    else {
+        conf->req->enableMux = 0;
+    }
 
     for (i=optind; i<argc; i++) {
 
@@ -257,6 +302,7 @@ void process_client_cmd_line(int argc, char *argv[], client_conf_t *conf)
 
     if (gotHelp
         || ((conf->req->command != CONMAN_CMD_QUERY)
+            && (conf->req->command != CONMAN_CMD_STATS)
             && list_is_empty(conf->req->consoles))) {
         display_client_help(conf);
         exit(0);
@@ -331,9 +377,14 @@ static void display_client_help(client_conf_t *conf)
     printf("  -l FILE   Log connection output to file.\n");
     printf("  -L        Display license information.\n");
     printf("  -m        Monitor connection (read-only).\n");
+    printf("  -M        Monitor multiple consoles over one connection.\n");
+    printf("  -o DIR    Write multiplexed console output to files in dir.\n");
     printf("  -q        Query server about specified console(s).\n");
     printf("  -Q        Be quiet and suppress informational messages.\n");
     printf("  -r        Match console names via regex instead of globbing.\n");
+    printf("  -R N      Replay last N bytes (or N lines if N ends in 'l')"
+           " of console.\n");
+    printf("  -S        Display I/O statistics of specified console(s).\n");
     printf("  -v        Be verbose.\n");
     printf("  -V        Display version information.\n");
     printf("\n");
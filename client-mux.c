@@ -0,0 +1,323 @@
+/*****************************************************************************
+ *  Written by Chris Dunlap <cdunlap@llnl.gov>.
+ *  Copyright (C) 2007-2019 Lawrence Livermore National Security, LLC.
+ *  Copyright (C) 2001-2007 The Regents of the University of California.
+ *  UCRL-CODE-2002-009.
+ *
+ *  This file is part of ConMan: The Console Manager.
+ *  For details, see <https://dun.github.io/conman/>.
+ *
+ *  ConMan is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  ConMan is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with ConMan.  If not, see <http://www.gnu.org/licenses/>.
+*****************************************************************************/
+
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "client.h"
+#include "common.h"
+#include "list.h"
+#include "log.h"
+#include "util-file.h"
+#include "util-str.h"
+#include "util.h"
+
+
+typedef struct mux_console {            /* MUX CONSOLE OUTPUT STATE:         */
+    char            *name;              /*  console name                     */
+    char            *file;              /*  per-console output file name     */
+    int              fd;                /*  per-console output file fd       */
+    int              lineLen;           /*  num bytes in partial line buf    */
+    char             line[MAX_LINE];    /*  partial line awaiting a newline  */
+} mux_console_t;
+
+
+static void exit_handler(int signum);
+static mux_console_t * create_mux_consoles(client_conf_t *conf, int *num);
+static void destroy_mux_consoles(client_conf_t *conf,
+    mux_console_t *cons, int num);
+static int read_mux_frames(client_conf_t *conf, mux_console_t *cons, int num);
+static void write_mux_console(client_conf_t *conf,
+    mux_console_t *con, unsigned char *src, int len);
+static void write_mux_line(client_conf_t *conf, mux_console_t *con);
+static void write_mux_stdout(client_conf_t *conf, void *src, int len);
+static void display_mux_status(client_conf_t *conf, int num, char *msg);
+
+
+static int done = 0;
+
+
+void mux_consoles(client_conf_t *conf)
+{
+/*  Receives the output of multiple consoles multiplexed over a single
+ *    connection.  Each console's output is written either to stdout with
+ *    each line prefixed by the console name, or to a per-console file
+ *    within conf->muxDir.  Session-wide messages are written to stdout.
+ */
+    mux_console_t *cons;
+    int num;
+    fd_set rset;
+    int n;
+
+    assert(conf->req->sd >= 0);
+    assert(conf->req->command == CONMAN_CMD_MONITOR);
+    assert(conf->req->enableMux);
+
+    posix_signal(SIGHUP, exit_handler);
+    posix_signal(SIGINT, exit_handler);
+    posix_signal(SIGPIPE, SIG_IGN);
+    posix_signal(SIGTERM, exit_handler);
+
+    cons = create_mux_consoles(conf, &num);
+    display_mux_status(conf, num, "opened");
+
+    while (!done) {
+        FD_ZERO(&rset);
+        FD_SET(conf->req->sd, &rset);
+        if ((n = select(conf->req->sd + 1, &rset, NULL, NULL, NULL)) < 0) {
+            if (errno != EINTR)
+                log_err(errno, "Unable to multiplex I/O");
+            continue;
+        }
+        if ((n > 0) && !read_mux_frames(conf, cons, num))
+            break;
+    }
+    if (done)
+        conf->isClosedByClient = 1;
+
+    if (close(conf->req->sd) < 0)
+        log_err(errno, "Unable to close connection to <%s:%d>",
+            conf->req->host, conf->req->port);
+    conf->req->sd = -1;
+
+    destroy_mux_consoles(conf, cons, num);
+
+    if (!conf->isClosedByClient)
+        display_mux_status(conf, num, "terminated by server");
+    return;
+}
+
+
+static void exit_handler(int signum)
+{
+/*  Exit-handler to break out of while-loop in mux_consoles().
+ */
+    done = 1;
+    return;
+}
+
+
+static mux_console_t * create_mux_consoles(client_conf_t *conf, int *num)
+{
+/*  Creates the output state for each console in the response.
+ *  A console's position in the list is the id tagging its frames.
+ *  Returns the array of consoles, setting (num) to its length.
+ */
+    mux_console_t *cons;
+    ListIterator i;
+    char *name;
+    char *p;
+    int n;
+
+    n = list_count(conf->req->consoles);
+    assert(n > 0);
+    if (!(cons = malloc(n * sizeof(mux_console_t))))
+        out_of_memory();
+
+    n = 0;
+    i = list_iterator_create(conf->req->consoles);
+    while ((name = list_next(i))) {
+        cons[n].name = name;
+        cons[n].file = NULL;
+        cons[n].fd = -1;
+        cons[n].lineLen = 0;
+        if (conf->muxDir) {
+            cons[n].file = create_format_string("%s/%s.log",
+                conf->muxDir, name);
+            p = cons[n].file + strlen(conf->muxDir) + 1;
+            while ((p = strchr(p, '/')))
+                *p++ = '_';
+            cons[n].fd = open(cons[n].file,
+                O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+            if (cons[n].fd < 0)
+                log_err(errno, "Unable to open \"%s\"", cons[n].file);
+        }
+        n++;
+    }
+    list_iterator_destroy(i);
+    *num = n;
+    return(cons);
+}
+
+
+static void destroy_mux_consoles(client_conf_t *conf,
+    mux_console_t *cons, int num)
+{
+/*  Flushes any partial lines and closes the per-console output files.
+ *  This is done whether the session was closed by the server or the user.
+ */
+    int n;
+
+    for (n = 0; n < num; n++) {
+        if (cons[n].lineLen > 0)
+            write_mux_line(conf, &cons[n]);
+        if (cons[n].fd >= 0) {
+            if (close(cons[n].fd) < 0)
+                log_err(errno, "Unable to close \"%s\"", cons[n].file);
+        }
+        free(cons[n].file);
+    }
+    free(cons);
+    return;
+}
+
+
+static int read_mux_frames(client_conf_t *conf, mux_console_t *cons, int num)
+{
+/*  Reads from the socket connection and dispatches each complete frame
+ *    to the console identified by its id.
+ *  Partial frames are kept until the remainder of the frame is read.
+ *  Returns 1 if the read was successful,
+ *    or 0 if the socket connection is to be closed.
+ */
+    static unsigned char buf[MUX_HDR_LEN + MUX_MAX_DATA + MAX_BUF_SIZE * 4];
+    static int len = 0;
+    unsigned char *p;
+    int id;
+    int n;
+
+    while ((n = read(conf->req->sd, buf + len, sizeof(buf) - len)) < 0) {
+        if (errno == EINTR)
+            return(!done);
+        log_err(errno, "Unable to read from <%s:%d>",
+            conf->req->host, conf->req->port);
+    }
+    if (n == 0)
+        return(0);
+    len += n;
+    p = buf;
+    while (len >= MUX_HDR_LEN) {
+        id = (p[0] << 8) | p[1];
+        n = (p[2] << 8) | p[3];
+        if ((n > MUX_MAX_DATA) || ((id >= num) && (id != MUX_SESSION_ID)))
+            log_err(0, "Received invalid frame from <%s:%d>",
+                conf->req->host, conf->req->port);
+        if (len < MUX_HDR_LEN + n)
+            break;
+        if (id == MUX_SESSION_ID)
+            write_mux_stdout(conf, p + MUX_HDR_LEN, n);
+        else
+            write_mux_console(conf, &cons[id], p + MUX_HDR_LEN, n);
+        p += MUX_HDR_LEN + n;
+        len -= MUX_HDR_LEN + n;
+    }
+    if ((len > 0) && (p > buf))
+        memmove(buf, p, len);
+    return(1);
+}
+
+
+static void write_mux_console(client_conf_t *conf,
+    mux_console_t *con, unsigned char *src, int len)
+{
+/*  Writes the buffer (src) of length (len) received for console (con).
+ *  Output destined for stdout is assembled into lines so lines from
+ *    different consoles are not interleaved.
+ */
+    unsigned char *end = src + len;
+
+    if (con->fd >= 0) {
+        if (write_n(con->fd, src, len) < 0)
+            log_err(errno, "Unable to write to \"%s\"", con->file);
+        return;
+    }
+    for (; src < end; src++) {
+        if (*src == '\r')
+            continue;
+        if (*src == '\n') {
+            write_mux_line(conf, con);
+            continue;
+        }
+        con->line[con->lineLen++] = *src;
+        if (con->lineLen == sizeof(con->line))
+            write_mux_line(conf, con);
+    }
+    return;
+}
+
+
+static void write_mux_line(client_conf_t *conf, mux_console_t *con)
+{
+/*  Writes the partial line of console (con) to stdout
+ *    prefixed by the console name.
+ */
+    char buf[MAX_LINE * 2];
+    int n;
+
+    n = snprintf(buf, sizeof(buf) - sizeof(con->line) - 1, "%s: ", con->name);
+    if ((n < 0) || ((size_t) n >= sizeof(buf) - sizeof(con->line) - 1))
+        n = strlen(buf);
+    memcpy(buf + n, con->line, con->lineLen);
+    n += con->lineLen;
+    buf[n++] = '\n';
+    con->lineLen = 0;
+    write_mux_stdout(conf, buf, n);
+    return;
+}
+
+
+static void write_mux_stdout(client_conf_t *conf, void *src, int len)
+{
+/*  Writes the buffer (src) of length (len) to stdout and the client log.
+ */
+    if (write_n(STDOUT_FILENO, src, len) < 0) {
+        if (errno == EPIPE)
+            exit(0);
+        log_err(errno, "Unable to write to stdout");
+    }
+    if (conf->logd >= 0)
+        if (write_n(conf->logd, src, len) < 0)
+            log_err(errno, "Unable to write to \"%s\"", conf->log);
+    return;
+}
+
+
+static void display_mux_status(client_conf_t *conf, int num, char *msg)
+{
+/*  Displays (msg) regarding the state of the multiplexed connection.
+ */
+    char buf[MAX_LINE];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%sConnection to %d console%s %s%s",
+        CONMAN_MSG_PREFIX, num, (num == 1 ? "" : "s"), msg,
+        CONMAN_MSG_SUFFIX);
+    if ((n < 0) || ((size_t) n >= sizeof(buf)))
+        strcpy(&buf[sizeof(buf) - 3], "\r\n");
+    if (write_n(STDERR_FILENO, buf, strlen(buf)) < 0)
+        log_err(errno, "Unable to write to stderr");
+    return;
+}
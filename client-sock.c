@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include "client.h"
 #include "common.h"
@@ -44,7 +45,11 @@
 #include "util-str.h"
 
 
-static void parse_rsp_ok(Lex l, client_conf_t *conf);
+static const char * get_local_sock_name(client_conf_t *conf,
+    const struct in_addr *addr);
+static int connect_to_local_sock(const char *name);
+static int recv_rsp_line(client_conf_t *conf, int *gotMore);
+static void parse_rsp_ok(Lex l, client_conf_t *conf, int *gotMore);
 static void parse_rsp_err(Lex l, client_conf_t *conf);
 
 
@@ -55,12 +60,11 @@ int connect_to_server(client_conf_t *conf)
     char buf[MAX_LINE];
     char *p;
 
+    const char *name;
+
     assert(conf->req->host != NULL);
     assert(conf->req->port > 0);
 
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        log_err(errno, "Unable to create socket");
-
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = AF_INET;
     saddr.sin_port = htons(conf->req->port);
@@ -68,7 +72,6 @@ int connect_to_server(client_conf_t *conf)
         conf->errnum = CONMAN_ERR_LOCAL;
         conf->errmsg = create_format_string(
             "Unable to resolve host <%s>", conf->req->host);
-        (void) close(sd);
         return(-1);
     }
 
@@ -83,6 +86,18 @@ int connect_to_server(client_conf_t *conf)
         conf->req->host = create_string(buf);
     }
 
+    /*  Prefer the unix-domain socket of a local server if one is available.
+     *    If it cannot be reached, silently fall back to TCP.
+     */
+    if ((name = get_local_sock_name(conf, &saddr.sin_addr))
+      && ((sd = connect_to_local_sock(name)) >= 0)) {
+        conf->req->sd = sd;
+        return(0);
+    }
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        log_err(errno, "Unable to create socket");
+
     if (connect(sd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0) {
         conf->errnum = CONMAN_ERR_LOCAL;
         conf->errmsg = create_format_string(
@@ -96,6 +111,54 @@ int connect_to_server(client_conf_t *conf)
 }
 
 
+static const char * get_local_sock_name(client_conf_t *conf,
+    const struct in_addr *addr)
+{
+/*  Returns the pathname of the unix-domain socket to try for a server at
+ *    the loopback address [addr], or NULL if a TCP connection should be
+ *    used.  The socket named by the CONMAN_UNIXSOCKET env var is used for
+ *    any loopback server (an empty string disables this); o/w, the default
+ *    socket is used for a loopback server on the default port.
+ */
+    if ((ntohl(addr->s_addr) >> 24) != IN_LOOPBACKNET) {
+        return(NULL);
+    }
+    if (conf->unixSock) {
+        return((*conf->unixSock != '\0') ? conf->unixSock : NULL);
+    }
+    if (conf->req->port == atoi(CONMAN_PORT)) {
+        return(CONMAN_UNIXSOCK);
+    }
+    return(NULL);
+}
+
+
+static int connect_to_local_sock(const char *name)
+{
+/*  Connects to the unix-domain socket [name].
+ *  Returns the connected socket descriptor, or -1 on error.
+ */
+    int sd;
+    struct sockaddr_un saddr;
+
+    if (strlen(name) >= sizeof(saddr.sun_path)) {
+        return(-1);
+    }
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strcpy(saddr.sun_path, name);
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return(-1);
+    }
+    if (connect(sd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0) {
+        (void) close(sd);
+        return(-1);
+    }
+    return(sd);
+}
+
+
 int send_greeting(client_conf_t *conf)
 {
     char buf[MAX_SOCK_LINE] = "";       /* init buf for appending with NUL */
@@ -108,20 +171,31 @@ int send_greeting(client_conf_t *conf)
         LEX_TOK2STR(proto_strs, CONMAN_TOK_HELLO),
         LEX_TOK2STR(proto_strs, CONMAN_TOK_USER),
         lex_encode(conf->req->user));
-
+    if (n < 0) {
+        goto overrun;
+    }
     if (conf->req->tty) {
         n = append_format_string(buf, sizeof(buf), " %s='%s'",
             LEX_TOK2STR(proto_strs, CONMAN_TOK_TTY),
             lex_encode(conf->req->tty));
+        if (n < 0) {
+            goto overrun;
+        }
     }
 
+    /*  Ask for console lists to be streamed across multiple response lines
+     *    so large queries are not bounded by MAX_SOCK_LINE.  Servers that
+     *    do not recognize the option ignore it and leave it unacknowledged.
+     */
+    n = append_format_string(buf, sizeof(buf), " %s=%s",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_STREAM));
+    if (n < 0) {
+        goto overrun;
+    }
     n = append_format_string(buf, sizeof(buf), "\n");
-
     if (n < 0) {
-        conf->errnum = CONMAN_ERR_LOCAL;
-        conf->errmsg = create_string(
-            "Overran request buffer for sending greeting");
-        return(-1);
+        goto overrun;
     }
 
     if (write_n(conf->req->sd, buf, strlen(buf)) < 0) {
@@ -145,6 +219,12 @@ int send_greeting(client_conf_t *conf)
         return(-1);
     }
     return(0);
+
+overrun:
+    conf->errnum = CONMAN_ERR_LOCAL;
+    conf->errmsg = create_string(
+        "Overran request buffer for sending greeting");
+    return(-1);
 }
 
 
@@ -161,6 +241,9 @@ int send_req(client_conf_t *conf)
     case CONMAN_CMD_QUERY:
         cmd = LEX_TOK2STR(proto_strs, CONMAN_TOK_QUERY);
         break;
+    case CONMAN_CMD_STATS:
+        cmd = LEX_TOK2STR(proto_strs, CONMAN_TOK_STATS);
+        break;
     case CONMAN_CMD_MONITOR:
         cmd = LEX_TOK2STR(proto_strs, CONMAN_TOK_MONITOR);
         break;
@@ -184,6 +267,19 @@ int send_req(client_conf_t *conf)
             LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
             LEX_TOK2STR(proto_strs, CONMAN_TOK_REGEX));
     }
+    if ((conf->req->command != CONMAN_CMD_QUERY)
+      && (conf->req->command != CONMAN_CMD_STATS)) {
+        if (conf->req->replayLines > 0) {
+            n = append_format_string(buf, sizeof(buf), " %s=%d",
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_LINES),
+                conf->req->replayLines);
+        }
+        else if (conf->req->replayBytes > 0) {
+            n = append_format_string(buf, sizeof(buf), " %s=%d",
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_REPLAY),
+                conf->req->replayBytes);
+        }
+    }
     if (conf->req->command == CONMAN_CMD_CONNECT) {
         if (conf->req->enableForce) {
             n = append_format_string(buf, sizeof(buf), " %s=%s",
@@ -201,6 +297,11 @@ int send_req(client_conf_t *conf)
                 LEX_TOK2STR(proto_strs, CONMAN_TOK_BROADCAST));
         }
     }
+    if (conf->req->enableMux) {
+        n = append_format_string(buf, sizeof(buf), " %s=%s",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_MUX));
+    }
 
     /*  Empty the consoles list here because it will be filled in
      *    with the actual console names in recv_rsp().
@@ -228,10 +329,16 @@ int send_req(client_conf_t *conf)
         return(-1);
     }
 
-    /*  For QUERY commands, the write-half of the socket
+    /*  The mux option is set again if acknowledged in the response.
+     *    A server that does not support it replies with an unframed session.
+     */
+    conf->req->enableMux = 0;
+
+    /*  For QUERY and STATS commands, the write-half of the socket
      *    connection can be closed once the request is sent.
      */
-    if (conf->req->command == CONMAN_CMD_QUERY) {
+    if ((conf->req->command == CONMAN_CMD_QUERY)
+      || (conf->req->command == CONMAN_CMD_STATS)) {
         if (shutdown(conf->req->sd, SHUT_WR) < 0) {
             conf->errnum = CONMAN_ERR_LOCAL;
             conf->errmsg = create_format_string(
@@ -246,6 +353,43 @@ int send_req(client_conf_t *conf)
 
 int recv_rsp(client_conf_t *conf)
 {
+    int gotMore;
+
+    do {
+        if (recv_rsp_line(conf, &gotMore) < 0)
+            return(-1);
+    } while (gotMore);
+    return(0);
+}
+
+
+int recv_query_rsp(client_conf_t *conf, int fd)
+{
+/*  Receives the response to a QUERY (or STATS) request, writing the matching
+ *    console names (and their stats) to (fd) as each response line arrives.
+ *  The consoles list is emptied after each line so memory stays bounded
+ *    for large queries.
+ */
+    int gotMore;
+    char *str;
+
+    do {
+        if (recv_rsp_line(conf, &gotMore) < 0)
+            return(-1);
+        display_consoles(conf, fd);
+        while ((str = list_pop(conf->req->consoles)))
+            free(str);
+    } while (gotMore);
+    return(0);
+}
+
+
+static int recv_rsp_line(client_conf_t *conf, int *gotMore)
+{
+/*  Receives a single response line from the server.
+ *  Sets (gotMore) if the server will continue the response on the next line.
+ *  Returns 0 on an "OK" response, or -1 on error.
+ */
     char buf[MAX_SOCK_LINE];
     int n;
     Lex l;
@@ -254,6 +398,8 @@ int recv_rsp(client_conf_t *conf)
 
     assert(conf->req->sd >= 0);
 
+    *gotMore = 0;
+
     if ((n = read_line(conf->req->sd, buf, sizeof(buf))) < 0) {
         conf->errnum = CONMAN_ERR_LOCAL;
         conf->errmsg = create_format_string("Unable to read response"
@@ -273,7 +419,7 @@ int recv_rsp(client_conf_t *conf)
         tok = lex_next(l);
         switch(tok) {
         case CONMAN_TOK_OK:             /* OK, so ignore rest of line */
-            parse_rsp_ok(l, conf);
+            parse_rsp_ok(l, conf, gotMore);
             done = 1;
             break;
         case CONMAN_TOK_ERROR:
@@ -301,27 +447,56 @@ int recv_rsp(client_conf_t *conf)
 }
 
 
-static void parse_rsp_ok(Lex l, client_conf_t *conf)
+static void parse_rsp_ok(Lex l, client_conf_t *conf, int *gotMore)
 {
     int tok;
     int done = 0;
     char *str;
+    char *name = NULL;
 
     while (!done) {
         tok = lex_next(l);
         switch (tok) {
         case CONMAN_TOK_CONSOLE:
             if ((lex_next(l) == '=') && (lex_next(l) == LEX_STR)) {
-                if ((str = lex_decode(create_string(lex_text(l)))))
+                if (!(str = lex_decode(create_string(lex_text(l)))))
+                    break;
+                /*  The stats of a console follow its name,
+                 *    so defer adding it to the list until they arrive.
+                 */
+                if (conf->req->command == CONMAN_CMD_STATS) {
+                    if (name)
+                        free(name);
+                    name = str;
+                }
+                else
                     list_append(conf->req->consoles, str);
             }
             break;
+        case CONMAN_TOK_STATS:
+            if ((lex_next(l) == '=') && (lex_next(l) == LEX_STR) && name) {
+                str = lex_decode(create_string(lex_text(l)));
+                list_append(conf->req->consoles,
+                    create_format_string("%s: %s", name, str));
+                free(str);
+                free(name);
+                name = NULL;
+            }
+            break;
         case CONMAN_TOK_OPTION:
             if (lex_next(l) == '=') {
-                if (lex_next(l) == CONMAN_TOK_RESET)
+                tok = lex_next(l);
+                if (tok == CONMAN_TOK_RESET)
                     conf->req->enableReset = 1;
+                else if (tok == CONMAN_TOK_STREAM)
+                    conf->req->enableStream = 1;
+                else if (tok == CONMAN_TOK_MUX)
+                    conf->req->enableMux = 1;
             }
             break;
+        case CONMAN_TOK_MORE:
+            *gotMore = 1;
+            break;
         case LEX_EOF:
         case LEX_EOL:
             done = 1;
@@ -330,6 +505,8 @@ static void parse_rsp_ok(Lex l, client_conf_t *conf)
             break;                      /* ignore unrecognized tokens */
         }
     }
+    if (name)
+        free(name);
     return;
 }
 
@@ -45,6 +45,10 @@
 
 static void exit_handler(int signum);
 static int read_from_stdin(client_conf_t *conf);
+static unsigned char * stuff_esc_chars(
+    unsigned char *dst, const unsigned char *src, int len);
+static int send_stdin_data(client_conf_t *conf, unsigned char *buf, int len);
+static int perform_esc(client_conf_t *conf, char c);
 static int write_to_stdout(client_conf_t *conf);
 static int send_esc_seq(client_conf_t *conf, char c);
 static int perform_break_esc(client_conf_t *conf, char c);
@@ -157,97 +161,161 @@ static int read_from_stdin(client_conf_t *conf)
 /*  Reads from stdin and writes to the socket connection.
  *  Returns 1 if the read was successful,
  *    or 0 if the connection is to be closed.
+ *  Stdin is read a block at a time so pasted text is sent across the socket
+ *    in a single write instead of one write per character.
  *  Note that this routine can conceivably block in the write() to the socket.
  */
     static enum { CHR, EOL, ESC } mode = EOL;
+    static const char esc_cmds[] = {
+        ESC_CHAR_BREAK, ESC_CHAR_CLOSE, ESC_CHAR_DEL, ESC_CHAR_ECHO,
+        ESC_CHAR_FORCE, ESC_CHAR_HELP, ESC_CHAR_INFO, ESC_CHAR_JOIN,
+        ESC_CHAR_REPLAY, ESC_CHAR_MONITOR, ESC_CHAR_QUIET, ESC_CHAR_RESET,
+        ESC_CHAR_SUSPEND, '\0' };
     int n;
     unsigned char c;
     char esc = conf->escapeChar;
-    unsigned char buf[4];
-    unsigned char *p = buf;
-    unsigned char *q, *r;
+    unsigned char buf[MAX_BUF_SIZE];
+    unsigned char out[MAX_BUF_SIZE * 2];
+    unsigned char *p, *e, *end;
+    unsigned char *q = out;
 
-    while ((n = read(STDIN_FILENO, &c, 1)) < 0) {
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) < 0) {
         if (errno != EINTR)
             log_err(errno, "Unable to read from stdin");
     }
     if (n == 0)
         return(0);
 
-    if ((mode != ESC) && (c == esc)) {
-        mode = ESC;
-        return(1);
-    }
-    if (mode == ESC) {
-        mode = EOL;
-        switch(c) {
-        case ESC_CHAR_BREAK:
-            return(perform_break_esc(conf, c));
-        case ESC_CHAR_CLOSE:
-            return(perform_close_esc(conf, c));
-        case ESC_CHAR_DEL:              /* XXX: gnats:100 del char kludge */
-            return(perform_del_esc(conf, c));
-        case ESC_CHAR_ECHO:
-            return(perform_echo_esc(conf, c));
-        case ESC_CHAR_FORCE:
-            return(perform_force_esc(conf, c));
-        case ESC_CHAR_HELP:
-            return(perform_help_esc(conf, c));
-        case ESC_CHAR_INFO:
-            return(perform_info_esc(conf, c));
-        case ESC_CHAR_JOIN:
-            return(perform_join_esc(conf, c));
-        case ESC_CHAR_REPLAY:
-            return(perform_log_replay_esc(conf, c));
-        case ESC_CHAR_MONITOR:
-            return(perform_monitor_esc(conf, c));
-        case ESC_CHAR_QUIET:
-            return(perform_quiet_esc(conf, c));
-        case ESC_CHAR_RESET:
-            return(perform_reset_esc(conf, c));
-        case ESC_CHAR_SUSPEND:
-            return(perform_suspend_esc(conf, c));
+    p = buf;
+    end = buf + n;
+    while (p < end) {
+
+        if (mode == ESC) {
+            c = *p++;
+            mode = EOL;
+            if ((c != '\0') && strchr(esc_cmds, c)) {
+                /*
+                 *  Flush pending data before performing the escape so it
+                 *    reaches the server in the same order it was typed.
+                 */
+                if (!send_stdin_data(conf, out, q - out))
+                    return(0);
+                q = out;
+                if (!perform_esc(conf, c))
+                    return(0);
+                continue;
+            }
+            if (c != esc) {
+                /*
+                 *  If the input was escape-someothercharacter, write both the
+                 *    escape character and the other character to the socket.
+                 */
+                q = stuff_esc_chars(q, (unsigned char *) &esc, 1);
+            }
+            q = stuff_esc_chars(q, &c, 1);
+            mode = ((c == '\r') || (c == '\n')) ? EOL : CHR;
+            continue;
+        }
+        /*  Copy the run of chars up to the next escape char in bulk.
+         */
+        if (!(e = memchr(p, (unsigned char) esc, end - p)))
+            e = end;
+        if (e > p) {
+            q = stuff_esc_chars(q, p, e - p);
+            c = *(e - 1);
+            mode = ((c == '\r') || (c == '\n')) ? EOL : CHR;
+            p = e;
         }
-        if (c != esc) {
-            /*
-             *  If the input was escape-someothercharacter, write both the
-             *    escape character and the other character to the socket.
-             *  Just write the escape character here, since the default case
-             *    for writing the other character is a few lines further down.
-             */
-            *p++ = esc;
+        if (p < end) {
+            mode = ESC;
+            p++;
         }
     }
-    if ((c == '\r') || (c == '\n'))
-        mode = EOL;
-    else
-        mode = CHR;
+    assert((size_t) (q - out) <= sizeof(out));
 
-    *p++ = c;
-    assert((p > buf) && ((size_t) (p - buf) <= sizeof(buf)));
+    if (!send_stdin_data(conf, out, q - out))
+        return(0);
+    return(1);
+}
+
+
+static unsigned char * stuff_esc_chars(
+    unsigned char *dst, const unsigned char *src, int len)
+{
+/*  Copies (len) chars from (src) into (dst), performing character-stuffing
+ *    of the escape-sequence character by doubling all occurrences of it.
+ *  Returns a ptr to the char following the last one written in (dst).
+ */
+    const unsigned char *end = src + len;
+
+    while (src < end) {
+        if (*src == ESC_CHAR)
+            *dst++ = ESC_CHAR;
+        *dst++ = *src++;
+    }
+    return(dst);
+}
+
+
+static int send_stdin_data(client_conf_t *conf, unsigned char *buf, int len)
+{
+/*  Sends (len) bytes of character-stuffed stdin data in (buf) to the server.
+ *  Returns 1 on success, or 0 if the socket connection is to be closed.
+ */
+    if (len <= 0)
+        return(1);
 
     /*  Do not send chars across the socket if we are in MONITOR mode.
      *    The server would discard them anyways, but why waste resources.
      *  Besides, we're now practicing conservation here in California. ;)
      */
-    if (conf->req->command == CONMAN_CMD_CONNECT) {
-        /*
-         *  Perform character-stuffing of the escape-sequence character
-         *    by doubling all occurrences of it.
-         */
-        for (q=p-1; q>=buf; q--) {
-            if (*q == ESC_CHAR) {
-                for (r=p-1, p++; r>=q; r--)
-                    *(r+1) = *r;
-            }
-        }
-        if (write_n(conf->req->sd, buf, p - buf) < 0) {
-            if (errno == EPIPE)
-                return(0);
-            log_err(errno, "Unable to write to <%s:%d>",
-                conf->req->host, conf->req->port);
-        }
+    if (conf->req->command != CONMAN_CMD_CONNECT)
+        return(1);
+
+    if (write_n(conf->req->sd, buf, len) < 0) {
+        if (errno == EPIPE)
+            return(0);
+        log_err(errno, "Unable to write to <%s:%d>",
+            conf->req->host, conf->req->port);
+    }
+    return(1);
+}
+
+
+static int perform_esc(client_conf_t *conf, char c)
+{
+/*  Performs the escape sequence command (c).
+ *  Returns 1 on success, or 0 if the socket connection is to be closed.
+ */
+    switch(c) {
+    case ESC_CHAR_BREAK:
+        return(perform_break_esc(conf, c));
+    case ESC_CHAR_CLOSE:
+        return(perform_close_esc(conf, c));
+    case ESC_CHAR_DEL:                  /* XXX: gnats:100 del char kludge */
+        return(perform_del_esc(conf, c));
+    case ESC_CHAR_ECHO:
+        return(perform_echo_esc(conf, c));
+    case ESC_CHAR_FORCE:
+        return(perform_force_esc(conf, c));
+    case ESC_CHAR_HELP:
+        return(perform_help_esc(conf, c));
+    case ESC_CHAR_INFO:
+        return(perform_info_esc(conf, c));
+    case ESC_CHAR_JOIN:
+        return(perform_join_esc(conf, c));
+    case ESC_CHAR_REPLAY:
+        return(perform_log_replay_esc(conf, c));
+    case ESC_CHAR_MONITOR:
+        return(perform_monitor_esc(conf, c));
+    case ESC_CHAR_QUIET:
+        return(perform_quiet_esc(conf, c));
+    case ESC_CHAR_RESET:
+        return(perform_reset_esc(conf, c));
+    case ESC_CHAR_SUSPEND:
+        return(perform_suspend_esc(conf, c));
     }
+    assert(0);                          /* c not in esc_cmds[] */
     return(1);
 }
 
@@ -261,9 +329,6 @@ static int write_to_stdout(client_conf_t *conf)
     unsigned char buf[MAX_BUF_SIZE];
     int n;
 
-    /*  Stdin has to be processed character-by-character to check for
-     *    escape sequences.  For human input, this isn't too bad.
-     */
     while ((n = read(conf->req->sd, buf, sizeof(buf))) < 0) {
         if (errno == EPIPE)
             return(0);
@@ -444,12 +509,10 @@ static int perform_help_esc(client_conf_t *conf, char c)
             esc, tmp);
     }
 
-    /*  FIXME: Only display this option if the console is being logged.
-     */
     if (!conf->req->enableBroadcast) {
         write_esc_char(ESC_CHAR_REPLAY, tmp);
         (void) append_format_string(buf, sizeof(buf),
-            "  %2s%-2s -  Replay up to the last %d bytes of the log.\r\n",
+            "  %2s%-2s -  Replay up to the last %d bytes of output.\r\n",
             esc, tmp, LOG_REPLAY_LEN);
     }
 
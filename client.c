@@ -53,10 +53,15 @@ int main(int argc, char *argv[])
         display_error(conf);
     else if (send_req(conf) < 0)
         display_error(conf);
+    else if ((conf->req->command == CONMAN_CMD_QUERY)
+      || (conf->req->command == CONMAN_CMD_STATS)) {
+        if (recv_query_rsp(conf, STDOUT_FILENO) < 0)
+            display_error(conf);
+    }
     else if (recv_rsp(conf) < 0)
         display_error(conf);
-    else if (conf->req->command == CONMAN_CMD_QUERY)
-        display_consoles(conf, STDOUT_FILENO);
+    else if (conf->req->enableMux)
+        mux_consoles(conf);
     else if ((conf->req->command == CONMAN_CMD_CONNECT)
       || (conf->req->command == CONMAN_CMD_MONITOR))
         connect_console(conf);
@@ -35,6 +35,8 @@ typedef struct client_conf {
     int             escapeChar;         /* char to issue client escape seq   */
     char           *log;                /* connection logfile name           */
     int             logd;               /* connection logfile descriptor     */
+    char           *muxDir;             /* dir for per-console mux output    */
+    char           *unixSock;           /* unix-domain socket of local server*/
     int             errnum;             /* error number from issuing command */
     char           *errmsg;             /* error msg from issuing command    */
     struct termios  tty;                /* saved "cooked" terminal mode      */
@@ -72,6 +74,8 @@ int send_req(client_conf_t *conf);
 
 int recv_rsp(client_conf_t *conf);
 
+int recv_query_rsp(client_conf_t *conf, int fd);
+
 void display_error(client_conf_t *conf);
 
 void display_data(client_conf_t *conf, int fd);
@@ -88,4 +92,11 @@ void connect_console(client_conf_t *conf);
 char * write_esc_char(char c, char *dst);
 
 
+/******************\
+**  client-mux.c  **
+\******************/
+
+void mux_consoles(client_conf_t *conf);
+
+
 #endif /* !_CLIENT_H */
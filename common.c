@@ -65,14 +65,20 @@ char *proto_strs[] = {
     "FORCE",
     "HELLO",
     "JOIN",
+    "LINES",
     "MESSAGE",
     "MONITOR",
+    "MORE",
+    "MUX",
     "OK",
     "OPTION",
     "QUERY",
     "QUIET",
     "REGEX",
+    "REPLAY",
     "RESET",
+    "STATS",
+    "STREAM",
     "TTY",
     "USER",
     NULL
@@ -95,14 +101,19 @@ req_t * create_req(void)
     req->ip = NULL;
     req->port = 0;
     req->consoles = list_create((ListDelF) destroy_string);
+    req->replayBytes = 0;
+    req->replayLines = 0;
     req->command = CONMAN_CMD_NONE;
     req->enableBroadcast = 0;
     req->enableEcho = 0;
     req->enableForce = 0;
     req->enableJoin = 0;
+    req->enableMux = 0;
     req->enableQuiet = 0;
     req->enableRegex = 0;
     req->enableReset = 0;
+    req->enableStream = 0;
+    req->gotPeerCred = 0;
     return(req);
 }
 
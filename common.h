@@ -55,6 +55,18 @@
 #define CONMAN_PORT             "7890"
 #endif /* !CONMAN_PORT */
 
+/*  CONMAN_UNIXSOCK is the default unix-domain socket of a local server
+ *    listening on the default port.
+ */
+#ifndef CONMAN_UNIXSOCK
+#define CONMAN_UNIXSOCK         "/var/run/conman.sock"
+#endif /* !CONMAN_UNIXSOCK */
+
+/*  Max length of a unix-domain socket path (including the terminating NUL)
+ *    that fits in sockaddr_un.sun_path on all supported platforms.
+ */
+#define MAX_UNIX_SOCK_PATH      104
+
 /*  Default escape char for the client.
  */
 #define DEFAULT_CLIENT_ESCAPE   '&'
@@ -77,10 +89,12 @@
  *
  *    - OBJ_BUF_SIZE >= LOG_REPLAY_LEN * 2
  *    - OBJ_BUF_SIZE >= MAX_LINE
+ *    - OBJ_RING_SIZE >= OBJ_BUF_SIZE
  *    - MAX_BUF_SIZE >= MAX_LINE
  *    - MAX_SOCK_LINE >= MAX_LINE
  */
 #define OBJ_BUF_SIZE            16384
+#define OBJ_RING_SIZE           65536
 #define LOG_REPLAY_LEN          4096
 #define MAX_BUF_SIZE            4096
 #define MAX_SOCK_LINE           131072
@@ -103,6 +117,16 @@
 #define ESC_CHAR_RESET          'R'
 #define ESC_CHAR_SUSPEND        'Z'
 
+/*  Framing of a multiplexed (MUX) monitor session.
+ *  Each frame from the server consists of a 2-byte console id and a 2-byte
+ *    data length (both in network byte order) followed by the data.
+ *  The console id is the console's position in the list of consoles
+ *    returned in the response; MUX_SESSION_ID tags session-wide messages.
+ */
+#define MUX_HDR_LEN             4
+#define MUX_MAX_DATA            MAX_BUF_SIZE
+#define MUX_SESSION_ID          0xFFFF
+
 /*  Version string information
  */
 #ifndef NDEBUG
@@ -133,11 +157,12 @@ typedef int socklen_t;                  /* socklen_t is uint32_t in Posix.1g */
 #endif /* !HAVE_SOCKLEN_T */
 
 
-typedef enum cmd_type {                 /* ConMan command (2 bits)           */
+typedef enum cmd_type {                 /* ConMan command (3 bits)           */
     CONMAN_CMD_NONE,
     CONMAN_CMD_CONNECT,
     CONMAN_CMD_MONITOR,
-    CONMAN_CMD_QUERY
+    CONMAN_CMD_QUERY,
+    CONMAN_CMD_STATS
 } cmd_t;
 
 typedef struct request {
@@ -149,14 +174,19 @@ typedef struct request {
     char     *ip;                       /* queried remote ip addr string     */
     int       port;                     /* remote port number                */
     List      consoles;                 /* list of consoles affected by cmd  */
-    unsigned  command:2;                /* ConMan command to perform (cmd_t) */
+    int       replayBytes;              /* num bytes of scrollback to replay */
+    int       replayLines;              /* num lines of scrollback to replay */
+    unsigned  command:3;                /* ConMan command to perform (cmd_t) */
     unsigned  enableBroadcast:1;        /* true if b-casting to >1 consoles  */
     unsigned  enableEcho:1;             /* true if echoing standard input    */
     unsigned  enableForce:1;            /* true if forcing console conn      */
     unsigned  enableJoin:1;             /* true if joining console conn      */
+    unsigned  enableMux:1;              /* true if muxing multiple consoles  */
     unsigned  enableQuiet:1;            /* true if suppressing info messages */
     unsigned  enableRegex:1;            /* true if regex console matching    */
     unsigned  enableReset:1;            /* true if server supports reset cmd */
+    unsigned  enableStream:1;           /* true if streaming rsp negotiated  */
+    unsigned  gotPeerCred:1;            /* true if user from peer credentials*/
 } req_t;
 
 
@@ -183,14 +213,20 @@ enum proto_toks {
     CONMAN_TOK_FORCE,
     CONMAN_TOK_HELLO,
     CONMAN_TOK_JOIN,
+    CONMAN_TOK_LINES,
     CONMAN_TOK_MESSAGE,
     CONMAN_TOK_MONITOR,
+    CONMAN_TOK_MORE,
+    CONMAN_TOK_MUX,
     CONMAN_TOK_OK,
     CONMAN_TOK_OPTION,
     CONMAN_TOK_QUERY,
     CONMAN_TOK_QUIET,
     CONMAN_TOK_REGEX,
+    CONMAN_TOK_REPLAY,
     CONMAN_TOK_RESET,
+    CONMAN_TOK_STATS,
+    CONMAN_TOK_STREAM,
     CONMAN_TOK_TTY,
     CONMAN_TOK_USER
 };
@@ -0,0 +1,364 @@
+#!/bin/sh
+###############################################################################
+# ConMan synthetic load benchmark.
+###############################################################################
+# Written by Chris Dunlap <cdunlap@llnl.gov>.
+# Copyright (C) 2007-2019 Lawrence Livermore National Security, LLC.
+# Copyright (C) 2001-2007 The Regents of the University of California.
+# UCRL-CODE-2002-009.
+#
+# This file is part of ConMan: The Console Manager.
+# For details, see <https://dun.github.io/conman/>.
+#
+# ConMan is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option)
+# any later version.
+#
+# ConMan is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+# for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with ConMan.  If not, see <http://www.gnu.org/licenses/>.
+###############################################################################
+#
+# Starts a private conmand with N test consoles generating output at a
+# controlled rate, drives it with a mix of client sessions via conman-bench,
+# and reports client throughput, dropped bytes, and daemon CPU & RSS.
+# The consoles can instead replay a captured console trace as fast as the
+# daemon reads it, reporting the rate at which it is logged.
+# CPU & RSS are read from /proc and are only reported on Linux.
+#
+# See scripts/bench/README for details.
+###############################################################################
+
+PROG=`basename "$0"`
+
+CONSOLES=100
+BUSY=
+RATE=4096
+INTERVAL=100
+SECS=10
+MONITORS=0
+CONNECTS=0
+BROADCASTS=0
+MUXES=1
+WRITE_RATE=0
+STORMS=0
+SLOW=0
+THREADS=
+CLIENT_THREADS=
+LOGFILES=0
+LOGOPTS=
+TRACE=
+BUFSIZE=
+LATENCY=off
+PORT=17990
+CONMAND=conmand
+CONMAN=conman
+BENCH=conman-bench
+KEEP=0
+
+usage()
+{
+  cat <<EOT
+Usage: $PROG [OPTIONS]
+
+  -n NUM    Number of test consoles. [$CONSOLES]
+  -a NUM    Number of those consoles generating output; the rest stay idle.
+            [all]
+  -r NUM    Output bytes/sec generated by each console. [$RATE]
+  -i MSECS  Interval between bursts of console output. [$INTERVAL]
+  -t SECS   Duration of the run. [$SECS]
+  -m NUM    Read-only (monitor) sessions. [$MONITORS]
+  -c NUM    Joined read-write (connect) sessions. [$CONNECTS]
+  -b NUM    Broadcast sessions writing to all consoles. [$BROADCASTS]
+  -x NUM    Multiplexed sessions reading all consoles. [$MUXES]
+  -w NUM    Bytes/sec written by each connect/broadcast session. [$WRITE_RATE]
+  -H NUM    Concurrent query handshakes to storm the daemon with. [$STORMS]
+  -s NUM    Slow clients trickling in their greetings a byte/sec. [$SLOW]
+  -T NUM    Number of daemon worker threads. [daemon default]
+  -W NUM    Number of daemon client worker threads. [daemon default]
+  -R FILE   Replay the console trace FILE in a loop on each busy console
+            instead of generating output; "-" replays a synthetic trace.
+            Each busy console is then a process console running
+            "conman-bench -r FILE".
+  -l        Write a logfile for each console.
+  -o OPTS   Write a logfile for each console with logopts OPTS.
+  -z BYTES  Size of each console and logfile buffer. [daemon default]
+  -L        Enable output latency sampling.
+  -p PORT   Port on which the daemon listens. [$PORT]
+  -D PATH   Path to conmand. [$CONMAND]
+  -C PATH   Path to conman. [$CONMAN]
+  -B PATH   Path to conman-bench. [$BENCH]
+  -k        Keep the working directory.
+  -h        Display this help.
+EOT
+}
+
+die()
+{
+  echo "$PROG: $*" >&2
+  exit 1
+}
+
+while getopts "a:n:r:i:t:m:c:b:x:w:H:s:T:W:R:lo:z:Lp:D:C:B:kh" OPT; do
+  case "$OPT" in
+  a) BUSY=$OPTARG ;;
+  n) CONSOLES=$OPTARG ;;
+  r) RATE=$OPTARG ;;
+  i) INTERVAL=$OPTARG ;;
+  t) SECS=$OPTARG ;;
+  m) MONITORS=$OPTARG ;;
+  c) CONNECTS=$OPTARG ;;
+  b) BROADCASTS=$OPTARG ;;
+  x) MUXES=$OPTARG ;;
+  w) WRITE_RATE=$OPTARG ;;
+  H) STORMS=$OPTARG ;;
+  s) SLOW=$OPTARG ;;
+  T) THREADS=$OPTARG ;;
+  W) CLIENT_THREADS=$OPTARG ;;
+  R) TRACE=$OPTARG ;;
+  l) LOGFILES=1 ;;
+  o) LOGFILES=1; LOGOPTS=$OPTARG ;;
+  z) BUFSIZE=$OPTARG ;;
+  L) LATENCY=on ;;
+  p) PORT=$OPTARG ;;
+  D) CONMAND=$OPTARG ;;
+  C) CONMAN=$OPTARG ;;
+  B) BENCH=$OPTARG ;;
+  k) KEEP=1 ;;
+  h) usage; exit 0 ;;
+  *) usage >&2; exit 1 ;;
+  esac
+done
+
+test "$CONSOLES" -ge 1 -a "$CONSOLES" -le 9999 2>/dev/null \
+  || die "number of consoles must be within 1-9999"
+test "$INTERVAL" -ge 1 2>/dev/null || die "interval must be positive"
+test -n "$BUSY" || BUSY=$CONSOLES
+test "$BUSY" -ge 0 -a "$BUSY" -le "$CONSOLES" 2>/dev/null \
+  || die "number of busy consoles must be within 0-$CONSOLES"
+test -z "$TRACE" -o "$TRACE" = "-" -o -r "$TRACE" \
+  || die "unable to read trace \"$TRACE\""
+
+# The test console emits a burst of b bytes every m..n msecs.
+#
+BURST=`expr "$RATE" \* "$INTERVAL" / 1000`
+test "$BURST" -ge 1 || BURST=1
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/conman-bench.XXXXXX"` \
+  || die "unable to create working directory"
+CONF="$WORKDIR/conman.conf"
+PID=
+
+cleanup()
+{
+  if test -n "$PID" && kill -0 "$PID" 2>/dev/null; then
+    kill -TERM "$PID" 2>/dev/null
+    i=0
+    while kill -0 "$PID" 2>/dev/null && test $i -lt 50; do
+      sleep 0.1
+      i=`expr $i + 1`
+    done
+    kill -KILL "$PID" 2>/dev/null
+  fi
+  test "$KEEP" -eq 1 || rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT TERM
+
+# The synthetic trace resembles a boot log: timestamped kernel messages
+# and init status lines with ANSI color escapes, some ending in CR-LF.
+#
+if test "$TRACE" = "-"; then
+  TRACE="$WORKDIR/trace"
+  awk 'BEGIN {
+    srand(1)
+    for (i = 0; i < 20000; i++) {
+      t = i * 0.0123
+      if (i % 5 == 0) {
+        printf "[  \033[1;32mOK\033[0m  ] Started unit %d of the boot" \
+          " sequence.\r\n", i
+      } else if (i % 97 == 0) {
+        printf "\033[0;31mWARNING\033[0m: device %04x\treset\r\n", \
+          int(rand() * 65536)
+      } else {
+        printf "[%12.6f] kernel: pci 0000:%02x:%02x.%d: reg 0x%02x:" \
+          " [mem 0x%08x-0x%08x]\n", t, i % 256, i % 32, i % 8,
+          16 + 4 * (i % 6), i * 4096, i * 4096 + 4095
+      }
+    }
+  }' > "$TRACE"
+fi
+
+# The trace consoles run conman-bench to replay the trace, so both paths
+# are made absolute for the daemon.
+#
+case "$TRACE" in
+  ''|/*) ;;
+  *) TRACE="`pwd`/$TRACE" ;;
+esac
+case "$BENCH" in
+  */*) BENCH_DIR=`dirname "$BENCH"`
+       BENCH_PATH=`cd "$BENCH_DIR" && pwd`/`basename "$BENCH"` ;;
+  *) BENCH_PATH=$BENCH ;;
+esac
+
+{
+  echo "server keepalive=off"
+  echo "server port=$PORT"
+  echo "server logfile=\"$WORKDIR/conmand.log\""
+  echo "server latency=$LATENCY"
+  echo "server nofile=`expr $CONSOLES \* 2 + 1024`"
+  test -n "$THREADS" && echo "server threads=$THREADS"
+  test -n "$CLIENT_THREADS" && echo "server clientthreads=$CLIENT_THREADS"
+  test -n "$BUFSIZE" && echo "server bufsize=$BUFSIZE"
+  test "$LOGFILES" -eq 1 && echo "global log=\"$WORKDIR/log/%N.log\""
+  test -n "$LOGOPTS" && echo "global logopts=\"$LOGOPTS\""
+  echo "global testopts=\"b:$BURST,m:$INTERVAL,n:$INTERVAL,p:100\""
+  # Idle consoles never emit output, and their timers fire once an hour.
+  #
+  i=0
+  while test $i -lt "$CONSOLES"; do
+    if test $i -lt "$BUSY" -a -n "$TRACE"; then
+      printf 'console name="bench%04d"' $i
+      printf ' dev="%s -r %s"\n' "$BENCH_PATH" "$TRACE"
+    elif test $i -lt "$BUSY"; then
+      printf 'console name="bench%04d" dev="test:"\n' $i
+    else
+      printf 'console name="bench%04d" dev="test:"' $i
+      printf ' testopts="p:0,m:3600000,n:3600000"\n'
+    fi
+    i=`expr $i + 1`
+  done
+} > "$CONF"
+test "$LOGFILES" -eq 1 && mkdir -p "$WORKDIR/log"
+
+# Keep the clients on TCP so they reach this daemon and not a system one.
+#
+CONMAN_UNIXSOCKET=
+export CONMAN_UNIXSOCKET
+
+"$CONMAND" -F -c "$CONF" > "$WORKDIR/conmand.out" 2>&1 &
+PID=$!
+
+i=0
+until "$CONMAN" -d "127.0.0.1:$PORT" -q "bench0000" >/dev/null 2>&1; do
+  kill -0 "$PID" 2>/dev/null \
+    || die "conmand failed to start: `cat "$WORKDIR/conmand.out"`"
+  test $i -lt 100 || die "conmand not responding on port $PORT"
+  sleep 0.1
+  i=`expr $i + 1`
+done
+
+# Returns the user+system CPU ticks consumed by the daemon.
+#
+cpu_ticks()
+{
+  test -r "/proc/$PID/stat" || { echo 0; return; }
+  sed 's/.*) //' "/proc/$PID/stat" | awk '{ print $12 + $13 }'
+}
+
+# Returns the value in kB of the daemon's /proc status field $1.
+#
+proc_kb()
+{
+  test -r "/proc/$PID/status" || { echo 0; return; }
+  awk -v k="$1:" '$1 == k { print $2 }' "/proc/$PID/status"
+}
+
+# Returns the sum of the console bytes_in counters in "conman -S" output $1.
+#
+bytes_in()
+{
+  awk '{ for (i = 2; i <= NF; i++) if (sub(/^bytes_in=/, "", $i)) n += $i }
+    END { printf "%d\n", n }' "$1"
+}
+
+# Trace consoles start replaying as soon as the daemon starts, so their
+# throughput is measured from the counters at the start of the run.
+#
+if test -n "$TRACE"; then
+  "$CONMAN" -d "127.0.0.1:$PORT" -S > "$WORKDIR/stats0.out" 2>&1 \
+    || die "unable to query console statistics"
+fi
+
+HZ=`getconf CLK_TCK 2>/dev/null || echo 100`
+T0=`cpu_ticks`
+W0=`date +%s.%N`
+
+"$BENCH" -d "127.0.0.1:$PORT" -n "$CONSOLES" -p bench -t "$SECS" \
+  -m "$MONITORS" -c "$CONNECTS" -b "$BROADCASTS" -x "$MUXES" \
+  -w "$WRITE_RATE" -H "$STORMS" -s "$SLOW" > "$WORKDIR/bench.out" \
+  || die "conman-bench failed"
+
+T1=`cpu_ticks`
+W1=`date +%s.%N`
+RSS=`proc_kb VmRSS`
+HWM=`proc_kb VmHWM`
+
+"$CONMAN" -d "127.0.0.1:$PORT" -S > "$WORKDIR/stats.out" 2>&1 \
+  || die "unable to query console statistics"
+
+if test "$LOGFILES" -eq 1; then
+  LOG_BYTES=`cat "$WORKDIR"/log/*.log 2>/dev/null | wc -c`
+  LOG_LINES=`cat "$WORKDIR"/log/*.log 2>/dev/null | wc -l`
+fi
+
+if test -n "$TRACE"; then
+  echo "Consoles: $CONSOLES ($BUSY busy) replaying $TRACE" \
+    "(`wc -c < "$TRACE"` bytes)"
+else
+  echo "Consoles: $CONSOLES ($BUSY busy) at $RATE bytes/sec" \
+    "($BURST bytes every $INTERVAL ms)"
+fi
+test "$LOGFILES" -eq 1 && echo "Logfiles: logopts=\"$LOGOPTS\""
+echo "Sessions: monitor=$MONITORS connect=$CONNECTS broadcast=$BROADCASTS" \
+  "mux=$MUXES write=$WRITE_RATE bytes/sec"
+test "$STORMS" -gt 0 && echo "Queries: $STORMS concurrent handshake loops"
+test "$SLOW" -gt 0 && echo "Slow clients: $SLOW sending a greeting byte/sec"
+echo
+cat "$WORKDIR/bench.out"
+echo
+awk '
+  {
+    for (i = 2; i <= NF; i++) {
+      split($i, kv, "=")
+      sum[kv[1]] += kv[2]
+    }
+  }
+  END {
+    printf "Console bytes_in=%d bytes_out=%d bytes_lost=%d overruns=%d\n",
+      sum["bytes_in"], sum["bytes_out"], sum["bytes_lost"], sum["overruns"]
+    printf "Dropped reader_bytes_lost=%d log_bytes_lost=%d" \
+      " log_overruns=%d\n",
+      sum["reader_bytes_lost"], sum["log_bytes_lost"], sum["log_overruns"]
+  }' "$WORKDIR/stats.out"
+awk -v t0="$T0" -v t1="$T1" -v w0="$W0" -v w1="$W1" -v hz="$HZ" \
+  -v rss="$RSS" -v hwm="$HWM" '
+  BEGIN {
+    cpu = (t1 - t0) / hz
+    wall = w1 - w0
+    printf "Daemon cpu_secs=%.2f cpu_pct=%.1f rss_kb=%d rss_peak_kb=%d\n",
+      cpu, (wall > 0) ? 100 * cpu / wall : 0, rss, hwm
+  }'
+# The replayed lines are estimated from the trace's mean line length.
+#
+test -n "$TRACE" && awk -v w0="$W0" -v w1="$W1" \
+  -v b0="`bytes_in "$WORKDIR/stats0.out"`" \
+  -v b1="`bytes_in "$WORKDIR/stats.out"`" \
+  -v tb="`wc -c < "$TRACE"`" -v tl="`wc -l < "$TRACE"`" '
+  BEGIN {
+    wall = (w1 > w0) ? w1 - w0 : 1
+    bytes = b1 - b0
+    lines = (tb > 0) ? bytes * tl / tb : 0
+    printf "Replayed bytes=%d lines=%d MB/s=%.1f lines/s=%.0f\n",
+      bytes, lines, bytes / wall / 1048576, lines / wall
+  }'
+test "$LOGFILES" -eq 1 \
+  && echo "Logged bytes=$LOG_BYTES lines=$LOG_LINES (written at end of run)"
+test "$KEEP" -eq 1 && echo "Working directory: $WORKDIR"
+exit 0
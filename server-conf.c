@@ -54,7 +54,9 @@ enum server_conf_toks {
 /*
  *  Keep enums in sync w/ server_conf_strs[].
  */
-    SERVER_CONF_CONSOLE = LEX_TOK_OFFSET,
+    SERVER_CONF_BUFSIZE = LEX_TOK_OFFSET,
+    SERVER_CONF_CLIENTTHREADS,
+    SERVER_CONF_CONSOLE,
     SERVER_CONF_COREDUMP,
     SERVER_CONF_COREDUMPDIR,
     SERVER_CONF_DEV,
@@ -64,11 +66,15 @@ enum server_conf_toks {
     SERVER_CONF_IPMIOPTS,
 #endif /* WITH_FREEIPMI */
     SERVER_CONF_KEEPALIVE,
+    SERVER_CONF_LATENCY,
     SERVER_CONF_LOG,
     SERVER_CONF_LOGDIR,
     SERVER_CONF_LOGFILE,
     SERVER_CONF_LOGOPTS,
+    SERVER_CONF_LOGSYNC,
+    SERVER_CONF_LOGTHREADS,
     SERVER_CONF_LOOPBACK,
+    SERVER_CONF_METRICS,
     SERVER_CONF_NAME,
     SERVER_CONF_NOFILE,
     SERVER_CONF_OFF,
@@ -76,12 +82,16 @@ enum server_conf_toks {
     SERVER_CONF_PIDFILE,
     SERVER_CONF_PORT,
     SERVER_CONF_RESETCMD,
+    SERVER_CONF_RESOLVE,
+    SERVER_CONF_SCROLLBACK,
     SERVER_CONF_SEROPTS,
     SERVER_CONF_SERVER,
     SERVER_CONF_SYSLOG,
     SERVER_CONF_TCPWRAPPERS,
     SERVER_CONF_TESTOPTS,
-    SERVER_CONF_TIMESTAMP
+    SERVER_CONF_THREADS,
+    SERVER_CONF_TIMESTAMP,
+    SERVER_CONF_UNIXSOCKET
 };
 
 static char *server_conf_strs[] = {
@@ -89,6 +99,8 @@ static char *server_conf_strs[] = {
  *  Keep strings in sync w/ server_conf_toks enum.
  *  These must be sorted in a case-insensitive manner.
  */
+    "BUFSIZE",
+    "CLIENTTHREADS",
     "CONSOLE",
     "COREDUMP",
     "COREDUMPDIR",
@@ -99,11 +111,15 @@ static char *server_conf_strs[] = {
     "IPMIOPTS",
 #endif /* WITH_FREEIPMI */
     "KEEPALIVE",
+    "LATENCY",
     "LOG",
     "LOGDIR",
     "LOGFILE",
     "LOGOPTS",
+    "LOGSYNC",
+    "LOGTHREADS",
     "LOOPBACK",
+    "METRICS",
     "NAME",
     "NOFILE",
     "OFF",
@@ -111,12 +127,16 @@ static char *server_conf_strs[] = {
     "PIDFILE",
     "PORT",
     "RESETCMD",
+    "RESOLVE",
+    "SCROLLBACK",
     "SEROPTS",
     "SERVER",
     "SYSLOG",
     "TCPWRAPPERS",
     "TESTOPTS",
+    "THREADS",
     "TIMESTAMP",
+    "UNIXSOCKET",
     NULL
 };
 
@@ -180,6 +200,8 @@ typedef struct console_strs {
     char *iopts;
 #endif /* WITH_FREEIPMI */
     char *topts;
+    int   bufsize;
+    int   scrollback;
 } console_strs_t;
 
 
@@ -190,6 +212,11 @@ static int process_console(server_conf_t *conf, console_strs_t *con_p,
     char *errbuf, int errbuflen);
 static void parse_global_directive(server_conf_t *conf, Lex l);
 static void parse_server_directive(server_conf_t *conf, Lex l);
+static int parse_size(Lex l, const char *tokstr, int min, int max,
+    char *err, int errlen);
+static void set_default_obj_sizes(server_conf_t *conf);
+static void create_console_index(server_conf_t *conf);
+static int compare_console_names(const void *p1, const void *p2);
 static int read_pidfile(const char *pidfile);
 static int write_pidfile(const char *pidfile);
 static int lookup_syslog_priority(const char *priority);
@@ -214,6 +241,12 @@ server_conf_t * create_server_conf(void)
     conf->logFilePtr = NULL;
     conf->logFileLevel = LOG_INFO;
     conf->numOpenFiles = 0;
+    conf->objBufSize = OBJ_BUF_SIZE;
+    conf->scrollbackSize = 0;
+    conf->numThreads = 1;
+    conf->numLogThreads = 0;
+    conf->numClientThreads = DEFAULT_CLIENT_THREADS;
+    conf->logSyncSecs = 0;
     conf->pidFileName = NULL;
     conf->resetCmd = NULL;
     conf->syslogFacility = -1;
@@ -230,13 +263,21 @@ server_conf_t * create_server_conf(void)
     conf->fd = -1;
     conf->port = 0;
     conf->ld = -1;
+    conf->unixSockName = NULL;
+    conf->uld = -1;
+    conf->metricsPort = 0;
+    conf->metricsSockName = NULL;
+    conf->mld = -1;
     conf->objs = list_create((ListDelF) destroy_obj);
+    conf->consoleIndex = NULL;
+    conf->numConsoles = 0;
     if (!(conf->tp = tpoll_create(0))) {
         log_err(0, "Unable to create object for multiplexing I/O");
     }
     conf->globalLogName = NULL;
     conf->globalLogOpts.enableSanitize = DEFAULT_LOGOPT_SANITIZE;
     conf->globalLogOpts.enableTimestamp = DEFAULT_LOGOPT_TIMESTAMP;
+    conf->globalLogOpts.enableTimeMsec = DEFAULT_LOGOPT_TIMESTAMP_MSEC;
     conf->globalLogOpts.enableLock = DEFAULT_LOGOPT_LOCK;
     conf->globalSerOpts.bps = DEFAULT_SEROPT_BPS;
     conf->globalSerOpts.databits = DEFAULT_SEROPT_DATABITS;
@@ -255,7 +296,9 @@ server_conf_t * create_server_conf(void)
     }
     conf->enableCoreDump = 0;
     conf->enableKeepAlive = 1;
+    conf->enableLatency = 0;
     conf->enableLoopBack = 1;
+    conf->enableResolve = 1;
     conf->enableTCPWrap = 0;
     conf->enableVerbose = 0;
     conf->enableZeroLogs = 0;
@@ -299,6 +342,31 @@ void destroy_server_conf(server_conf_t *conf)
         }
         conf->ld = -1;
     }
+    if (conf->uld >= 0) {
+        if (close(conf->uld) < 0) {
+            log_msg(LOG_ERR, "Unable to close unix-domain socket: %s",
+                strerror(errno));
+        }
+        conf->uld = -1;
+        if (unlink(conf->unixSockName) < 0) {
+            log_msg(LOG_ERR, "Unable to delete unix-domain socket \"%s\": %s",
+                conf->unixSockName, strerror(errno));
+        }
+    }
+    if (conf->mld >= 0) {
+        if (close(conf->mld) < 0) {
+            log_msg(LOG_ERR, "Unable to close metrics socket: %s",
+                strerror(errno));
+        }
+        conf->mld = -1;
+        if (conf->metricsSockName && (unlink(conf->metricsSockName) < 0)) {
+            log_msg(LOG_ERR, "Unable to delete metrics socket \"%s\": %s",
+                conf->metricsSockName, strerror(errno));
+        }
+    }
+    if (conf->consoleIndex) {
+        free(conf->consoleIndex);
+    }
     if (conf->objs) {
         list_destroy(conf->objs);
     }
@@ -313,8 +381,10 @@ void destroy_server_conf(server_conf_t *conf)
     destroy_string(conf->logDirName);
     destroy_string(conf->logFileName);
     destroy_string(conf->logFmtName);
+    destroy_string(conf->metricsSockName);
     destroy_string(conf->pidFileName);
     destroy_string(conf->resetCmd);
+    destroy_string(conf->unixSockName);
     free(conf);
     return;
 }
@@ -462,6 +532,9 @@ void process_config(server_conf_t *conf)
     lex_destroy(l);
     free(buf);
 
+    set_default_obj_sizes(conf);
+    create_console_index(conf);
+
     if (conf->port <= 0) {              /* port not set so use default */
         conf->port = atoi(CONMAN_PORT);
     }
@@ -582,6 +655,7 @@ static void parse_console_directive(server_conf_t *conf, Lex l)
 {
 /*  CONSOLE NAME="<str>" DEV="<file>" [LOG="<file>"]
  *    [LOGOPTS="<str>"] [SEROPTS="<str>"] [IPMIOPTS="<str>"] [TESTOPTS="<str>"]
+ *    [BUFSIZE=<int>] [SCROLLBACK=<int>]
  *  Note: IPMIOPTS is only available if WITH_FREEIPMI is defined.
  */
     const char *directive;              /* name of directive being parsed */
@@ -590,6 +664,7 @@ static void parse_console_directive(server_conf_t *conf, Lex l)
     int done = 0;
     char err[MAX_LINE] = "";
     console_strs_t con;
+    int n;
 
     memset(&con, 0, sizeof(con));
 
@@ -602,6 +677,20 @@ static void parse_console_directive(server_conf_t *conf, Lex l)
         tokstr = lex_tok_to_str(l, tok);
         switch(tok) {
 
+        case SERVER_CONF_BUFSIZE:
+            if ((n = parse_size(l, tokstr, MIN_OBJ_BUF_SIZE,
+                    MAX_OBJ_BUF_SIZE, err, sizeof(err))) > 0) {
+                con.bufsize = n;
+            }
+            break;
+
+        case SERVER_CONF_SCROLLBACK:
+            if ((n = parse_size(l, tokstr, MIN_SCROLLBACK_SIZE,
+                    MAX_SCROLLBACK_SIZE, err, sizeof(err))) > 0) {
+                con.scrollback = n;
+            }
+            break;
+
         case SERVER_CONF_NAME:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -920,6 +1009,9 @@ static int process_console(server_conf_t *conf, console_strs_t *con_p,
             con_p->name, arg0);
         goto err;
     }
+    console->bufSize = con_p->bufsize;
+    console->ringSize = con_p->scrollback;
+
     if ((con_p->log && con_p->log[ 0 ] != '\0')
             || (!con_p->log && conf->globalLogName)) {
         if (con_p->log) {
@@ -942,6 +1034,7 @@ static int process_console(server_conf_t *conf, console_strs_t *con_p,
                 conf, buf, console, &logopts, errbuf, errbuflen))) {
             goto err;
         }
+        logfile->bufSize = con_p->bufsize;
         link_objs(console, logfile);
     }
     list_destroy(args);
@@ -1125,6 +1218,32 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
         tokstr = lex_tok_to_str(l, tok);
         switch(tok) {
 
+        case SERVER_CONF_BUFSIZE:
+            if ((n = parse_size(l, tokstr, MIN_OBJ_BUF_SIZE,
+                    MAX_OBJ_BUF_SIZE, err, sizeof(err))) > 0) {
+                conf->objBufSize = n;
+            }
+            break;
+
+        case SERVER_CONF_CLIENTTHREADS:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) != LEX_INT) {
+                snprintf(err, sizeof(err),
+                    "expected INTEGER for %s value", tokstr);
+            }
+            else if (((n = atoi(lex_text(l))) < 1)
+                    || (n > MAX_CLIENT_THREADS)) {
+                snprintf(err, sizeof(err),
+                    "invalid %s value %d", tokstr, n);
+            }
+            else {
+                conf->numClientThreads = n;
+            }
+            break;
+
         case SERVER_CONF_COREDUMP:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1219,6 +1338,23 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
             }
             break;
 
+        case SERVER_CONF_LATENCY:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) == SERVER_CONF_ON) {
+                conf->enableLatency = 1;
+            }
+            else if (lex_prev(l) == SERVER_CONF_OFF) {
+                conf->enableLatency = 0;
+            }
+            else {
+                snprintf(err, sizeof(err),
+                    "expected ON or OFF for %s value", tokstr);
+            }
+            break;
+
         case SERVER_CONF_LOGDIR:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1273,6 +1409,43 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
             }
             break;
 
+        case SERVER_CONF_LOGSYNC:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) != LEX_INT) {
+                snprintf(err, sizeof(err),
+                    "expected INTEGER for %s value", tokstr);
+            }
+            else if ((n = atoi(lex_text(l))) < 0) {
+                snprintf(err, sizeof(err),
+                    "invalid %s value %d", tokstr, n);
+            }
+            else {
+                conf->logSyncSecs = n;
+            }
+            break;
+
+        case SERVER_CONF_LOGTHREADS:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) != LEX_INT) {
+                snprintf(err, sizeof(err),
+                    "expected INTEGER for %s value", tokstr);
+            }
+            else if (((n = atoi(lex_text(l))) < 0)
+                    || (n > MAX_LOG_THREADS)) {
+                snprintf(err, sizeof(err),
+                    "invalid %s value %d", tokstr, n);
+            }
+            else {
+                conf->numLogThreads = n;
+            }
+            break;
+
         case SERVER_CONF_LOOPBACK:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1290,6 +1463,43 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
             }
             break;
 
+        case SERVER_CONF_METRICS:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) == LEX_INT) {
+                if (((n = atoi(lex_text(l))) <= 0) || (n > 65535)) {
+                    snprintf(err, sizeof(err),
+                        "invalid %s value %d", tokstr, n);
+                }
+                else {
+                    conf->metricsPort = n;
+                    destroy_string(conf->metricsSockName);
+                    conf->metricsSockName = NULL;
+                }
+            }
+            else if ((lex_prev(l) != LEX_STR)
+                    || is_empty_string(lex_text(l))) {
+                snprintf(err, sizeof(err),
+                    "expected INTEGER or STRING for %s value", tokstr);
+            }
+            else if (lex_text(l)[0] != '/') {
+                snprintf(err, sizeof(err),
+                    "expected absolute pathname for %s value", tokstr);
+            }
+            else if (strlen(lex_text(l)) >= MAX_UNIX_SOCK_PATH) {
+                snprintf(err, sizeof(err),
+                    "%s value exceeds %d-byte maximum",
+                    tokstr, MAX_UNIX_SOCK_PATH - 1);
+            }
+            else {
+                destroy_string(conf->metricsSockName);
+                conf->metricsSockName = create_string(lex_text(l));
+                conf->metricsPort = 0;
+            }
+            break;
+
         case SERVER_CONF_NOFILE:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1368,6 +1578,30 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
             }
             break;
 
+        case SERVER_CONF_RESOLVE:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) == SERVER_CONF_ON) {
+                conf->enableResolve = 1;
+            }
+            else if (lex_prev(l) == SERVER_CONF_OFF) {
+                conf->enableResolve = 0;
+            }
+            else {
+                snprintf(err, sizeof(err),
+                    "expected ON or OFF for %s value", tokstr);
+            }
+            break;
+
+        case SERVER_CONF_SCROLLBACK:
+            if ((n = parse_size(l, tokstr, MIN_SCROLLBACK_SIZE,
+                    MAX_SCROLLBACK_SIZE, err, sizeof(err))) > 0) {
+                conf->scrollbackSize = n;
+            }
+            break;
+
         case SERVER_CONF_SYSLOG:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1409,6 +1643,25 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
 #endif /* WITH_TCP_WRAPPERS */
             break;
 
+        case SERVER_CONF_THREADS:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if (lex_next(l) != LEX_INT) {
+                snprintf(err, sizeof(err),
+                    "expected INTEGER for %s value", tokstr);
+            }
+            else if (((n = atoi(lex_text(l))) <= 0)
+                    || (n > MAX_SERVER_THREADS)) {
+                snprintf(err, sizeof(err),
+                    "invalid %s value %d", tokstr, n);
+            }
+            else {
+                conf->numThreads = n;
+            }
+            break;
+
         case SERVER_CONF_TIMESTAMP:
             if (lex_next(l) != '=') {
                 snprintf(err, sizeof(err),
@@ -1456,6 +1709,31 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
             }
             break;
 
+        case SERVER_CONF_UNIXSOCKET:
+            if (lex_next(l) != '=') {
+                snprintf(err, sizeof(err),
+                    "expected '=' after %s keyword", tokstr);
+            }
+            else if ((lex_next(l) != LEX_STR)
+                    || is_empty_string(lex_text(l))) {
+                snprintf(err, sizeof(err),
+                    "expected STRING for %s value", tokstr);
+            }
+            else if (lex_text(l)[0] != '/') {
+                snprintf(err, sizeof(err),
+                    "expected absolute pathname for %s value", tokstr);
+            }
+            else if (strlen(lex_text(l)) >= MAX_UNIX_SOCK_PATH) {
+                snprintf(err, sizeof(err),
+                    "%s value exceeds %d-byte maximum",
+                    tokstr, MAX_UNIX_SOCK_PATH - 1);
+            }
+            else {
+                destroy_string(conf->unixSockName);
+                conf->unixSockName = create_string(lex_text(l));
+            }
+            break;
+
         case LEX_EOF:
         case LEX_EOL:
             done = 1;
@@ -1482,6 +1760,109 @@ static void parse_server_directive(server_conf_t *conf, Lex l)
 }
 
 
+static int parse_size(Lex l, const char *tokstr, int min, int max,
+    char *err, int errlen)
+{
+/*  Parses the "=<int>" value of a BUFSIZE or SCROLLBACK keyword,
+ *    which must be within the range [min,max].
+ *  Returns the size on success; o/w, returns 0 (writing an error
+ *    message into buffer 'err' of length 'errlen').
+ */
+    int n;
+
+    if (lex_next(l) != '=') {
+        snprintf(err, errlen, "expected '=' after %s keyword", tokstr);
+    }
+    else if (lex_next(l) != LEX_INT) {
+        snprintf(err, errlen, "expected INTEGER for %s value", tokstr);
+    }
+    else if (((n = atoi(lex_text(l))) < min) || (n > max)) {
+        snprintf(err, errlen, "invalid %s value %d (must be %d-%d)",
+            tokstr, n, min, max);
+    }
+    else {
+        return(n);
+    }
+    return(0);
+}
+
+
+static void set_default_obj_sizes(server_conf_t *conf)
+{
+/*  Sets the buffer size of console and logfile objs not having
+ *    a per-console BUFSIZE to the server's default, and likewise for
+ *    the scrollback size of console objs.
+ *  This is done after the config has been processed since the
+ *    SERVER BUFSIZE & SCROLLBACK keywords may follow the CONSOLE directives.
+ *  The read size of each obj is then updated for its readers' buffer sizes.
+ */
+    ListIterator i;
+    obj_t *obj;
+
+    i = list_iterator_create(conf->objs);
+    while ((obj = list_next(i))) {
+        if (obj->bufSize <= 0) {
+            obj->bufSize = conf->objBufSize;
+        }
+        if (is_console_obj(obj) && (obj->ringSize <= 0)) {
+            obj->ringSize = conf->scrollbackSize;
+        }
+    }
+    list_iterator_reset(i);
+    while ((obj = list_next(i))) {
+        set_obj_read_size(obj);
+    }
+    list_iterator_destroy(i);
+    return;
+}
+
+
+static void create_console_index(server_conf_t *conf)
+{
+/*  Creates an index of the console objs sorted by name (in strcmp order)
+ *    for resolving the console names & patterns of client requests.
+ *  Since all consoles sharing a common name prefix are adjacent, a literal
+ *    name can be found via a binary search, and a glob pattern with a literal
+ *    prefix only needs to be matched against the consoles within that range.
+ *  Console objs are only created while processing the config,
+ *    so the index remains valid for the life of the daemon.
+ */
+    ListIterator i;
+    obj_t *obj;
+    int n;
+
+    assert(conf->consoleIndex == NULL);
+
+    if (!(conf->consoleIndex = malloc((list_count(conf->objs) + 1)
+            * sizeof(obj_t *)))) {
+        out_of_memory();
+    }
+    n = 0;
+    i = list_iterator_create(conf->objs);
+    while ((obj = list_next(i))) {
+        if (is_console_obj(obj)) {
+            conf->consoleIndex[n++] = obj;
+        }
+    }
+    list_iterator_destroy(i);
+
+    qsort(conf->consoleIndex, n, sizeof(obj_t *), compare_console_names);
+    conf->numConsoles = n;
+    return;
+}
+
+
+static int compare_console_names(const void *p1, const void *p2)
+{
+/*  Used by qsort() to compare the names of two console objs in the index.
+ */
+    const obj_t *obj1 = *(obj_t * const *) p1;
+    const obj_t *obj2 = *(obj_t * const *) p2;
+
+    return(strcmp(obj1->name, obj2->name));
+}
+
+
 static int read_pidfile(const char *pidfile)
 {
 /*  Reads the PID from the specified pidfile.
@@ -43,13 +43,10 @@
 #include "util.h"
 #include "wrapper.h"
 
-extern tpoll_t tp_global;               /* defined in server.c */
-
 
 static void perform_serial_break(obj_t *client);
 static void perform_del_char_seq(obj_t *client);
 static void perform_console_writer_linkage(obj_t *client);
-static void perform_log_replay(obj_t *client);
 static void perform_quiet_toggle(obj_t *client);
 static void perform_reset(obj_t *client);
 static void kill_reset_cmd(obj_t *console);
@@ -97,7 +94,7 @@ int process_client_escapes(obj_t *client, void *src, int len)
                 perform_console_writer_linkage(client);
                 break;
             case ESC_CHAR_REPLAY:
-                perform_log_replay(client);
+                perform_log_replay(client, LOG_REPLAY_LEN, 0);
                 break;
             case ESC_CHAR_MONITOR:
                 client->aux.client.req->enableForce = 0;
@@ -259,25 +256,19 @@ static void perform_console_writer_linkage(obj_t *client)
 }
 
 
-static void perform_log_replay(obj_t *client)
+void perform_log_replay(obj_t *client, int numBytes, int numLines)
 {
 /*  Kinda like TiVo's Instant Replay.  :)
- *  Replays the last bytes from the console logfile (if present) associated
+ *  Replays the scrollback held in the output ring of the console associated
  *    with this client (in either a R/O or R/W session, but not a B/C session).
- *
- *  The maximum amount of data that can be written into an object's
- *    circular-buffer via write_obj_data() is (OBJ_BUF_SIZE - 1) bytes.
- *    But writing this much data may likely overwrite data in the buffer that
- *    has not been flushed to the object's file descriptor via write_to_obj().
- *    Therefore, it is recommended (LOG_REPLAY_LEN <= OBJ_BUF_SIZE / 2).
+ *  If (numLines) is positive, the last (numLines) lines are replayed;
+ *    o/w, the last (numBytes) bytes are replayed.
+ *  The replay is written to the client in chunks as its fd becomes writable
+ *    (see write_ring_to_client()), so it is not bounded by the size of
+ *    the client's circular-buffer.
  */
     obj_t *console;
-    obj_t *logfile;
-    unsigned char buf[OBJ_BUF_SIZE - 1];
-    unsigned char *ptr = buf;
-    int len = sizeof(buf);
-    unsigned char *p;
-    int n, m;
+    char buf[MAX_LINE];
 
     assert(is_client_obj(client));
 
@@ -291,102 +282,20 @@ static void perform_log_replay(obj_t *client)
     assert(list_count(client->writers) == 1);
     console = list_peek(client->writers);
     assert(is_console_obj(console));
-    logfile = get_console_logfile_obj(console);
-
-    if (!logfile) {
-        assert(len > 0);
-        n = snprintf((char *) ptr, len,
-            "%sConsole [%s] is not being logged -- cannot replay%s",
-            CONMAN_MSG_PREFIX, console->name, CONMAN_MSG_SUFFIX);
-        if ((n < 0) || (n >= len)) {
-            log_msg(LOG_WARNING,
-                "Insufficient buffer to write message to console [%s] log",
-                console->name);
-            return;
-        }
-        ptr += n;
-        len -= n;
-    }
-    else {
-        assert(is_logfile_obj(logfile));
-        assert(len > 0);
-        n = snprintf((char *) ptr, len, "%sBegin log replay of console [%s]%s",
-            CONMAN_MSG_PREFIX, console->name, CONMAN_MSG_SUFFIX);
-        if ((n < 0) || (n >= len)) {
-            log_msg(LOG_WARNING,
-                "Insufficient buffer to replay console [%s] log for <%s>",
-                console->name, client->name);
-            return;
-        }
-        ptr += n;
-        len -= n;
-        /*
-         *  Reserve space in 'buf' for the "End log replay" message
-         *    (which is 2 bytes less than the "Begin log replay" message).
-         */
-        len -= n - 2;
-        if (len <= 0) {
-            log_msg(LOG_WARNING,
-                "Insufficient buffer to replay console [%s] log for <%s>",
-                console->name, client->name);
-            return;
-        }
-        x_pthread_mutex_lock(&logfile->bufLock);
-
-        /*  Compute the number of bytes to replay.
-         *  If the console's circular-buffer has not yet wrapped around,
-         *    don't wrap back into uncharted buffer territory.
-         *  The result is bounded by the value of LOG_REPLAY_LEN and the
-         *    amount of buffer space remaining in 'buf'.
-         */
-        if (!logfile->gotBufWrap) {
-            n = logfile->bufInPtr - logfile->buf;
-        }
-        else {
-            n = OBJ_BUF_SIZE - 1;
-        }
-        if (n < 0) {
-            n = 0;
-        }
-        if (n > LOG_REPLAY_LEN) {
-            n = LOG_REPLAY_LEN;
-        }
-        if (n > len) {
-            n = len;
-        }
 
-        p = logfile->bufInPtr - n;
-        if (p >= logfile->buf) {        /* no wrap needed */
-            assert(n > 0);
-            memcpy(ptr, p, n);
-            ptr += n;
-        }
-        else {                          /* wrap backwards */
-            m = logfile->buf - p;
-            assert(m > 0);
-            assert(m <= n);
-            p = &logfile->buf[OBJ_BUF_SIZE] - m;
-            memcpy(ptr, p, m);
-            ptr += m;
-            n -= m;
-            memcpy(ptr, logfile->buf, n);
-            ptr += n;
-        }
-
-        x_pthread_mutex_unlock(&logfile->bufLock);
+    snprintf(buf, sizeof(buf), "%sBegin log replay of console [%s]%s",
+        CONMAN_MSG_PREFIX, console->name, CONMAN_MSG_SUFFIX);
+    strcpy(&buf[sizeof(buf) - 3], "\r\n");
+    write_obj_data(client, buf, strlen(buf), 0);
 
-        /*  Recompute 'len' since space was already reserved for it above.
-         */
-        len = &buf[sizeof(buf)] - ptr;
-        assert(len > 0);
-        n = snprintf((char *) ptr, len, "%sEnd log replay of console [%s]%s",
+    if (replay_console_ring(client, numBytes, numLines) < 0) {
+        snprintf(buf, sizeof(buf), "%sEnd log replay of console [%s]%s",
             CONMAN_MSG_PREFIX, console->name, CONMAN_MSG_SUFFIX);
-        assert((n >= 0) && (n < len));
-        ptr += n;
+        strcpy(&buf[sizeof(buf) - 3], "\r\n");
+        write_obj_data(client, buf, strlen(buf), 0);
+        return;
     }
-
     DPRINTF((5, "Performing log replay on console [%s].\n", console->name));
-    write_obj_data(client, buf, ptr - buf, 0);
     return;
 }
 
@@ -498,7 +407,7 @@ static void perform_reset(obj_t *client)
 
         /*  Set a timer to ensure the reset cmd does not exceed its time limit.
          */
-        console->resetCmdTimer = tpoll_timeout_relative(tp_global,
+        console->resetCmdTimer = tpoll_timeout_relative(console->tp,
             (callback_f) kill_reset_cmd, console, RESET_CMD_TIMEOUT * 1000);
         if (console->resetCmdTimer < 0) {
             write_notify_msg(console, LOG_WARNING,
@@ -553,19 +462,19 @@ static void kill_reset_cmd(obj_t *console)
 static void perform_suspend(obj_t *client)
 {
 /*  Toggles whether output to the client is suspended/resumed.
- *  Note that while a client is suspended, data may still be written
- *    into its circular-buffer; if the client does not resume before
- *    the buffer wraps around, data will be lost.
+ *  Note that while a client is suspended, console output is still written
+ *    into the console's output ring; if the client does not resume before
+ *    the ring wraps around, data will be lost and the client notified.
  */
     assert(is_client_obj(client));
 
     client->aux.client.gotSuspend ^= 1;
 
     if (client->aux.client.gotSuspend) {
-        tpoll_clear(tp_global, client->fd, POLLOUT);
+        tpoll_clear(client->tp, client->fd, POLLOUT);
     }
     else {
-        tpoll_set(tp_global, client->fd, POLLOUT);
+        tpoll_set(client->tp, client->fd, POLLOUT);
     }
 
     /*  FIXME: Do check_console_state() here looking for downed telnets.
@@ -76,7 +76,6 @@ static int complete_ipmi_connect(obj_t *ipmi);
 static void fail_ipmi_connect(obj_t *ipmi);
 static void reset_ipmi_delay(obj_t *ipmi);
 
-extern tpoll_t tp_global;               /* defined in server.c */
 static int is_ipmi_engine_started = 0;
 
 
@@ -810,11 +809,11 @@ static void disconnect_ipmi_obj(obj_t *ipmi)
     x_pthread_mutex_lock(&ipmi->aux.ipmi.mutex);
 
     if (ipmi->aux.ipmi.timer >= 0) {
-        (void) tpoll_timeout_cancel(tp_global, ipmi->aux.ipmi.timer);
+        (void) tpoll_timeout_cancel(ipmi->tp, ipmi->aux.ipmi.timer);
         ipmi->aux.ipmi.timer = -1;
     }
     if (ipmi->fd >= 0) {
-        tpoll_clear(tp_global, ipmi->fd, POLLIN | POLLOUT);
+        tpoll_clear(ipmi->tp, ipmi->fd, POLLIN | POLLOUT);
         if (close(ipmi->fd) < 0) {
             log_msg(LOG_WARNING,
                 "Unable to close connection to <%s> for console [%s]: %s",
@@ -861,7 +860,7 @@ static int connect_ipmi_obj(obj_t *ipmi)
     if (ipmi->aux.ipmi.state != CONMAN_IPMI_UP) {
 
         if (ipmi->aux.ipmi.timer >= 0) {
-            (void) tpoll_timeout_cancel(tp_global, ipmi->aux.ipmi.timer);
+            (void) tpoll_timeout_cancel(ipmi->tp, ipmi->aux.ipmi.timer);
             ipmi->aux.ipmi.timer = -1;
         }
         if (ipmi->aux.ipmi.state == CONMAN_IPMI_DOWN) {
@@ -914,7 +913,7 @@ static int initiate_ipmi_connect(obj_t *ipmi)
      *    connect_ipmi_obj().
      */
     assert(ipmi->aux.ipmi.timer == -1);
-    ipmi->aux.ipmi.timer = tpoll_timeout_relative(tp_global,
+    ipmi->aux.ipmi.timer = tpoll_timeout_relative(ipmi->tp,
         (callback_f) connect_ipmi_obj, ipmi,
         IPMI_CONNECT_TIMEOUT * 1000);
 
@@ -992,7 +991,7 @@ static int complete_ipmi_connect(obj_t *ipmi)
 
     ipmi->gotEOF = 0;
     ipmi->aux.ipmi.state = CONMAN_IPMI_UP;
-    tpoll_set(tp_global, ipmi->fd, POLLIN);
+    tpoll_set(ipmi->tp, ipmi->fd, POLLIN);
 
     /*  Require the connection to be up for a minimum length of time
      *    before resetting the reconnect delay back to the minimum.
@@ -1000,11 +999,12 @@ static int complete_ipmi_connect(obj_t *ipmi)
      *    connect_ipmi_obj().
      */
     assert(ipmi->aux.ipmi.timer == -1);
-    ipmi->aux.ipmi.timer = tpoll_timeout_relative(tp_global,
+    ipmi->aux.ipmi.timer = tpoll_timeout_relative(ipmi->tp,
         (callback_f) reset_ipmi_delay, ipmi, IPMI_MIN_TIMEOUT * 1000);
 
     /*  Notify linked objs when transitioning into an UP state.
      */
+    obj_stats_add(&ipmi->stats.numConnects, 1);
     write_notify_msg(ipmi, LOG_INFO, "Console [%s] connected to <%s>",
         ipmi->name, ipmi->aux.ipmi.host);
     DPRINTF((15, "Connection established to <%s> via IPMI for [%s].\n",
@@ -1042,7 +1042,7 @@ static void fail_ipmi_connect(obj_t *ipmi)
     DPRINTF((15, "Reconnect attempt to <%s> via IPMI for [%s] in %ds.\n",
         ipmi->aux.ipmi.host, ipmi->name, ipmi->aux.ipmi.delay));
     assert(ipmi->aux.ipmi.timer == -1);
-    ipmi->aux.ipmi.timer = tpoll_timeout_relative(tp_global,
+    ipmi->aux.ipmi.timer = tpoll_timeout_relative(ipmi->tp,
         (callback_f) connect_ipmi_obj, ipmi,
         ipmi->aux.ipmi.delay * 1000);
 
@@ -30,18 +30,83 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #include "common.h"
 #include "log.h"
 #include "server.h"
 #include "tpoll.h"
 #include "util-file.h"
 #include "util-str.h"
+#include "util.h"
+#include "wrapper.h"
 
-extern tpoll_t tp_global;               /* defined in server.c */
+
+static void * log_writer_thread(void *arg);
+static obj_t * get_log_writer_batch(void);
+static void put_log_writer_batch(obj_t *batch, unsigned long usecs);
+static void enqueue_logfile(obj_t *logfile);
+static void flush_logfile(obj_t *logfile);
+static void set_log_time(const struct timeval *tvp);
+static int get_log_time_string(int enableMsec, char *dst, int dstlen);
+static void init_log_char_tables(void);
+static int get_log_run_len(const unsigned char *p, int len, int isSanitize);
+
+
+/*  Logfiles are written by a pool of log writer threads (if enabled)
+ *    instead of by the mux threads, so the mux loop never blocks on
+ *    filesystem I/O.  Logfiles with buffered data are placed on a FIFO
+ *    queue (linked via aux.logfile.writeNext) and written out in batches.
+ *  The queue, stats, and each logfile's writeState are protected by
+ *    log_writer_lock.
+ */
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *log_writer_tids = NULL;
+static int num_log_writers = 0;
+static int log_writer_sync_secs = 0;
+static int log_writer_is_exiting = 0;
+static int log_writer_got_urgent = 0;
+static obj_t *log_writer_head = NULL;
+static obj_t *log_writer_tail = NULL;
+static log_writer_stats_t log_writer_stats;
+
+/*  Logfile timestamps are copied from a cached time string that is shared by
+ *    all logfile objs.  The cached time is refreshed from a single clock read
+ *    per mux loop iteration via update_log_time(), and the date & time string
+ *    is only reformatted when the second changes.
+ *  The cache is protected by log_time_lock.
+ */
+#define LOG_TIME_STR_LEN 24             /* "YYYY-MM-DD HH:MM:SS.mmm "        */
+
+static pthread_mutex_t log_time_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval log_time_tv = { 0, 0 };
+static char log_time_str[20];           /* "YYYY-MM-DD HH:MM:SS" + NUL       */
+static int got_log_timestamps = 0;
+
+/*  Console data is written to processed logfiles in runs of bytes that can
+ *    be copied verbatim, only dropping into the CR/LF state machine and
+ *    sanitize escapes for the bytes that need it.  The lookup tables are
+ *    built once during configuration and are read-only thereafter.
+ *  log_run_table[0][c] is set if (c) needs no processing within a line;
+ *    log_run_table[1][c] is the same for sanitized logs.
+ *  log_sanitize_table[c] is the one- or two-char sanitized form of (c);
+ *    the second char is NUL for single-char forms.
+ */
+static unsigned char log_run_table[2][256];
+static unsigned char log_sanitize_table[256][2];
+static int got_log_char_tables = 0;
+
+#define LOG_ONES  (~0UL / 255)          /* 0x0101...01                       */
+#define LOG_HIGHS (LOG_ONES * 0x80)     /* 0x8080...80                       */
+#define LOG_HAS_LESS(w,n) (((w) - LOG_ONES * (n)) & ~(w) & LOG_HIGHS)
+#define LOG_HAS_BYTE(w,c) LOG_HAS_LESS((w) ^ (LOG_ONES * (c)), 1)
 
 
 int parse_logfile_opts(logopt_t *opts, const char *str,
@@ -78,6 +143,7 @@ int parse_logfile_opts(logopt_t *opts, const char *str,
         return(-1);
     }
     /*  Parse the string.
+     *  The "timestampms" token enables timestamps with msec resolution.
      */
     tok = strtok(buf, separators);
     while (tok != NULL) {
@@ -89,10 +155,18 @@ int parse_logfile_opts(logopt_t *opts, const char *str,
             optsTmp.enableSanitize = 1;
         else if (!strcasecmp(tok, "nosanitize"))
             optsTmp.enableSanitize = 0;
-        else if (!strcasecmp(tok, "timestamp"))
+        else if (!strcasecmp(tok, "timestamp")) {
             optsTmp.enableTimestamp = 1;
-        else if (!strcasecmp(tok, "notimestamp"))
+            optsTmp.enableTimeMsec = 0;
+        }
+        else if (!strcasecmp(tok, "timestampms")) {
+            optsTmp.enableTimestamp = 1;
+            optsTmp.enableTimeMsec = 1;
+        }
+        else if (!strcasecmp(tok, "notimestamp")) {
             optsTmp.enableTimestamp = 0;
+            optsTmp.enableTimeMsec = 0;
+        }
         else {
             log_msg(LOG_WARNING, "ignoring unrecognized token '%s'", tok);
         }
@@ -157,16 +231,26 @@ obj_t * create_logfile_obj(server_conf_t *conf, char *name,
     }
     logfile = create_obj(conf, name, -1, CONMAN_OBJ_LOGFILE);
     logfile->aux.logfile.console = console;
+    logfile->aux.logfile.writeNext = NULL;
+    x_pthread_mutex_init(&logfile->aux.logfile.writeLock, NULL);
+    logfile->aux.logfile.syncTime = 0;
+    logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_IDLE;
     logfile->aux.logfile.lineState = CONMAN_LOG_LINE_INIT;
     logfile->aux.logfile.opts = *opts;
     logfile->aux.logfile.gotTruncate = !!conf->enableZeroLogs;
 
-    if (logfile->aux.logfile.opts.enableSanitize
-            || logfile->aux.logfile.opts.enableTimestamp) {
-        logfile->aux.logfile.gotProcessing = 1;
+    /*  Console data bypasses write_log_data()'s processing unless the
+     *    logfile is sanitized or timestamped.  Either option requires it;
+     *    only timestamps require the cached per-second timestamp string.
+     */
+    logfile->aux.logfile.gotProcessing =
+        (logfile->aux.logfile.opts.enableSanitize
+            || logfile->aux.logfile.opts.enableTimestamp);
+    if (logfile->aux.logfile.gotProcessing) {
+        init_log_char_tables();
     }
-    else {
-        logfile->aux.logfile.gotProcessing = 0;
+    if (logfile->aux.logfile.opts.enableTimestamp) {
+        got_log_timestamps = 1;
     }
 
     if (strchr(name, '%')) {
@@ -238,8 +322,12 @@ int open_logfile_obj(obj_t *logfile)
     assert(logfile->aux.logfile.console != NULL);
     assert(logfile->aux.logfile.console->name != NULL);
 
+    /*  The fd may be in use by a log writer thread.
+     */
+    x_pthread_mutex_lock(&logfile->aux.logfile.writeLock);
+
     if (logfile->fd >= 0) {
-        tpoll_clear(tp_global, logfile->fd, POLLOUT);
+        tpoll_clear(logfile->tp, logfile->fd, POLLOUT);
         if (close(logfile->fd) < 0)
             log_msg(LOG_WARNING, "Unable to close logfile \"%s\": %s",
                 logfile->name, strerror(errno));
@@ -258,6 +346,7 @@ int open_logfile_obj(obj_t *logfile)
                 "Unable to open logfile for [%s]: filename exceeded buffer",
                 logfile->aux.logfile.console->name);
             logfile->fd = -1;
+            x_pthread_mutex_unlock(&logfile->aux.logfile.writeLock);
             return(-1);
         }
         free(logfile->name);
@@ -278,6 +367,7 @@ int open_logfile_obj(obj_t *logfile)
     if ((logfile->fd = open(logfile->name, flags, S_IRUSR | S_IWUSR)) < 0) {
         log_msg(LOG_WARNING, "Unable to open logfile \"%s\": %s",
             logfile->name, strerror(errno));
+        x_pthread_mutex_unlock(&logfile->aux.logfile.writeLock);
         return(-1);
     }
     if (logfile->aux.logfile.opts.enableLock
@@ -285,11 +375,15 @@ int open_logfile_obj(obj_t *logfile)
         log_msg(LOG_WARNING, "Unable to lock \"%s\"", logfile->name);
         (void) close(logfile->fd);
         logfile->fd = -1;
+        x_pthread_mutex_unlock(&logfile->aux.logfile.writeLock);
         return(-1);
     }
     logfile->gotEOF = 0;
     set_fd_nonblocking(logfile->fd);    /* redundant, just playing it safe */
     set_fd_closed_on_exec(logfile->fd);
+    logfile->aux.logfile.syncTime = time(NULL);
+
+    x_pthread_mutex_unlock(&logfile->aux.logfile.writeLock);
 
     now = create_long_time_string(0);
     msg = create_format_string("%sConsole [%s] log opened at %s%s",
@@ -353,6 +447,27 @@ obj_t * get_console_logfile_obj(obj_t *console)
 }
 
 
+void update_log_time(void)
+{
+/*  Refreshes the cached time used for logfile timestamps.
+ *  This is called once per mux loop iteration, and is a no-op
+ *    if no logfiles are being timestamped.
+ */
+    struct timeval tv;
+
+    if (!got_log_timestamps) {
+        return;
+    }
+    if (gettimeofday(&tv, NULL) < 0) {
+        log_err(errno, "gettimeofday() failed");
+    }
+    x_pthread_mutex_lock(&log_time_lock);
+    set_log_time(&tv);
+    x_pthread_mutex_unlock(&log_time_lock);
+    return;
+}
+
+
 int write_log_data(obj_t *log, const void *src, int len)
 {
 /*  Writes a potentially modified version of the buffer (src) of length (len)
@@ -364,17 +479,26 @@ int write_log_data(obj_t *log, const void *src, int len)
  *    sequences.
  *  If newline timestamping is enabled, the current timestamp is appended
  *    after each newline.
+ *  The processed data is staged in chunks no larger than the logfile obj's
+ *    buffer can hold, so any data that does not fit is counted as lost
+ *    by write_obj_data() instead of being truncated.
  *  Returns the number of bytes written into the logfile obj's buffer.
  */
-    const int minbuf = 25;              /* cr/lf + timestamp + meta/char */
+    const int minbuf = LOG_TIME_STR_LEN + 5; /* cr/lf + tstamp + meta/char */
     unsigned char buf[OBJ_BUF_SIZE - 1];
     const unsigned char *p;
     unsigned char *q;
-    const unsigned char * const qLast = buf + sizeof(buf);
+    const unsigned char *qLast;
+    char tstamp[LOG_TIME_STR_LEN + 1];
+    int tlen = 0;
+    int m;
     int n = 0;
 
     assert(is_logfile_obj(log));
     assert(sizeof(buf) >= (size_t) minbuf);
+    assert(log->bufSize > minbuf);
+
+    qLast = buf + MIN(sizeof(buf), (size_t) log->bufSize - 1);
 
     /*  If no additional processing is needed, listen to Biff Tannen:
      *    "make like a tree and get outta here".
@@ -385,7 +509,35 @@ int write_log_data(obj_t *log, const void *src, int len)
     DPRINTF((15, "Processing %d bytes for [%s] log \"%s\".\n",
         len, log->aux.logfile.console->name, log->name));
 
-    for (p=src, q=buf; len>0; p++, len--) {
+    /*  All lines within this buffer share the same timestamp.
+     */
+    if (log->aux.logfile.opts.enableTimestamp) {
+        tlen = get_log_time_string(log->aux.logfile.opts.enableTimeMsec,
+            tstamp, sizeof(tstamp));
+    }
+
+    p = src;
+    q = buf;
+    while (len > 0) {
+        /*
+         *  Within a line of data, bytes that need no processing are
+         *    bulk-copied up to the space available in the internal buffer.
+         */
+        if (log->aux.logfile.lineState == CONMAN_LOG_LINE_DATA) {
+            m = MIN(len, (int) (qLast - q) - minbuf);
+            m = get_log_run_len(p, m, log->aux.logfile.opts.enableSanitize);
+            if (m > 0) {
+                memcpy(q, p, m);
+                p += m;
+                q += m;
+                len -= m;
+                if ((qLast - q) < minbuf) {
+                    n += write_obj_data(log, buf, q - buf, 0);
+                    q = buf;
+                }
+                continue;
+            }
+        }
         /*
          *  A newline state machine is used to properly sanitize CR/LF line
          *    terminations.  This is responsible for coalescing multiple CRs,
@@ -398,8 +550,10 @@ int write_log_data(obj_t *log, const void *src, int len)
                 log->aux.logfile.lineState = CONMAN_LOG_LINE_CR;
             }
             else if (log->aux.logfile.lineState == CONMAN_LOG_LINE_INIT) {
-                if (log->aux.logfile.opts.enableTimestamp)
-                    q += write_time_string(0, (char *) q, qLast - q);
+                if (log->aux.logfile.opts.enableTimestamp) {
+                    memcpy(q, tstamp, tlen);
+                    q += tlen;
+                }
                 log->aux.logfile.lineState = CONMAN_LOG_LINE_CR;
             }
             else {
@@ -409,8 +563,10 @@ int write_log_data(obj_t *log, const void *src, int len)
         else if (*p == '\n') {
             if (  (log->aux.logfile.lineState == CONMAN_LOG_LINE_INIT)
                || (log->aux.logfile.lineState == CONMAN_LOG_LINE_LF) ) {
-                if (log->aux.logfile.opts.enableTimestamp)
-                    q += write_time_string(0, (char *) q, qLast - q);
+                if (log->aux.logfile.opts.enableTimestamp) {
+                    memcpy(q, tstamp, tlen);
+                    q += tlen;
+                }
             }
             *q++ = '\r';
             *q++ = '\n';
@@ -427,33 +583,26 @@ int write_log_data(obj_t *log, const void *src, int len)
                 *q++ = '\n';
             }
             if (log->aux.logfile.lineState != CONMAN_LOG_LINE_DATA) {
-                if (log->aux.logfile.opts.enableTimestamp)
-                    q += write_time_string(0, (char *) q, qLast - q);
+                if (log->aux.logfile.opts.enableTimestamp) {
+                    memcpy(q, tstamp, tlen);
+                    q += tlen;
+                }
             }
             log->aux.logfile.lineState = CONMAN_LOG_LINE_DATA;
 
             if (log->aux.logfile.opts.enableSanitize) {
-
-                int c = *p & 0x7F;      /* strip data to 7-bit ASCII */
-
-                if (c < 0x20) {         /* ASCII ctrl-chars */
-                    *q++ = (*p & 0x80) ? '~' : '^';
-                    *q++ = c + '@';
-                }
-                else if (c == 0x7F) {   /* ASCII DEL char */
-                    *q++ = (*p & 0x80) ? '~' : '^';
-                    *q++ = '?';
-                }
-                else {
-                    if (*p & 0x80)
-                        *q++ = '`';
-                    *q++ = c;
+                *q++ = log_sanitize_table[*p][0];
+                if (log_sanitize_table[*p][1] != '\0') {
+                    *q++ = log_sanitize_table[*p][1];
                 }
             }
             else {
                 *q++ = *p;
             }
         }
+        p++;
+        len--;
+
         /*  Flush internal buffer before it overruns.
          */
         if ((qLast - q) < minbuf) {
@@ -466,3 +615,483 @@ int write_log_data(obj_t *log, const void *src, int len)
     n += write_obj_data(log, buf, q - buf, 0);
     return(n);
 }
+
+
+void start_log_writers(server_conf_t *conf)
+{
+/*  Starts the log writer threads if enabled by the LogThreads keyword.
+ *  This must be called before the logfiles are opened since opening
+ *    a logfile writes a message into it.
+ *  All signals are blocked in these threads so they will be delivered to
+ *    the main thread.
+ */
+    sigset_t sigset;
+    sigset_t sigset_bak;
+    int k;
+    int rc;
+
+    assert(conf != NULL);
+
+    if (conf->numLogThreads <= 0) {
+        return;
+    }
+    if (!(log_writer_tids = calloc(conf->numLogThreads, sizeof(pthread_t)))) {
+        out_of_memory();
+    }
+    memset(&log_writer_stats, 0, sizeof(log_writer_stats));
+    log_writer_sync_secs = conf->logSyncSecs;
+    log_writer_is_exiting = 0;
+    num_log_writers = conf->numLogThreads;
+
+    sigfillset(&sigset);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset, &sigset_bak)) != 0) {
+        log_err(rc, "Unable to block signals for log writer threads");
+    }
+    for (k = 0; k < num_log_writers; k++) {
+        if ((rc = pthread_create(&log_writer_tids[k], NULL,
+          log_writer_thread, NULL)) != 0) {
+            log_err(rc, "Unable to create log writer thread #%d", k);
+        }
+    }
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset_bak, NULL)) != 0) {
+        log_err(rc, "Unable to restore signal mask");
+    }
+    log_msg(LOG_INFO, "Writing logfiles with %d thread%s",
+        num_log_writers, (num_log_writers == 1 ? "" : "s"));
+    return;
+}
+
+
+void stop_log_writers(void)
+{
+/*  Tells the log writer threads to exit once the queue has been drained,
+ *    and waits for them to do so.
+ *  This must be called after the mux threads have stopped and before
+ *    the logfile objs are destroyed.
+ */
+    int k;
+    int rc;
+
+    if (num_log_writers <= 0) {
+        return;
+    }
+    x_pthread_mutex_lock(&log_writer_lock);
+    log_writer_is_exiting = 1;
+    x_pthread_cond_broadcast(&log_writer_cond);
+    x_pthread_mutex_unlock(&log_writer_lock);
+
+    for (k = 0; k < num_log_writers; k++) {
+        if ((rc = pthread_join(log_writer_tids[k], NULL)) != 0) {
+            log_msg(LOG_WARNING, "Unable to join log writer thread #%d: %s",
+                k, strerror(rc));
+        }
+    }
+    report_log_writer_stats();
+
+    free(log_writer_tids);
+    log_writer_tids = NULL;
+    num_log_writers = 0;
+    return;
+}
+
+
+int queue_logfile_write(obj_t *logfile, int isUrgent)
+{
+/*  Queues the 'logfile' obj to have its buffered data written out by
+ *    a log writer thread.  If 'isUrgent' is true, the logfile's buffer
+ *    is filling up, so the queue is written out without waiting for
+ *    more data to accumulate.
+ *  This is called by write_obj_data() with the logfile's bufLock held.
+ *  Returns 0 if the logfile was queued, or -1 if log writers are disabled
+ *    (in which case the logfile must be written by its mux thread).
+ */
+    assert(is_logfile_obj(logfile));
+
+    if (num_log_writers <= 0) {
+        return(-1);
+    }
+    x_pthread_mutex_lock(&log_writer_lock);
+
+    switch (logfile->aux.logfile.writeState) {
+    case CONMAN_LOG_WRITE_IDLE:
+        enqueue_logfile(logfile);
+        break;
+    case CONMAN_LOG_WRITE_BUSY:
+        logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_REQUEUE;
+        break;
+    default:
+        break;
+    }
+    if (isUrgent && !log_writer_got_urgent
+            && (logfile->aux.logfile.writeState == CONMAN_LOG_WRITE_QUEUED)) {
+        log_writer_got_urgent = 1;
+        x_pthread_cond_signal(&log_writer_cond);
+    }
+    x_pthread_mutex_unlock(&log_writer_lock);
+    return(0);
+}
+
+
+void get_log_writer_stats(log_writer_stats_t *stats)
+{
+/*  Copies a snapshot of the log writer stats into 'stats'.
+ */
+    assert(stats != NULL);
+
+    x_pthread_mutex_lock(&log_writer_lock);
+    *stats = log_writer_stats;
+    x_pthread_mutex_unlock(&log_writer_lock);
+    return;
+}
+
+
+void report_log_writer_stats(void)
+{
+/*  Logs the log writer stats (if log writers are enabled).
+ */
+    log_writer_stats_t stats;
+
+    if (num_log_writers <= 0) {
+        return;
+    }
+    get_log_writer_stats(&stats);
+    log_msg(LOG_INFO, "Log writers flushed %lu logfile%s in %lu batch%s"
+        " (%lu sync%s): queue depth %d (max %d),"
+        " batch latency %lu us avg (%lu us max)",
+        stats.numFlushes, (stats.numFlushes == 1 ? "" : "s"),
+        stats.numBatches, (stats.numBatches == 1 ? "" : "es"),
+        stats.numSyncs, (stats.numSyncs == 1 ? "" : "s"),
+        stats.queueDepth, stats.maxQueueDepth,
+        (stats.numBatches ? stats.sumFlushUsecs / stats.numBatches : 0),
+        stats.maxFlushUsecs);
+    return;
+}
+
+
+static void * log_writer_thread(void *arg)
+{
+/*  Thread routine for writing out batches of queued logfiles.
+ */
+    obj_t *batch;
+    obj_t *logfile;
+    struct timeval t0, t1;
+    unsigned long usecs;
+
+    DPRINTF((5, "Started log writer thread.\n"));
+
+    while ((batch = get_log_writer_batch())) {
+
+        gettimeofday(&t0, NULL);
+        logfile = batch;
+        while (logfile) {
+            flush_logfile(logfile);
+            logfile = logfile->aux.logfile.writeNext;
+        }
+        gettimeofday(&t1, NULL);
+
+        if (timercmp(&t1, &t0, <)) {
+            usecs = 0;
+        }
+        else {
+            usecs = ((t1.tv_sec - t0.tv_sec) * 1000000)
+                + (t1.tv_usec - t0.tv_usec);
+        }
+        put_log_writer_batch(batch, usecs);
+    }
+    DPRINTF((5, "Stopped log writer thread.\n"));
+    return(NULL);
+}
+
+
+static obj_t * get_log_writer_batch(void)
+{
+/*  Waits for queued logfiles and removes a batch of them from the queue.
+ *  Once a logfile has been queued, the writer waits up to
+ *    LOG_WRITER_BATCH_MSECS for more data to accumulate so that it can be
+ *    written with fewer and larger writes, unless a logfile's buffer is
+ *    filling up or the writers are exiting.
+ *  The queue is divided among the log writers so a slow filesystem does
+ *    not hold up every logfile.
+ *  Returns a list of logfiles (linked via aux.logfile.writeNext) marked
+ *    as busy, or NULL if the writer should exit.
+ */
+    struct timeval tv;
+    struct timespec ts;
+    obj_t *batch;
+    obj_t *logfile;
+    int n;
+
+    x_pthread_mutex_lock(&log_writer_lock);
+
+    for (;;) {
+        while (!log_writer_head && !log_writer_is_exiting) {
+            x_pthread_cond_wait(&log_writer_cond, &log_writer_lock);
+        }
+        if (!log_writer_head) {
+            x_pthread_mutex_unlock(&log_writer_lock);
+            return(NULL);
+        }
+        if (log_writer_got_urgent || log_writer_is_exiting) {
+            break;
+        }
+        gettimeofday(&tv, NULL);
+        tv.tv_usec += LOG_WRITER_BATCH_MSECS * 1000;
+        ts.tv_sec = tv.tv_sec + (tv.tv_usec / 1000000);
+        ts.tv_nsec = (tv.tv_usec % 1000000) * 1000;
+
+        while (!log_writer_got_urgent && !log_writer_is_exiting
+                && (pthread_cond_timedwait(&log_writer_cond, &log_writer_lock,
+                    &ts) == 0)) {
+            ;
+        }
+        /*  Another writer may have taken the queue in the meantime.
+         */
+        if (log_writer_head) {
+            break;
+        }
+    }
+    n = (log_writer_stats.queueDepth + num_log_writers - 1) / num_log_writers;
+    batch = logfile = log_writer_head;
+    while (--n > 0) {
+        logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_BUSY;
+        logfile = logfile->aux.logfile.writeNext;
+        log_writer_stats.queueDepth--;
+    }
+    logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_BUSY;
+    log_writer_stats.queueDepth--;
+    log_writer_head = logfile->aux.logfile.writeNext;
+    logfile->aux.logfile.writeNext = NULL;
+
+    if (!log_writer_head) {
+        log_writer_tail = NULL;
+        log_writer_got_urgent = 0;
+    }
+    else {
+        x_pthread_cond_signal(&log_writer_cond);
+    }
+    x_pthread_mutex_unlock(&log_writer_lock);
+    return(batch);
+}
+
+
+static void put_log_writer_batch(obj_t *batch, unsigned long usecs)
+{
+/*  Returns a 'batch' of logfiles written out in 'usecs' microseconds
+ *    to the idle state, requeueing those that received more data while
+ *    they were being written.
+ */
+    obj_t *logfile;
+
+    x_pthread_mutex_lock(&log_writer_lock);
+
+    log_writer_stats.numBatches++;
+    log_writer_stats.sumFlushUsecs += usecs;
+    if (usecs > log_writer_stats.maxFlushUsecs) {
+        log_writer_stats.maxFlushUsecs = usecs;
+    }
+    while ((logfile = batch)) {
+        batch = logfile->aux.logfile.writeNext;
+        logfile->aux.logfile.writeNext = NULL;
+        log_writer_stats.numFlushes++;
+
+        if (logfile->aux.logfile.writeState == CONMAN_LOG_WRITE_REQUEUE) {
+            enqueue_logfile(logfile);
+        }
+        else {
+            logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_IDLE;
+        }
+    }
+    x_pthread_mutex_unlock(&log_writer_lock);
+    return;
+}
+
+
+static void enqueue_logfile(obj_t *logfile)
+{
+/*  Appends the 'logfile' obj to the tail of the log writer queue,
+ *    waking a log writer if the queue was empty.
+ *  The log_writer_lock must be held when calling this routine.
+ */
+    logfile->aux.logfile.writeState = CONMAN_LOG_WRITE_QUEUED;
+    logfile->aux.logfile.writeNext = NULL;
+
+    if (log_writer_tail) {
+        log_writer_tail->aux.logfile.writeNext = logfile;
+    }
+    else {
+        log_writer_head = logfile;
+        x_pthread_cond_signal(&log_writer_cond);
+    }
+    log_writer_tail = logfile;
+
+    if (++log_writer_stats.queueDepth > log_writer_stats.maxQueueDepth) {
+        log_writer_stats.maxQueueDepth = log_writer_stats.queueDepth;
+    }
+    return;
+}
+
+
+static void flush_logfile(obj_t *logfile)
+{
+/*  Writes the data buffered in the 'logfile' obj out to its file,
+ *    followed by an fdatasync() if one is due.
+ */
+    time_t now;
+    int rc;
+
+    x_pthread_mutex_lock(&logfile->aux.logfile.writeLock);
+
+    if (logfile->fd >= 0) {
+        (void) write_to_obj(logfile);
+    }
+    if ((logfile->fd >= 0) && (log_writer_sync_secs > 0)) {
+        now = time(NULL);
+        if ((now - logfile->aux.logfile.syncTime) >= log_writer_sync_secs) {
+#if HAVE_FDATASYNC
+            rc = fdatasync(logfile->fd);
+#else  /* !HAVE_FDATASYNC */
+            rc = fsync(logfile->fd);
+#endif /* !HAVE_FDATASYNC */
+            if (rc < 0) {
+                log_msg(LOG_WARNING, "Unable to sync logfile \"%s\": %s",
+                    logfile->name, strerror(errno));
+            }
+            logfile->aux.logfile.syncTime = now;
+            x_pthread_mutex_lock(&log_writer_lock);
+            log_writer_stats.numSyncs++;
+            x_pthread_mutex_unlock(&log_writer_lock);
+        }
+    }
+    x_pthread_mutex_unlock(&logfile->aux.logfile.writeLock);
+    return;
+}
+
+
+static void set_log_time(const struct timeval *tvp)
+{
+/*  Sets the cached time for logfile timestamps to (tvp),
+ *    reformatting the date & time string if the second has changed.
+ *  The log_time_lock must be held when calling this routine.
+ */
+    time_t t;
+    struct tm tm;
+
+    if (tvp->tv_sec != log_time_tv.tv_sec) {
+        t = tvp->tv_sec;
+        get_localtime(&t, &tm);
+        if (!strftime(log_time_str, sizeof(log_time_str),
+                "%Y-%m-%d %H:%M:%S", &tm)) {
+            log_time_str[0] = '\0';
+        }
+    }
+    log_time_tv = *tvp;
+    return;
+}
+
+
+static int get_log_time_string(int enableMsec, char *dst, int dstlen)
+{
+/*  Writes the cached timestamp string "YYYY-MM-DD HH:MM:SS " into the
+ *    buffer (dst) of length (dstlen); if (enableMsec) is true, the string
+ *    instead has msec resolution ("YYYY-MM-DD HH:MM:SS.mmm ").
+ *  Returns the length of the string written (not including the NUL).
+ */
+    struct timeval tv;
+    int n;
+
+    assert(dst != NULL);
+    assert(dstlen > LOG_TIME_STR_LEN);
+
+    x_pthread_mutex_lock(&log_time_lock);
+
+    if (log_time_tv.tv_sec == 0) {
+        if (gettimeofday(&tv, NULL) < 0) {
+            log_err(errno, "gettimeofday() failed");
+        }
+        set_log_time(&tv);
+    }
+    if (enableMsec) {
+        n = snprintf(dst, dstlen, "%s.%03d ",
+            log_time_str, (int) (log_time_tv.tv_usec / 1000));
+    }
+    else {
+        n = snprintf(dst, dstlen, "%s ", log_time_str);
+    }
+    x_pthread_mutex_unlock(&log_time_lock);
+
+    if ((n < 0) || (n >= dstlen)) {
+        return(0);
+    }
+    return(n);
+}
+
+
+static void init_log_char_tables(void)
+{
+/*  Builds the lookup tables used by write_log_data() for classifying
+ *    and sanitizing console data.
+ *  Sanitized data is stripped to 7-bit ASCII: ctrl-chars and DEL are
+ *    written as '^' followed by a printable char ('~' if the high bit was
+ *    set), and other chars with the high bit set are prefixed with '`'.
+ */
+    int i;
+    int c;
+
+    if (got_log_char_tables) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+
+        c = i & 0x7F;
+
+        log_run_table[0][i] = (i != '\r') && (i != '\n');
+        log_run_table[1][i] = (i >= 0x20) && (i < 0x7F);
+
+        if ((c < 0x20) || (c == 0x7F)) {
+            log_sanitize_table[i][0] = (i & 0x80) ? '~' : '^';
+            log_sanitize_table[i][1] = (c == 0x7F) ? '?' : c + '@';
+        }
+        else if (i & 0x80) {
+            log_sanitize_table[i][0] = '`';
+            log_sanitize_table[i][1] = c;
+        }
+        else {
+            log_sanitize_table[i][0] = c;
+            log_sanitize_table[i][1] = '\0';
+        }
+    }
+    got_log_char_tables = 1;
+    return;
+}
+
+
+static int get_log_run_len(const unsigned char *p, int len, int isSanitize)
+{
+/*  Returns the number of leading bytes of the buffer (p) of length (len)
+ *    that can be copied into a logfile without processing: anything but
+ *    CR and LF, or only printable 7-bit ASCII if (isSanitize) is true.
+ *  The buffer is scanned a word at a time until a word contains a byte
+ *    of interest; its position is then found via log_run_table[].
+ */
+    const unsigned char *table = log_run_table[isSanitize ? 1 : 0];
+    unsigned long w;
+    int i = 0;
+
+    while (i <= len - (int) sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        if (isSanitize) {
+            if ((w & LOG_HIGHS) || LOG_HAS_LESS(w, 0x20)
+                    || LOG_HAS_BYTE(w, 0x7F)) {
+                break;
+            }
+        }
+        else if (LOG_HAS_BYTE(w, '\r') || LOG_HAS_BYTE(w, '\n')) {
+            break;
+        }
+        i += sizeof(w);
+    }
+    while ((i < len) && table[p[i]]) {
+        i++;
+    }
+    return(i);
+}
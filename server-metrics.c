@@ -0,0 +1,734 @@
+/*****************************************************************************
+ *  Written by Chris Dunlap <cdunlap@llnl.gov>.
+ *  Copyright (C) 2007-2019 Lawrence Livermore National Security, LLC.
+ *  Copyright (C) 2001-2007 The Regents of the University of California.
+ *  UCRL-CODE-2002-009.
+ *
+ *  This file is part of ConMan: The Console Manager.
+ *  For details, see <https://dun.github.io/conman/>.
+ *
+ *  ConMan is free software: you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  ConMan is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with ConMan.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "common.h"
+#include "log.h"
+#include "server.h"
+#include "util-file.h"
+#include "util-str.h"
+#include "util.h"
+#include "wrapper.h"
+
+
+/*  The metrics server is a single thread answering HTTP GET requests on the
+ *    metrics socket (conf->mld) with a snapshot of the daemon's counters in
+ *    the OpenMetrics text format.  The counters are maintained by the mux
+ *    threads with relaxed atomic updates (see obj_stats_add()) and the tpoll
+ *    timer counts are read without taking the tpoll locks, so serving a
+ *    request never waits on (or stalls) mux_io().
+ *  Requests are served one at a time.  The socket I/O is bounded by a
+ *    timeout of METRICS_IO_SECS so a stalled scraper cannot hold the thread.
+ *  The thread is told to exit by writing into its wake pipe.
+ */
+#define METRICS_BUF_SIZE        16384
+#define METRICS_MAX_HEADERS     64
+#define METRICS_MAX_SHARDS      MAX_SERVER_THREADS
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct metrics_buf {
+    int              sd;                /* socket descriptor of scraper      */
+    int              len;               /* num bytes pending in buf          */
+    int              gotError;          /* true if a write has failed        */
+    char             buf[METRICS_BUF_SIZE]; /* output pending write          */
+} metrics_buf_t;
+
+static void * metrics_thread(void *arg);
+static void serve_metrics_client(server_conf_t *conf, int sd);
+static int read_metrics_request(int sd, char *path, int pathlen);
+static void write_metrics(server_conf_t *conf, metrics_buf_t *mb);
+static void write_console_metrics(server_conf_t *conf, metrics_buf_t *mb);
+static void write_console_family(metrics_buf_t *mb, const char *name,
+    const char *type, const char *unit, const char *help);
+static void write_metrics_hist(metrics_buf_t *mb, const char *name,
+    const char *labels, const latency_hist_t *hist);
+static void metrics_printf(metrics_buf_t *mb, const char *fmt, ...);
+static void flush_metrics_buf(metrics_buf_t *mb);
+static const char * escape_label(const char *src, char *dst, int dstlen);
+
+static pthread_t metrics_tid;
+static int metrics_fd_pipe[2] = { -1, -1 };
+static int metrics_is_running = 0;
+
+
+unsigned long get_latency_usecs(void)
+{
+/*  Returns the current time in usecs for timing latency samples.
+ */
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0) {
+        log_err(errno, "gettimeofday() failed");
+    }
+    return(((unsigned long) tv.tv_sec * 1000000) + tv.tv_usec);
+}
+
+
+void add_latency_hist(latency_hist_t *hist, unsigned long usecs)
+{
+/*  Adds a sample of (usecs) microseconds to the latency histogram (hist).
+ *  Bucket k counts the samples less than 2^k usecs (and not less than
+ *    2^(k-1) usecs); the last bucket counts all larger samples.
+ *  The histogram is updated without a lock, so it may be shared by threads.
+ */
+    unsigned long v = usecs;
+    int k = 0;
+
+    assert(hist != NULL);
+
+    while ((v > 0) && (k < LATENCY_HIST_BUCKETS - 1)) {
+        v >>= 1;
+        k++;
+    }
+    obj_stats_add(&hist->counts[k], 1);
+    obj_stats_add(&hist->sumUsecs, usecs);
+    return;
+}
+
+
+unsigned long get_latency_hist_percentile(
+    const latency_hist_t *hist, int pct)
+{
+/*  Returns the upper bound (in usecs) of the bucket of the latency
+ *    histogram (hist) holding the (pct) percentile sample, or 0 if the
+ *    histogram is empty.  For the last bucket, its lower bound is returned.
+ */
+    unsigned long total = 0;
+    unsigned long rank;
+    unsigned long n = 0;
+    int k;
+
+    assert(hist != NULL);
+    assert((pct >= 0) && (pct <= 100));
+
+    for (k = 0; k < LATENCY_HIST_BUCKETS; k++) {
+        total += hist->counts[k];
+    }
+    if (total == 0) {
+        return(0);
+    }
+    rank = ((total * pct) + 99) / 100;
+    for (k = 0; k < LATENCY_HIST_BUCKETS - 1; k++) {
+        n += hist->counts[k];
+        if ((n > 0) && (n >= rank)) {
+            break;
+        }
+    }
+    return(1UL << MIN(k, LATENCY_HIST_BUCKETS - 2));
+}
+
+
+void start_metrics_server(server_conf_t *conf)
+{
+/*  Starts the thread serving metrics requests if a metrics socket
+ *    has been created.
+ *  All signals are blocked in this thread so they will be delivered to
+ *    the main thread.
+ */
+    sigset_t sigset;
+    sigset_t sigset_bak;
+    int rc;
+
+    assert(conf != NULL);
+
+    if (conf->mld < 0) {
+        return;
+    }
+    if (pipe(metrics_fd_pipe) < 0) {
+        log_err(errno, "Unable to create pipe for metrics thread");
+    }
+    set_fd_closed_on_exec(metrics_fd_pipe[0]);
+    set_fd_closed_on_exec(metrics_fd_pipe[1]);
+
+    sigfillset(&sigset);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset, &sigset_bak)) != 0) {
+        log_err(rc, "Unable to block signals for metrics thread");
+    }
+    if ((rc = pthread_create(&metrics_tid, NULL, metrics_thread, conf)) != 0) {
+        log_err(rc, "Unable to create metrics thread");
+    }
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset_bak, NULL)) != 0) {
+        log_err(rc, "Unable to restore signal mask");
+    }
+    metrics_is_running = 1;
+
+    if (conf->metricsSockName) {
+        log_msg(LOG_INFO, "Serving metrics on \"%s\"", conf->metricsSockName);
+    }
+    else {
+        log_msg(LOG_INFO, "Serving metrics on port %d", conf->metricsPort);
+    }
+    return;
+}
+
+
+void stop_metrics_server(void)
+{
+/*  Tells the metrics thread to exit, and waits for it to do so.
+ *  A request being served is bounded by METRICS_IO_SECS.
+ */
+    int rc;
+    int k;
+
+    if (!metrics_is_running) {
+        return;
+    }
+    if (write_n(metrics_fd_pipe[1], "X", 1) < 0) {
+        log_msg(LOG_WARNING, "Unable to signal metrics thread: %s",
+            strerror(errno));
+    }
+    else if ((rc = pthread_join(metrics_tid, NULL)) != 0) {
+        log_msg(LOG_WARNING, "Unable to join metrics thread: %s",
+            strerror(rc));
+    }
+    for (k = 0; k < 2; k++) {
+        (void) close(metrics_fd_pipe[k]);
+        metrics_fd_pipe[k] = -1;
+    }
+    metrics_is_running = 0;
+    return;
+}
+
+
+static void * metrics_thread(void *arg)
+{
+/*  Thread routine for accepting and serving metrics requests until
+ *    a byte is written into the metrics wake pipe.
+ */
+    server_conf_t *conf = arg;
+    struct pollfd pfd[2];
+    int sd;
+
+    DPRINTF((5, "Started metrics thread.\n"));
+
+    for (;;) {
+        pfd[0].fd = conf->mld;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = metrics_fd_pipe[0];
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(LOG_ERR, "Unable to poll metrics socket: %s",
+                strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+        if ((sd = accept(conf->mld, NULL, NULL)) < 0) {
+            if ((errno != EINTR) && (errno != EAGAIN)
+              && (errno != EWOULDBLOCK) && (errno != ECONNABORTED)) {
+                log_msg(LOG_WARNING, "Unable to accept metrics connection: %s",
+                    strerror(errno));
+            }
+            continue;
+        }
+        serve_metrics_client(conf, sd);
+
+        if (close(sd) < 0) {
+            log_msg(LOG_WARNING, "Unable to close metrics connection: %s",
+                strerror(errno));
+        }
+    }
+    DPRINTF((5, "Stopped metrics thread.\n"));
+    return(NULL);
+}
+
+
+static void serve_metrics_client(server_conf_t *conf, int sd)
+{
+/*  Serves a single HTTP request from the metrics socket (sd).
+ *  Only a GET (or HEAD) of "/metrics" (or "/") is supported.
+ *  The response is HTTP/1.0 and the connection is closed once it is sent.
+ */
+    metrics_buf_t *mb;
+    struct timeval tv;
+    char path[MAX_LINE];
+    int method;
+
+    /*  As with client handshakes, the accepted socket is forced to be
+     *    blocking for portability, and its I/O is bounded by a timeout.
+     */
+    set_fd_blocking(sd);
+
+    tv.tv_sec = METRICS_IO_SECS;
+    tv.tv_usec = 0;
+    if ((setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO,
+            (const void *) &tv, sizeof(tv)) < 0)
+      || (setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO,
+            (const void *) &tv, sizeof(tv)) < 0)) {
+        log_msg(LOG_WARNING, "Unable to set metrics socket timeout: %s",
+            strerror(errno));
+    }
+    if ((method = read_metrics_request(sd, path, sizeof(path))) < 0) {
+        return;
+    }
+    if (!(mb = malloc(sizeof(metrics_buf_t)))) {
+        out_of_memory();
+    }
+    mb->sd = sd;
+    mb->len = 0;
+    mb->gotError = 0;
+
+    if (method == 0) {
+        metrics_printf(mb, "HTTP/1.0 405 Method Not Allowed\r\n"
+            "Allow: GET, HEAD\r\nContent-Type: text/plain\r\n"
+            "Connection: close\r\n\r\nMethod not allowed\n");
+    }
+    else if (strcmp(path, "/metrics") && strcmp(path, "/")) {
+        metrics_printf(mb, "HTTP/1.0 404 Not Found\r\n"
+            "Content-Type: text/plain\r\n"
+            "Connection: close\r\n\r\nNot found\n");
+    }
+    else {
+        metrics_printf(mb, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+            "Connection: close\r\n\r\n", METRICS_CONTENT_TYPE);
+        if (method == 1) {
+            write_metrics(conf, mb);
+        }
+    }
+    flush_metrics_buf(mb);
+    free(mb);
+    return;
+}
+
+
+static int read_metrics_request(int sd, char *path, int pathlen)
+{
+/*  Reads the HTTP request from the metrics socket (sd), copying the path
+ *    of the requested URI (without any query string) into (path).
+ *  Returns 1 for a GET, 2 for a HEAD, 0 for any other method,
+ *    or -1 if the request could not be read.
+ */
+    char buf[MAX_LINE];
+    char method[16];
+    char *p;
+    int n;
+    int k;
+
+    assert(pathlen > 0);
+
+    if ((n = read_line(sd, buf, sizeof(buf))) <= 0) {
+        return(-1);
+    }
+    if ((p = strchr(buf, ' '))) {
+        *p++ = '\0';
+    }
+    if (!p || (strlcpy(method, buf, sizeof(method)) >= sizeof(method))) {
+        return(-1);
+    }
+    n = strcspn(p, " ?\r\n");
+    if (n >= pathlen) {
+        n = pathlen - 1;
+    }
+    memcpy(path, p, n);
+    path[n] = '\0';
+
+    /*  Consume the request headers up to the blank line ending them
+     *    so the scraper does not see a reset before reading the response.
+     */
+    for (k = 0; k < METRICS_MAX_HEADERS; k++) {
+        if ((n = read_line(sd, buf, sizeof(buf))) <= 0) {
+            break;
+        }
+        if ((buf[0] == '\n') || ((buf[0] == '\r') && (buf[1] == '\n'))) {
+            break;
+        }
+    }
+    if (!strcmp(method, "GET")) {
+        return(1);
+    }
+    if (!strcmp(method, "HEAD")) {
+        return(2);
+    }
+    return(0);
+}
+
+
+static void write_metrics(server_conf_t *conf, metrics_buf_t *mb)
+{
+/*  Writes a snapshot of the daemon's metrics to the metrics buffer (mb).
+ */
+    latency_hist_t hist;
+    latency_hist_t lagHists[METRICS_MAX_SHARDS];
+    log_writer_stats_t logStats;
+    int counts[METRICS_MAX_SHARDS];
+    char labels[32];
+    int n;
+    int k;
+
+    write_console_metrics(conf, mb);
+
+    n = get_mux_shard_timeouts(counts, METRICS_MAX_SHARDS);
+    metrics_printf(mb, "# TYPE conman_mux_timers gauge\n"
+        "# HELP conman_mux_timers Timers pending in each mux thread.\n");
+    for (k = 0; k < n; k++) {
+        metrics_printf(mb, "conman_mux_timers{shard=\"%d\"} %d\n",
+            k, counts[k]);
+    }
+    if (conf->enableLatency) {
+        n = get_mux_shard_lag_hists(lagHists, METRICS_MAX_SHARDS);
+        metrics_printf(mb, "# TYPE conman_mux_dispatch_lag_seconds histogram\n"
+            "# UNIT conman_mux_dispatch_lag_seconds seconds\n"
+            "# HELP conman_mux_dispatch_lag_seconds"
+            " Time from a mux thread's poll returning until an obj's"
+            " I/O is handled.\n");
+        for (k = 0; k < n; k++) {
+            snprintf(labels, sizeof(labels), "shard=\"%d\"", k);
+            write_metrics_hist(mb, "conman_mux_dispatch_lag_seconds",
+                labels, &lagHists[k]);
+        }
+    }
+
+    get_log_writer_stats(&logStats);
+    metrics_printf(mb, "# TYPE conman_log_writer_queue_depth gauge\n"
+        "# HELP conman_log_writer_queue_depth"
+        " Logfiles awaiting a log writer thread.\n"
+        "conman_log_writer_queue_depth %d\n", logStats.queueDepth);
+    metrics_printf(mb, "# TYPE conman_log_writer_batches counter\n"
+        "# HELP conman_log_writer_batches Batches of logfiles written.\n"
+        "conman_log_writer_batches_total %lu\n", logStats.numBatches);
+    metrics_printf(mb, "# TYPE conman_log_writer_flushes counter\n"
+        "# HELP conman_log_writer_flushes Logfiles flushed in batches.\n"
+        "conman_log_writer_flushes_total %lu\n", logStats.numFlushes);
+
+    get_client_handshake_hist(&hist);
+    metrics_printf(mb, "# TYPE conman_client_handshake_seconds histogram\n"
+        "# UNIT conman_client_handshake_seconds seconds\n"
+        "# HELP conman_client_handshake_seconds"
+        " Time from accepting a client until its request is answered.\n");
+    write_metrics_hist(mb, "conman_client_handshake_seconds", NULL, &hist);
+
+    metrics_printf(mb, "# EOF\n");
+    return;
+}
+
+
+static void write_console_metrics(server_conf_t *conf, metrics_buf_t *mb)
+{
+/*  Writes the metrics of each console to the metrics buffer (mb).
+ *  The stats of all consoles are copied first since each metric family
+ *    must be written contiguously.
+ */
+    console_stats_t *stats;
+    console_stats_t *s;
+    latency_hist_t hists[CONMAN_LATENCY_TYPES];
+    char name[MAX_LINE];
+    char labels[MAX_LINE + 32];
+    const char *label;
+    int n = conf->numConsoles;
+    int k;
+    int j;
+
+    if (n <= 0) {
+        return;
+    }
+    if (!(stats = malloc(n * sizeof(console_stats_t)))) {
+        out_of_memory();
+    }
+    for (k = 0; k < n; k++) {
+        get_console_stats(conf->consoleIndex[k], &stats[k]);
+    }
+
+#define CONSOLE_METRIC(NAME, SUFFIX, FMT, EXPR)                               \
+    do {                                                                      \
+        for (k = 0, s = stats; k < n; k++, s++) {                             \
+            label = escape_label(conf->consoleIndex[k]->name,                 \
+                name, sizeof(name));                                          \
+            metrics_printf(mb, NAME SUFFIX "{console=\"%s\"} " FMT "\n",      \
+                label, (EXPR));                                               \
+        }                                                                     \
+    } while (0)
+
+    write_console_family(mb, "conman_console_read_bytes", "counter", "bytes",
+        "Bytes read from the console device.");
+    CONSOLE_METRIC("conman_console_read_bytes", "_total", "%lu",
+        s->console.numBytesIn);
+
+    write_console_family(mb, "conman_console_written_bytes", "counter",
+        "bytes", "Bytes written to the console device.");
+    CONSOLE_METRIC("conman_console_written_bytes", "_total", "%lu",
+        s->console.numBytesOut);
+
+    write_console_family(mb, "conman_console_lost_bytes", "counter", "bytes",
+        "Bytes of console input overwritten before being written.");
+    CONSOLE_METRIC("conman_console_lost_bytes", "_total", "%lu",
+        s->console.numBytesLost);
+
+    write_console_family(mb, "conman_console_overruns", "counter", NULL,
+        "Overruns of the console input buffer.");
+    CONSOLE_METRIC("conman_console_overruns", "_total", "%lu",
+        s->console.numOverruns);
+
+    write_console_family(mb, "conman_console_buffer_max_bytes", "gauge",
+        "bytes", "High-water mark of console input awaiting the device.");
+    CONSOLE_METRIC("conman_console_buffer_max_bytes", "", "%lu",
+        s->console.maxBytesBuffered);
+
+    write_console_family(mb, "conman_console_reader_lost_bytes", "counter",
+        "bytes", "Bytes of console output skipped by slow clients.");
+    CONSOLE_METRIC("conman_console_reader_lost_bytes", "_total", "%lu",
+        s->console.numReaderBytesLost);
+
+    write_console_family(mb, "conman_console_connects", "counter", NULL,
+        "Times the console has been connected.");
+    CONSOLE_METRIC("conman_console_connects", "_total", "%lu",
+        s->console.numConnects);
+
+    write_console_family(mb, "conman_console_readers", "gauge", NULL,
+        "Clients reading from the console.");
+    CONSOLE_METRIC("conman_console_readers", "", "%d", s->numReaders);
+
+    write_console_family(mb, "conman_console_writers", "gauge", NULL,
+        "Clients writing to the console.");
+    CONSOLE_METRIC("conman_console_writers", "", "%d", s->numWriters);
+
+#undef CONSOLE_METRIC
+
+    write_console_family(mb, "conman_console_state", "stateset", NULL,
+        "Connection state of the console.");
+    for (k = 0, s = stats; k < n; k++, s++) {
+        label = escape_label(conf->consoleIndex[k]->name, name, sizeof(name));
+        for (j = CONMAN_CONSOLE_DOWN; j <= CONMAN_CONSOLE_UP; j++) {
+            metrics_printf(mb, "conman_console_state{console=\"%s\","
+                "conman_console_state=\"%s\"} %d\n", label,
+                get_console_state_string(j), (s->state == (int) j));
+        }
+    }
+
+#define LOGFILE_METRIC(NAME, SUFFIX, EXPR)                                    \
+    do {                                                                      \
+        for (k = 0, s = stats; k < n; k++, s++) {                             \
+            if (!s->gotLogfile) {                                             \
+                continue;                                                     \
+            }                                                                 \
+            label = escape_label(conf->consoleIndex[k]->name,                 \
+                name, sizeof(name));                                          \
+            metrics_printf(mb, NAME SUFFIX "{console=\"%s\"} %lu\n",          \
+                label, (EXPR));                                               \
+        }                                                                     \
+    } while (0)
+
+    write_console_family(mb, "conman_logfile_written_bytes", "counter",
+        "bytes", "Bytes written to the console's logfile.");
+    LOGFILE_METRIC("conman_logfile_written_bytes", "_total",
+        s->logfile.numBytesOut);
+
+    write_console_family(mb, "conman_logfile_lost_bytes", "counter", "bytes",
+        "Bytes of console output overwritten before being logged.");
+    LOGFILE_METRIC("conman_logfile_lost_bytes", "_total",
+        s->logfile.numBytesLost);
+
+    write_console_family(mb, "conman_logfile_buffer_max_bytes", "gauge",
+        "bytes", "High-water mark of console output awaiting the logfile.");
+    LOGFILE_METRIC("conman_logfile_buffer_max_bytes", "",
+        s->logfile.maxBytesBuffered);
+
+#undef LOGFILE_METRIC
+
+    if (conf->enableLatency) {
+        write_console_family(mb, "conman_console_latency_seconds",
+            "histogram", "seconds",
+            "Time from reading console output until it is written out"
+            " to a reader.");
+        for (k = 0; k < n; k++) {
+            if (!get_console_latency_hists(conf->consoleIndex[k], hists)) {
+                continue;
+            }
+            label = escape_label(conf->consoleIndex[k]->name,
+                name, sizeof(name));
+            for (j = 0; j < CONMAN_LATENCY_TYPES; j++) {
+                snprintf(labels, sizeof(labels),
+                    "console=\"%s\",reader=\"%s\"",
+                    label, get_latency_type_string(j));
+                write_metrics_hist(mb, "conman_console_latency_seconds",
+                    labels, &hists[j]);
+            }
+        }
+    }
+    free(stats);
+    return;
+}
+
+
+static void write_console_family(metrics_buf_t *mb, const char *name,
+    const char *type, const char *unit, const char *help)
+{
+/*  Writes the metadata of the metric family (name) to the metrics buffer.
+ */
+    metrics_printf(mb, "# TYPE %s %s\n", name, type);
+    if (unit) {
+        metrics_printf(mb, "# UNIT %s %s\n", name, unit);
+    }
+    metrics_printf(mb, "# HELP %s %s\n", name, help);
+    return;
+}
+
+
+static void write_metrics_hist(metrics_buf_t *mb, const char *name,
+    const char *labels, const latency_hist_t *hist)
+{
+/*  Writes the samples of the latency histogram (hist) for the metric family
+ *    (name) to the metrics buffer.  The (labels) string (if not NULL) holds
+ *    additional comma-separated labels for each sample.
+ *  Bucket bounds are converted from usecs to secs.
+ */
+    unsigned long total = 0;
+    const char *sep = labels ? "," : "";
+    int k;
+
+    if (!labels) {
+        labels = "";
+    }
+    for (k = 0; k < LATENCY_HIST_BUCKETS - 1; k++) {
+        total += hist->counts[k];
+        metrics_printf(mb, "%s_bucket{%s%sle=\"%.6f\"} %lu\n",
+            name, labels, sep, (double) (1UL << k) / 1e6, total);
+    }
+    total += hist->counts[k];
+    metrics_printf(mb, "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+        name, labels, sep, total);
+    if (*labels) {
+        metrics_printf(mb, "%s_count{%s} %lu\n", name, labels, total);
+        metrics_printf(mb, "%s_sum{%s} %.6f\n",
+            name, labels, (double) hist->sumUsecs / 1e6);
+    }
+    else {
+        metrics_printf(mb, "%s_count %lu\n", name, total);
+        metrics_printf(mb, "%s_sum %.6f\n",
+            name, (double) hist->sumUsecs / 1e6);
+    }
+    return;
+}
+
+
+static void metrics_printf(metrics_buf_t *mb, const char *fmt, ...)
+{
+/*  Appends the formatted string to the metrics buffer (mb), writing the
+ *    buffer out to the scraper first if the string does not fit.
+ *  Once a write has failed, any further output is discarded.
+ */
+    va_list vargs;
+    int avail;
+    int n;
+
+    if (mb->gotError) {
+        return;
+    }
+    avail = sizeof(mb->buf) - mb->len;
+    va_start(vargs, fmt);
+    n = vsnprintf(mb->buf + mb->len, avail, fmt, vargs);
+    va_end(vargs);
+
+    if ((n >= 0) && (n < avail)) {
+        mb->len += n;
+        return;
+    }
+    flush_metrics_buf(mb);
+    if (mb->gotError) {
+        return;
+    }
+    avail = sizeof(mb->buf);
+    va_start(vargs, fmt);
+    n = vsnprintf(mb->buf, avail, fmt, vargs);
+    va_end(vargs);
+
+    if ((n < 0) || (n >= avail)) {
+        log_msg(LOG_WARNING, "Metrics buffer overrun");
+        mb->gotError = 1;
+        return;
+    }
+    mb->len = n;
+    return;
+}
+
+
+static void flush_metrics_buf(metrics_buf_t *mb)
+{
+/*  Writes any data pending in the metrics buffer (mb) out to the scraper.
+ */
+    if (mb->gotError || (mb->len == 0)) {
+        return;
+    }
+    if (write_n(mb->sd, mb->buf, mb->len) < 0) {
+        log_msg(LOG_INFO, "Unable to write metrics: %s", strerror(errno));
+        mb->gotError = 1;
+    }
+    mb->len = 0;
+    return;
+}
+
+
+static const char * escape_label(const char *src, char *dst, int dstlen)
+{
+/*  Copies the string (src) into the buffer (dst) of length (dstlen),
+ *    escaping backslashes, double-quotes, and newlines for use as an
+ *    OpenMetrics label value.  The string is truncated if needed.
+ *  Returns (dst).
+ */
+    char *p = dst;
+    char *q = dst + dstlen - 1;
+
+    assert(dstlen > 0);
+
+    for (; *src && (p < q); src++) {
+        if ((*src == '\\') || (*src == '"') || (*src == '\n')) {
+            if (q - p < 2) {
+                break;
+            }
+            *p++ = '\\';
+            *p++ = (*src == '\n') ? 'n' : *src;
+        }
+        else {
+            *p++ = *src;
+        }
+    }
+    *p = '\0';
+    return(dst);
+}
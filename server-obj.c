@@ -53,13 +53,105 @@
 
 extern tpoll_t tp_global;               /* defined in server.c */
 
+/*  The 'obj_refs_lock' protects obj refs held across threads.  When the
+ *    daemon is muxing I/O with multiple threads, a thread may hold a ref to
+ *    an obj (eg, a console notifying a B/C client) that is muxed by another
+ *    thread.  Such refs must only be used while holding a read-lock via
+ *    lock_obj_refs().  Before an obj is destroyed, it is unlinked from all
+ *    other objs and removed from the master objs list; destroy_obj() then
+ *    acquires the write-lock to ensure no other thread is still using it.
+ */
+static pthread_rwlock_t obj_refs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*  An obj's readers and writers arrays are instead protected by the obj's
+ *    own 'vecLock', since they are walked for every read in the I/O path.
+ *  That lock is mostly taken by the thread muxing the obj, so the mux
+ *    threads do not contend on a lock shared by every obj.  The arrays are
+ *    walked via lock_obj_vecs() and modified while holding it exclusively
+ *    by link_objs() & unlink_objs().
+ */
+
+/*  If latency sampling is enabled, console output is sampled on its way from
+ *    the console's fd to each of its readers.  Each reader has at most one
+ *    sample pending at a time: when console data is read and the reader has
+ *    none pending, the position in the reader's buffer (or in the console
+ *    ring being read) at which the data will be written is marked with the
+ *    time of the read.  When the reader writes out the marked byte, the
+ *    time it spent buffered (including any delay in the reader's mux thread)
+ *    is added to the console's histogram for the reader's latency_type_t.
+ *  A sample is set by a producer while holding the reader's bufLock, but
+ *    is claimed by the consumer with a compare-and-swap on 'latUsecs' since
+ *    the consumer does not hold the lock; a sample whose marked byte has been
+ *    overwritten (in a ring) or dropped (from a full buffer) is cancelled
+ *    by clearing 'latUsecs'.
+ *  The flag is set once before the mux threads are started.
+ */
+static int latency_sampling = 0;
+
+/*  An obj's circular-buffer has a single consumer (the mux thread writing
+ *    the buffer out to the obj's fd via write_to_obj()), but may have
+ *    multiple producers (eg, consoles muxed by other threads, B/C clients,
+ *    and client-processing threads writing informational messages).
+ *  Producers serialize amongst themselves on the obj's 'bufLock' and only
+ *    advance 'bufInPtr', publishing it after the data has been copied.
+ *    The consumer only advances 'bufOutPtr'.  Both ptrs are accessed with
+ *    atomic ops so the consumer does not contend with producers or hold the
+ *    lock across the writev().  Since write_obj_data() must not block and
+ *    the consumer may be writing out any unwritten data, a producer drops
+ *    data that does not fit instead of overwriting unwritten data.
+ *  If atomic builtins are not available, the consumer holds the lock.
+ *  Defining OBJ_BUF_NO_LOCK_FREE also makes the consumer hold the lock
+ *    (eg, for benchmarking), but keeps the atomic ops.
+ */
+#if defined(__ATOMIC_ACQUIRE) && WITH_PTHREADS
+#  ifdef OBJ_BUF_NO_LOCK_FREE
+#    define OBJ_BUF_LOCK_FREE 0
+#  else  /* !OBJ_BUF_NO_LOCK_FREE */
+#    define OBJ_BUF_LOCK_FREE 1
+#  endif /* !OBJ_BUF_NO_LOCK_FREE */
+#  define obj_buf_load(PTR) \
+     __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#  define obj_buf_store(PTR, VAL) \
+     __atomic_store_n((PTR), (VAL), __ATOMIC_RELEASE)
+#  define obj_buf_cas(PTR, OLD, NEW) \
+     __atomic_compare_exchange_n((PTR), (OLD), (NEW), 0, \
+       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else  /* !__ATOMIC_ACQUIRE || !WITH_PTHREADS */
+#  define OBJ_BUF_LOCK_FREE 0
+#  define obj_buf_load(PTR) (*(PTR))
+#  define obj_buf_store(PTR, VAL) (*(PTR) = (VAL))
+#  define obj_buf_cas(PTR, OLD, NEW) \
+     ((*(PTR) == *(OLD)) ? (*(PTR) = (NEW), 1) : (*(OLD) = *(PTR), 0))
+#endif /* !__ATOMIC_ACQUIRE || !WITH_PTHREADS */
+
 
 static char * sanitize_file_string(char *str);
 static char * find_trailing_int_str(char *str);
 #ifndef NDEBUG
 static int validate_obj_links(obj_t *obj);
 #endif /* !NDEBUG */
+static void add_obj_vec(obj_vec_t *vec, obj_t *obj);
+static int remove_obj_vec(obj_vec_t *vec, obj_t *obj);
+static int is_obj_in_vec(obj_vec_t *vec, obj_t *obj);
 static int num_bytes_buffered(obj_t *obj);
+static int num_bytes_between(
+    obj_t *obj, const unsigned char *in, const unsigned char *out);
+static void create_obj_buf(obj_t *obj);
+static void write_ring_data(obj_t *console, const void *src, int len);
+static int compare_mux_ids(const void *p1, const void *p2);
+static int write_mux_frames(
+    obj_t *client, int id, const void *src, int len, int isInfo);
+static int write_obj_buf(obj_t *obj, const void *src, int len, int isInfo);
+static int write_ring_to_client(obj_t *client);
+static int is_client_ring_empty(obj_t *client);
+static void count_obj_loss(obj_t *obj, unsigned long len, int isQuiet);
+static void log_obj_loss(obj_t *obj);
+static void start_latency_sample(obj_t *reader, obj_t *console,
+    unsigned long head, unsigned long usecs);
+static void end_latency_sample(
+    obj_t *obj, unsigned long start, int n, int size);
+static void copy_obj_stats(obj_stats_t *dst, obj_t *obj);
+static console_state_t get_console_state(obj_t *console);
 
 
 obj_t * create_obj(
@@ -76,10 +168,32 @@ obj_t * create_obj(
         out_of_memory();
     obj->name = create_string(name);
     obj->fd = fd;
-    obj->bufInPtr = obj->bufOutPtr = obj->buf;
+    obj->tp = tp_global;
+    /*
+     *  The circular-buffer is not allocated until data is written into it.
+     *  A bufSize of 0 is replaced by the configured default once the
+     *    config has been processed.
+     */
+    obj->buf = obj->bufInPtr = obj->bufOutPtr = NULL;
+    obj->bufSize = (type == CONMAN_OBJ_CLIENT) ? OBJ_BUF_SIZE : 0;
+    obj->readSize = OBJ_READ_SIZE;
     x_pthread_mutex_init(&obj->bufLock, NULL);
+    obj->ringBuf = NULL;
+    obj->ringHead = 0;
+    obj->ringSize = 0;
     obj->readers = list_create(NULL);
     obj->writers = list_create(NULL);
+    obj->readerVec.objs = obj->writerVec.objs = NULL;
+    obj->readerVec.num = obj->writerVec.num = 0;
+    obj->readerVec.max = obj->writerVec.max = 0;
+    x_pthread_rwlock_init(&obj->vecLock, NULL);
+    memset(&obj->stats, 0, sizeof(obj->stats));
+    obj->latUsecs = 0;
+    obj->latPos = 0;
+    obj->latConsole = NULL;
+    obj->latHists = NULL;
+    obj->wakeNext = NULL;
+    obj->isWakeQueued = 0;
     if ((type == 0) || (type >= CONMAN_OBJ_LAST_ENTRY)) {
         log_err(0, "INTERNAL: Unrecognized object [%s] type=%d", name, type);
     }
@@ -103,10 +217,13 @@ obj_t * create_client_obj(server_conf_t *conf, req_t *req)
 {
 /*  Creates a new client object and adds it to the master objs list.
  *    Note: the socket is open and set for non-blocking I/O.
+ *  The client is muxed by the same thread as the first console
+ *    in its request.
  *  Returns the new object.
  */
     char name[MAX_LINE];
     obj_t *client;
+    obj_t *console;
 
     assert(conf != NULL);
     assert(req != NULL);
@@ -116,33 +233,99 @@ obj_t * create_client_obj(server_conf_t *conf, req_t *req)
 
     set_fd_nonblocking(req->sd);
     set_fd_closed_on_exec(req->sd);
-    tpoll_set(tp_global, req->sd, POLLIN);
 
     snprintf(name, sizeof(name), "%s@%s:%d", req->user, req->host, req->port);
     name[sizeof(name) - 1] = '\0';
     client = create_obj(conf, name, req->sd, CONMAN_OBJ_CLIENT);
     client->aux.client.req = req;
+    client->aux.client.muxIds = NULL;
+    client->aux.client.numMuxIds = 0;
     time(&client->aux.client.timeLastRead);
     if (client->aux.client.timeLastRead == (time_t) -1)
         log_err(errno, "time() failed");
+    client->aux.client.ringObj = NULL;
+    client->aux.client.ringPos = 0;
+    client->aux.client.ringEnd = 0;
+    client->aux.client.replayEnd = 0;
     client->aux.client.gotEscape = 0;
     client->aux.client.gotSuspend = 0;
+    client->aux.client.gotRingEnd = 0;
+    client->aux.client.gotReplay = 0;
 
+    if ((console = list_peek(req->consoles))) {
+        client->tp = console->tp;
+    }
     /*  Add obj to the master conf->objs list.
      */
     list_append(conf->objs, client);
 
+    tpoll_set(client->tp, req->sd, POLLIN);
+    tpoll_set_arg(client->tp, req->sd, client);
+
     DPRINTF((9, "Opened client: fd=%d user=%s tty=%s host=%s port=%d.\n",
         req->sd, req->user, req->tty, req->host, req->port));
     return(client);
 }
 
 
+void create_client_mux_ids(obj_t *client)
+{
+/*  Creates the map of console ids for a multiplexed (mux) client session.
+ *  A console's id is its position in the client's list of consoles
+ *    (ie, the order in which the consoles were returned in the response).
+ *  The map is sorted by obj in order to look up the id for each write.
+ */
+    ListIterator i;
+    obj_t *console;
+    int n;
+
+    assert(is_client_obj(client));
+    assert(client->aux.client.muxIds == NULL);
+    assert(client->buf == NULL);
+
+    n = list_count(client->aux.client.req->consoles);
+    assert(n < MUX_SESSION_ID);
+    if (!(client->aux.client.muxIds = malloc(n * sizeof(mux_id_t)))) {
+        out_of_memory();
+    }
+    n = 0;
+    i = list_iterator_create(client->aux.client.req->consoles);
+    while ((console = list_next(i))) {
+        client->aux.client.muxIds[n].obj = console;
+        client->aux.client.muxIds[n].id = n;
+        n++;
+    }
+    list_iterator_destroy(i);
+    qsort(client->aux.client.muxIds, n, sizeof(mux_id_t), compare_mux_ids);
+    client->aux.client.numMuxIds = n;
+
+    /*  The client's buffer is shared by the output of all of its consoles.
+     */
+    client->bufSize = MUX_CLIENT_BUF_SIZE;
+    return;
+}
+
+
+static int compare_mux_ids(const void *p1, const void *p2)
+{
+/*  Compares two mux console id map entries by obj.
+ *  Helper function for qsort() and bsearch().
+ */
+    const mux_id_t *m1 = p1;
+    const mux_id_t *m2 = p2;
+
+    if (m1->obj < m2->obj) {
+        return(-1);
+    }
+    return(m1->obj > m2->obj);
+}
+
+
 void destroy_obj(obj_t *obj)
 {
 /*  Destroys the object, closing the fd and freeing resources as needed.
- *  This routine should only be called via the obj's list destructor, thereby
- *    ensuring it will be removed from the master objs list before destruction.
+ *  This routine should only be called after the obj has been removed from
+ *    the master objs list (eg, via the list destructor or remove_obj()).
  */
     int n;
     char **pp;
@@ -150,12 +333,26 @@ void destroy_obj(obj_t *obj)
     assert(obj != NULL);
     DPRINTF((10, "Destroying object [%s].\n", obj->name));
 
+    /*  Wait for any other thread still using a ref to this obj.
+     *  Since the obj is no longer reachable, new refs cannot be acquired.
+     */
+    x_pthread_rwlock_wrlock(&obj_refs_lock);
+    x_pthread_rwlock_unlock(&obj_refs_lock);
+    x_pthread_rwlock_wrlock(&obj->vecLock);
+    x_pthread_rwlock_unlock(&obj->vecLock);
+    unschedule_obj_write(obj);
+
     n = num_bytes_buffered(obj);
     if (n > 0) {
         log_msg(LOG_WARNING,
             "Destroying [%s] with %d byte%s of unwritten data",
             obj->name, n, (n == 1 ? "" : "s"));
     }
+    /*  Report any losses not yet logged by count_obj_loss().
+     */
+    if (obj->stats.numBytesLost != obj->stats.numBytesLostLogged) {
+        log_obj_loss(obj);
+    }
 
     switch(obj->type) {
     case CONMAN_OBJ_CLIENT:
@@ -167,8 +364,13 @@ void destroy_obj(obj_t *obj)
             destroy_req(req);
             obj->aux.client.req = NULL;
         }
+        if (obj->aux.client.muxIds) {
+            free(obj->aux.client.muxIds);
+            obj->aux.client.muxIds = NULL;
+        }
         break;
     case CONMAN_OBJ_LOGFILE:
+        x_pthread_mutex_destroy(&obj->aux.logfile.writeLock);
         if (obj->aux.logfile.fmtName) {
             free(obj->aux.logfile.fmtName);
         }
@@ -238,14 +440,30 @@ void destroy_obj(obj_t *obj)
     }
 
     x_pthread_mutex_destroy(&obj->bufLock);
+    if (obj->buf) {
+        free(obj->buf);
+    }
+    if (obj->ringBuf) {
+        free(obj->ringBuf);
+    }
+    if (obj->latHists) {
+        free(obj->latHists);
+    }
     if (obj->readers) {
         list_destroy(obj->readers);
     }
     if (obj->writers) {
         list_destroy(obj->writers);
     }
+    if (obj->readerVec.objs) {
+        free(obj->readerVec.objs);
+    }
+    if (obj->writerVec.objs) {
+        free(obj->writerVec.objs);
+    }
+    x_pthread_rwlock_destroy(&obj->vecLock);
     if (obj->fd >= 0) {
-        tpoll_clear(tp_global, obj->fd, POLLIN | POLLOUT);
+        tpoll_clear(obj->tp, obj->fd, POLLIN | POLLOUT);
         if (close(obj->fd) < 0) {
             log_msg(LOG_WARNING, "Unable to close [%s] during destruction: %s",
                 obj->name, strerror(errno));
@@ -512,6 +730,45 @@ int find_obj(obj_t *obj, obj_t *key)
 }
 
 
+void lock_obj_refs(void)
+{
+/*  Acquires a shared lock preventing objs from being destroyed
+ *    while refs to them are in use by the calling thread.
+ */
+    x_pthread_rwlock_rdlock(&obj_refs_lock);
+    return;
+}
+
+
+void unlock_obj_refs(void)
+{
+/*  Releases the shared lock acquired by lock_obj_refs().
+ */
+    x_pthread_rwlock_unlock(&obj_refs_lock);
+    return;
+}
+
+
+void lock_obj_vecs(obj_t *obj)
+{
+/*  Acquires a shared lock on the (obj)'s readers and writers arrays,
+ *    preventing the objs in them from being unlinked (and thus destroyed)
+ *    while they are in use by the calling thread.
+ */
+    x_pthread_rwlock_rdlock(&obj->vecLock);
+    return;
+}
+
+
+void unlock_obj_vecs(obj_t *obj)
+{
+/*  Releases the shared lock acquired by lock_obj_vecs().
+ */
+    x_pthread_rwlock_unlock(&obj->vecLock);
+    return;
+}
+
+
 int write_notify_msg(obj_t *console, int priority, char *fmt, ...)
 {
 /*  Writes a notification message to the daemon logfile and all attached
@@ -577,27 +834,30 @@ void notify_console_objs(obj_t *console, char *msg)
 /*  Notifies all readers & writers of (console) with the informational (msg).
  *  If an obj is both a reader and a writer, it will only be notified once.
  */
-    ListIterator i;
+    int len;
+    int k;
     obj_t *obj;
 
     assert(is_console_obj(console));
 
-    if (!msg || !strlen(msg)) {
+    if (!msg || !(len = strlen(msg))) {
         return;
     }
-    i = list_iterator_create(console->readers);
-    while ((obj = list_next(i))) {
-        write_obj_data(obj, msg, strlen(msg), 1);
-    }
-    list_iterator_destroy(i);
+    /*  The console's writers may include B/C clients muxed by other threads.
+     */
+    lock_obj_vecs(console);
 
-    i = list_iterator_create(console->writers);
-    while ((obj = list_next(i))) {
-        if (!list_find_first(console->readers, (ListFindF) find_obj, obj)) {
-            write_obj_data(obj, msg, strlen(msg), 1);
+    for (k = 0; k < console->readerVec.num; k++) {
+        obj = console->readerVec.objs[k];
+        write_client_data(obj, console, msg, len, 1);
+    }
+    for (k = 0; k < console->writerVec.num; k++) {
+        obj = console->writerVec.objs[k];
+        if (!is_obj_in_vec(&console->readerVec, obj)) {
+            write_obj_data(obj, msg, len, 1);
         }
     }
-    list_iterator_destroy(i);
+    unlock_obj_vecs(console);
     return;
 }
 
@@ -666,6 +926,21 @@ void link_objs(obj_t *src, obj_t *dst)
         free(now);
     }
 
+    /*  A client reads console output by reference from the console's
+     *    output ring, starting with the next byte written into it.
+     *  A mux client instead has the output of its consoles framed
+     *    into its own buffer.
+     */
+    if (is_console_obj(src) && is_client_obj(dst)
+            && !dst->aux.client.muxIds) {
+        create_obj_ring(src);
+        x_pthread_mutex_lock(&dst->bufLock);
+        dst->aux.client.ringObj = src;
+        dst->aux.client.ringPos = obj_buf_load(&src->ringHead);
+        dst->aux.client.gotRingEnd = 0;
+        dst->aux.client.gotReplay = 0;
+        x_pthread_mutex_unlock(&dst->bufLock);
+    }
     /*  Create link from src reads to dst writes.
      */
     assert(!list_find_first(src->readers, (ListFindF) find_obj, dst));
@@ -673,6 +948,17 @@ void link_objs(obj_t *src, obj_t *dst)
     assert(!list_find_first(dst->writers, (ListFindF) find_obj, src));
     list_append(dst->writers, src);
 
+    /*  Each array is updated under its own obj's lock; the locks are
+     *    never held together, so they are not ordered.
+     */
+    x_pthread_rwlock_wrlock(&src->vecLock);
+    add_obj_vec(&src->readerVec, dst);
+    set_obj_read_size(src);
+    x_pthread_rwlock_unlock(&src->vecLock);
+    x_pthread_rwlock_wrlock(&dst->vecLock);
+    add_obj_vec(&dst->writerVec, src);
+    x_pthread_rwlock_unlock(&dst->vecLock);
+
     DPRINTF((10, "Linked [%s] reads to [%s] writes.\n", src->name, dst->name));
     assert(validate_obj_links(src) >= 0);
     assert(validate_obj_links(dst) >= 0);
@@ -690,10 +976,27 @@ void unlink_objs(obj_t *src, obj_t *dst)
     char *tty;
     char buf[MAX_LINE];
 
+    x_pthread_rwlock_wrlock(&src->vecLock);
+    remove_obj_vec(&src->readerVec, dst);
+    set_obj_read_size(src);
+    x_pthread_rwlock_unlock(&src->vecLock);
+    x_pthread_rwlock_wrlock(&dst->vecLock);
+    remove_obj_vec(&dst->writerVec, src);
+    x_pthread_rwlock_unlock(&dst->vecLock);
+
     if (list_delete_all(src->readers, (ListFindF) find_obj, dst)) {
         DPRINTF((10, "Removing [%s] from [%s] readers.\n",
             dst->name, src->name));
     }
+    /*  Stop the client from reading console output written after this point.
+     *  Output already in the ring will still be written to the client.
+     */
+    if (is_client_obj(dst) && (dst->aux.client.ringObj == src)) {
+        x_pthread_mutex_lock(&dst->bufLock);
+        dst->aux.client.ringEnd = obj_buf_load(&src->ringHead);
+        dst->aux.client.gotRingEnd = 1;
+        x_pthread_mutex_unlock(&dst->bufLock);
+    }
     if ((n = list_delete_all(dst->writers, (ListFindF) find_obj, src))) {
         DPRINTF((10, "Removing [%s] from [%s] writers.\n",
             src->name, dst->name));
@@ -756,6 +1059,99 @@ void unlink_obj(obj_t *obj)
 }
 
 
+static void add_obj_vec(obj_vec_t *vec, obj_t *obj)
+{
+/*  Appends (obj) to the inline array (vec), growing it as needed.
+ *  The vecLock of the obj owning (vec) must be held exclusively
+ *    when calling this routine.
+ */
+    obj_t **objs;
+    int max;
+
+    assert(vec != NULL);
+    assert(obj != NULL);
+
+    if (vec->num >= vec->max) {
+        max = (vec->max > 0) ? vec->max * 2 : 4;
+        if (!(objs = realloc(vec->objs, max * sizeof(obj_t *)))) {
+            out_of_memory();
+        }
+        vec->objs = objs;
+        vec->max = max;
+    }
+    vec->objs[vec->num++] = obj;
+    return;
+}
+
+
+static int remove_obj_vec(obj_vec_t *vec, obj_t *obj)
+{
+/*  Removes all occurrences of (obj) from the inline array (vec),
+ *    preserving the order of the remaining objs.
+ *  The vecLock of the obj owning (vec) must be held exclusively
+ *    when calling this routine.
+ *  Returns the number of objs removed.
+ */
+    int j;
+    int k;
+
+    assert(vec != NULL);
+
+    for (j = k = 0; k < vec->num; k++) {
+        if (vec->objs[k] != obj) {
+            vec->objs[j++] = vec->objs[k];
+        }
+    }
+    k = vec->num - j;
+    vec->num = j;
+    return(k);
+}
+
+
+void set_obj_read_size(obj_t *obj)
+{
+/*  Sets the max number of bytes read at once from the obj's fd so that
+ *    each read fits within half the circular-buffer of its smallest reader.
+ *  This leaves room for a logfile's data to grow as a result of the
+ *    additional processing in write_log_data().
+ *  The obj's vecLock must be held exclusively when calling this routine
+ *    (unless the I/O threads have not yet been started).
+ */
+    int n;
+    int k;
+    int size;
+
+    assert(obj != NULL);
+
+    n = OBJ_READ_SIZE;
+    for (k = 0; k < obj->readerVec.num; k++) {
+        size = obj->readerVec.objs[k]->bufSize;
+        if (size > 0) {
+            n = MIN(n, (size / 2) - 1);
+        }
+    }
+    obj_buf_store(&obj->readSize, n);
+    return;
+}
+
+
+static int is_obj_in_vec(obj_vec_t *vec, obj_t *obj)
+{
+/*  Returns true if (obj) is in the inline array (vec).
+ */
+    int k;
+
+    assert(vec != NULL);
+
+    for (k = 0; k < vec->num; k++) {
+        if (vec->objs[k] == obj) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+
 #ifndef NDEBUG
 static int validate_obj_links(obj_t *obj)
 {
@@ -790,6 +1186,12 @@ static int validate_obj_links(obj_t *obj)
     }
     list_iterator_destroy(i);
 
+    if ((list_count(obj->readers) != obj->readerVec.num)
+            || (list_count(obj->writers) != obj->writerVec.num)) {
+        DPRINTF((1, "[%s] readers/writers arrays not in sync with lists.\n",
+            obj->name));
+        gotError = 1;
+    }
     return(gotError ? -1 : 0);
 }
 #endif /* !NDEBUG */
@@ -816,7 +1218,7 @@ int shutdown_obj(obj_t *obj)
     }
     /*  Close the existing connection.
      */
-    tpoll_clear(tp_global, obj->fd, POLLIN | POLLOUT);
+    tpoll_clear(obj->tp, obj->fd, POLLIN | POLLOUT);
     if (close(obj->fd) < 0) {
         log_msg(LOG_WARNING, "Unable to close [%s] during shutdown: %s",
             obj->name, strerror(errno));
@@ -843,8 +1245,8 @@ int shutdown_obj(obj_t *obj)
             n, (n == 1 ? "" : "s"), obj->name);
     }
     /*  Prepare this obj for destruction by unlinking it from all others.
-     *    It will be removed from the master objs list by mux_io(),
-     *    and the objs list destructor will destroy the obj.
+     *    It will be removed from the master objs list and destroyed
+     *    by mux_io().
      */
     if (is_client_obj(obj)) {
         unlink_obj(obj);
@@ -872,21 +1274,21 @@ int shutdown_obj(obj_t *obj)
 int read_from_obj(obj_t *obj)
 {
 /*  Reads data from the obj's file descriptor and writes it out
- *    to the circular-buffer of each obj in its "readers" list.
+ *    to the circular-buffer of each obj in its "readers" list
+ *    (or, for clients reading a console, into the console's output ring).
  *  Returns the number of bytes read (>=0 on success),
  *    or -1 if the obj is ready to be destroyed.
  *
  *  An obj's circular-buffer is empty when (bufInPtr == bufOutPtr).
- *    Thus, it can hold at most (OBJ_BUF_SIZE - 1) bytes of data.
+ *    Thus, it can hold at most (bufSize - 1) bytes of data.
  *  But if the obj is a logfile, its data can grow as a result of the
- *    additional processing.  This routine's internal buffer is reduced
- *    somewhat to reduce the likelihood of log data being dropped.
+ *    additional processing.  Each read is therefore bounded by half the
+ *    buffer size of the obj's smallest reader (see set_obj_read_size())
+ *    to reduce the likelihood of log data being dropped.
  */
-    unsigned char buf[(OBJ_BUF_SIZE / 2) - 1];
+    unsigned char buf[OBJ_READ_SIZE];
     int n;
     int isEmpty;
-    ListIterator i;
-    obj_t *reader;
 
     DPRINTF((20, "Entered read_from_obj: [%s]\n", obj->name));
 
@@ -902,7 +1304,7 @@ int read_from_obj(obj_t *obj)
         return(0);
     }
 again:
-    if ((n = read(obj->fd, buf, sizeof(buf))) < 0) {
+    if ((n = read(obj->fd, buf, obj_buf_load(&obj->readSize))) < 0) {
         if (errno == EINTR) {
             goto again;
         }
@@ -919,8 +1321,27 @@ again:
             log_msg(LOG_WARNING, "Read EOF from [%s] after gotEOF", obj->name);
         }
         obj->gotEOF = 1;
-        tpoll_clear(tp_global, obj->fd, POLLIN);
-        isEmpty = (obj->bufInPtr == obj->bufOutPtr);
+        tpoll_clear(obj->tp, obj->fd, POLLIN);
+        /*
+         *  A client's pending console output is bounded by the ring head
+         *    at EOF (as if it had been unlinked), just as no more data can
+         *    be written into its buffer.  That output is still written out
+         *    before the client is shut down by write_to_obj().
+         */
+        if (is_client_obj(obj)) {
+            x_pthread_mutex_lock(&obj->bufLock);
+            if (obj->aux.client.ringObj && !obj->aux.client.gotRingEnd) {
+                obj->aux.client.ringEnd =
+                    obj_buf_load(&obj->aux.client.ringObj->ringHead);
+                obj->aux.client.gotRingEnd = 1;
+            }
+            x_pthread_mutex_unlock(&obj->bufLock);
+        }
+        isEmpty = (obj_buf_load(&obj->bufInPtr)
+            == obj_buf_load(&obj->bufOutPtr)) && is_client_ring_empty(obj);
+        if (!isEmpty) {
+            tpoll_set(obj->tp, obj->fd, POLLOUT);
+        }
         return(isEmpty ? shutdown_obj(obj) : 0);
     }
     else {
@@ -941,35 +1362,255 @@ again:
          *    after the escape characters have been processed.
          */
         if (n > 0) {
-            i = list_iterator_create(obj->readers);
-            while ((reader = list_next(i))) {
+            write_readers_data(obj, buf, n);
+        }
+    }
+    return(n);
+}
 
-                if (is_logfile_obj(reader)) {
-                    write_log_data(reader, buf, n);
-                }
-                else {
-                    write_obj_data(reader, buf, n, 0);
-                }
+
+void write_readers_data(obj_t *obj, const void *src, int len)
+{
+/*  Writes the buffer (src) of length (len) read from the obj's fd
+ *    to each obj in its "readers" list.
+ *  Console output is written once into the console's output ring
+ *    (which also serves as its scrollback); clients reading the console
+ *    are then only notified that more output is available.
+ */
+    int gotRing;
+    int k;
+    obj_t *reader;
+    unsigned long head;
+    unsigned long usecs = 0;
+
+    assert(obj != NULL);
+
+    obj_stats_add(&obj->stats.numBytesIn, len);
+
+    /*  A console's ring is created by the thread reading the console once
+     *    it first produces output, so its output can be replayed to clients
+     *    connecting later while consoles that never produce any cost nothing.
+     */
+    if (is_console_obj(obj)) {
+        create_obj_ring(obj);
+    }
+    /*  The ring head is only advanced by the thread reading the console.
+     */
+    head = obj->ringHead;
+    gotRing = (obj_buf_load(&obj->ringBuf) != NULL);
+    if (gotRing) {
+        write_ring_data(obj, src, len);
+    }
+    lock_obj_vecs(obj);
+    for (k = 0; k < obj->readerVec.num; k++) {
+
+        reader = obj->readerVec.objs[k];
+
+        if (latency_sampling && obj->latHists
+                && !obj_buf_load(&reader->latUsecs)) {
+            if (!usecs) {
+                usecs = get_latency_usecs();
             }
-            list_iterator_destroy(i);
+            start_latency_sample(reader, obj, head, usecs);
         }
+        if (is_logfile_obj(reader)) {
+            write_log_data(reader, src, len);
+        }
+        else if (gotRing && is_client_obj(reader)
+                && (reader->aux.client.ringObj == obj)) {
+            if (!reader->aux.client.gotSuspend) {
+                schedule_obj_write(reader);
+            }
+        }
+        else {
+            write_client_data(reader, obj, src, len, 0);
+        }
+    }
+    unlock_obj_vecs(obj);
+    return;
+}
+
+
+int replay_console_ring(obj_t *client, int numBytes, int numLines)
+{
+/*  Rewinds the (client) obj's position within the output ring of the
+ *    console it is reading in order to replay the console's scrollback.
+ *  If (numLines) is positive, the last (numLines) lines are replayed;
+ *    o/w, the last (numBytes) bytes are replayed.  Either is bounded by
+ *    the amount of output held in the ring.
+ *  The replay is written to the client in chunks by write_ring_to_client()
+ *    as the client's fd becomes writable, followed by an "End log replay"
+ *    message once the output up to the current ring head has been written.
+ *  Returns the number of bytes to be replayed, or -1 if the client
+ *    is not reading a console.
+ */
+    obj_t *console;
+    unsigned long head;
+    unsigned long last;
+    unsigned long start;
+    unsigned long avail;
+    unsigned long n;
+
+    assert(is_client_obj(client));
+
+    console = client->aux.client.ringObj;
+    if (!console || client->aux.client.gotRingEnd) {
+        return(-1);
+    }
+    assert(is_console_obj(console));
+    assert(console->ringBuf != NULL);
+
+    head = obj_buf_load(&console->ringHead);
+    avail = MIN(head, (unsigned long) console->ringSize);
+
+    if (numLines > 0) {
+        /*
+         *  Scan backwards from the ring head for the start of the line
+         *    (numLines) lines back, ignoring a trailing newline.
+         */
+        n = 0;
+        if ((avail > 0)
+                && (console->ringBuf[(head - 1) % console->ringSize] == '\n')) {
+            n++;
+        }
+        while (n < avail) {
+            if ((console->ringBuf[(head - n - 1) % console->ringSize] == '\n')
+                    && (--numLines == 0)) {
+                break;
+            }
+            n++;
+        }
+    }
+    else {
+        n = MIN((unsigned long) MAX(numBytes, 0), avail);
+    }
+    /*  The console's thread may have overwritten the oldest part of the
+     *    replay while the ring was being scanned, so the replay is clamped
+     *    to the data still held in the ring.
+     */
+    last = obj_buf_load(&console->ringHead);
+    if ((last - head) + n > (unsigned long) console->ringSize) {
+        n = (last - head < (unsigned long) console->ringSize)
+            ? console->ringSize - (last - head) : 0;
+    }
+    start = head - n;
+
+    x_pthread_mutex_lock(&client->bufLock);
+    /*
+     *  Output not yet written to the client is included in the replay
+     *    if it precedes the start of the replay.
+     */
+    if (head - client->aux.client.ringPos < n) {
+        client->aux.client.ringPos = start;
+    }
+    client->aux.client.replayEnd = head;
+    client->aux.client.gotReplay = 1;
+    x_pthread_mutex_unlock(&client->bufLock);
+
+    if (!client->aux.client.gotSuspend) {
+        schedule_obj_write(client);
     }
+    DPRINTF((10, "Replaying %lu bytes from [%s] ring to [%s].\n",
+        n, console->name, client->name));
     return(n);
 }
 
 
 int write_obj_data(obj_t *obj, const void *src, int len, int isInfo)
 {
+/*  Writes the buffer (src) of length (len) into the object's (obj)
+ *    circular-buffer.  If (isInfo) is true, the data is considered
+ *    an informational message which a client may suppress.
+ *  Data written to a mux client is framed as a session-wide message.
+ *  Returns the number of bytes written.
+ */
+    if (is_client_obj(obj) && obj->aux.client.muxIds) {
+        return(write_mux_frames(obj, MUX_SESSION_ID, src, len, isInfo));
+    }
+    return(write_obj_buf(obj, src, len, isInfo));
+}
+
+
+int write_client_data(obj_t *client, obj_t *console,
+    const void *src, int len, int isInfo)
+{
+/*  Writes the buffer (src) of length (len) read from (console)
+ *    into the (client) obj's circular-buffer.
+ *  Data written to a mux client is framed with the console's id.
+ *  Returns the number of bytes written.
+ */
+    mux_id_t key;
+    mux_id_t *m;
+    int n;
+
+    if (!is_client_obj(client) || !client->aux.client.muxIds) {
+        return(write_obj_data(client, src, len, isInfo));
+    }
+    key.obj = console;
+    m = bsearch(&key, client->aux.client.muxIds,
+        client->aux.client.numMuxIds, sizeof(mux_id_t), compare_mux_ids);
+
+    n = write_mux_frames(client, (m ? m->id : MUX_SESSION_ID),
+        src, len, isInfo);
+
+    /*  Frames dropped by the client's buffer are console output lost
+     *    to a slow reader.
+     */
+    if (m && !isInfo && (n < len)) {
+        obj_stats_add(&console->stats.numReaderBytesLost, len - n);
+    }
+    return(n);
+}
+
+
+static int write_mux_frames(
+    obj_t *client, int id, const void *src, int len, int isInfo)
+{
+/*  Writes the buffer (src) of length (len) into the mux (client) obj's
+ *    circular-buffer as one or more frames tagged with the console (id).
+ *  Returns the number of data bytes written.
+ */
+    unsigned char frame[MUX_HDR_LEN + MUX_MAX_DATA];
+    const unsigned char *p = src;
+    int n;
+    int total = 0;
+
+    assert(is_client_obj(client));
+    assert((id >= 0) && (id <= MUX_SESSION_ID));
+
+    if (!src) {
+        return(0);
+    }
+    while (len > 0) {
+        n = MIN(len, MUX_MAX_DATA);
+        frame[0] = (id >> 8) & 0xFF;
+        frame[1] = id & 0xFF;
+        frame[2] = (n >> 8) & 0xFF;
+        frame[3] = n & 0xFF;
+        memcpy(frame + MUX_HDR_LEN, p, n);
+        if (write_obj_buf(client, frame, MUX_HDR_LEN + n, isInfo) > 0) {
+            total += n;
+        }
+        p += n;
+        len -= n;
+    }
+    return(total);
+}
+
+
+static int write_obj_buf(obj_t *obj, const void *src, int len, int isInfo)
+{
 /*  Writes the buffer (src) of length (len) into the object's (obj)
  *    circular-buffer.  If (isInfo) is true, the data is considered
  *    an informational message which a client may suppress.
  *  Returns the number of bytes written.
  *
- *  Note that this routine can write at most (OBJ_BUF_SIZE - 1) bytes
+ *  Note that this routine can write at most (bufSize - 1) bytes
  *    of data into the object's circular-buffer.
  */
     int avail;
     int n, m;
+    unsigned char *in;
 
     DPRINTF((20, "Entered write_obj_data: [%s]\n", obj->name));
 
@@ -984,12 +1625,7 @@ int write_obj_data(obj_t *obj, const void *src, int len, int isInfo)
             len, (len == 1 ? "" : "s"), obj->name);
         return(0);
     }
-    /*  An obj's circular-buffer is empty when (bufInPtr == bufOutPtr).
-     *    Thus, it can hold at most (OBJ_BUF_SIZE - 1) bytes of data.
-     */
-    if (len >= OBJ_BUF_SIZE) {
-        len = OBJ_BUF_SIZE - 1;
-    }
+    assert(obj->bufSize > 0);
     x_pthread_mutex_lock(&obj->bufLock);
 
     /*  Do nothing if this is an informational message
@@ -999,69 +1635,102 @@ int write_obj_data(obj_t *obj, const void *src, int len, int isInfo)
         x_pthread_mutex_unlock(&obj->bufLock);
         return(0);
     }
+    if (!obj->buf) {
+        create_obj_buf(obj);
+    }
     /*  Assert the buffer's input and output ptrs are valid upon entry.
      */
     assert(obj->bufInPtr >= obj->buf);
-    assert(obj->bufInPtr < &obj->buf[OBJ_BUF_SIZE]);
+    assert(obj->bufInPtr < &obj->buf[obj->bufSize]);
     assert(obj->bufOutPtr >= obj->buf);
-    assert(obj->bufOutPtr < &obj->buf[OBJ_BUF_SIZE]);
+    assert(obj->bufOutPtr < &obj->buf[obj->bufSize]);
 
-    n = len;
+    in = obj->bufInPtr;
 
-    /*  Calculate the number of bytes available before data is overwritten.
-     *  Data in the circular-buffer will be overwritten if needed since
-     *    this routine must not block.
+    /*  Calculate the number of bytes available before unwritten data would
+     *    be overwritten.
      *  Since an obj's circular-buffer is empty when (bufInPtr == bufOutPtr),
      *    subtract one byte to account for this sentinel.
+     *  Data exceeding this (including data larger than the buffer itself)
+     *    is counted as lost.
+     *  The consumer may concurrently free up more space, so this is a
+     *    lower bound.
+     */
+    avail = obj->bufSize - 1 - num_bytes_buffered(obj);
+
+    /*  Only the consumer advances the output ptr, and it may be writing
+     *    out the unwritten data at any time without holding the lock.
+     *    So data that does not fit is dropped instead of overwriting it.
+     *  Data written to a mux client is framed, so a frame that does not fit
+     *    is dropped whole instead of being truncated.
      */
-    avail = OBJ_BUF_SIZE - 1 - num_bytes_buffered(obj);
+    if (len > avail) {
+        if (is_client_obj(obj) && obj->aux.client.muxIds) {
+            count_obj_loss(obj, len, 0);
+            x_pthread_mutex_unlock(&obj->bufLock);
+            return(0);
+        }
+        count_obj_loss(obj, len - avail,
+            is_client_obj(obj) && obj->aux.client.gotSuspend);
+        len = avail;
+        /*
+         *  A latency sample marking this write will never see its byte.
+         */
+        if (len == 0) {
+            obj_buf_store(&obj->latUsecs, 0);
+        }
+    }
+    n = len;
 
     /*  Copy first chunk of data (ie, up to the end of the buffer).
      */
-    m = MIN(len, &obj->buf[OBJ_BUF_SIZE] - obj->bufInPtr);
+    m = MIN(n, &obj->buf[obj->bufSize] - in);
     if (m > 0) {
-        memcpy(obj->bufInPtr, src, m);
+        memcpy(in, src, m);
         n -= m;
         src = (unsigned char *) src + m;
-        obj->bufInPtr += m;
+        in += m;
         /*
          *  Do the hokey-pokey and perform a circular-buffer wrap-around.
          */
-        if (obj->bufInPtr == &obj->buf[OBJ_BUF_SIZE]) {
-            obj->bufInPtr = obj->buf;
+        if (in == &obj->buf[obj->bufSize]) {
+            in = obj->buf;
             obj->gotBufWrap = 1;
         }
     }
     /*  Copy second chunk of data (ie, from the beginning of the buffer).
      */
     if (n > 0) {
-        memcpy(obj->bufInPtr, src, n);
-        obj->bufInPtr += n;             /* Hokey-Pokey not needed here */
+        memcpy(in, src, n);
+        in += n;                        /* Hokey-Pokey not needed here */
     }
-    /*  Check to see if any data in circular-buffer was overwritten.
+    /*  Publish the new data to the consumer once it has been copied.
      */
-    if (len > avail) {
-        if (!is_client_obj(obj) || !obj->aux.client.gotSuspend) {
-            log_msg(LOG_NOTICE, "Overwrote %d bytes for \"%s\"",
-                len - avail, obj->name);
-        }
-        obj->bufOutPtr = obj->bufInPtr + 1;
-        if (obj->bufOutPtr == &obj->buf[OBJ_BUF_SIZE]) {
-            obj->bufOutPtr = obj->buf;
-        }
+    obj_buf_store(&obj->bufInPtr, in);
+
+    /*  Track the buffer's high-water mark.
+     */
+    m = num_bytes_buffered(obj);
+    if ((unsigned long) m > obj->stats.maxBytesBuffered) {
+        obj_stats_set(&obj->stats.maxBytesBuffered, m);
     }
     /*  Notify tpoll that data is available for writing
      *    unless it is a client obj that is currently suspended.
+     *  Logfiles are instead queued for the log writer threads if enabled;
+     *    the write is urgent once the buffer is half full.
      */
-    if (!is_client_obj(obj) || !obj->aux.client.gotSuspend) {
-        tpoll_set(tp_global, obj->fd, POLLOUT);
+    if (!is_logfile_obj(obj) || (queue_logfile_write(obj,
+            num_bytes_buffered(obj) >= obj->bufSize / 2) < 0)) {
+        if (!is_client_obj(obj) || !obj->aux.client.gotSuspend) {
+            schedule_obj_write(obj);
+        }
     }
     /*  Assert the buffer's input and output ptrs are valid upon exit.
      */
     assert(obj->bufInPtr >= obj->buf);
-    assert(obj->bufInPtr < &obj->buf[OBJ_BUF_SIZE]);
+    assert(obj->bufInPtr < &obj->buf[obj->bufSize]);
     assert(obj->bufOutPtr >= obj->buf);
-    assert(obj->bufOutPtr < &obj->buf[OBJ_BUF_SIZE]);
+    assert(obj->bufOutPtr < &obj->buf[obj->bufSize]);
 
     x_pthread_mutex_unlock(&obj->bufLock);
 
@@ -1084,6 +1753,9 @@ int write_to_obj(obj_t *obj)
     int iovcnt = 0;
     int isDead = 0;
     int n;
+    unsigned char *in;
+    unsigned char *out;
+    unsigned char *p;
 
     DPRINTF((20, "Entered write_to_obj: [%s]\n", obj->name));
 
@@ -1098,35 +1770,43 @@ int write_to_obj(obj_t *obj)
         open_telnet_obj(obj);
         return(0);
     }
+#if ! OBJ_BUF_LOCK_FREE
     x_pthread_mutex_lock(&obj->bufLock);
+#endif /* !OBJ_BUF_LOCK_FREE */
+
+    /*  Take a snapshot of the buffer's input and output ptrs.
+     *  Producers may append more data in the meantime; it will be written
+     *    out on a subsequent call.
+     *  The input ptr is NULL until the buffer has been allocated.
+     */
+    in = obj_buf_load(&obj->bufInPtr);
+    out = (in != NULL) ? obj_buf_load(&obj->bufOutPtr) : NULL;
 
     /*  Assert the buffer's input and output ptrs are valid upon entry.
      */
-    assert(obj->bufInPtr >= obj->buf);
-    assert(obj->bufInPtr < &obj->buf[OBJ_BUF_SIZE]);
-    assert(obj->bufOutPtr >= obj->buf);
-    assert(obj->bufOutPtr < &obj->buf[OBJ_BUF_SIZE]);
+    assert(!in || ((in >= obj->buf) && (in < &obj->buf[obj->bufSize])));
+    assert(!in || ((out >= obj->buf) && (out < &obj->buf[obj->bufSize])));
 
     /*  IOV for object buffer cases OIO (wrap-around pt1) & IO (no-wrap).
      */
-    if (obj->bufOutPtr > obj->bufInPtr) {
-        iov[0].iov_base = obj->bufOutPtr;
-        iov[0].iov_len = &obj->buf[OBJ_BUF_SIZE] - obj->bufOutPtr;
+    if (out > in) {
+        iov[0].iov_base = out;
+        iov[0].iov_len = &obj->buf[obj->bufSize] - out;
         iovcnt = 1;
         /*
          *  IOV for object buffer case OIO (wrap-around pt2).
          */
-        if (obj->bufInPtr > obj->buf) {
+        if (in > obj->buf) {
             iov[1].iov_base = obj->buf;
-            iov[1].iov_len = obj->bufInPtr - obj->buf;
+            iov[1].iov_len = in - obj->buf;
             iovcnt = 2;
         }
     }
     /*  IOV for object buffer cases IOI & OI.
      */
-    else if (obj->bufInPtr > obj->bufOutPtr) {
-        iov[0].iov_base = obj->bufOutPtr;
-        iov[0].iov_len = obj->bufInPtr - obj->bufOutPtr;
+    else if (in > out) {
+        iov[0].iov_base = out;
+        iov[0].iov_len = in - out;
         iovcnt = 1;
     }
 
@@ -1149,15 +1829,45 @@ again:
         }
         else if (n > 0) {
             DPRINTF((15, "Wrote %d bytes to [%s].\n", n, obj->name));
-            obj->bufOutPtr += n;
-            if (obj->bufOutPtr >= &obj->buf[OBJ_BUF_SIZE]) {
-                obj->bufOutPtr -= OBJ_BUF_SIZE;
+            obj_stats_add(&obj->stats.numBytesOut, n);
+            if (latency_sampling
+                    && (!is_client_obj(obj) || !obj->aux.client.ringObj)) {
+                end_latency_sample(obj, out - obj->buf, n, obj->bufSize);
+            }
+            p = out + n;
+            if (p >= &obj->buf[obj->bufSize]) {
+                p -= obj->bufSize;
             }
+            obj_buf_store(&obj->bufOutPtr, p);
+            out = p;
         }
     }
+#if ! OBJ_BUF_LOCK_FREE
+    /*  The lock is released since write_ring_to_client() acquires it.
+     */
+    x_pthread_mutex_unlock(&obj->bufLock);
+#endif /* !OBJ_BUF_LOCK_FREE */
+
+    /*  Once a client's own buffer has been written out, write any pending
+     *    output from the console ring it is reading.
+     *  Note that an informational message can thus reach the client ahead
+     *    of console output read before the message was written.
+     */
+    if (!isDead && is_client_obj(obj) && (obj_buf_load(&obj->bufInPtr) == out)
+            && (write_ring_to_client(obj) < 0)) {
+        isDead = 1;
+    }
     /*  If all buffered data has been written out to the fd...
+     *  This is re-checked under the lock since write_obj_data() sets
+     *    POLLOUT under the lock after appending data; o/w, that
+     *    notification could be lost.
      */
-    if (obj->bufInPtr == obj->bufOutPtr) {
+    if (obj_buf_load(&obj->bufInPtr) != out) {
+        return(isDead ? shutdown_obj(obj) : 0);
+    }
+    x_pthread_mutex_lock(&obj->bufLock);
+
+    if ((obj->bufInPtr == obj->bufOutPtr) && is_client_ring_empty(obj)) {
         /*
          *  If the gotEOF flag is set, no additional data can be written into
          *    the buffer.  As such, the object is ready for shutdown.
@@ -1166,16 +1876,14 @@ again:
             isDead = 1;
         }
         /*  Notify tpoll that all available data has been written.
+         *  Console output is written into the ring without the client's lock,
+         *    so re-check the ring to ensure its notification was not lost.
          */
-        tpoll_clear(tp_global, obj->fd, POLLOUT);
+        tpoll_clear(obj->tp, obj->fd, POLLOUT);
+        if (!is_client_ring_empty(obj)) {
+            tpoll_set(obj->tp, obj->fd, POLLOUT);
+        }
     }
-    /*  Assert the buffer's input and output ptrs are valid upon exit.
-     */
-    assert(obj->bufInPtr >= obj->buf);
-    assert(obj->bufInPtr < &obj->buf[OBJ_BUF_SIZE]);
-    assert(obj->bufOutPtr >= obj->buf);
-    assert(obj->bufOutPtr < &obj->buf[OBJ_BUF_SIZE]);
-
     x_pthread_mutex_unlock(&obj->bufLock);
 
     return(isDead ? shutdown_obj(obj) : 0);
@@ -1187,16 +1895,655 @@ static int num_bytes_buffered(obj_t *obj)
 /*  Returns the number of bytes of buffered data in 'obj' waiting to be
  *    written out to the file descriptor.
  */
-    int n;
-
     assert(obj != NULL);
 
-    if (obj->bufInPtr >= obj->bufOutPtr) {
-        n = obj->bufInPtr - obj->bufOutPtr;
+    return(num_bytes_between(obj, obj_buf_load(&obj->bufInPtr),
+        obj_buf_load(&obj->bufOutPtr)));
+}
+
+
+static int num_bytes_between(
+    obj_t *obj, const unsigned char *in, const unsigned char *out)
+{
+/*  Returns the number of bytes of data in the obj's circular-buffer
+ *    between the output ptr (out) and the input ptr (in).
+ */
+    int n;
+
+    if (in >= out) {
+        n = in - out;
     }
     else {
-        n = (&obj->buf[OBJ_BUF_SIZE] - obj->bufOutPtr) +
-            (obj->bufInPtr - obj->buf);
+        n = obj->bufSize - (out - in);
+    }
+    return(n);
+}
+
+
+static void create_obj_buf(obj_t *obj)
+{
+/*  Allocates the obj's circular-buffer of 'bufSize' bytes.
+ *  The obj's bufLock must be held by the caller.
+ *  The output ptr is published before the input ptr since the consumer
+ *    only reads the buffer once the input ptr has moved.
+ */
+    unsigned char *buf;
+
+    assert(obj->buf == NULL);
+    assert(obj->bufSize > 0);
+
+    if (!(buf = malloc(obj->bufSize))) {
+        out_of_memory();
+    }
+    obj->buf = buf;
+    obj_buf_store(&obj->bufOutPtr, buf);
+    obj_buf_store(&obj->bufInPtr, buf);
+    DPRINTF((15, "Allocated %d-byte buffer for [%s].\n",
+        obj->bufSize, obj->name));
+    return;
+}
+
+
+void create_obj_ring(obj_t *console)
+{
+/*  Creates the (console) obj's output ring if it does not already exist.
+ *  The ring is allocated once the console first produces output
+ *    or a client first reads from it, whichever comes first.
+ *  It is published via an atomic store after it has been initialized,
+ *    so other threads only need to load 'ringBuf' to use it.
+ */
+    unsigned char *ring;
+    int size;
+    int n;
+
+    assert(is_console_obj(console));
+
+    if (obj_buf_load(&console->ringBuf) != NULL) {
+        return;
+    }
+    x_pthread_mutex_lock(&console->bufLock);
+    if (console->ringBuf == NULL) {
+        /*
+         *  Unless a scrollback size was configured, the ring is scaled with
+         *    the console's buffer size.  It is rounded up to a power of two
+         *    so ring positions remain contiguous when the position counters
+         *    wrap around.
+         */
+        if (console->ringSize > 0) {
+            size = console->ringSize;
+        }
+        else {
+            size = OBJ_RING_SIZE / OBJ_BUF_SIZE * console->bufSize;
+        }
+        for (n = 1; n < size; n <<= 1) {
+            ;
+        }
+        if (!(ring = malloc(n))) {
+            out_of_memory();
+        }
+        console->ringSize = n;
+        obj_buf_store(&console->ringBuf, ring);
+    }
+    x_pthread_mutex_unlock(&console->bufLock);
+    return;
+}
+
+
+static void write_ring_data(obj_t *console, const void *src, int len)
+{
+/*  Writes the buffer (src) of length (len) into the (console) obj's
+ *    output ring.  The ring is only written by the thread muxing the
+ *    console, so it has a single producer.  The oldest data is overwritten
+ *    as needed; clients that fall behind are notified of the overrun
+ *    by write_ring_to_client().
+ */
+    unsigned long head;
+    int off;
+    int m;
+
+    assert(console->ringBuf != NULL);
+
+    if (len > console->ringSize) {
+        src = (const unsigned char *) src + (len - console->ringSize);
+        len = console->ringSize;
+    }
+    head = console->ringHead;
+    off = head % console->ringSize;
+    m = MIN(len, console->ringSize - off);
+    memcpy(console->ringBuf + off, src, m);
+    if (len > m) {
+        memcpy(console->ringBuf, (const unsigned char *) src + m, len - m);
+    }
+    obj_buf_store(&console->ringHead, head + len);
+    return;
+}
+
+
+static int write_ring_to_client(obj_t *client)
+{
+/*  Writes pending console output from the console ring being read by
+ *    (client) out to the client's file descriptor.
+ *  Returns 0 on success, or -1 if the client is ready to be destroyed.
+ */
+    obj_t *console;
+    unsigned long pos;
+    unsigned long end;
+    unsigned long lost = 0;
+    unsigned long replayEnd;
+    int gotEnd;
+    int gotReplay;
+    struct iovec iov[2];
+    int iovcnt;
+    int off;
+    int len;
+    int n;
+    char buf[MAX_LINE];
+
+    assert(is_client_obj(client));
+
+    x_pthread_mutex_lock(&client->bufLock);
+    console = client->aux.client.ringObj;
+    pos = client->aux.client.ringPos;
+    gotEnd = client->aux.client.gotRingEnd;
+    end = client->aux.client.ringEnd;
+    gotReplay = client->aux.client.gotReplay;
+    replayEnd = client->aux.client.replayEnd;
+    x_pthread_mutex_unlock(&client->bufLock);
+
+    if (!console) {
+        return(0);
+    }
+    if (!gotEnd) {
+        end = obj_buf_load(&console->ringHead);
+    }
+    /*  A replay is written up to the ring head at the time it was requested,
+     *    after which the client is notified that the replay has ended.
+     */
+    if (gotReplay) {
+        if (replayEnd - pos <= end - pos) {
+            end = replayEnd;
+        }
+        else {                          /* replay skipped by an overrun */
+            end = pos;
+        }
+        if (pos == end) {
+            x_pthread_mutex_lock(&client->bufLock);
+            client->aux.client.gotReplay = 0;
+            x_pthread_mutex_unlock(&client->bufLock);
+            snprintf(buf, sizeof(buf), "%sEnd log replay of console [%s]%s",
+                CONMAN_MSG_PREFIX, console->name, CONMAN_MSG_SUFFIX);
+            strcpy(&buf[sizeof(buf) - 3], "\r\n");
+            write_obj_data(client, buf, strlen(buf), 0);
+            return(0);
+        }
+    }
+    if (end == pos) {
+        return(0);
+    }
+    /*  If the client has fallen behind the ring's tail, skip ahead
+     *    to the oldest data still in the ring.
+     */
+    if (end - pos > (unsigned long) console->ringSize) {
+        lost = (end - pos) - console->ringSize;
+        pos += lost;
+    }
+    off = pos % console->ringSize;
+    len = end - pos;
+    iov[0].iov_base = console->ringBuf + off;
+    iov[0].iov_len = MIN(len, console->ringSize - off);
+    iovcnt = 1;
+    if (len > (int) iov[0].iov_len) {
+        iov[1].iov_base = console->ringBuf;
+        iov[1].iov_len = len - iov[0].iov_len;
+        iovcnt = 2;
+    }
+    /*  Notify the client of the overrun before writing the ring data.
+     */
+    if (lost > 0) {
+        x_pthread_mutex_lock(&client->bufLock);
+        if (client->aux.client.ringPos < pos) {
+            client->aux.client.ringPos = pos;
+        }
+        count_obj_loss(client, lost, 0);
+        obj_buf_store(&client->latUsecs, 0);
+        x_pthread_mutex_unlock(&client->bufLock);
+        obj_stats_add(&console->stats.numReaderBytesLost, lost);
+        snprintf(buf, sizeof(buf),
+            "%sConsole [%s] output overrun: %lu byte%s dropped%s",
+            CONMAN_MSG_PREFIX, console->name, lost, (lost == 1 ? "" : "s"),
+            CONMAN_MSG_SUFFIX);
+        strcpy(&buf[sizeof(buf) - 3], "\r\n");
+        write_obj_data(client, buf, strlen(buf), 0);
+        return(0);
+    }
+again:
+    n = writev(client->fd, iov, iovcnt);
+    if (n < 0) {
+        if (errno == EINTR) {
+            goto again;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            log_msg(LOG_INFO, "Unable to write to [%s]: %s",
+                client->name, strerror(errno));
+            return(-1);
+        }
+    }
+    else if (n > 0) {
+        DPRINTF((15, "Wrote %d bytes from [%s] ring to [%s].\n",
+            n, console->name, client->name));
+        obj_stats_add(&client->stats.numBytesOut, n);
+        if (latency_sampling) {
+            end_latency_sample(client, pos, n, 0);
+        }
+        x_pthread_mutex_lock(&client->bufLock);
+        if (client->aux.client.ringPos == pos) {
+            client->aux.client.ringPos = pos + n;
+        }
+        x_pthread_mutex_unlock(&client->bufLock);
+    }
+    return(0);
+}
+
+
+static int is_client_ring_empty(obj_t *obj)
+{
+/*  Returns true if (obj) is not a client with pending console output
+ *    in the console ring it is reading (or a pending end-of-replay message).
+ */
+    obj_t *console;
+    unsigned long end;
+
+    if (!is_client_obj(obj) || !(console = obj->aux.client.ringObj)) {
+        return(1);
+    }
+    if (obj->aux.client.gotReplay) {
+        return(0);
+    }
+    end = obj->aux.client.gotRingEnd
+        ? obj->aux.client.ringEnd : obj_buf_load(&console->ringHead);
+    return(obj->aux.client.ringPos == end);
+}
+
+
+void get_console_stats(obj_t *console, console_stats_t *stats)
+{
+/*  Copies a snapshot of the I/O counters of the (console) obj (and of its
+ *    logfile, if any) into (stats), along with the number of clients
+ *    currently reading from and writing to the console and its connection
+ *    state.  The counters are read without taking the objs' buffer locks.
+ */
+    obj_t *logfile;
+    int k;
+
+    assert(is_console_obj(console));
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    copy_obj_stats(&stats->console, console);
+    if ((logfile = get_console_logfile_obj(console))) {
+        copy_obj_stats(&stats->logfile, logfile);
+        stats->gotLogfile = 1;
+    }
+    lock_obj_vecs(console);
+    for (k = 0; k < console->readerVec.num; k++) {
+        if (is_client_obj(console->readerVec.objs[k])) {
+            stats->numReaders++;
+        }
+    }
+    stats->numWriters = console->writerVec.num;
+    unlock_obj_vecs(console);
+
+    stats->state = get_console_state(console);
+    return;
+}
+
+
+const char * get_console_state_string(console_state_t state)
+{
+/*  Returns the string naming the console connection (state).
+ */
+    switch(state) {
+    case CONMAN_CONSOLE_DOWN:
+        return("down");
+    case CONMAN_CONSOLE_PENDING:
+        return("pending");
+    case CONMAN_CONSOLE_UP:
+        return("up");
+    }
+    return("unknown");
+}
+
+
+int format_obj_stats(char *buf, int buflen, obj_t *console)
+{
+/*  Formats the I/O counters of the (console) obj into the buffer (buf)
+ *    of length (buflen) as a space-separated list of "key=value" pairs.
+ *  The counters of the console's logfile (if any), the number of clients
+ *    currently reading from and writing to the console, and its connection
+ *    state are also included.  If latency sampling is enabled, the median
+ *    and 99th percentile latencies (in usecs, rounded up to a power of 2)
+ *    of each type of reader that has been sampled are appended.
+ *  Returns the number of characters written into (buf) (not including
+ *    the terminating NUL), or -1 if (buf) is not large enough.
+ */
+    console_stats_t stats;
+    latency_hist_t hists[CONMAN_LATENCY_TYPES];
+    unsigned long p50;
+    int n, m;
+    int t;
+
+    assert(buf != NULL);
+    assert(buflen > 0);
+
+    get_console_stats(console, &stats);
+
+    n = snprintf(buf, buflen, "state=%s bytes_in=%lu bytes_out=%lu"
+        " bytes_lost=%lu overruns=%lu max_buffered=%lu reader_bytes_lost=%lu"
+        " connects=%lu readers=%d writers=%d",
+        get_console_state_string(stats.state),
+        stats.console.numBytesIn, stats.console.numBytesOut,
+        stats.console.numBytesLost, stats.console.numOverruns,
+        stats.console.maxBytesBuffered, stats.console.numReaderBytesLost,
+        stats.console.numConnects, stats.numReaders, stats.numWriters);
+    if ((n < 0) || (n >= buflen)) {
+        return(-1);
+    }
+    if (stats.gotLogfile) {
+        m = snprintf(buf + n, buflen - n,
+            " log_bytes_out=%lu log_bytes_lost=%lu log_overruns=%lu"
+            " log_max_buffered=%lu",
+            stats.logfile.numBytesOut, stats.logfile.numBytesLost,
+            stats.logfile.numOverruns, stats.logfile.maxBytesBuffered);
+        if ((m < 0) || (m >= buflen - n)) {
+            return(-1);
+        }
+        n += m;
+    }
+    if (get_console_latency_hists(console, hists)) {
+        for (t = 0; t < CONMAN_LATENCY_TYPES; t++) {
+            if (!(p50 = get_latency_hist_percentile(&hists[t], 50))) {
+                continue;
+            }
+            m = snprintf(buf + n, buflen - n,
+                " %s_latency_p50_us=%lu %s_latency_p99_us=%lu",
+                get_latency_type_string(t), p50, get_latency_type_string(t),
+                get_latency_hist_percentile(&hists[t], 99));
+            if ((m < 0) || (m >= buflen - n)) {
+                return(-1);
+            }
+            n += m;
+        }
     }
     return(n);
 }
+
+
+void enable_latency_sampling(server_conf_t *conf)
+{
+/*  Enables sampling of console output latency if configured,
+ *    allocating the latency histograms of each console.
+ *  This must be called before the mux threads are started.
+ */
+    ListIterator i;
+    obj_t *obj;
+
+    assert(conf != NULL);
+
+    if (!conf->enableLatency) {
+        return;
+    }
+    i = list_iterator_create(conf->objs);
+    while ((obj = list_next(i))) {
+        if (!is_console_obj(obj)) {
+            continue;
+        }
+        obj->latHists = calloc(CONMAN_LATENCY_TYPES, sizeof(latency_hist_t));
+        if (!obj->latHists) {
+            out_of_memory();
+        }
+    }
+    list_iterator_destroy(i);
+    latency_sampling = 1;
+    return;
+}
+
+
+int get_console_latency_hists(obj_t *console, latency_hist_t *hists)
+{
+/*  Copies a snapshot of the (console) obj's output latency histograms
+ *    (indexed by latency_type_t) into the array (hists).
+ *  Returns 1 if the histograms were copied, or 0 if latency sampling
+ *    is not enabled.
+ */
+    int t;
+    int k;
+
+    assert(is_console_obj(console));
+    assert(hists != NULL);
+
+    if (!console->latHists) {
+        return(0);
+    }
+    for (t = 0; t < CONMAN_LATENCY_TYPES; t++) {
+        for (k = 0; k < LATENCY_HIST_BUCKETS; k++) {
+            hists[t].counts[k] =
+                obj_stats_get(&console->latHists[t].counts[k]);
+        }
+        hists[t].sumUsecs = obj_stats_get(&console->latHists[t].sumUsecs);
+    }
+    return(1);
+}
+
+
+const char * get_latency_type_string(latency_type_t type)
+{
+/*  Returns the string naming the console reader latency (type).
+ */
+    switch(type) {
+    case CONMAN_LATENCY_CLIENT:
+        return("client");
+    case CONMAN_LATENCY_MUX:
+        return("mux");
+    case CONMAN_LATENCY_LOGFILE:
+        return("logfile");
+    case CONMAN_LATENCY_TYPES:
+        break;
+    }
+    return("unknown");
+}
+
+
+static void copy_obj_stats(obj_stats_t *dst, obj_t *obj)
+{
+/*  Copies the I/O counters of the (obj) into (dst).
+ *  The loss-logging state is not copied.
+ */
+    dst->numBytesIn = obj_stats_get(&obj->stats.numBytesIn);
+    dst->numBytesOut = obj_stats_get(&obj->stats.numBytesOut);
+    dst->numBytesLost = obj_stats_get(&obj->stats.numBytesLost);
+    dst->numOverruns = obj_stats_get(&obj->stats.numOverruns);
+    dst->numReaderBytesLost = obj_stats_get(&obj->stats.numReaderBytesLost);
+    dst->numConnects = obj_stats_get(&obj->stats.numConnects);
+    dst->maxBytesBuffered = obj_stats_get(&obj->stats.maxBytesBuffered);
+    return;
+}
+
+
+static console_state_t get_console_state(obj_t *console)
+{
+/*  Returns the connection state of the (console) obj.
+ *  The state is owned by the console's mux thread; when called from another
+ *    thread, the result is a snapshot that may already be out of date.
+ */
+    if (is_telnet_obj(console)) {
+        if (console->aux.telnet.state == CONMAN_TELNET_UP) {
+            return(CONMAN_CONSOLE_UP);
+        }
+        if (console->aux.telnet.state == CONMAN_TELNET_PENDING) {
+            return(CONMAN_CONSOLE_PENDING);
+        }
+        return(CONMAN_CONSOLE_DOWN);
+    }
+    if (is_process_obj(console)) {
+        return((console->aux.process.state == CONMAN_PROCESS_UP)
+            ? CONMAN_CONSOLE_UP : CONMAN_CONSOLE_DOWN);
+    }
+    if (is_unixsock_obj(console)) {
+        return((console->aux.unixsock.state == CONMAN_UNIXSOCK_UP)
+            ? CONMAN_CONSOLE_UP : CONMAN_CONSOLE_DOWN);
+    }
+#if WITH_FREEIPMI
+    if (is_ipmi_obj(console)) {
+        if (console->aux.ipmi.state == CONMAN_IPMI_UP) {
+            return(CONMAN_CONSOLE_UP);
+        }
+        if (console->aux.ipmi.state == CONMAN_IPMI_PENDING) {
+            return(CONMAN_CONSOLE_PENDING);
+        }
+        return(CONMAN_CONSOLE_DOWN);
+    }
+#endif /* WITH_FREEIPMI */
+    /*
+     *  Serial and test consoles are up whenever their device is open.
+     */
+    return((console->fd >= 0) ? CONMAN_CONSOLE_UP : CONMAN_CONSOLE_DOWN);
+}
+
+
+static void count_obj_loss(obj_t *obj, unsigned long len, int isQuiet)
+{
+/*  Counts (len) bytes of data lost by the (obj), either overwritten in its
+ *    circular-buffer (or skipped in the console ring it is reading) or
+ *    dropped whole from a mux client's buffer.
+ *  Instead of logging each overrun, the losses are logged at most once
+ *    every OBJ_LOSS_LOG_SECS per obj as the total since the previous message.
+ *    Losses left unlogged when the obj is destroyed are logged then.
+ *  If (isQuiet) is true, the loss is counted but never logged
+ *    (eg, for a client that has suspended its output).
+ *  The caller must hold the obj's bufLock.
+ */
+    time_t now;
+
+    obj_stats_add(&obj->stats.numBytesLost, len);
+    obj_stats_add(&obj->stats.numOverruns, 1);
+
+    if (isQuiet) {
+        obj->stats.numBytesLostLogged += len;
+        obj->stats.numOverrunsLogged++;
+        return;
+    }
+    if (time(&now) == (time_t) -1) {
+        log_err(errno, "time() failed");
+    }
+    if (now - obj->stats.timeLossLogged < OBJ_LOSS_LOG_SECS) {
+        return;
+    }
+    obj->stats.timeLossLogged = now;
+    log_obj_loss(obj);
+    return;
+}
+
+
+static void log_obj_loss(obj_t *obj)
+{
+/*  Logs the data lost by the (obj) since its previous loss message.
+ *  The caller must hold the obj's bufLock (or the only ref to the obj).
+ */
+    unsigned long bytes;
+    unsigned long events;
+
+    bytes = obj_stats_get(&obj->stats.numBytesLost)
+        - obj->stats.numBytesLostLogged;
+    events = obj_stats_get(&obj->stats.numOverruns)
+        - obj->stats.numOverrunsLogged;
+    obj->stats.numBytesLostLogged += bytes;
+    obj->stats.numOverrunsLogged += events;
+
+    log_msg(LOG_NOTICE, "Lost %lu byte%s for \"%s\" in %lu overrun%s",
+        bytes, (bytes == 1 ? "" : "s"), obj->name,
+        events, (events == 1 ? "" : "s"));
+    return;
+}
+
+
+static void start_latency_sample(obj_t *reader, obj_t *console,
+    unsigned long head, unsigned long usecs)
+{
+/*  Starts a latency sample for the (reader) of (console) output read at
+ *    time (usecs) unless the reader already has one pending.
+ *  A client reading the console ring is marked at the ring position (head)
+ *    of the data; other readers are marked at their buffer's input ptr
+ *    since the data has not yet been written into it.
+ *  Suspended clients are not sampled.
+ */
+    x_pthread_mutex_lock(&reader->bufLock);
+
+    if (reader->latUsecs != 0) {
+        ;                               /* sample already pending */
+    }
+    else if (is_client_obj(reader) && reader->aux.client.ringObj) {
+        if ((reader->aux.client.ringObj == console)
+                && !reader->aux.client.gotSuspend) {
+            reader->latPos = head;
+            reader->latConsole = console;
+            obj_buf_store(&reader->latUsecs, usecs);
+        }
+    }
+    else if (!is_client_obj(reader) || !reader->aux.client.gotSuspend) {
+        reader->latPos = reader->buf ? reader->bufInPtr - reader->buf : 0;
+        reader->latConsole = console;
+        obj_buf_store(&reader->latUsecs, usecs);
+    }
+    x_pthread_mutex_unlock(&reader->bufLock);
+    return;
+}
+
+
+static void end_latency_sample(
+    obj_t *obj, unsigned long start, int n, int size)
+{
+/*  Ends the latency sample pending for the (obj) if the byte it marks is
+ *    among the (n) bytes just written out from position (start).
+ *  Positions are offsets into the obj's circular-buffer of (size) bytes,
+ *    or positions in the console ring being read if (size) is 0.
+ */
+    unsigned long usecs;
+    unsigned long now;
+    unsigned long dist;
+    obj_t *console;
+    latency_type_t type;
+
+    if (!(usecs = obj_buf_load(&obj->latUsecs))) {
+        return;
+    }
+    dist = obj->latPos - start;
+    if (size > 0) {
+        dist = (obj->latPos + size - start) % size;
+    }
+    if (dist >= (unsigned long) n) {
+        return;
+    }
+    console = obj->latConsole;
+    /*
+     *  Claim the sample in case a producer has concurrently cancelled it.
+     */
+    if (!obj_buf_cas(&obj->latUsecs, &usecs, 0)) {
+        return;
+    }
+    if (!console || !console->latHists) {
+        return;
+    }
+    if (is_logfile_obj(obj)) {
+        type = CONMAN_LATENCY_LOGFILE;
+    }
+    else if (is_client_obj(obj) && obj->aux.client.muxIds) {
+        type = CONMAN_LATENCY_MUX;
+    }
+    else {
+        type = CONMAN_LATENCY_CLIENT;
+    }
+    now = get_latency_usecs();
+    add_latency_hist(&console->latHists[type],
+        (now > usecs) ? now - usecs : 0);
+    return;
+}
@@ -26,18 +26,27 @@
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE                   /* for struct ucred w/ SO_PEERCRED */
+#endif /* !_GNU_SOURCE */
+
 #include <sys/types.h>                  /* include before in.h for bsd */
 #include <netinet/in.h>                 /* include before inet.h for bsd */
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <poll.h>
 #include <pthread.h>
+#include <pwd.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include "common.h"
@@ -47,6 +56,7 @@
 #include "util-file.h"
 #include "util-net.h"
 #include "util-str.h"
+#include "util.h"
 #include "wrapper.h"
 
 
@@ -66,57 +76,287 @@ int deny_severity = LOG_WARNING;        /* logging level for rejected reqs */
 #endif /* WITH_TCP_WRAPPERS */
 
 
+static void * client_worker_thread(void *arg);
+static void process_client(client_arg_t *args);
 static int resolve_addr(server_conf_t *conf, req_t *req, int sd);
-static int recv_greeting(req_t *req);
+static int resolve_unix_peer(req_t *req, int sd);
+static char * lookup_addr_name(const struct in_addr *addr,
+    char *dst, int dstlen);
+static int read_client_line(req_t *req, const struct timeval *tvDeadline,
+    char *buf, int buflen);
+static int recv_greeting(req_t *req, const struct timeval *tvDeadline);
 static void parse_greeting(Lex l, req_t *req);
-static int recv_req(req_t *req);
+static int recv_req(req_t *req, const struct timeval *tvDeadline);
 static void parse_cmd_opts(Lex l, req_t *req);
 static int query_consoles(server_conf_t *conf, req_t *req);
 static int query_consoles_via_globbing(
     server_conf_t *conf, req_t *req, List matches);
 static int query_consoles_via_regex(
     server_conf_t *conf, req_t *req, List matches);
+static int find_console_index(server_conf_t *conf, const char *str, int len);
+static int get_regex_cache_matches(
+    server_conf_t *conf, const char *pattern, List matches);
+static void put_regex_cache_matches(
+    const char *pattern, int *positions, int numPositions);
 static int validate_req(req_t *req);
 static int check_too_many_consoles(req_t *req);
 static int check_busy_consoles(req_t *req);
 static int send_rsp(req_t *req, int errnum, char *errmsg);
+static int send_rsp_stream(req_t *req);
 static int perform_query_cmd(req_t *req);
 static int perform_monitor_cmd(req_t *req, server_conf_t *conf);
 static int perform_connect_cmd(req_t *req, server_conf_t *conf);
 static void check_console_state(obj_t *console, obj_t *client);
 
 
-void process_client(client_arg_t *args)
+/*  New client connections are admitted by a fixed pool of client worker
+ *    threads instead of a thread per connection, so a reconnect storm does
+ *    not spawn hundreds of threads contending for the objs list and tpoll.
+ *  accept_client() places each new socket on a FIFO queue (linked via
+ *    client_arg_t's next) to await its greeting & request processing.
+ *  The queue is protected by client_worker_lock.
+ */
+static pthread_mutex_t client_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_worker_cond = PTHREAD_COND_INITIALIZER;
+static int num_client_workers = 0;
+static int client_worker_is_exiting = 0;
+static client_arg_t *client_queue_head = NULL;
+static client_arg_t *client_queue_tail = NULL;
+
+/*  Reverse lookups of client addresses are cached so connection setup
+ *    (eg, for the periodic queries of monitoring scripts) does not depend
+ *    on resolver latency.  The cache is a direct-mapped table indexed by
+ *    a hash of the IPv4 addr; a colliding entry simply replaces the old one.
+ *  Failed lookups are cached (with a NULL fqdn) for a shorter interval.
+ *  The cache is protected by dns_cache_lock, but the lookup itself
+ *    is performed without holding it.
+ */
+typedef struct dns_cache_entry {
+    struct in_addr   addr;              /* client IPv4 addr                  */
+    time_t           expires;           /* time entry expires, or 0 if empty */
+    char            *fqdn;              /* fqdn of addr, or NULL if unknown  */
+} dns_cache_entry_t;
+
+static pthread_mutex_t dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_cache_entry_t dns_cache[DNS_CACHE_SIZE];
+
+/*  The consoles matched by recent regex queries are cached so the repeated
+ *    queries of dashboards skip both compiling the regex and scanning every
+ *    console.  A match set is stored as a list of positions within the
+ *    console index; since the console index does not change after the config
+ *    has been processed, a cached match set remains valid for as long as the
+ *    index does.  The least-recently-used entry is replaced when full.
+ *  The cache is protected by regex_cache_lock.
+ */
+typedef struct regex_cache_entry {
+    char            *pattern;           /* combined regex, or NULL if empty  */
+    int             *positions;         /* console index positions matched   */
+    int              numPositions;      /* num positions matched             */
+    unsigned long    lastUsed;          /* cache clock at time of last use   */
+} regex_cache_entry_t;
+
+static pthread_mutex_t regex_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static regex_cache_entry_t regex_cache[REGEX_CACHE_SIZE];
+static unsigned long regex_cache_clock = 0;
+
+/*  The latency of each successful client handshake (from when the connection
+ *    was accepted until its response was sent) is recorded for the metrics.
+ */
+static latency_hist_t client_handshake_hist;
+
+
+void start_client_workers(server_conf_t *conf)
+{
+/*  Starts the client worker threads as specified by the ClientThreads
+ *    keyword.  These threads are detached since a worker may be blocked
+ *    in a client handshake (for up to CLIENT_HANDSHAKE_SECS) when the
+ *    daemon exits.
+ *  All signals are blocked in these threads so they will be delivered to
+ *    the main thread.
+ */
+    sigset_t sigset;
+    sigset_t sigset_bak;
+    pthread_t tid;
+    int k;
+    int rc;
+
+    assert(conf != NULL);
+    assert(conf->numClientThreads > 0);
+
+    client_worker_is_exiting = 0;
+    num_client_workers = conf->numClientThreads;
+
+    sigfillset(&sigset);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset, &sigset_bak)) != 0) {
+        log_err(rc, "Unable to block signals for client worker threads");
+    }
+    for (k = 0; k < num_client_workers; k++) {
+        if ((rc = pthread_create(&tid, NULL,
+          client_worker_thread, NULL)) != 0) {
+            log_err(rc, "Unable to create client worker thread #%d", k);
+        }
+        x_pthread_detach(tid);
+    }
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset_bak, NULL)) != 0) {
+        log_err(rc, "Unable to restore signal mask");
+    }
+    log_msg(LOG_INFO, "Admitting clients with %d thread%s",
+        num_client_workers, (num_client_workers == 1 ? "" : "s"));
+    return;
+}
+
+
+void stop_client_workers(void)
+{
+/*  Tells the client worker threads to exit once their current client
+ *    has been processed, and closes the sockets of queued clients that
+ *    have not yet been processed.
+ */
+    client_arg_t *args;
+
+    x_pthread_mutex_lock(&client_worker_lock);
+    client_worker_is_exiting = 1;
+    x_pthread_cond_broadcast(&client_worker_cond);
+
+    while ((args = client_queue_head)) {
+        client_queue_head = args->next;
+        (void) close(args->sd);
+        free(args);
+    }
+    client_queue_tail = NULL;
+    num_client_workers = 0;
+    x_pthread_mutex_unlock(&client_worker_lock);
+    return;
+}
+
+
+void queue_client(server_conf_t *conf, int sd)
+{
+/*  Queues the newly-accepted client socket (sd) to be processed
+ *    by the next available client worker thread.
+ */
+    client_arg_t *args;
+
+    assert(conf != NULL);
+    assert(sd >= 0);
+
+    if (!(args = malloc(sizeof(client_arg_t)))) {
+        out_of_memory();
+    }
+    args->sd = sd;
+    args->conf = conf;
+    args->next = NULL;
+    if (gettimeofday(&args->tvAccept, NULL) < 0) {
+        timerclear(&args->tvAccept);
+    }
+
+    x_pthread_mutex_lock(&client_worker_lock);
+    if (client_queue_tail) {
+        client_queue_tail->next = args;
+    }
+    else {
+        client_queue_head = args;
+    }
+    client_queue_tail = args;
+    x_pthread_cond_signal(&client_worker_cond);
+    x_pthread_mutex_unlock(&client_worker_lock);
+    return;
+}
+
+
+void get_client_handshake_hist(latency_hist_t *hist)
+{
+/*  Copies a snapshot of the client handshake latency histogram into 'hist'.
+ */
+    int k;
+
+    assert(hist != NULL);
+
+    for (k = 0; k < LATENCY_HIST_BUCKETS; k++) {
+        hist->counts[k] = obj_stats_get(&client_handshake_hist.counts[k]);
+    }
+    hist->sumUsecs = obj_stats_get(&client_handshake_hist.sumUsecs);
+    return;
+}
+
+
+static void * client_worker_thread(void *arg)
+{
+/*  Thread routine for processing queued client connections.
+ */
+    client_arg_t *args;
+
+    DPRINTF((5, "Started client worker thread.\n"));
+
+    for (;;) {
+        x_pthread_mutex_lock(&client_worker_lock);
+        while (!client_queue_head && !client_worker_is_exiting) {
+            x_pthread_cond_wait(&client_worker_cond, &client_worker_lock);
+        }
+        if (client_worker_is_exiting) {
+            x_pthread_mutex_unlock(&client_worker_lock);
+            break;
+        }
+        args = client_queue_head;
+        client_queue_head = args->next;
+        if (!client_queue_head) {
+            client_queue_tail = NULL;
+        }
+        x_pthread_mutex_unlock(&client_worker_lock);
+
+        process_client(args);
+    }
+    DPRINTF((5, "Stopped client worker thread.\n"));
+    return(NULL);
+}
+
+
+static void process_client(client_arg_t *args)
 {
-/*  The thread responsible for accepting a client connection
- *    and processing the request.
- *  The QUERY cmd is processed entirely by this thread.
+/*  Accepts a client connection and processes the request.
+ *  The QUERY and STATS cmds are processed entirely by the client worker
+ *    thread.
  *  The MONITOR and CONNECT cmds are setup and then placed
  *    in the conf->objs list to be handled by mux_io().
  */
     int sd;
     server_conf_t *conf;
     req_t *req;
+    struct timeval tvAccept;
+    struct timeval tvDeadline;
+    struct timeval tvDone;
+    long usecs;
 
-    /*  Free the tmp struct that was created by accept_client()
-     *    in order to pass multiple args to this thread.
+    /*  Free the tmp struct that was created by queue_client().
      */
     assert(args != NULL);
     sd = args->sd;
     conf = args->conf;
+    tvAccept = args->tvAccept;
     free(args);
 
     DPRINTF((5, "Processing new client.\n"));
 
-    x_pthread_detach(pthread_self());
+    /*  The client must complete its greeting and request within
+     *    CLIENT_HANDSHAKE_SECS of being accepted.  The socket's receive
+     *    timeout restarts with each read, so it alone cannot stop a client
+     *    trickling in one byte at a time from holding this worker.
+     */
+    if (timerisset(&tvAccept)) {
+        tvDeadline = tvAccept;
+    }
+    else if (gettimeofday(&tvDeadline, NULL) < 0) {
+        log_err(errno, "Unable to get time of day");
+    }
+    tvDeadline.tv_sec += CLIENT_HANDSHAKE_SECS;
 
     req = create_req();
 
     if (resolve_addr(conf, req, sd) < 0)
         goto err;
-    if (recv_greeting(req) < 0)
+    if (recv_greeting(req, &tvDeadline) < 0)
         goto err;
-    if (recv_req(req) < 0)
+    if (recv_req(req, &tvDeadline) < 0)
         goto err;
     if (query_consoles(conf, req) < 0)
         goto err;
@@ -140,6 +380,7 @@ void process_client(client_arg_t *args)
             goto err;
         break;
     case CONMAN_CMD_QUERY:
+    case CONMAN_CMD_STATS:
         if (perform_query_cmd(req) < 0)
             goto err;
         break;
@@ -148,6 +389,13 @@ void process_client(client_arg_t *args)
             req->command, req->user, req->fqdn, req->port);
         goto err;
     }
+    if (timerisset(&tvAccept) && (gettimeofday(&tvDone, NULL) == 0)) {
+        usecs = ((tvDone.tv_sec - tvAccept.tv_sec) * 1000000)
+            + (tvDone.tv_usec - tvAccept.tv_usec);
+        if (usecs >= 0) {
+            add_latency_hist(&client_handshake_hist, usecs);
+        }
+    }
     return;
 
 err:
@@ -162,7 +410,11 @@ static int resolve_addr(server_conf_t *conf, req_t *req, int sd)
  *    peer at the other end of the socket connection.
  *  Returns 0 if the remote client address is valid, or -1 on error.
  */
-    struct sockaddr_in addr;
+    union {
+        struct sockaddr     sa;
+        struct sockaddr_in  sin;
+        struct sockaddr_un  sun;
+    } addr;
     socklen_t addrlen = sizeof(addr);
     char buf[MAX_LINE];
     char *p;
@@ -171,11 +423,13 @@ static int resolve_addr(server_conf_t *conf, req_t *req, int sd)
     assert(sd >= 0);
 
     req->sd = sd;
-    if (getpeername(sd, (struct sockaddr *) &addr, &addrlen) < 0)
+    if (getpeername(sd, &addr.sa, &addrlen) < 0)
         log_err(errno, "Unable to get address of remote peer");
-    if (!inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)))
+    if (addr.sa.sa_family == AF_UNIX)
+        return(resolve_unix_peer(req, sd));
+    if (!inet_ntop(AF_INET, &addr.sin.sin_addr, buf, sizeof(buf)))
         log_err(errno, "Unable to convert network address into string");
-    req->port = ntohs(addr.sin_port);
+    req->port = ntohs(addr.sin.sin_port);
     req->ip = create_string(buf);
     /*
      *  Attempt to resolve IP address.  If it succeeds, buf contains
@@ -183,7 +437,8 @@ static int resolve_addr(server_conf_t *conf, req_t *req, int sd)
      *    Either way, copy buf to prevent having to code everything as
      *    (req->host ? req->host : req->ip).
      */
-    if ((host_addr4_to_name(&addr.sin_addr, buf, sizeof(buf)))) {
+    if (conf->enableResolve
+            && (lookup_addr_name(&addr.sin.sin_addr, buf, sizeof(buf)))) {
         gotHostName = 1;
         req->fqdn = create_string(buf);
         if ((p = strchr(buf, '.')))
@@ -217,7 +472,165 @@ static int resolve_addr(server_conf_t *conf, req_t *req, int sd)
 }
 
 
-static int recv_greeting(req_t *req)
+static int resolve_unix_peer(req_t *req, int sd)
+{
+/*  Resolves the local peer at the other end of the unix-domain socket
+ *    connection.  Where supported, the client user is taken from the
+ *    credentials of the peer process (via SO_PEERCRED) instead of the
+ *    USER string in its greeting, and the peer's pid takes the place
+ *    of its port number.
+ *  Returns 0 if the peer is valid, or -1 on error.
+ */
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    struct passwd pw;
+    struct passwd *pwp = NULL;
+    char buf[MAX_BUF_SIZE * 4];
+
+    if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+        log_msg(LOG_NOTICE,
+            "Unable to get credentials of unix-domain peer: %s",
+            strerror(errno));
+        return(-1);
+    }
+    if ((getpwuid_r(cred.uid, &pw, buf, sizeof(buf), &pwp) != 0) || !pwp) {
+        log_msg(LOG_NOTICE,
+            "Unable to lookup user name for unix-domain peer UID=%d",
+            (int) cred.uid);
+        return(-1);
+    }
+    req->user = create_string(pw.pw_name);
+    req->gotPeerCred = 1;
+    req->port = (int) cred.pid;
+#endif /* SO_PEERCRED */
+
+    req->ip = create_string("localhost");
+    req->fqdn = create_string("localhost");
+    req->host = create_string("localhost");
+    return(0);
+}
+
+
+static char * lookup_addr_name(const struct in_addr *addr,
+    char *dst, int dstlen)
+{
+/*  Looks up the host name of the IPv4 (addr) via the DNS cache, performing
+ *    a reverse lookup (and caching the result) on a miss.
+ *  Returns (dst) containing the fqdn, or NULL if the addr cannot be resolved
+ *    (in which case dst is unchanged).
+ */
+    dns_cache_entry_t *entry;
+    unsigned long h;
+    time_t now;
+    char buf[MAX_LINE];
+    char *p;
+    int gotHit = 0;
+
+    assert(addr != NULL);
+    assert(dst != NULL);
+
+    h = ntohl(addr->s_addr);
+    h = (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) % DNS_CACHE_SIZE;
+    entry = &dns_cache[h];
+
+    if (time(&now) == (time_t) -1) {
+        log_err(errno, "time() failed");
+    }
+    x_pthread_mutex_lock(&dns_cache_lock);
+    if ((entry->expires > now)
+            && (entry->addr.s_addr == addr->s_addr)) {
+        gotHit = 1;
+        p = NULL;
+        if (entry->fqdn && (strlen(entry->fqdn) < (size_t) dstlen)) {
+            p = strcpy(dst, entry->fqdn);
+        }
+    }
+    x_pthread_mutex_unlock(&dns_cache_lock);
+
+    if (gotHit) {
+        return(p);
+    }
+    p = host_addr4_to_name(addr, buf, sizeof(buf));
+
+    x_pthread_mutex_lock(&dns_cache_lock);
+    destroy_string(entry->fqdn);
+    entry->addr = *addr;
+    entry->fqdn = p ? create_string(p) : NULL;
+    entry->expires = now + (p ? DNS_CACHE_TTL_SECS : DNS_CACHE_NEG_TTL_SECS);
+    x_pthread_mutex_unlock(&dns_cache_lock);
+
+    if (!p || (strlen(p) >= (size_t) dstlen)) {
+        return(NULL);
+    }
+    return(strcpy(dst, p));
+}
+
+
+static int read_client_line(req_t *req, const struct timeval *tvDeadline,
+    char *buf, int buflen)
+{
+/*  Reads a line from the client into 'buf' of length 'buflen' as read_line()
+ *    does, but fails with ETIMEDOUT if the line has not been completely read
+ *    by the time 'tvDeadline' is reached.
+ *  The line is read one byte at a time so nothing beyond it is consumed.
+ *  Returns the number of bytes read, 0 on EOF, or -1 on error.
+ */
+    struct pollfd pfd;
+    struct timeval tvNow;
+    long msecs;
+    int n;
+    int rv;
+    char c;
+
+    assert(req->sd >= 0);
+    assert(tvDeadline != NULL);
+    assert(buf != NULL);
+    assert(buflen > 0);
+
+    pfd.fd = req->sd;
+    pfd.events = POLLIN;
+    n = 0;
+    while (n < buflen - 1) {
+        if (gettimeofday(&tvNow, NULL) < 0) {
+            return(-1);
+        }
+        msecs = ((tvDeadline->tv_sec - tvNow.tv_sec) * 1000)
+            + ((tvDeadline->tv_usec - tvNow.tv_usec) / 1000);
+        if (msecs <= 0) {
+            errno = ETIMEDOUT;
+            return(-1);
+        }
+        if ((rv = poll(&pfd, 1, (int) msecs)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        if (rv == 0) {
+            errno = ETIMEDOUT;
+            return(-1);
+        }
+        if ((rv = read(req->sd, &c, 1)) < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+            return(-1);
+        }
+        if (rv == 0) {
+            break;
+        }
+        buf[n++] = c;
+        if (c == '\n') {
+            break;
+        }
+    }
+    buf[n] = '\0';
+    return(n);
+}
+
+
+static int recv_greeting(req_t *req, const struct timeval *tvDeadline)
 {
 /*  Performs the initial handshake with the client
  *    (SOMEDAY including authentication & encryption, if needed).
@@ -231,7 +644,7 @@ static int recv_greeting(req_t *req)
 
     assert(req->sd >= 0);
 
-    if ((n = read_line(req->sd, buf, sizeof(buf))) < 0) {
+    if ((n = read_client_line(req, tvDeadline, buf, sizeof(buf))) < 0) {
         log_msg(LOG_NOTICE, "Unable to read greeting from <%s:%d>: %s",
             req->fqdn, req->port, strerror(errno));
         return(-1);
@@ -279,7 +692,11 @@ static int recv_greeting(req_t *req)
 static void parse_greeting(Lex l, req_t *req)
 {
 /*  Parses the "HELLO" command from the client:
- *    HELLO USER='<str>' TTY='<str>'
+ *    HELLO USER='<str>' TTY='<str>' [OPTION=STREAM]
+ *  The USER string is ignored if the user has been taken from the
+ *    credentials of a unix-domain peer.
+ *  If the client requests STREAM, the response to its request may be split
+ *    across multiple "OK" lines, each line but the last ending with MORE.
  */
     int done = 0;
     int tok;
@@ -289,7 +706,7 @@ static void parse_greeting(Lex l, req_t *req)
         switch(tok) {
         case CONMAN_TOK_USER:
             if ((lex_next(l) == '=') && (lex_next(l) == LEX_STR)
-              && (*lex_text(l) != '\0')) {
+              && (*lex_text(l) != '\0') && !req->gotPeerCred) {
                 if (req->user)
                     free(req->user);
                 req->user = lex_decode(create_string(lex_text(l)));
@@ -303,6 +720,10 @@ static void parse_greeting(Lex l, req_t *req)
                 req->tty = lex_decode(create_string(lex_text(l)));
             }
             break;
+        case CONMAN_TOK_OPTION:
+            if ((lex_next(l) == '=') && (lex_next(l) == CONMAN_TOK_STREAM))
+                req->enableStream = 1;
+            break;
         case LEX_EOF:
         case LEX_EOL:
             done = 1;
@@ -315,7 +736,7 @@ static void parse_greeting(Lex l, req_t *req)
 }
 
 
-static int recv_req(req_t *req)
+static int recv_req(req_t *req, const struct timeval *tvDeadline)
 {
 /*  Receives the request from the client after the greeting has completed.
  *  Returns 0 if the request is read OK, or -1 on error.
@@ -328,7 +749,7 @@ static int recv_req(req_t *req)
 
     assert(req->sd >= 0);
 
-    if ((n = read_line(req->sd, buf, sizeof(buf))) < 0) {
+    if ((n = read_client_line(req, tvDeadline, buf, sizeof(buf))) < 0) {
         log_msg(LOG_NOTICE, "Unable to read request from <%s:%d>: %s",
             req->fqdn, req->port, strerror(errno));
         return(-1);
@@ -357,6 +778,10 @@ static int recv_req(req_t *req)
             req->command = CONMAN_CMD_QUERY;
             parse_cmd_opts(l, req);
             break;
+        case CONMAN_TOK_STATS:
+            req->command = CONMAN_CMD_STATS;
+            parse_cmd_opts(l, req);
+            break;
         case LEX_EOF:
         case LEX_EOL:
             done = 1;
@@ -367,6 +792,11 @@ static int recv_req(req_t *req)
     }
     lex_destroy(l);
 
+    /*  Multiplexed sessions are only supported for R/O monitoring.
+     */
+    if (req->command != CONMAN_CMD_MONITOR)
+        req->enableMux = 0;
+
     return(0);
 }
 
@@ -397,12 +827,22 @@ static void parse_cmd_opts(Lex l, req_t *req)
                     req->enableForce = 1;
                 else if (lex_prev(l) == CONMAN_TOK_JOIN)
                     req->enableJoin = 1;
+                else if (lex_prev(l) == CONMAN_TOK_MUX)
+                    req->enableMux = 1;
                 else if (lex_prev(l) == CONMAN_TOK_QUIET)
                     req->enableQuiet = 1;
                 else if (lex_prev(l) == CONMAN_TOK_REGEX)
                     req->enableRegex = 1;
             }
             break;
+        case CONMAN_TOK_LINES:
+            if ((lex_next(l) == '=') && (lex_next(l) == LEX_INT))
+                req->replayLines = atoi(lex_text(l));
+            break;
+        case CONMAN_TOK_REPLAY:
+            if ((lex_next(l) == '=') && (lex_next(l) == LEX_INT))
+                req->replayBytes = atoi(lex_text(l));
+            break;
         case LEX_EOF:
         case LEX_EOL:
             done = 1;
@@ -426,7 +866,8 @@ static int query_consoles(server_conf_t *conf, req_t *req)
     List matches;
     int rc;
 
-    if (list_is_empty(req->consoles) && (req->command != CONMAN_CMD_QUERY))
+    if (list_is_empty(req->consoles) && (req->command != CONMAN_CMD_QUERY)
+      && (req->command != CONMAN_CMD_STATS))
         return(0);
 
     /*  The NULL destructor is used for 'matches' because the matches list
@@ -461,14 +902,18 @@ static int query_consoles_via_globbing(
     server_conf_t *conf, req_t *req, List matches)
 {
 /*  Match request patterns against console names using shell-style globbing.
- *  This is less efficient than matching via regular expressions
- *    since the console list must be traversed for each pattern, and the
- *    matches list must be traversed for each match to prevent duplicates.
+ *  A pattern without glob characters is looked up directly in the console
+ *    index; o/w, it is only matched against the range of consoles sharing
+ *    its literal prefix (which is every console if the prefix is empty).
+ *  Matches are marked by index position so each console is only added once,
+ *    regardless of how many patterns it matches.
  */
     char *p;
-    ListIterator i, j;
+    ListIterator i;
     char *pat;
-    obj_t *obj;
+    unsigned char *isMatch;
+    int n;
+    int k;
 
     /*  An empty list for the QUERY command matches all consoles.
      */
@@ -476,27 +921,63 @@ static int query_consoles_via_globbing(
         p = create_string("*");
         list_append(req->consoles, p);
     }
-
-    /*  Search objs for console names matching console patterns in the request.
+    if (!(isMatch = calloc(conf->numConsoles + 1, sizeof(unsigned char)))) {
+        out_of_memory();
+    }
+    /*  Search the console index for names matching patterns in the request.
      */
     i = list_iterator_create(req->consoles);
-    j = list_iterator_create(conf->objs);
     while ((pat = list_next(i))) {
-        list_iterator_reset(j);
-        while ((obj = list_next(j))) {
-            if (!is_console_obj(obj))
-                continue;
-            if (!fnmatch(pat, obj->name, 0)
-              && !list_find_first(matches, (ListFindF) find_obj, obj))
-                list_append(matches, obj);
+        n = strcspn(pat, "*?[\\");
+        if (pat[n] == '\0') {
+            k = find_console_index(conf, pat, n + 1);
+            if ((k < conf->numConsoles)
+              && !strcmp(conf->consoleIndex[k]->name, pat))
+                isMatch[k] = 1;
+            continue;
+        }
+        for (k = find_console_index(conf, pat, n);
+          (k < conf->numConsoles)
+          && !strncmp(conf->consoleIndex[k]->name, pat, n); k++) {
+            if (!isMatch[k] && !fnmatch(pat, conf->consoleIndex[k]->name, 0))
+                isMatch[k] = 1;
         }
     }
     list_iterator_destroy(i);
-    list_iterator_destroy(j);
+
+    for (k = 0; k < conf->numConsoles; k++) {
+        if (isMatch[k])
+            list_append(matches, conf->consoleIndex[k]);
+    }
+    free(isMatch);
     return(0);
 }
 
 
+static int find_console_index(server_conf_t *conf, const char *str, int len)
+{
+/*  Searches the console index for the first console whose name is not less
+ *    than the first (len) chars of (str).  If (len) includes the string's
+ *    NUL-termination, this is the position of the console named (str)
+ *    if it exists; o/w, it is the start of the range of consoles
+ *    whose names are prefixed by those chars.
+ *  Returns the index position, or numConsoles if no such console exists.
+ */
+    int lo = 0;
+    int hi = conf->numConsoles;
+    int mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (strncmp(conf->consoleIndex[mid]->name, str, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return(lo);
+}
+
+
 static int query_consoles_via_regex(
     server_conf_t *conf, req_t *req, List matches)
 {
@@ -509,6 +990,9 @@ static int query_consoles_via_regex(
     regex_t rex;
     regmatch_t match;
     obj_t *obj;
+    int *positions;
+    int n;
+    int k;
 
     /*  An empty list for the QUERY command matches all consoles.
      */
@@ -527,6 +1011,9 @@ static int query_consoles_via_regex(
     }
     list_iterator_destroy(i);
 
+    if (get_regex_cache_matches(conf, buf, matches)) {
+        return(0);
+    }
     /*  Initialize 'rex' to silence "uninitialized use" warnings.
      */
     memset(&rex, 0, sizeof(rex));
@@ -542,23 +1029,99 @@ static int query_consoles_via_regex(
         return(-1);
     }
 
-    /*  Search objs for console names matching console patterns in the request.
+    /*  Search the console index for names matching the combined regex.
      */
-    i = list_iterator_create(conf->objs);
-    while ((obj = list_next(i))) {
-        if (!is_console_obj(obj))
-            continue;
+    if (!(positions = malloc((conf->numConsoles + 1) * sizeof(int)))) {
+        out_of_memory();
+    }
+    n = 0;
+    for (k = 0; k < conf->numConsoles; k++) {
+        obj = conf->consoleIndex[k];
         if (!regexec(&rex, obj->name, 1, &match, 0)
           && (match.rm_so == 0)
-          && (match.rm_eo == (int) strlen(obj->name)))
+          && (match.rm_eo == (int) strlen(obj->name))) {
             list_append(matches, obj);
+            positions[n++] = k;
+        }
     }
-    list_iterator_destroy(i);
     regfree(&rex);
+    put_regex_cache_matches(buf, positions, n);
     return(0);
 }
 
 
+static int get_regex_cache_matches(
+    server_conf_t *conf, const char *pattern, List matches)
+{
+/*  Appends the consoles matching the combined regex (pattern) to the
+ *    (matches) list if the pattern is in the regex cache.
+ *  Returns true on a cache hit; o/w, returns false.
+ */
+    regex_cache_entry_t *entry;
+    int gotHit = 0;
+    int j;
+    int k;
+
+    x_pthread_mutex_lock(&regex_cache_lock);
+    for (j = 0; j < REGEX_CACHE_SIZE; j++) {
+        entry = &regex_cache[j];
+        if (entry->pattern && !strcmp(entry->pattern, pattern)) {
+            entry->lastUsed = ++regex_cache_clock;
+            for (k = 0; k < entry->numPositions; k++) {
+                assert(entry->positions[k] < conf->numConsoles);
+                list_append(matches, conf->consoleIndex[entry->positions[k]]);
+            }
+            gotHit = 1;
+            break;
+        }
+    }
+    x_pthread_mutex_unlock(&regex_cache_lock);
+    return(gotHit);
+}
+
+
+static void put_regex_cache_matches(
+    const char *pattern, int *positions, int numPositions)
+{
+/*  Adds the console index (positions) matching the combined regex (pattern)
+ *    to the regex cache, replacing the least-recently-used entry if needed.
+ *  The cache takes ownership of the (positions) array.
+ */
+    regex_cache_entry_t *entry;
+    regex_cache_entry_t *victim = &regex_cache[0];
+    int j;
+
+    x_pthread_mutex_lock(&regex_cache_lock);
+    for (j = 0; j < REGEX_CACHE_SIZE; j++) {
+        entry = &regex_cache[j];
+        if (entry->pattern && !strcmp(entry->pattern, pattern)) {
+            /*
+             *  Another thread cached this pattern in the meantime.
+             */
+            x_pthread_mutex_unlock(&regex_cache_lock);
+            free(positions);
+            return;
+        }
+        if (!entry->pattern) {
+            victim = entry;
+        }
+        else if (victim->pattern && (entry->lastUsed < victim->lastUsed)) {
+            victim = entry;
+        }
+    }
+    destroy_string(victim->pattern);
+    if (victim->positions) {
+        free(victim->positions);
+    }
+    victim->pattern = create_string(pattern);
+    victim->positions = positions;
+    victim->numPositions = numPositions;
+    victim->lastUsed = ++regex_cache_clock;
+    x_pthread_mutex_unlock(&regex_cache_lock);
+    return;
+}
+
+
 static int validate_req(req_t *req)
 {
 /*  Validates the given request.
@@ -581,8 +1144,9 @@ static int check_too_many_consoles(req_t *req)
 {
 /*  Checks to see if the request matches too many consoles
  *    for the given command.
- *  A MONITOR command can only affect a single console, as can a
- *    CONNECT command unless the broadcast option is enabled.
+ *  A MONITOR command can only affect a single console unless the mux
+ *    option is enabled, and a CONNECT command can only affect a single
+ *    console unless the broadcast option is enabled.
  *  Returns 0 if the request is valid, or -1 on error.
  */
     ListIterator i;
@@ -591,12 +1155,16 @@ static int check_too_many_consoles(req_t *req)
 
     assert(!list_is_empty(req->consoles));
 
-    if (req->command == CONMAN_CMD_QUERY)
+    if ((req->command == CONMAN_CMD_QUERY)
+      || (req->command == CONMAN_CMD_STATS))
         return(0);
     if (list_count(req->consoles) == 1)
         return(0);
     if ((req->command == CONMAN_CMD_CONNECT) && (req->enableBroadcast))
         return(0);
+    if ((req->command == CONMAN_CMD_MONITOR) && (req->enableMux)
+            && (list_count(req->consoles) < MUX_SESSION_ID))
+        return(0);
 
     snprintf(buf, sizeof(buf), "Found %d matching consoles",
         list_count(req->consoles));
@@ -638,6 +1206,7 @@ static int check_busy_consoles(req_t *req)
     assert(!list_is_empty(req->consoles));
 
     if ((req->command == CONMAN_CMD_QUERY)
+      || (req->command == CONMAN_CMD_STATS)
       || (req->command == CONMAN_CMD_MONITOR))
         return(0);
     if (req->enableForce || req->enableJoin)
@@ -723,6 +1292,10 @@ static int send_rsp(req_t *req, int errnum, char *errmsg)
     assert(req->sd >= 0);
     assert(errnum >= 0);
 
+    if ((errnum == CONMAN_ERR_NONE) && req->enableStream
+            && (list_count(req->consoles) > 0)) {
+        return(send_rsp_stream(req));
+    }
     if (errnum == CONMAN_ERR_NONE) {
 
         n = append_format_string(buf, sizeof(buf), "%s",
@@ -730,6 +1303,17 @@ static int send_rsp(req_t *req, int errnum, char *errmsg)
         if (n == -1) {
             goto overrun;
         }
+        /*  Acknowledge the client's request for streamed responses
+         *    in the response to its greeting.
+         */
+        if (req->enableStream && (list_count(req->consoles) == 0)) {
+            n = append_format_string(buf, sizeof(buf), " %s=%s",
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_STREAM));
+            if (n == -1) {
+                goto overrun;
+            }
+        }
         /*  If consoles have been defined by this point, the "response"
          *    is to the request as opposed to the greeting.
          */
@@ -743,6 +1327,14 @@ static int send_rsp(req_t *req, int errnum, char *errmsg)
                     goto overrun;
                 }
             }
+            if (req->enableMux) {
+                n = append_format_string(buf, sizeof(buf), " %s=%s",
+                    LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+                    LEX_TOK2STR(proto_strs, CONMAN_TOK_MUX));
+                if (n == -1) {
+                    goto overrun;
+                }
+            }
             i = list_iterator_create(req->consoles);
             while ((console = list_next(i))) {
                 n = strlcpy(tmp, console->name, sizeof(tmp));
@@ -755,6 +1347,17 @@ static int send_rsp(req_t *req, int errnum, char *errmsg)
                 if (n == -1) {
                     goto overrun;
                 }
+                if (req->command == CONMAN_CMD_STATS) {
+                    if (format_obj_stats(tmp, sizeof(tmp), console) < 0) {
+                        goto overrun;
+                    }
+                    n = append_format_string(buf, sizeof(buf), " %s='%s'",
+                        LEX_TOK2STR(proto_strs, CONMAN_TOK_STATS),
+                        lex_encode(tmp));
+                    if (n == -1) {
+                        goto overrun;
+                    }
+                }
             }
             list_iterator_destroy(i);
         }
@@ -799,20 +1402,127 @@ overrun:
 }
 
 
+static int send_rsp_stream(req_t *req)
+{
+/*  Sends the successful response to the request (req) as a stream of
+ *    "OK" lines so the size of the console list is not bounded by the
+ *    size of a protocol line.  Each line holds roughly STREAM_RSP_CHUNK_SIZE
+ *    bytes of CONSOLE tokens (each followed by a STATS token for the STATS
+ *    cmd); all but the last line end with MORE.
+ *  Each line is written via writev() as it is filled.
+ *  Returns 0 if the response is sent OK, or -1 on error.
+ */
+    char buf[STREAM_RSP_CHUNK_SIZE + (3 * MAX_LINE)];
+    char tmp[MAX_LINE];                 /* tmp buffer for lex-encoding strs */
+    struct iovec iov[2];
+    const char *console_str;
+    const char *more_str;
+    ListIterator i;
+    obj_t *console;
+    int gotNext;
+    int m;
+    int n;
+
+    assert(req->sd >= 0);
+    assert(req->enableStream);
+
+    console_str = LEX_TOK2STR(proto_strs, CONMAN_TOK_CONSOLE);
+    more_str = LEX_TOK2STR(proto_strs, CONMAN_TOK_MORE);
+
+    n = snprintf(buf, sizeof(buf), "%s",
+        LEX_TOK2STR(proto_strs, CONMAN_TOK_OK));
+    if (req->enableReset) {
+        n += snprintf(buf + n, sizeof(buf) - n, " %s=%s",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_RESET));
+    }
+    if (req->enableMux) {
+        n += snprintf(buf + n, sizeof(buf) - n, " %s=%s",
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_OPTION),
+            LEX_TOK2STR(proto_strs, CONMAN_TOK_MUX));
+    }
+    i = list_iterator_create(req->consoles);
+    console = list_next(i);
+    while (console) {
+        if (strlcpy(tmp, console->name, sizeof(tmp)) >= sizeof(tmp)) {
+            list_iterator_destroy(i);
+            goto overrun;
+        }
+        m = snprintf(buf + n, sizeof(buf) - n, " %s='%s'",
+            console_str, lex_encode(tmp));
+        if ((m < 0) || ((size_t) m >= sizeof(buf) - n)) {
+            list_iterator_destroy(i);
+            goto overrun;
+        }
+        n += m;
+        if (req->command == CONMAN_CMD_STATS) {
+            if (format_obj_stats(tmp, sizeof(tmp), console) < 0) {
+                list_iterator_destroy(i);
+                goto overrun;
+            }
+            m = snprintf(buf + n, sizeof(buf) - n, " %s='%s'",
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_STATS), lex_encode(tmp));
+            if ((m < 0) || ((size_t) m >= sizeof(buf) - n)) {
+                list_iterator_destroy(i);
+                goto overrun;
+            }
+            n += m;
+        }
+        console = list_next(i);
+        gotNext = (console != NULL);
+
+        if (!gotNext || (n >= STREAM_RSP_CHUNK_SIZE)) {
+            if (gotNext) {
+                m = snprintf(tmp, sizeof(tmp), " %s\n", more_str);
+            }
+            else {
+                m = snprintf(tmp, sizeof(tmp), "\n");
+            }
+            iov[0].iov_base = buf;
+            iov[0].iov_len = n;
+            iov[1].iov_base = tmp;
+            iov[1].iov_len = m;
+            if (writev_n(req->sd, iov, 2) < 0) {
+                log_msg(LOG_NOTICE, "Unable to write to <%s:%d>: %s",
+                    req->fqdn, req->port, strerror(errno));
+                list_iterator_destroy(i);
+                return(-1);
+            }
+            n = snprintf(buf, sizeof(buf), "%s",
+                LEX_TOK2STR(proto_strs, CONMAN_TOK_OK));
+        }
+    }
+    list_iterator_destroy(i);
+    DPRINTF((5, "Sent streamed response for %d consoles.\n",
+        list_count(req->consoles)));
+    return(0);
+
+overrun:
+    log_msg(LOG_WARNING,
+        "Client <%s@%s:%d> request terminated due to buffer overrun",
+        req->user, req->fqdn, req->port);
+    return(-1);
+}
+
+
 static int perform_query_cmd(req_t *req)
 {
 /*  Performs the QUERY command, returning a list of consoles that
  *    matches the console patterns given in the client's request.
+ *  The STATS command is performed likewise, but each console in the
+ *    list is followed by its I/O counters.
  *  Returns 0 if the command succeeds, or -1 on error.
  *  Since this cmd is processed entirely by this thread,
  *    the client socket connection is closed once it is finished.
  */
     assert(req->sd >= 0);
-    assert(req->command == CONMAN_CMD_QUERY);
+    assert((req->command == CONMAN_CMD_QUERY)
+        || (req->command == CONMAN_CMD_STATS));
     assert(!list_is_empty(req->consoles));
 
-    log_msg(LOG_INFO, "Client <%s@%s:%d> issued query",
-        req->user, req->fqdn, req->port);
+    log_msg(LOG_INFO, "Client <%s@%s:%d> issued %s",
+        req->user, req->fqdn, req->port,
+        (req->command == CONMAN_CMD_STATS ? "stats query" : "query"));
 
     if (send_rsp(req, CONMAN_ERR_NONE, NULL) < 0) {
         return(-1);
@@ -826,23 +1536,46 @@ static int perform_monitor_cmd(req_t *req, server_conf_t *conf)
 {
 /*  Performs the MONITOR command, placing the client in a
  *    "read-only" session with a single console.
+ *  If the mux option is enabled, the client is instead placed in a
+ *    "read-only" session with all of the requested consoles whose
+ *    output is framed and tagged per console over the one connection.
  *  Returns 0 if the command succeeds, or -1 on error.
  */
     obj_t *client;
     obj_t *console;
+    ListIterator i;
 
     assert(req->sd >= 0);
     assert(req->command == CONMAN_CMD_MONITOR);
-    assert(list_count(req->consoles) == 1);
+    assert((list_count(req->consoles) == 1) || req->enableMux);
 
     if (send_rsp(req, CONMAN_ERR_NONE, NULL) < 0) {
         return(-1);
     }
     client = create_client_obj(conf, req);
+
+    if (req->enableMux) {
+        create_client_mux_ids(client);
+        i = list_iterator_create(req->consoles);
+        while ((console = list_next(i))) {
+            assert(is_console_obj(console));
+            link_objs(console, client);
+            check_console_state(console, client);
+        }
+        list_iterator_destroy(i);
+
+        log_msg(LOG_INFO,
+            "Client <%s@%s:%d> connected to %d consoles (multiplexed)",
+            req->user, req->fqdn, req->port, list_count(req->consoles));
+        return(0);
+    }
     console = list_peek(req->consoles);
     assert(is_console_obj(console));
     link_objs(console, client);
     check_console_state(console, client);
+    if ((req->replayBytes > 0) || (req->replayLines > 0)) {
+        perform_log_replay(client, req->replayBytes, req->replayLines);
+    }
 
     log_msg(LOG_INFO, "Client <%s@%s:%d> connected to [%s] (read-only)",
         req->user, req->fqdn, req->port, console->name);
@@ -880,6 +1613,9 @@ static int perform_connect_cmd(req_t *req, server_conf_t *conf)
         link_objs(client, console);
         link_objs(console, client);
         check_console_state(console, client);
+        if ((req->replayBytes > 0) || (req->replayLines > 0)) {
+            perform_log_replay(client, req->replayBytes, req->replayLines);
+        }
 
         log_msg(LOG_INFO, "Client <%s@%s:%d> connected to [%s]",
             req->user, req->fqdn, req->port, console->name);
@@ -921,7 +1657,7 @@ static void check_console_state(obj_t *console, obj_t *client)
             CONMAN_MSG_PREFIX, console->name, console->aux.process.prog,
             CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
-        write_obj_data(client, buf, strlen(buf), 1);
+        write_client_data(client, console, buf, strlen(buf), 1);
         open_process_obj(console);
     }
     else if (is_serial_obj(console) && (console->fd < 0)) {
@@ -930,7 +1666,7 @@ static void check_console_state(obj_t *console, obj_t *client)
             CONMAN_MSG_PREFIX, console->name, console->aux.serial.dev,
             CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
-        write_obj_data(client, buf, strlen(buf), 1);
+        write_client_data(client, console, buf, strlen(buf), 1);
         open_serial_obj(console);
     }
     else if (is_telnet_obj(console)
@@ -940,7 +1676,7 @@ static void check_console_state(obj_t *console, obj_t *client)
             CONMAN_MSG_PREFIX, console->name, console->aux.telnet.host,
             console->aux.telnet.port, CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
-        write_obj_data(client, buf, strlen(buf), 1);
+        write_client_data(client, console, buf, strlen(buf), 1);
         console->aux.telnet.delay = TELNET_MIN_TIMEOUT;
         /*
          *  Do not call connect_telnet_obj() while in the PENDING state since
@@ -958,7 +1694,7 @@ static void check_console_state(obj_t *console, obj_t *client)
             CONMAN_MSG_PREFIX, console->name, console->aux.unixsock.dev,
             CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
-        write_obj_data(client, buf, strlen(buf), 1);
+        write_client_data(client, console, buf, strlen(buf), 1);
         open_unixsock_obj(console);
     }
 #if WITH_FREEIPMI
@@ -969,7 +1705,7 @@ static void check_console_state(obj_t *console, obj_t *client)
             CONMAN_MSG_PREFIX, console->name, console->aux.ipmi.host,
             CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
-        write_obj_data(client, buf, strlen(buf), 1);
+        write_client_data(client, console, buf, strlen(buf), 1);
         if (console->aux.ipmi.state == CONMAN_IPMI_DOWN) {
             open_ipmi_obj(console);
         }
@@ -51,8 +51,6 @@ static int connect_unixsock_obj(obj_t *unixsock);
 static int disconnect_unixsock_obj(obj_t *unixsock);
 static void reset_unixsock_delay(obj_t *unixsock);
 
-extern tpoll_t tp_global;               /* defined in server.c */
-
 
 int is_unixsock_dev(const char *dev, const char *cwd, char **path_ref)
 {
@@ -234,7 +232,7 @@ static int connect_unixsock_obj(obj_t *unixsock)
     auxp->isViaInotify = 0;
 
     if (auxp->timer >= 0) {
-        (void) tpoll_timeout_cancel(tp_global, auxp->timer);
+        (void) tpoll_timeout_cancel(unixsock->tp, auxp->timer);
         auxp->timer = -1;
     }
 
@@ -298,16 +296,17 @@ static int connect_unixsock_obj(obj_t *unixsock)
      */
     unixsock->gotEOF = 0;
     auxp->state = CONMAN_UNIXSOCK_UP;
-    tpoll_set(tp_global, unixsock->fd, POLLIN);
+    tpoll_set(unixsock->tp, unixsock->fd, POLLIN);
 
     /*  Require the connection to be up for a minimum length of time before
      *    resetting the reconnect-delay back to the minimum.
      */
-    auxp->timer = tpoll_timeout_relative(tp_global,
+    auxp->timer = tpoll_timeout_relative(unixsock->tp,
         (callback_f) reset_unixsock_delay, unixsock, MIN_CONNECT_SECS * 1000);
 
     /*  Notify linked objs when transitioning into an UP state.
      */
+    obj_stats_add(&unixsock->stats.numConnects, 1);
     write_notify_msg(unixsock, LOG_INFO, "Console [%s] connected to \"%s\"",
         unixsock->name, auxp->dev);
     DPRINTF((9, "Opened [%s] unixsock: fd=%d dev=%s.\n",
@@ -331,11 +330,11 @@ static int disconnect_unixsock_obj(obj_t *unixsock)
     auxp = &(unixsock->aux.unixsock);
 
     if (auxp->timer >= 0) {
-        (void) tpoll_timeout_cancel(tp_global, auxp->timer);
+        (void) tpoll_timeout_cancel(unixsock->tp, auxp->timer);
         auxp->timer = -1;
     }
     if (unixsock->fd >= 0) {
-        tpoll_clear(tp_global, unixsock->fd, POLLIN | POLLOUT);
+        tpoll_clear(unixsock->tp, unixsock->fd, POLLIN | POLLOUT);
         if (close(unixsock->fd) < 0) {
             log_msg(LOG_WARNING, "Console [%s] cannot close device \"%s\": %s",
                 unixsock->name, auxp->dev, strerror(errno));
@@ -352,7 +351,7 @@ static int disconnect_unixsock_obj(obj_t *unixsock)
     }
     /*  Set timer for establishing new connection.
      */
-    auxp->timer = tpoll_timeout_relative(tp_global,
+    auxp->timer = tpoll_timeout_relative(unixsock->tp,
         (callback_f) connect_unixsock_obj, unixsock, auxp->delay * 1000);
 
     if (auxp->delay < UNIXSOCK_MAX_TIMEOUT) {
@@ -40,6 +40,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "common.h"
@@ -51,7 +52,40 @@
 #include "util-file.h"
 #include "util-str.h"
 #include "util.h"
-
+#include "wrapper.h"
+
+
+/*  A mux shard is a thread multiplexing I/O & timers for a subset of objs
+ *    via its own tpoll obj.  Shard 0 is the main thread; it also handles the
+ *    listening socket, inotify events, and signals.  Requests are passed to
+ *    the other shards by writing a request char into their wake pipes.
+ *  Only the shard muxing an obj may use the obj's fd, since the shard can
+ *    close or reassign it at any time (eg, when a console is reopened).
+ *    Other threads with data for the obj to write instead place the obj on
+ *    the shard's wake queue via schedule_obj_write(); the shard then sets
+ *    POLLOUT on the obj's fd itself before it next waits for I/O.
+ */
+#define MUX_SHARD_REQ_EXIT      'X'
+#define MUX_SHARD_REQ_RECONFIG  'R'
+#define MUX_SHARD_REQ_TIMESTAMP 'T'
+#define MUX_SHARD_REQ_WAKE      'W'
+
+typedef struct mux_shard {
+    server_conf_t   *conf;              /* server's configuration            */
+    tpoll_t          tp;                /* tpoll obj for muxing shard's objs */
+    int              fd_pipe[2];        /* pipe for waking shard w/ requests */
+    pthread_t        tid;               /* thread id of shard                */
+    int              id;                /* shard index                       */
+    int              isExiting;         /* true if shard has been told to go */
+    latency_hist_t   lagHist;           /* dispatch lag if sampling latency  */
+    pthread_mutex_t  wakeLock;          /* lock protecting the wake queue    */
+    obj_t           *wakeHead;          /* objs awaiting POLLOUT via shard   */
+} mux_shard_t;
+
+typedef struct obj_fd_key {
+    tpoll_t          tp;                /* tpoll obj muxing the fd           */
+    int              fd;                /* file descriptor                   */
+} obj_fd_key_t;
 
 static void begin_daemonize(int *fd_ptr, pid_t *pgid_ptr);
 static void end_daemonize(int fd);
@@ -66,12 +100,29 @@ static void display_configuration(server_conf_t *conf);
 static void schedule_timestamp(server_conf_t *conf);
 static void timestamp_logfiles(server_conf_t *conf);
 static void create_listen_socket(server_conf_t *conf);
+static void create_unix_listen_socket(server_conf_t *conf);
+static void create_metrics_socket(server_conf_t *conf);
+static int open_unix_listen_socket(const char *path);
 static void setup_nofile_limit(server_conf_t *conf);
 static void open_objs(server_conf_t *conf);
-static void mux_io(server_conf_t *conf);
+static void create_mux_shards(server_conf_t *conf);
+static void start_mux_shards(server_conf_t *conf);
+static void stop_mux_shards(void);
+static void destroy_mux_shards(void);
+static void * mux_shard_thread(void *arg);
+static void signal_mux_shards(char req);
+static void process_mux_shard_reqs(server_conf_t *conf, mux_shard_t *shard);
+static mux_shard_t * find_mux_shard(tpoll_t tp);
+static void process_mux_shard_wakes(mux_shard_t *shard);
+static void mux_io(server_conf_t *conf, mux_shard_t *shard);
+static obj_t * lookup_ready_obj(server_conf_t *conf, tpoll_t tp, int fd);
+static int find_obj_fd(obj_t *obj, obj_fd_key_t *key);
+static void remove_obj(server_conf_t *conf, obj_t *obj);
 static void open_daemon_logfile(server_conf_t *conf);
-static void reopen_logfiles(server_conf_t *conf);
-static void accept_client(server_conf_t *conf);
+static void reopen_logfiles(server_conf_t *conf, tpoll_t tp);
+static int stamp_logfiles(server_conf_t *conf, tpoll_t tp);
+static int count_logfiles(server_conf_t *conf);
+static void accept_client(server_conf_t *conf, int ld);
 
 /*  Signal handler flags and whatnot.
  */
@@ -79,6 +130,8 @@ static volatile sig_atomic_t done = 0;
 static volatile sig_atomic_t reconfig = 0;
 static int coredump = 0;
 static char coredumpdir[PATH_MAX];
+static mux_shard_t *mux_shards = NULL;
+static int num_mux_shards = 0;
 
 /*  The 'tp_global' var is to allow timers to be set or canceled
  *    without having to pass the conf's tp var through the call stack.
@@ -148,14 +201,25 @@ int main(int argc, char *argv[])
 #endif /* WITH_FREEIPMI */
 
     setup_nofile_limit(conf);
+    create_mux_shards(conf);
+    start_log_writers(conf);
+    enable_latency_sampling(conf);
     open_objs(conf);
-    mux_io(conf);
+    start_mux_shards(conf);
+    start_client_workers(conf);
+    start_metrics_server(conf);
+    mux_io(conf, &mux_shards[0]);
+    stop_metrics_server();
+    stop_client_workers();
+    stop_mux_shards();
+    stop_log_writers();
 
 #if WITH_FREEIPMI
     ipmi_fini();
 #endif /* WITH_FREEIPMI */
 
     destroy_server_conf(conf);
+    destroy_mux_shards();
 
     if (pgid > 0) {
         if (kill(-pgid, SIGTERM) < 0) {
@@ -513,10 +577,26 @@ static void display_configuration(server_conf_t *conf)
         fprintf(stderr, " KeepAlive");
         gotOptions++;
     }
+    if (conf->enableLatency) {
+        fprintf(stderr, " Latency");
+        gotOptions++;
+    }
     if (conf->logFileName) {
         fprintf(stderr, " LogFile");
         gotOptions++;
     }
+    if (conf->logSyncSecs > 0) {
+        fprintf(stderr, " LogSync=%ds", conf->logSyncSecs);
+        gotOptions++;
+    }
+    if (conf->numClientThreads != DEFAULT_CLIENT_THREADS) {
+        fprintf(stderr, " ClientThreads=%d", conf->numClientThreads);
+        gotOptions++;
+    }
+    if (conf->numLogThreads > 0) {
+        fprintf(stderr, " LogThreads=%d", conf->numLogThreads);
+        gotOptions++;
+    }
     if (conf->enableLoopBack) {
         fprintf(stderr, " LoopBack");
         gotOptions++;
@@ -525,6 +605,10 @@ static void display_configuration(server_conf_t *conf)
         fprintf(stderr, " ResetCmd");
         gotOptions++;
     }
+    if (conf->enableResolve) {
+        fprintf(stderr, " Resolve");
+        gotOptions++;
+    }
     if (conf->syslogFacility >= 0) {
         fprintf(stderr, " SysLog");
         gotOptions++;
@@ -533,10 +617,26 @@ static void display_configuration(server_conf_t *conf)
         fprintf(stderr, " TCP-Wrappers");
         gotOptions++;
     }
+    if (conf->numThreads > 1) {
+        fprintf(stderr, " Threads=%d", conf->numThreads);
+        gotOptions++;
+    }
     if (conf->tStampMinutes > 0) {
         fprintf(stderr, " TimeStamp=%dm", conf->tStampMinutes);
         gotOptions++;
     }
+    if (conf->metricsPort > 0) {
+        fprintf(stderr, " Metrics=%d", conf->metricsPort);
+        gotOptions++;
+    }
+    else if (conf->metricsSockName) {
+        fprintf(stderr, " Metrics");
+        gotOptions++;
+    }
+    if (conf->unixSockName) {
+        fprintf(stderr, " UnixSocket");
+        gotOptions++;
+    }
     if (conf->enableZeroLogs) {
         fprintf(stderr, " ZeroLogs");
         gotOptions++;
@@ -546,6 +646,16 @@ static void display_configuration(server_conf_t *conf)
     }
     fprintf(stderr, "\n");
     fprintf(stderr, "Listening on port %d\n", conf->port);
+    if (conf->unixSockName) {
+        fprintf(stderr, "Listening on \"%s\"\n", conf->unixSockName);
+    }
+    if (conf->metricsPort > 0) {
+        fprintf(stderr, "Serving metrics on port %d (loopback)\n",
+            conf->metricsPort);
+    }
+    else if (conf->metricsSockName) {
+        fprintf(stderr, "Serving metrics on \"%s\"\n", conf->metricsSockName);
+    }
     fprintf(stderr, "Monitoring %d console%s\n", n, ((n == 1) ? "" : "s"));
     fprintf(stderr, "\n");
     return;
@@ -600,6 +710,30 @@ static void schedule_timestamp(server_conf_t *conf)
 static void timestamp_logfiles(server_conf_t *conf)
 {
 /*  Writes a timestamp message into all of the console logfiles.
+ *  Each mux shard timestamps the logfiles it owns.
+ */
+    int gotLogs;
+
+    signal_mux_shards(MUX_SHARD_REQ_TIMESTAMP);
+    gotLogs = stamp_logfiles(conf, conf->tp);
+
+    /*  If any logfile objs exist, schedule a timer for the next timestamp.
+     *  With multiple mux shards, the logfiles may all be owned by the others.
+     */
+    if (!gotLogs && (num_mux_shards > 1)) {
+        gotLogs = count_logfiles(conf);
+    }
+    if (gotLogs) {
+        schedule_timestamp(conf);
+    }
+    return;
+}
+
+
+static int stamp_logfiles(server_conf_t *conf, tpoll_t tp)
+{
+/*  Writes a timestamp message into the console logfiles muxed by [tp].
+ *  Returns the number of logfiles timestamped.
  */
     char *now;
     ListIterator i;
@@ -608,9 +742,10 @@ static void timestamp_logfiles(server_conf_t *conf)
     int gotLogs = 0;
 
     now = create_long_time_string(0);
+    lock_obj_refs();
     i = list_iterator_create(conf->objs);
     while ((logfile = list_next(i))) {
-        if (!is_logfile_obj(logfile)) {
+        if (!is_logfile_obj(logfile) || (logfile->tp != tp)) {
             continue;
         }
         snprintf(buf, sizeof(buf), "%sConsole [%s] log at %s%s",
@@ -618,17 +753,31 @@ static void timestamp_logfiles(server_conf_t *conf)
             now, CONMAN_MSG_SUFFIX);
         strcpy(&buf[sizeof(buf) - 3], "\r\n");
         write_obj_data(logfile, buf, strlen(buf), 1);
-        gotLogs = 1;
+        gotLogs++;
     }
     list_iterator_destroy(i);
+    unlock_obj_refs();
     free(now);
+    return(gotLogs);
+}
 
-    /*  If any logfile objs exist, schedule a timer for the next timestamp.
-     */
-    if (gotLogs) {
-        schedule_timestamp(conf);
+
+static int count_logfiles(server_conf_t *conf)
+{
+/*  Returns the number of logfiles muxed by all of the mux shards.
+ */
+    ListIterator i;
+    obj_t *obj;
+    int n = 0;
+
+    i = list_iterator_create(conf->objs);
+    while ((obj = list_next(i))) {
+        if (is_logfile_obj(obj)) {
+            n++;
+        }
     }
-    return;
+    list_iterator_destroy(i);
+    return(n);
 }
 
 
@@ -664,15 +813,136 @@ static void create_listen_socket(server_conf_t *conf)
     if (bind(ld, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
         log_err(errno, "Unable to bind to port %d", conf->port);
     }
-    if (listen(ld, 10) < 0) {
+    if (listen(ld, SOMAXCONN) < 0) {
         log_err(errno, "Unable to listen on port %d", conf->port);
     }
     conf->ld = ld;
     tpoll_set(conf->tp, conf->ld, POLLIN);
+
+    if (conf->unixSockName) {
+        create_unix_listen_socket(conf);
+    }
+    if ((conf->metricsPort > 0) || conf->metricsSockName) {
+        create_metrics_socket(conf);
+    }
     return;
 }
 
 
+static void create_unix_listen_socket(server_conf_t *conf)
+{
+/*  Creates the unix-domain socket on which to listen for local client
+ *    connections.
+ */
+    assert(conf->unixSockName != NULL);
+
+    conf->uld = open_unix_listen_socket(conf->unixSockName);
+    tpoll_set(conf->tp, conf->uld, POLLIN);
+    return;
+}
+
+
+static void create_metrics_socket(server_conf_t *conf)
+{
+/*  Creates the socket on which to listen for metrics requests: either a
+ *    unix-domain socket or a TCP socket bound to the loopback address.
+ *  This socket is not muxed by tpoll since the requests are served by
+ *    the metrics thread.
+ */
+    int ld;
+    struct sockaddr_in addr;
+    const int on = 1;
+
+    if (conf->metricsSockName) {
+        conf->mld = open_unix_listen_socket(conf->metricsSockName);
+        return;
+    }
+    assert(conf->metricsPort > 0);
+
+    if ((ld = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        log_err(errno, "Unable to create metrics listening socket");
+    }
+    DPRINTF((9, "Opened metrics listen socket: fd=%d.\n", ld));
+    set_fd_nonblocking(ld);
+    set_fd_closed_on_exec(ld);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(conf->metricsPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (setsockopt(ld, SOL_SOCKET, SO_REUSEADDR,
+      (const void *) &on, sizeof(on)) < 0) {
+        log_err(errno, "Unable to set REUSEADDR socket option");
+    }
+    if (bind(ld, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_err(errno, "Unable to bind to metrics port %d", conf->metricsPort);
+    }
+    if (listen(ld, SOMAXCONN) < 0) {
+        log_err(errno, "Unable to listen on metrics port %d",
+            conf->metricsPort);
+    }
+    conf->mld = ld;
+    return;
+}
+
+
+static int open_unix_listen_socket(const char *path)
+{
+/*  Creates a unix-domain socket listening on (path).  A stale socket left
+ *    behind by a previous daemon is removed, but one still accepting
+ *    connections is left alone.
+ *  Returns the listening socket descriptor; errors are fatal.
+ */
+    int ld;
+    struct sockaddr_un addr;
+    struct stat st;
+    int sd;
+
+    assert(path != NULL);
+    assert(strlen(path) < sizeof(addr.sun_path));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+        if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            log_err(errno, "Unable to create unix-domain socket");
+        }
+        if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            log_err(0, "Unix-domain socket \"%s\" is already in use", path);
+        }
+        (void) close(sd);
+        if ((unlink(path) < 0) && (errno != ENOENT)) {
+            log_err(errno, "Unable to remove stale unix-domain socket \"%s\"",
+                path);
+        }
+    }
+    if ((ld = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        log_err(errno, "Unable to create unix-domain listening socket");
+    }
+    DPRINTF((9, "Opened unix-domain listen socket: fd=%d.\n", ld));
+    set_fd_nonblocking(ld);
+    set_fd_closed_on_exec(ld);
+
+    if (bind(ld, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_err(errno, "Unable to bind to \"%s\"", path);
+    }
+    /*  Access to the client socket is controlled by the peer credentials
+     *    checked on each connection, and the metrics are no more sensitive
+     *    than a STATS query, so any local user may connect.
+     */
+    if (chmod(path, 0666) < 0) {
+        log_err(errno, "Unable to set permissions on \"%s\"", path);
+    }
+    if (listen(ld, SOMAXCONN) < 0) {
+        log_err(errno, "Unable to listen on \"%s\"", path);
+    }
+    return(ld);
+}
+
+
 static void setup_nofile_limit(server_conf_t *conf)
 {
 /*  Sets the NOFILE limit as specified in the configuration file.
@@ -735,38 +1005,442 @@ static void open_objs(server_conf_t *conf)
 }
 
 
-static void mux_io(server_conf_t *conf)
+static void create_mux_shards(server_conf_t *conf)
 {
-/*  Multiplexes I/O between all of the objs in the configuration.
- *  This routine is the heart of ConMan.
+/*  Creates the mux shards and assigns each console (along with its logfile)
+ *    to one of them in round-robin order.  Client objs are assigned to the
+ *    shard of their console when created, so the readers/writers fan-out of
+ *    a console remains within a single thread.
+ *  Unixsock consoles are assigned to shard 0 since their inotify events
+ *    are processed there.
  */
+    int n;
+    int k;
+    mux_shard_t *shard;
     ListIterator i;
+    obj_t *obj;
+    obj_t *logfile;
+
+    assert(conf->tp != NULL);
+
+    n = (conf->numThreads > 0) ? conf->numThreads : 1;
+    if (!(mux_shards = calloc(n, sizeof(mux_shard_t)))) {
+        out_of_memory();
+    }
+    num_mux_shards = n;
+
+    for (k = 0; k < n; k++) {
+        shard = &mux_shards[k];
+        shard->conf = conf;
+        shard->id = k;
+        shard->isExiting = 0;
+        shard->fd_pipe[0] = shard->fd_pipe[1] = -1;
+        x_pthread_mutex_init(&shard->wakeLock, NULL);
+        shard->wakeHead = NULL;
+        if (k == 0) {
+            shard->tp = conf->tp;
+            shard->tid = pthread_self();
+        }
+        else if (!(shard->tp = tpoll_create(0))) {
+            log_err(0, "Unable to create object for multiplexing I/O");
+        }
+        if (pipe(shard->fd_pipe) < 0) {
+            log_err(errno, "Unable to create pipe for mux thread #%d", k);
+        }
+        set_fd_nonblocking(shard->fd_pipe[0]);
+        set_fd_nonblocking(shard->fd_pipe[1]);
+        set_fd_closed_on_exec(shard->fd_pipe[0]);
+        set_fd_closed_on_exec(shard->fd_pipe[1]);
+        tpoll_set(shard->tp, shard->fd_pipe[0], POLLIN);
+    }
+    if (n == 1) {
+        return;
+    }
+    k = 0;
+    i = list_iterator_create(conf->objs);
+    while ((obj = list_next(i))) {
+        if (!is_console_obj(obj)) {
+            continue;
+        }
+        if (is_unixsock_obj(obj)) {
+            shard = &mux_shards[0];
+        }
+        else {
+            shard = &mux_shards[k++ % n];
+        }
+        obj->tp = shard->tp;
+        if ((logfile = get_console_logfile_obj(obj))) {
+            logfile->tp = shard->tp;
+        }
+    }
+    list_iterator_destroy(i);
+    return;
+}
+
+
+static void start_mux_shards(server_conf_t *conf)
+{
+/*  Starts a thread for each mux shard other than shard 0.
+ *  All signals are blocked in these threads so they will be delivered to
+ *    the main thread (shard 0).
+ */
+    sigset_t sigset;
+    sigset_t sigset_bak;
+    int k;
+    int rc;
+
+    if (num_mux_shards <= 1) {
+        return;
+    }
+    sigfillset(&sigset);
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset, &sigset_bak)) != 0) {
+        log_err(rc, "Unable to block signals for mux threads");
+    }
+    for (k = 1; k < num_mux_shards; k++) {
+        if ((rc = pthread_create(&mux_shards[k].tid, NULL,
+          mux_shard_thread, &mux_shards[k])) != 0) {
+            log_err(rc, "Unable to create mux thread #%d", k);
+        }
+    }
+    if ((rc = pthread_sigmask(SIG_SETMASK, &sigset_bak, NULL)) != 0) {
+        log_err(rc, "Unable to restore signal mask");
+    }
+    log_msg(LOG_INFO, "Multiplexing I/O with %d threads", num_mux_shards);
+    return;
+}
+
+
+static void stop_mux_shards(void)
+{
+/*  Tells all mux shard threads to exit, and waits for them to do so.
+ */
+    int k;
+    int rc;
+
+    if (num_mux_shards <= 1) {
+        return;
+    }
+    signal_mux_shards(MUX_SHARD_REQ_EXIT);
+
+    for (k = 1; k < num_mux_shards; k++) {
+        if ((rc = pthread_join(mux_shards[k].tid, NULL)) != 0) {
+            log_msg(LOG_WARNING, "Unable to join mux thread #%d: %s",
+                k, strerror(rc));
+        }
+    }
+    return;
+}
+
+
+static void destroy_mux_shards(void)
+{
+/*  Destroys the mux shards.  Shard 0's tpoll obj belongs to the conf.
+ *  This must be called after the objs have been destroyed since
+ *    destroy_obj() clears the obj's fd from its shard's tpoll obj.
+ */
+    int k;
+    int j;
+
+    for (k = 0; k < num_mux_shards; k++) {
+        if (k > 0) {
+            tpoll_destroy(mux_shards[k].tp);
+        }
+        for (j = 0; j < 2; j++) {
+            if (mux_shards[k].fd_pipe[j] >= 0) {
+                (void) close(mux_shards[k].fd_pipe[j]);
+            }
+        }
+        assert(mux_shards[k].wakeHead == NULL);
+        x_pthread_mutex_destroy(&mux_shards[k].wakeLock);
+    }
+    free(mux_shards);
+    mux_shards = NULL;
+    num_mux_shards = 0;
+    return;
+}
+
+
+int get_mux_shard_timeouts(int *counts, int len)
+{
+/*  Fills the array (counts) of length (len) with the number of timers
+ *    pending in each mux shard's tpoll obj.
+ *  This does not acquire any of the shards' locks.
+ *  Returns the number of shards for which counts were written.
+ */
+    int k;
+
+    assert(counts != NULL);
+
+    for (k = 0; (k < num_mux_shards) && (k < len); k++) {
+        counts[k] = tpoll_timeout_count(mux_shards[k].tp);
+    }
+    return(k);
+}
+
+
+int get_mux_shard_lag_hists(latency_hist_t *hists, int len)
+{
+/*  Fills the array (hists) of length (len) with a snapshot of each
+ *    mux shard's dispatch lag histogram.
+ *  Returns the number of shards for which histograms were written.
+ */
+    int k;
+    int j;
+
+    assert(hists != NULL);
+
+    for (k = 0; (k < num_mux_shards) && (k < len); k++) {
+        for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+            hists[k].counts[j] =
+                obj_stats_get(&mux_shards[k].lagHist.counts[j]);
+        }
+        hists[k].sumUsecs = obj_stats_get(&mux_shards[k].lagHist.sumUsecs);
+    }
+    return(k);
+}
+
+
+void schedule_obj_write(obj_t *obj)
+{
+/*  Sets POLLOUT on the (obj)'s fd once its mux shard is ready for it.
+ *  This is done immediately if called by the shard muxing the obj;
+ *    o/w, the obj is placed on the shard's wake queue (at most once)
+ *    and the shard is woken if the queue was empty.
+ *  The caller must hold a ref to the obj (see lock_obj_refs()
+ *    or lock_obj_vecs()).
+ */
+    mux_shard_t *shard;
+    int wasEmpty;
     int n;
+    char req = MUX_SHARD_REQ_WAKE;
+
+    assert(obj != NULL);
+
+    shard = find_mux_shard(obj->tp);
+    if (!shard || pthread_equal(shard->tid, pthread_self())) {
+        if (obj->fd >= 0) {
+            tpoll_set(obj->tp, obj->fd, POLLOUT);
+        }
+        return;
+    }
+    x_pthread_mutex_lock(&shard->wakeLock);
+    if (obj->isWakeQueued) {
+        x_pthread_mutex_unlock(&shard->wakeLock);
+        return;
+    }
+    wasEmpty = (shard->wakeHead == NULL);
+    obj->wakeNext = shard->wakeHead;
+    shard->wakeHead = obj;
+    obj->isWakeQueued = 1;
+    x_pthread_mutex_unlock(&shard->wakeLock);
+
+    if (wasEmpty) {
+        do {
+            n = write(shard->fd_pipe[1], &req, 1);
+        } while ((n < 0) && (errno == EINTR));
+
+        if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            log_msg(LOG_WARNING, "Unable to wake mux thread #%d: %s",
+                shard->id, strerror(errno));
+        }
+    }
+    return;
+}
+
+
+void unschedule_obj_write(obj_t *obj)
+{
+/*  Removes the (obj) from its mux shard's wake queue if present.
+ *  This is called before the obj is destroyed.
+ */
+    mux_shard_t *shard;
+    obj_t **pp;
+
+    assert(obj != NULL);
+
+    if (!(shard = find_mux_shard(obj->tp))) {
+        return;
+    }
+    x_pthread_mutex_lock(&shard->wakeLock);
+    if (obj->isWakeQueued) {
+        for (pp = &shard->wakeHead; *pp; pp = &(*pp)->wakeNext) {
+            if (*pp == obj) {
+                *pp = obj->wakeNext;
+                break;
+            }
+        }
+        obj->wakeNext = NULL;
+        obj->isWakeQueued = 0;
+    }
+    x_pthread_mutex_unlock(&shard->wakeLock);
+    return;
+}
+
+
+static mux_shard_t * find_mux_shard(tpoll_t tp)
+{
+/*  Returns the mux shard muxing objs via the tpoll obj [tp],
+ *    or NULL if the mux shards have not been created.
+ */
+    int k;
+
+    for (k = 0; k < num_mux_shards; k++) {
+        if (mux_shards[k].tp == tp) {
+            return(&mux_shards[k]);
+        }
+    }
+    return(NULL);
+}
+
+
+static void process_mux_shard_wakes(mux_shard_t *shard)
+{
+/*  Sets POLLOUT on the fds of the objs on the mux [shard]'s wake queue.
+ */
     obj_t *obj;
-    int inevent_fd;
+    obj_t *next;
+
+    x_pthread_mutex_lock(&shard->wakeLock);
+    obj = shard->wakeHead;
+    shard->wakeHead = NULL;
+    for (next = obj; next; next = next->wakeNext) {
+        next->isWakeQueued = 0;
+    }
+    /*  The objs cannot be destroyed while the lock is held (see
+     *    unschedule_obj_write()), so their fds are set before it is released.
+     */
+    while (obj) {
+        next = obj->wakeNext;
+        obj->wakeNext = NULL;
+        if (obj->fd >= 0) {
+            tpoll_set(obj->tp, obj->fd, POLLOUT);
+        }
+        obj = next;
+    }
+    x_pthread_mutex_unlock(&shard->wakeLock);
+    return;
+}
+
+
+static void * mux_shard_thread(void *arg)
+{
+/*  Thread routine for muxing the I/O of a mux shard other than shard 0.
+ */
+    mux_shard_t *shard = arg;
+
+    DPRINTF((5, "Started mux thread #%d.\n", shard->id));
+    mux_io(shard->conf, shard);
+    DPRINTF((5, "Stopped mux thread #%d.\n", shard->id));
+    return(NULL);
+}
+
+
+static void signal_mux_shards(char req)
+{
+/*  Sends the request [req] to all mux shards other than shard 0.
+ */
+    int k;
+    int n;
+
+    for (k = 1; k < num_mux_shards; k++) {
+        do {
+            n = write(mux_shards[k].fd_pipe[1], &req, 1);
+        } while ((n < 0) && (errno == EINTR));
+
+        if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            log_msg(LOG_WARNING, "Unable to signal mux thread #%d: %s",
+                k, strerror(errno));
+        }
+    }
+    return;
+}
+
+
+static void process_mux_shard_reqs(server_conf_t *conf, mux_shard_t *shard)
+{
+/*  Processes requests sent to the mux [shard] via signal_mux_shards().
+ */
+    char buf[64];
+    int n;
+    int k;
+    int gotReconfig = 0;
+    int gotTimestamp = 0;
+
+    while ((n = read(shard->fd_pipe[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                log_msg(LOG_WARNING, "Unable to read from mux pipe: %s",
+                    strerror(errno));
+            }
+            break;
+        }
+        for (k = 0; k < n; k++) {
+            if (buf[k] == MUX_SHARD_REQ_EXIT) {
+                shard->isExiting = 1;
+            }
+            else if (buf[k] == MUX_SHARD_REQ_RECONFIG) {
+                gotReconfig = 1;
+            }
+            else if (buf[k] == MUX_SHARD_REQ_TIMESTAMP) {
+                gotTimestamp = 1;
+            }
+        }
+    }
+    if (gotReconfig) {
+        reopen_logfiles(conf, shard->tp);
+    }
+    if (gotTimestamp) {
+        (void) stamp_logfiles(conf, shard->tp);
+    }
+    return;
+}
+
+
+static void mux_io(server_conf_t *conf, mux_shard_t *shard)
+{
+/*  Multiplexes I/O between all of the objs in the mux [shard].
+ *  This routine is the heart of ConMan.
+ */
+    tpoll_ready_t *ready = NULL;
+    int num_ready_alloc = 0;
+    int n;
+    int j;
+    obj_t *obj;
+    int inevent_fd = -1;
     int rvr, rvw;
+    unsigned long usecs = 0;
+    unsigned long now;
 
-    assert(conf->tp != NULL);
+    assert(shard != NULL);
+    assert(shard->tp != NULL);
     assert(!list_is_empty(conf->objs));
 
-    inevent_fd = inevent_get_fd();
-    if (inevent_fd >= 0) {
-        tpoll_set(conf->tp, inevent_get_fd(), POLLIN);
+    if (shard->id == 0) {
+        inevent_fd = inevent_get_fd();
+        if (inevent_fd >= 0) {
+            tpoll_set(shard->tp, inevent_get_fd(), POLLIN);
+        }
     }
-    i = list_iterator_create(conf->objs);
 
-    while (!done) {
+    while (!done && !shard->isExiting) {
 
-        if (reconfig) {
+        if (reconfig && (shard->id == 0)) {
             /*
              *  FIXME: A reconfig should pro'ly resurrect "downed" serial objs
              *    and reset reconnect timers of "downed" telnet objs.
              */
             log_msg(LOG_NOTICE, "Performing reconfig on signal=%d", reconfig);
-            reopen_logfiles(conf);
+            signal_mux_shards(MUX_SHARD_REQ_RECONFIG);
+            reopen_logfiles(conf, shard->tp);
+            report_log_writer_stats();
             reconfig = 0;
         }
-        while ((n = tpoll(conf->tp, -1)) < 0) {
+        process_mux_shard_wakes(shard);
+
+        while ((n = tpoll(shard->tp, -1)) < 0) {
             if (errno != EINTR) {
                 log_err(errno, "Unable to multiplex I/O");
             }
@@ -774,43 +1448,137 @@ static void mux_io(server_conf_t *conf)
                 break;
             }
         }
-        if ((n > 0) &&
-                (tpoll_is_set(conf->tp, conf->ld, POLLIN) > 0)) {
-            n--;
-            accept_client(conf);
-        }
-        if ((inevent_fd >= 0) &&
-                (n > 0) &&
-                (tpoll_is_set(conf->tp, inevent_fd, POLLIN) > 0)) {
-            n--;
-            inevent_process();
-        }
-        /*  If read_from_obj() or write_to_obj() returns -1,
-         *    the obj's buffer has been flushed.  If it is a console obj,
-         *    retain it and attempt to re-establish the connection;
-         *    o/w, give up and remove it from the master objs list.
+        if (n <= 0) {
+            continue;
+        }
+        update_log_time();
+
+        if (conf->enableLatency) {
+            usecs = get_latency_usecs();
+        }
+
+        if (n > num_ready_alloc) {
+            num_ready_alloc = MAX(n, num_ready_alloc * 2);
+            ready = realloc(ready, num_ready_alloc * sizeof(tpoll_ready_t));
+            if (!ready) {
+                out_of_memory();
+            }
+        }
+        /*  Only visit those fds that are ready.  The ready array is a snapshot
+         *    of the revents from the last tpoll(); an obj whose fd has since
+         *    been closed or reassigned will be skipped.
          */
-        list_iterator_reset(i);
-        while ((n > 0) &&
-                ((obj = list_next(i)) != NULL)) {
-
-            rvr = tpoll_is_set(conf->tp, obj->fd, POLLIN | POLLHUP | POLLERR);
-            rvw = tpoll_is_set(conf->tp, obj->fd, POLLOUT);
-            if ((rvr > 0) || (rvw > 0)) {
-                n--;
+        n = tpoll_get_ready(shard->tp, ready, n);
+
+        for (j = 0; j < n; j++) {
+
+            if ((shard->id == 0)
+              && ((ready[j].fd == conf->ld) || (ready[j].fd == conf->uld))) {
+                if (ready[j].revents & POLLIN) {
+                    accept_client(conf, ready[j].fd);
+                }
+                continue;
+            }
+            if ((inevent_fd >= 0) && (ready[j].fd == inevent_fd)) {
+                if (ready[j].revents & POLLIN) {
+                    inevent_process();
+                }
+                continue;
+            }
+            if (ready[j].fd == shard->fd_pipe[0]) {
+                process_mux_shard_reqs(conf, shard);
+                continue;
+            }
+            obj = ready[j].arg;
+            if (!obj) {
+                obj = lookup_ready_obj(conf, shard->tp, ready[j].fd);
+            }
+            if (!obj || (obj->fd != ready[j].fd)) {
+                continue;
+            }
+            /*  If read_from_obj() or write_to_obj() returns -1,
+             *    the obj's buffer has been flushed.  If it is a console obj,
+             *    retain it and attempt to re-establish the connection;
+             *    o/w, give up and remove it from the master objs list.
+             */
+            rvr = ready[j].revents & (POLLIN | POLLHUP | POLLERR);
+            rvw = ready[j].revents & POLLOUT;
+
+            /*  Sample the time this obj waited for the objs ahead of it.
+             */
+            if (conf->enableLatency) {
+                now = get_latency_usecs();
+                add_latency_hist(&shard->lagHist,
+                    (now > usecs) ? now - usecs : 0);
             }
+
             if ((rvr > 0) && (read_from_obj(obj) < 0)) {
-                list_delete(i);
+                remove_obj(conf, obj);
                 continue;
             }
             if ((rvw > 0) && (write_to_obj(obj) < 0)) {
-                list_delete(i);
+                remove_obj(conf, obj);
                 continue;
             }
         }
     }
-    log_msg(LOG_NOTICE, "Exiting on signal=%d", done);
+    if (shard->id == 0) {
+        log_msg(LOG_NOTICE, "Exiting on signal=%d", done);
+    }
+    if (ready) {
+        free(ready);
+    }
+    return;
+}
+
+
+static obj_t * lookup_ready_obj(server_conf_t *conf, tpoll_t tp, int fd)
+{
+/*  Searches the master objs list for the obj muxed by [tp] on [fd].
+ *  If found, the obj is assigned to [fd] within [tp] so subsequent lookups
+ *    are O(1); this assignment is reset when the fd is cleared from [tp].
+ *  Returns the obj, or NULL if not found.
+ */
+    obj_fd_key_t key;
+    obj_t *obj;
+
+    key.tp = tp;
+    key.fd = fd;
+    obj = list_find_first(conf->objs, (ListFindF) find_obj_fd, &key);
+
+    if (obj) {
+        tpoll_set_arg(tp, fd, obj);
+    }
+    return(obj);
+}
+
+
+static int find_obj_fd(obj_t *obj, obj_fd_key_t *key)
+{
+/*  Used by list_find_first() to locate the obj muxed on the given fd.
+ *  Returns non-zero if (obj) matches (key); o/w returns zero.
+ */
+    assert(obj != NULL);
+    assert(key != NULL);
+
+    return((obj->tp == key->tp) && (obj->fd == key->fd));
+}
+
+
+static void remove_obj(server_conf_t *conf, obj_t *obj)
+{
+/*  Removes (obj) from the master objs list and destroys it.
+ *  The obj is destroyed after the list's lock has been released since
+ *    destroy_obj() may wait on other mux threads still using a ref to it.
+ */
+    ListIterator i;
+
+    i = list_iterator_create(conf->objs);
+    if (list_find(i, (ListFindF) find_obj, obj)) {
+        (void) list_remove(i);
+    }
     list_iterator_destroy(i);
+    destroy_obj(obj);
     return;
 }
 
@@ -919,89 +1687,98 @@ err:
 }
 
 
-static void reopen_logfiles(server_conf_t *conf)
+static void reopen_logfiles(server_conf_t *conf, tpoll_t tp)
 {
-/*  Reopens the daemon logfile and all of the logfiles in the 'objs' list.
+/*  Reopens all of the logfiles in the 'objs' list muxed by [tp].
+ *  The daemon logfile is reopened by the main thread.
  */
     ListIterator i;
     obj_t *logfile;
 
+    lock_obj_refs();
     i = list_iterator_create(conf->objs);
     while ((logfile = list_next(i))) {
-        if (!is_logfile_obj(logfile)) {
+        if (!is_logfile_obj(logfile) || (logfile->tp != tp)) {
             continue;
         }
         open_logfile_obj(logfile);
     }
     list_iterator_destroy(i);
+    unlock_obj_refs();
 
-    if (conf->logFileName && !conf->enableForeground) {
+    if ((tp == conf->tp) && conf->logFileName && !conf->enableForeground) {
         open_daemon_logfile(conf);
     }
     return;
 }
 
 
-static void accept_client(server_conf_t *conf)
+static void accept_client(server_conf_t *conf, int ld)
 {
-/*  Accepts a new client connection on the listening socket.
+/*  Accepts a new client connection on the listening socket [ld].
  *  The new socket connection must be accept()'d within the poll() loop.
  *    O/w, the following scenario could occur:  Read activity would be
- *    poll()'d on the listen socket.  A new thread would be created to
- *    process this request.  Before this new thread is scheduled and the
- *    socket connection is accept()'d, the poll() loop begins its next
- *    iteration.  It notices read activity on the listen socket from the
- *    client that has not yet been accepted, so a new thread is created.
- *    Since the listen socket is set non-blocking, this new thread would
- *    receive an EAGAIN/EWOULDBLOCK on the accept() and terminate, but still...
+ *    poll()'d on the listen socket.  Another thread would be handed this
+ *    request.  Before that thread is scheduled and the socket connection
+ *    is accept()'d, the poll() loop begins its next iteration.  It notices
+ *    read activity on the listen socket from the client that has not yet
+ *    been accepted, so the request is handed off again.  Since the listen
+ *    socket is set non-blocking, that thread would receive an
+ *    EAGAIN/EWOULDBLOCK on the accept() and give up, but still...
+ *  Accepted connections are queued for the client worker threads.
  */
     int sd;
     const int on = 1;
-    client_arg_t *args;
-    int rc;
-    pthread_t tid;
+    struct timeval tv;
 
-    while ((sd = accept(conf->ld, NULL, NULL)) < 0) {
-        if (errno == EINTR) {
-            continue;
-        }
-        if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-            return;
+    /*  Drain the listen socket's backlog so a burst of connections
+     *    is admitted within a single pass of the poll() loop.
+     */
+    for (;;) {
+        if ((sd = accept(ld, NULL, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            log_err(errno, "Unable to accept new connection");
         }
-        if (errno == ECONNABORTED) {
-            return;
+        DPRINTF((5, "Accepted new client on fd=%d.\n", sd));
+
+        /*  While the listen fd is non-blocking, new fds that are accept()d
+         *    from it can be either blocking or non-blocking depending on the
+         *    platform.  The client handshake is processed by a client worker
+         *    thread with blocking I/O.  Once the client request has been
+         *    processed, this fd is set non-blocking and moved to the main
+         *    fd set.  Consequently, we force the new fd to be blocking here
+         *    for portability.
+         *  Since the pool of client worker threads is fixed, the handshake
+         *    I/O is bounded by a timeout so a stalled client cannot tie up
+         *    a worker indefinitely.  This timeout restarts with each read
+         *    or write; the worker also bounds the handshake as a whole.
+         */
+        set_fd_blocking(sd);
+
+        tv.tv_sec = CLIENT_HANDSHAKE_SECS;
+        tv.tv_usec = 0;
+        if ((setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO,
+                (const void *) &tv, sizeof(tv)) < 0)
+          || (setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO,
+                (const void *) &tv, sizeof(tv)) < 0)) {
+            log_msg(LOG_WARNING,
+                "Unable to set client handshake timeout: %s",
+                strerror(errno));
         }
-        log_err(errno, "Unable to accept new connection");
-    }
-    DPRINTF((5, "Accepted new client on fd=%d.\n", sd));
-
-    /*  While the listen fd is non-blocking, new fds that are accept()d from
-     *    it can be either blocking or non-blocking depending on the platform.
-     *  The current model spawns a thread to handle a new client with
-     *    blocking I/O.  Once the client request has been processed,
-     *    this fd is set non-blocking and moved to the main fd set.
-     *  Consequently, we force the new fd to be blocking here for portability.
-     */
-    set_fd_blocking(sd);
-
-    if (conf->enableKeepAlive) {
-        if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE,
-          (const void *) &on, sizeof(on)) < 0) {
-            log_err(errno, "Unable to set KEEPALIVE socket option");
+        if (conf->enableKeepAlive && (ld == conf->ld)) {
+            if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE,
+              (const void *) &on, sizeof(on)) < 0) {
+                log_err(errno, "Unable to set KEEPALIVE socket option");
+            }
         }
+        queue_client(conf, sd);
     }
-    /*  Create a tmp struct to hold two args to pass to the thread.
-     *  Note that the thread is responsible for freeing this memory.
-     */
-    if (!(args = malloc(sizeof(client_arg_t)))) {
-        out_of_memory();
-    }
-    args->sd = sd;
-    args->conf = conf;
-
-    if ((rc = pthread_create(&tid, NULL,
-      (PthreadFunc) process_client, args)) != 0) {
-        log_err(rc, "Unable to create new thread");
-    }
-    return;
 }
@@ -37,6 +37,7 @@
 #include <netinet/in.h>                 /* for struct sockaddr_in            */
 #include <pthread.h>                    /* for pthread_mutex_t               */
 #include <stdio.h>                      /* for FILE                          */
+#include <sys/time.h>                   /* for struct timeval                */
 #include <termios.h>                    /* for struct termios, speed_t       */
 #include <time.h>                       /* for time_t                        */
 #include <unistd.h>                     /* for pid_t                         */
@@ -48,6 +49,7 @@
 #define DEFAULT_LOGOPT_LOCK             1
 #define DEFAULT_LOGOPT_SANITIZE         0
 #define DEFAULT_LOGOPT_TIMESTAMP        0
+#define DEFAULT_LOGOPT_TIMESTAMP_MSEC   0
 
 #define DEFAULT_SEROPT_BPS              B9600
 #define DEFAULT_SEROPT_DATABITS         8
@@ -56,6 +58,39 @@
 
 #define MIN_CONNECT_SECS                60
 
+#define MAX_SERVER_THREADS              64
+#define MAX_LOG_THREADS                 16
+#define MAX_CLIENT_THREADS              64
+#define DEFAULT_CLIENT_THREADS          4
+
+#define CLIENT_HANDSHAKE_SECS           10
+
+#define DNS_CACHE_SIZE                  256
+#define DNS_CACHE_TTL_SECS              300
+#define DNS_CACHE_NEG_TTL_SECS          60
+
+#define REGEX_CACHE_SIZE                16
+
+#define STREAM_RSP_CHUNK_SIZE           16384
+
+#define MUX_CLIENT_BUF_SIZE             (OBJ_BUF_SIZE * 16)
+
+#define OBJ_READ_SIZE                   ((OBJ_BUF_SIZE / 2) - 1)
+
+#define LOG_WRITER_BATCH_MSECS          10
+
+#define OBJ_LOSS_LOG_SECS               60
+
+#define LATENCY_HIST_BUCKETS            28
+
+#define METRICS_IO_SECS                 5
+
+#define MIN_OBJ_BUF_SIZE                (LOG_REPLAY_LEN * 2)
+#define MAX_OBJ_BUF_SIZE                (16 * 1024 * 1024)
+
+#define MIN_SCROLLBACK_SIZE             MIN_OBJ_BUF_SIZE
+#define MAX_SCROLLBACK_SIZE             (256 * 1024 * 1024)
+
 #if WITH_FREEIPMI
 #define IPMI_ENGINE_CONSOLES_PER_THREAD 128
 #define IPMI_MAX_USER_LEN               IPMI_MAX_USER_NAME_LENGTH
@@ -96,17 +131,31 @@ enum obj_type {                         /* type of auxiliary obj             */
     CONMAN_OBJ_LAST_ENTRY
 };
 
+typedef struct mux_id {                 /* MUX CONSOLE ID MAP ENTRY:         */
+    struct base_obj *obj;               /*  console obj being multiplexed    */
+    int              id;                /*  console id tagging its frames    */
+} mux_id_t;
+
 typedef struct client_obj {             /* CLIENT AUX OBJ DATA:              */
     req_t           *req;               /*  client request info              */
+    mux_id_t        *muxIds;            /*  mux console ids sorted by obj    */
+    int              numMuxIds;         /*  number of entries in muxIds      */
     time_t           timeLastRead;      /*  time last data was read from fd  */
+    struct base_obj *ringObj;           /*  con obj whose ring is being read */
+    unsigned long    ringPos;           /*  ring pos of next byte to write   */
+    unsigned long    ringEnd;           /*  ring pos at which reading stops  */
+    unsigned long    replayEnd;         /*  ring pos at which replay ends    */
     unsigned         gotEscape:1;       /*  true if last char rcvd was esc   */
     unsigned         gotSuspend:1;      /*  true if suspending client output */
+    unsigned         gotRingEnd:1;      /*  true if ringEnd has been set     */
+    unsigned         gotReplay:1;       /*  true if replay is in progress    */
 } client_obj_t;
 
 typedef struct logfile_opt {            /* LOGFILE OBJ OPTIONS:              */
     unsigned         enableLock:1;      /*  true if logfile being locked     */
     unsigned         enableSanitize:1;  /*  true if logfile being sanitized  */
     unsigned         enableTimestamp:1; /*  true if timestamping each line   */
+    unsigned         enableTimeMsec:1;  /*  true if timestamps include msecs */
 } logopt_t;
 
 typedef enum logfile_line_state {       /* log CR/LF newline state (2 bits)  */
@@ -116,9 +165,20 @@ typedef enum logfile_line_state {       /* log CR/LF newline state (2 bits)  */
     CONMAN_LOG_LINE_LF
 } log_line_state_t;
 
+typedef enum logfile_write_state {     /* log writer queue state            */
+    CONMAN_LOG_WRITE_IDLE,
+    CONMAN_LOG_WRITE_QUEUED,
+    CONMAN_LOG_WRITE_BUSY,
+    CONMAN_LOG_WRITE_REQUEUE
+} log_write_state_t;
+
 typedef struct logfile_obj {            /* LOGFILE AUX OBJ DATA:             */
     struct base_obj *console;           /*  con obj ref for name expansion   */
     char            *fmtName;           /*  name with conversion specifiers  */
+    struct base_obj *writeNext;         /*  next logfile in log writer queue */
+    pthread_mutex_t  writeLock;         /*  lock held while fd is in use     */
+    time_t           syncTime;          /*  time of last fdatasync()         */
+    int              writeState;        /*  log_write_state_t queue state    */
     logopt_t         opts;              /*  local options                    */
     unsigned         gotProcessing:1;   /*  true if input processing req'd   */
     unsigned         gotTruncate:1;     /*  true if ZeroLogs is enabled      */
@@ -235,6 +295,12 @@ typedef struct test_obj {               /* TEST AUX OBJ DATA:                */
     char             lastChar;          /*  last char output by test console */
 } test_obj_t;
 
+typedef struct obj_vec {                /* INLINE ARRAY OF OBJ REFS:         */
+    struct base_obj **objs;             /*  array of obj refs                */
+    int              num;               /*  num obj refs in array            */
+    int              max;               /*  num obj refs allocated           */
+} obj_vec_t;
+
 typedef union aux_obj {
     client_obj_t     client;
     logfile_obj_t    logfile;
@@ -248,18 +314,74 @@ typedef union aux_obj {
     test_obj_t       test;
 } aux_obj_t;
 
+typedef struct obj_stats {              /* OBJ I/O COUNTERS:                 */
+    unsigned long    numBytesIn;        /*  bytes read from obj's fd         */
+    unsigned long    numBytesOut;       /*  bytes written to obj's fd        */
+    unsigned long    numBytesLost;      /*  bytes overwritten or dropped     */
+    unsigned long    numOverruns;       /*  num overwrite/drop events        */
+    unsigned long    numReaderBytesLost;/*  con bytes skipped by slow readers*/
+    unsigned long    numConnects;       /*  num times console (re)connected  */
+    unsigned long    maxBytesBuffered;  /*  high-water mark of circular-buf  */
+    unsigned long    numBytesLostLogged;/*  numBytesLost at last log msg     */
+    unsigned long    numOverrunsLogged; /*  numOverruns at last log msg      */
+    time_t           timeLossLogged;    /*  time of last loss log msg        */
+} obj_stats_t;
+
+typedef struct latency_hist {           /* LATENCY HISTOGRAM:                */
+    unsigned long    counts[LATENCY_HIST_BUCKETS]; /* by log2 of usecs       */
+    unsigned long    sumUsecs;          /* sum of all samples in usecs       */
+} latency_hist_t;
+
+typedef enum latency_type {             /* type of obj reading console data  */
+    CONMAN_LATENCY_CLIENT,              /*  client reading console ring      */
+    CONMAN_LATENCY_MUX,                 /*  mux client                       */
+    CONMAN_LATENCY_LOGFILE,             /*  console logfile                  */
+    CONMAN_LATENCY_TYPES                /*  num latency types                */
+} latency_type_t;
+
+typedef enum console_state {            /* console connection state          */
+    CONMAN_CONSOLE_DOWN,
+    CONMAN_CONSOLE_PENDING,
+    CONMAN_CONSOLE_UP
+} console_state_t;
+
+typedef struct console_stats {          /* CONSOLE STATS SNAPSHOT:           */
+    obj_stats_t      console;           /*  counters of console obj          */
+    obj_stats_t      logfile;           /*  counters of console's logfile    */
+    int              numReaders;        /*  num clients reading console      */
+    int              numWriters;        /*  num clients writing console      */
+    console_state_t  state;             /*  connection state of console      */
+    unsigned         gotLogfile:1;      /*  true if console has a logfile    */
+} console_stats_t;
+
 typedef struct base_obj {               /* BASE OBJ:                         */
     char            *name;              /*  obj name                         */
     int              fd;                /*  file descriptor                  */
-    unsigned char    buf[OBJ_BUF_SIZE]; /*  circular-buf to be written to fd */
+    tpoll_t          tp;                /*  tpoll obj (shard) muxing this fd */
+    unsigned char   *buf;               /*  circular-buf to be written to fd */
+    int              bufSize;           /*  size of circular-buf in bytes    */
+    int              readSize;          /*  max bytes per read from fd       */
     unsigned char   *bufInPtr;          /*  ptr for data written in to buf   */
     unsigned char   *bufOutPtr;         /*  ptr for data written out to fd   */
     pthread_mutex_t  bufLock;           /*  lock protecting access to buf    */
+    unsigned char   *ringBuf;           /*  con output ring read by clients  */
+    unsigned long    ringHead;          /*  num bytes ever written into ring */
+    int              ringSize;          /*  size of output ring (scrollback) */
     List             readers;           /*  list of objs that read from me   */
     List             writers;           /*  list of objs that write to me    */
+    obj_vec_t        readerVec;         /*  readers array for i/o fan-out    */
+    obj_vec_t        writerVec;         /*  writers array for i/o fan-out    */
+    pthread_rwlock_t vecLock;           /*  lock protecting reader/writerVec */
     char            *resetCmdRef;       /*  console reset cmd string ref     */
     pid_t            resetCmdPid;       /*  console reset cmd active pid     */
     int              resetCmdTimer;     /*  console reset cmd timer id       */
+    obj_stats_t      stats;             /*  i/o counters reported via STATS  */
+    unsigned long    latUsecs;          /*  ingress time of latency sample   */
+    unsigned long    latPos;            /*  buf/ring pos of latency sample   */
+    struct base_obj *latConsole;        /*  con obj of latency sample        */
+    latency_hist_t  *latHists;          /*  con latencies by latency_type_t  */
+    struct base_obj *wakeNext;          /*  next obj on shard's wake queue   */
+    int              isWakeQueued;      /*  true if on shard's wake queue    */
     unsigned         type;              /*  enum obj_type of auxiliary obj   */
     unsigned         gotBufWrap:1;      /*  true if circular-buf has wrapped */
     unsigned         gotEOF:1;          /*  true if obj got EOF on last read */
@@ -277,6 +399,12 @@ typedef struct server_conf {
     FILE            *logFilePtr;        /* msg log file ptr, !closed at exit */
     int              logFileLevel;      /* level at which to log msg to file */
     int              numOpenFiles;      /* rlimit for number of open files   */
+    int              objBufSize;        /* default console/logfile buf size  */
+    int              scrollbackSize;    /* default console scrollback size   */
+    int              numThreads;        /* num threads for muxing obj i/o    */
+    int              numLogThreads;     /* num threads for writing logfiles  */
+    int              numClientThreads;  /* num threads for admitting clients */
+    int              logSyncSecs;       /* secs 'tween logfile fdatasync()s  */
     char            *pidFileName;       /* file to which pid is written      */
     char            *resetCmd;          /* cmd to invoke for reset esc-seq   */
     int              syslogFacility;    /* syslog facility or -1 if disabled */
@@ -286,7 +414,14 @@ typedef struct server_conf {
     int              fd;                /* configuration file descriptor     */
     int              port;              /* port number on which to listen    */
     int              ld;                /* listening socket descriptor       */
+    char            *unixSockName;      /* unix-domain listening socket path */
+    int              uld;               /* unix-domain listening socket desc */
+    int              metricsPort;       /* loopback port for metrics, or 0   */
+    char            *metricsSockName;   /* unix-domain socket for metrics    */
+    int              mld;               /* metrics listening socket desc     */
     List             objs;              /* list of all server obj_t's        */
+    obj_t          **consoleIndex;      /* console objs sorted by name       */
+    int              numConsoles;       /* num console objs in consoleIndex  */
     tpoll_t          tp;                /* tpoll obj for muxing i/o & timers */
     char            *globalLogName;     /* global log name (must contain &)  */
     logopt_t         globalLogOpts;     /* global opts for logfile objects   */
@@ -298,16 +433,30 @@ typedef struct server_conf {
     test_opt_t       globalTestOpts;    /* global opts for test objs         */
     unsigned         enableCoreDump:1;  /* true if core dumps are enabled    */
     unsigned         enableKeepAlive:1; /* true if using TCP keep-alive      */
+    unsigned         enableLatency:1;   /* true if sampling output latency   */
     unsigned         enableLoopBack:1;  /* true if only listening on loopback*/
+    unsigned         enableResolve:1;   /* true if client addrs are resolved */
     unsigned         enableTCPWrap:1;   /* true if TCP-Wrappers is enabled   */
     unsigned         enableVerbose:1;   /* true if verbose output requested  */
     unsigned         enableZeroLogs:1;  /* true if console logs are zero'd   */
     unsigned         enableForeground:1;/* true if daemon should not fork    */
 } server_conf_t;
 
+typedef struct log_writer_stats {
+    int              queueDepth;        /* num logfiles awaiting a writer    */
+    int              maxQueueDepth;     /* max queueDepth seen               */
+    unsigned long    numBatches;        /* num batches written               */
+    unsigned long    numFlushes;        /* num logfiles flushed in batches   */
+    unsigned long    numSyncs;          /* num fdatasync()s performed        */
+    unsigned long    sumFlushUsecs;     /* total usecs spent writing batches */
+    unsigned long    maxFlushUsecs;     /* max usecs spent writing a batch   */
+} log_writer_stats_t;
+
 typedef struct client_args {
     int              sd;                /* socket descriptor of new client   */
+    struct timeval   tvAccept;          /* time at which client was accepted */
     server_conf_t   *conf;              /* server's configuration            */
+    struct client_args *next;           /* next client in admission queue    */
 } client_arg_t;
 
 
@@ -322,6 +471,13 @@ typedef struct client_args {
  *  into the circular write-buffer of each object listed in its readers list.
  *  Data in an object's write-buffer is written out to its file descriptor.
  *
+ *  The readers and writers lists are mirrored by the readerVec and writerVec
+ *  inline arrays.  The I/O paths walk these arrays while holding the obj's
+ *  own vecLock shared instead of creating a list iterator for each read;
+ *  they are only modified by link_objs() & unlink_objs() while holding it
+ *  exclusively.  An obj is unlinked before it is destroyed, so the objs in
+ *  an array cannot be destroyed while the array is being walked.
+ *
  *  CONSOLE objects: (aka PROCESS/SERIAL/TELNET objects)
  *  - readers list can contain at most one logfile object
  *    and any number of R/O or R/W client objects
@@ -366,6 +522,36 @@ typedef struct client_args {
 #define is_console_obj(OBJ)  (OBJ->type &  CONMAN_OBJ_IS_CONSOLE)
 
 
+/*  Concerning obj I/O COUNTERS:
+ *    The counters are updated on the I/O paths without taking a lock,
+ *    so they are read via obj_stats_get() when reported.  The loss-logging
+ *    state (the *Logged fields) is protected by the obj's bufLock.
+ */
+#if defined(__ATOMIC_RELAXED)
+#  define obj_stats_add(PTR, N) \
+     ((void) __atomic_add_fetch((PTR), (N), __ATOMIC_RELAXED))
+#  define obj_stats_get(PTR) \
+     __atomic_load_n((PTR), __ATOMIC_RELAXED)
+#  define obj_stats_set(PTR, N) \
+     __atomic_store_n((PTR), (N), __ATOMIC_RELAXED)
+#else  /* !__ATOMIC_RELAXED */
+#  define obj_stats_add(PTR, N) ((void) (*(PTR) += (N)))
+#  define obj_stats_get(PTR) (*(volatile unsigned long *) (PTR))
+#  define obj_stats_set(PTR, N) ((void) (*(PTR) = (N)))
+#endif /* !__ATOMIC_RELAXED */
+
+
+/*  server.c
+ */
+int get_mux_shard_timeouts(int *counts, int len);
+
+int get_mux_shard_lag_hists(latency_hist_t *hists, int len);
+
+void schedule_obj_write(obj_t *obj);
+
+void unschedule_obj_write(obj_t *obj);
+
+
 /*  server-conf.c
  */
 server_conf_t * create_server_conf(void);
@@ -381,6 +567,8 @@ void process_config(server_conf_t *conf);
  */
 int process_client_escapes(obj_t *client, void *src, int len);
 
+void perform_log_replay(obj_t *client, int numBytes, int numLines);
+
 
 /* server-ipmi.c
  */
@@ -419,8 +607,34 @@ int open_logfile_obj(obj_t *logfile);
 
 obj_t * get_console_logfile_obj(obj_t *console);
 
+void update_log_time(void);
+
 int write_log_data(obj_t *log, const void *src, int len);
 
+void start_log_writers(server_conf_t *conf);
+
+void stop_log_writers(void);
+
+int queue_logfile_write(obj_t *logfile, int isUrgent);
+
+void get_log_writer_stats(log_writer_stats_t *stats);
+
+void report_log_writer_stats(void);
+
+
+/*  server-metrics.c
+ */
+unsigned long get_latency_usecs(void);
+
+void add_latency_hist(latency_hist_t *hist, unsigned long usecs);
+
+unsigned long get_latency_hist_percentile(
+    const latency_hist_t *hist, int pct);
+
+void start_metrics_server(server_conf_t *conf);
+
+void stop_metrics_server(void);
+
 
 /*  server-obj.c
  */
@@ -429,16 +643,30 @@ obj_t * create_obj(server_conf_t *conf, char *name,
 
 obj_t * create_client_obj(server_conf_t *conf, req_t *req);
 
+void create_client_mux_ids(obj_t *client);
+
 void destroy_obj(obj_t *obj);
 
 void reopen_obj(obj_t *obj);
 
+void create_obj_ring(obj_t *console);
+
+void set_obj_read_size(obj_t *obj);
+
 int format_obj_string(char *buf, int buflen, obj_t *obj, const char *fmt);
 
 int compare_objs(obj_t *obj1, obj_t *obj2);
 
 int find_obj(obj_t *obj, obj_t *key);
 
+void lock_obj_refs(void);
+
+void unlock_obj_refs(void);
+
+void lock_obj_vecs(obj_t *obj);
+
+void unlock_obj_vecs(obj_t *obj);
+
 int write_notify_msg(obj_t *console, int priority, char *fmt, ...);
 
 void notify_console_objs(obj_t *console, char *msg);
@@ -453,10 +681,29 @@ int shutdown_obj(obj_t *obj);
 
 int read_from_obj(obj_t *obj);
 
+void write_readers_data(obj_t *obj, const void *src, int len);
+
+int replay_console_ring(obj_t *client, int numBytes, int numLines);
+
 int write_obj_data(obj_t *obj, const void *src, int len, int isInfo);
 
+int write_client_data(obj_t *client, obj_t *console,
+    const void *src, int len, int isInfo);
+
 int write_to_obj(obj_t *obj);
 
+void get_console_stats(obj_t *console, console_stats_t *stats);
+
+const char * get_console_state_string(console_state_t state);
+
+int format_obj_stats(char *buf, int buflen, obj_t *console);
+
+void enable_latency_sampling(server_conf_t *conf);
+
+int get_console_latency_hists(obj_t *console, latency_hist_t *hists);
+
+const char * get_latency_type_string(latency_type_t type);
+
 
 /*  server-process.c
  */
@@ -486,7 +733,13 @@ int open_serial_obj(obj_t *serial);
 
 /*  server-sock.c
  */
-void process_client(client_arg_t *args);
+void start_client_workers(server_conf_t *conf);
+
+void stop_client_workers(void);
+
+void queue_client(server_conf_t *conf, int sd);
+
+void get_client_handshake_hist(latency_hist_t *hist);
 
 
 /*  server-telnet.c
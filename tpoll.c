@@ -31,10 +31,17 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#if HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+#if HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif /* HAVE_SYS_EVENTFD_H */
 #include <unistd.h>
 #include "bool.h"
 #include "log.h"
@@ -57,15 +64,42 @@
  *  descriptors to the first empty slot in fd_array[], and maintaining a hash
  *  to map file descriptors onto the corresponding fd_array[] index.
  *
- *  This implementation assumes the number of concurrent active timers is
- *  moderate; as such, active timers are stored in a linked-list in order of
- *  increasing timevals (ie, the head of the list (timers_active) is the next
- *  timer to expire).  It does not scale well to a large number of timers
- *  because insertion and deletion are O(n), although dispatching is O(1).
- *  Other possible implementations are heaps [Sedgewick 1998] which are
- *  O(log n) for insertion, deletion, and dispatch; or hashed timing wheels
- *  [Varghese and Lauck 1996] which can be as efficient as O(1) for insertion,
- *  deletion, and dispatch.
+ *  When epoll is available, the fd_array[] is still used to track the events
+ *  and revents for each file descriptor, but the kernel is only told about
+ *  changes to the interest set (via epoll_ctl()) and only reports those file
+ *  descriptors that are ready.  This avoids the O(max_fd) cost of passing the
+ *  entire fd_array[] to poll() on every wakeup.  The revents of file
+ *  descriptors reported ready by the previous epoll_wait() are reset before
+ *  the next one, so the cost of each wakeup is proportional to the number of
+ *  ready file descriptors.  If epoll is not available at compile-time or an
+ *  epoll instance cannot be created at runtime, poll() is used instead.
+ *  Defining TPOLL_NO_EPOLL forces the use of poll() (eg, for benchmarking).
+ *
+ *  Active timers are stored in a binary min-heap [Sedgewick 1998] ordered by
+ *  increasing timevals (ie, the root of the heap (timers_heap[0]) is the next
+ *  timer to expire).  Each timer records its index within the heap, and is
+ *  also chained into a hash table keyed by timer ID so it can be located for
+ *  cancellation without a linear search.  Insertion, cancellation, and
+ *  dispatch are all O(log n).  This matters when a large number of timers
+ *  are set at once (eg, when many consoles lose their connections and
+ *  schedule reconnects).  Timers with equal timevals are dispatched in order
+ *  of increasing timer ID.
+ *
+ *  A blocked tpoll() is woken by signaling an eventfd (or a self-pipe if
+ *  eventfd is not available).  The thread that first calls tpoll() becomes
+ *  the owner of the tpoll object.  Once the object has an owner, fd interest
+ *  changes (tpoll_set(), tpoll_clear(), tpoll_set_arg()) made by any other
+ *  thread never wait on the mutex: if the mutex is busy, the change is
+ *  pushed onto a lock-free multi-producer/single-consumer command stack.
+ *  The owner detaches the entire stack with an atomic exchange once per
+ *  iteration, reverses it into FIFO order, and applies the commands while
+ *  holding the mutex.  Callers that take the mutex apply any pending
+ *  commands first, so the commands take effect in the order in which they
+ *  were issued.  A producer only signals the eventfd if the owner is blocked
+ *  and has not already been signaled, so a burst of changes (eg, when many
+ *  consoles reconnect at once) costs the owner at most one wakeup.  Changes
+ *  applied directly under epoll do not signal the owner at all since the
+ *  kernel's interest set is updated in place.
  */
 
 
@@ -74,26 +108,69 @@
  *****************************************************************************/
 
 #define TPOLL_ALLOC     256
+#define TPOLL_HASH_SIZE 256             /* initial num timer hash buckets    */
 
 
 /*****************************************************************************
  *  Internal Data Types
  *****************************************************************************/
 
+#if defined(__ATOMIC_SEQ_CST)
+#  define TPOLL_CMD_QUEUE 1
+#  define _tpoll_load(PTR) \
+     __atomic_load_n((PTR), __ATOMIC_SEQ_CST)
+#  define _tpoll_store(PTR, VAL) \
+     __atomic_store_n((PTR), (VAL), __ATOMIC_SEQ_CST)
+#  define _tpoll_exchange(PTR, VAL) \
+     __atomic_exchange_n((PTR), (VAL), __ATOMIC_SEQ_CST)
+#  define _tpoll_cas(PTR, OLD, NEW) \
+     __atomic_compare_exchange_n((PTR), (OLD), (NEW), 1, \
+       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#else  /* !__ATOMIC_SEQ_CST */
+#  define TPOLL_CMD_QUEUE 0
+#  define _tpoll_load(PTR) (*(PTR))
+#  define _tpoll_store(PTR, VAL) (*(PTR) = (VAL))
+#endif /* !__ATOMIC_SEQ_CST */
+
 typedef struct tpoll_timer * _tpoll_timer_t;
 
+typedef struct tpoll_cmd * _tpoll_cmd_t;
+
+typedef enum {
+    TPOLL_CMD_SET,                      /* tpoll_set()                       */
+    TPOLL_CMD_CLEAR,                    /* tpoll_clear()                     */
+    TPOLL_CMD_SET_ARG                   /* tpoll_set_arg()                   */
+} _tpoll_cmd_op_t;
+
 struct tpoll {
     struct pollfd   *fd_array;          /* poll fd array                     */
-    int              fd_pipe[ 2 ];      /* signal pipe for unblocking poll() */
+    void           **fd_args;           /* fd -> arg from tpoll_set_arg()    */
+    int              fd_signal[ 2 ];    /* eventfd/pipe for unblocking poll()*/
+    int              fd_epoll;          /* epoll instance, or -1 for poll()  */
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event *ep_array;       /* epoll ready event array           */
+    int              num_ep_alloc;      /* num epoll_event structs allocated */
+    int              num_ep_ready;      /* num epoll_event structs returned  */
+    int             *ep_file_idx;       /* fd -> index in ep_files, or -1    */
+    int             *ep_files;          /* fds that epoll cannot monitor     */
+    int              num_ep_files;      /* num fds in ep_files in use        */
+#endif /* HAVE_SYS_EPOLL_H */
     int              num_fds_alloc;     /* num pollfd structs allocated      */
     int              num_fds_used;      /* num pollfd structs in use         */
     int              max_fd;            /* max fd in array in use            */
-    _tpoll_timer_t   timers_active;     /* sorted list of active timers      */
+    _tpoll_timer_t  *timers_heap;       /* min-heap of active timers         */
+    int              num_timers_alloc;  /* num timer ptrs allocated in heap  */
+    int              num_timers;        /* num active timers in heap         */
+    _tpoll_timer_t  *timers_hash;       /* hash of active timers by id       */
+    int              num_timers_hash;   /* num hash buckets (power of 2)     */
     int              timers_next_id;    /* next id to be assigned to a timer */
+    _tpoll_cmd_t     cmd_stack;         /* cmds pushed by non-owner threads  */
+    pthread_t        owner;             /* thread that calls tpoll()         */
     pthread_mutex_t  mutex;             /* locking primitive                 */
+    bool             has_owner;         /* flag set once owner is assigned   */
     bool             is_blocked;        /* flag set when blocking on poll()  */
     bool             is_realloced;      /* flag set after fd_array[] realloc */
-    bool             is_signaled;       /* flag set when fd_pipe is signaled */
+    bool             is_signaled;       /* flag set when fd_signal signaled  */
     bool             is_mutex_inited;   /* flag set when mutex initialized   */
 };
 
@@ -102,7 +179,16 @@ struct tpoll_timer {
     callback_f       fnc;               /* callback function                 */
     void            *arg;               /* callback function arg             */
     struct timeval   tv;                /* expiration time                   */
-    _tpoll_timer_t   next;              /* next timer in list                */
+    int              heap_idx;          /* index of timer in timers_heap     */
+    _tpoll_timer_t   hash_next;         /* next timer in hash bucket         */
+};
+
+struct tpoll_cmd {
+    _tpoll_cmd_t     next;              /* next cmd on the cmd stack         */
+    _tpoll_cmd_op_t  op;                /* operation to perform              */
+    int              fd;                /* file descriptor                   */
+    short int        events;            /* events to set or clear            */
+    void            *arg;               /* arg for TPOLL_CMD_SET_ARG         */
 };
 
 
@@ -116,8 +202,46 @@ static void _tpoll_signal_send (tpoll_t tp);
 
 static void _tpoll_signal_recv (tpoll_t tp);
 
+static int _tpoll_signal_create (tpoll_t tp);
+
+static int _tpoll_lock_or_push (tpoll_t tp, _tpoll_cmd_op_t op, int fd,
+    short int events, void *arg);
+
+static int _tpoll_cmd_drain (tpoll_t tp);
+
+static void _tpoll_cmd_free (_tpoll_cmd_t cmd);
+
+static int _tpoll_set_fd (tpoll_t tp, int fd, short int events);
+
+static void _tpoll_clear_fd (tpoll_t tp, int fd, short int events);
+
+static int _tpoll_set_fd_arg (tpoll_t tp, int fd, void *arg);
+
 static int _tpoll_grow (tpoll_t tp, int num_fds_req);
 
+static void _tpoll_epoll_init (tpoll_t tp);
+
+#if HAVE_SYS_EPOLL_H
+static int _tpoll_epoll_grow (tpoll_t tp, int num_fds_old, int num_fds_new);
+#endif /* HAVE_SYS_EPOLL_H */
+
+static int _tpoll_epoll_update (tpoll_t tp, int fd,
+    short int events_old, short int events_new);
+
+static int _tpoll_epoll_wait (tpoll_t tp, int timeout);
+
+static int _tpoll_timer_insert (tpoll_t tp, _tpoll_timer_t t);
+
+static void _tpoll_timer_remove (tpoll_t tp, _tpoll_timer_t t);
+
+static _tpoll_timer_t _tpoll_timer_find (tpoll_t tp, int id);
+
+static int _tpoll_timer_cmp (_tpoll_timer_t t1, _tpoll_timer_t t2);
+
+static void _tpoll_timer_sift_up (tpoll_t tp, int i);
+
+static void _tpoll_timer_sift_down (tpoll_t tp, int i);
+
 static void _tpoll_get_timeval (struct timeval *tvp, int ms);
 
 static int _tpoll_diff_timeval (struct timeval *tvp1, struct timeval *tvp0);
@@ -135,8 +259,6 @@ tpoll_create (int n)
  *  Returns an opaque pointer to this new object, or NULL on error.
  */
     tpoll_t tp = NULL;
-    int     i;
-    int     fval;
     int     e;
 
     assert (TPOLL_ALLOC > 0);
@@ -147,8 +269,26 @@ tpoll_create (int n)
     if (!(tp = malloc (sizeof (struct tpoll)))) {
         goto err;
     }
-    tp->fd_pipe[ 0 ] = tp->fd_pipe[ 1 ] = -1;
-    tp->timers_active = NULL;
+    tp->fd_array = NULL;
+    tp->fd_args = NULL;
+    tp->fd_signal[ 0 ] = tp->fd_signal[ 1 ] = -1;
+    tp->fd_epoll = -1;
+#if HAVE_SYS_EPOLL_H
+    tp->ep_array = NULL;
+    tp->num_ep_alloc = 0;
+    tp->num_ep_ready = 0;
+    tp->ep_file_idx = NULL;
+    tp->ep_files = NULL;
+    tp->num_ep_files = 0;
+#endif /* HAVE_SYS_EPOLL_H */
+    tp->max_fd = -1;
+    tp->timers_heap = NULL;
+    tp->num_timers_alloc = 0;
+    tp->num_timers = 0;
+    tp->timers_hash = NULL;
+    tp->num_timers_hash = 0;
+    tp->cmd_stack = NULL;
+    tp->has_owner = false;
     tp->is_blocked = false;
     tp->is_realloced = false;
     tp->is_signaled = false;
@@ -157,21 +297,24 @@ tpoll_create (int n)
     if (!(tp->fd_array = malloc (n * sizeof (struct pollfd)))) {
         goto err;
     }
+    if (!(tp->fd_args = malloc (n * sizeof (void *)))) {
+        goto err;
+    }
     tp->num_fds_alloc = n;
 
-    if (pipe (tp->fd_pipe) < 0) {
+    if (!(tp->timers_heap = malloc (TPOLL_ALLOC * sizeof (_tpoll_timer_t)))) {
         goto err;
     }
-    for (i = 0; i < 2; i++) {
-        if ((fval = fcntl (tp->fd_pipe[ i ], F_GETFL, 0)) < 0) {
-            goto err;
-        }
-        if (fcntl (tp->fd_pipe[ i ], F_SETFL, fval | O_NONBLOCK) < 0) {
-            goto err;
-        }
-        if (fcntl (tp->fd_pipe[ i ], F_SETFD, FD_CLOEXEC) < 0) {
-            goto err;
-        }
+    tp->num_timers_alloc = TPOLL_ALLOC;
+
+    if (!(tp->timers_hash =
+            calloc (TPOLL_HASH_SIZE, sizeof (_tpoll_timer_t)))) {
+        goto err;
+    }
+    tp->num_timers_hash = TPOLL_HASH_SIZE;
+
+    if (_tpoll_signal_create (tp) < 0) {
+        goto err;
     }
     if ((e = pthread_mutex_init (&tp->mutex, NULL)) != 0) {
         errno = e;
@@ -179,6 +322,8 @@ tpoll_create (int n)
     }
     tp->is_mutex_inited = true;
 
+    _tpoll_epoll_init (tp);
+
     /*  The mutex is not locked here before calling _tpoll_init() because the
      *    object handle (tp) has not yet been returned.
      */
@@ -197,7 +342,6 @@ tpoll_destroy (tpoll_t tp)
 /*  Destroys the tpoll object [tp] and cancels all of its associated timers.
  */
     int            i;
-    _tpoll_timer_t t;
     int            e;
 
     if (!tp) {
@@ -212,16 +356,48 @@ tpoll_destroy (tpoll_t tp)
         free (tp->fd_array);
         tp->fd_array = NULL;
     }
-    for (i = 0; i < 2; i++) {
-        if (tp->fd_pipe[ i ] > -1) {
-            (void) close (tp->fd_pipe[ i ]);
-            tp->fd_pipe[ i ] = -1;
+    if (tp->fd_args) {
+        free (tp->fd_args);
+        tp->fd_args = NULL;
+    }
+    if (tp->fd_epoll > -1) {
+        (void) close (tp->fd_epoll);
+        tp->fd_epoll = -1;
+    }
+#if HAVE_SYS_EPOLL_H
+    if (tp->ep_array) {
+        free (tp->ep_array);
+        tp->ep_array = NULL;
+    }
+    if (tp->ep_file_idx) {
+        free (tp->ep_file_idx);
+        tp->ep_file_idx = NULL;
+    }
+    if (tp->ep_files) {
+        free (tp->ep_files);
+        tp->ep_files = NULL;
+    }
+#endif /* HAVE_SYS_EPOLL_H */
+    if ((tp->fd_signal[ 1 ] > -1)
+            && (tp->fd_signal[ 1 ] != tp->fd_signal[ 0 ])) {
+        (void) close (tp->fd_signal[ 1 ]);
+    }
+    if (tp->fd_signal[ 0 ] > -1) {
+        (void) close (tp->fd_signal[ 0 ]);
+    }
+    tp->fd_signal[ 0 ] = tp->fd_signal[ 1 ] = -1;
+    _tpoll_cmd_free (tp->cmd_stack);
+    tp->cmd_stack = NULL;
+    if (tp->timers_heap) {
+        for (i = 0; i < tp->num_timers; i++) {
+            free (tp->timers_heap[ i ]);
         }
+        free (tp->timers_heap);
+        tp->timers_heap = NULL;
     }
-    while (tp->timers_active) {
-        t = tp->timers_active;
-        tp->timers_active = t->next;
-        free (t);
+    if (tp->timers_hash) {
+        free (tp->timers_hash);
+        tp->timers_hash = NULL;
     }
     if (tp->is_mutex_inited) {
         if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
@@ -260,6 +436,7 @@ tpoll_zero (tpoll_t tp, tpoll_zero_t how)
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
+    _tpoll_cmd_drain (tp);
     _tpoll_init (tp, how);
     _tpoll_signal_send (tp);
 
@@ -276,11 +453,11 @@ tpoll_clear (tpoll_t tp, int fd, short int events)
 {
 /*  Removes the bitwise-OR'd [events] from any existing events for file
  *    descriptor [fd] within the tpoll object [tp].
+ *  If called by a thread other than the owner, the change is queued for
+ *    the owner to apply.
  *  Returns 0 on success, or -1 on error.
  */
-    short int events_new = 0;
-    int       i;
-    int       e;
+    int e;
 
     if (!tp) {
         errno = EINVAL;
@@ -293,36 +470,12 @@ tpoll_clear (tpoll_t tp, int fd, short int events)
     if (events == 0) {
         return (0);
     }
-    if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
-        log_err (errno = e, "Unable to lock tpoll mutex");
+    if (_tpoll_lock_or_push (tp, TPOLL_CMD_CLEAR, fd, events, NULL) == 0) {
+        return (0);
     }
-    if ((fd <= tp->max_fd) && (tp->fd_array[ fd ].fd > -1)) {
-
-        assert (tp->fd_array[ fd ].fd == fd);
-        events_new = tp->fd_array[ fd ].events & ~events;
-        if (tp->fd_array[ fd ].events != events_new) {
-
-            tp->fd_array[ fd ].events = events_new;
-
-            if (events_new == 0) {
-                tp->fd_array[ fd ].revents = 0;
-                tp->fd_array[ fd ].fd = -1;
-                tp->num_fds_used--;
+    _tpoll_cmd_drain (tp);
+    _tpoll_clear_fd (tp, fd, events);
 
-                if (tp->max_fd == fd) {
-                    for (i = fd - 1; i >= 0; i--) {
-                        if (tp->fd_array[ i ].fd > -1) {
-                            break;
-                        }
-                    }
-                    tp->max_fd = i;
-                }
-            }
-            _tpoll_signal_send (tp);
-        }
-    }
-    DPRINTF((21, "tpoll_clear fd=%d e=0x%02x r=0x%02x.\n",
-        fd, events, events_new));
     if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to unlock tpoll mutex");
     }
@@ -352,6 +505,8 @@ tpoll_is_set (tpoll_t tp, int fd, short int events)
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
+    _tpoll_cmd_drain (tp);
+
     if (fd > tp->max_fd) {
         rc = 0;
     }
@@ -377,11 +532,12 @@ tpoll_set (tpoll_t tp, int fd, short int events)
 /*  Adds the bitwise-OR'd [events] to any existing events for file descriptor
  *    [fd] within the tpoll object [tp].
  *  The internal fd table will grow as needed.
+ *  If called by a thread other than the owner, the change is queued for
+ *    the owner to apply; a failure to grow the fd table is then logged.
  *  Returns 0 on success, or -1 on error.
  */
-    int       rc;
-    short int events_new = 0;
-    int       e;
+    int rc;
+    int e;
 
     if (!tp) {
         errno = EINVAL;
@@ -394,38 +550,133 @@ tpoll_set (tpoll_t tp, int fd, short int events)
     if (events == 0) {
         return (0);
     }
+    if (_tpoll_lock_or_push (tp, TPOLL_CMD_SET, fd, events, NULL) == 0) {
+        return (0);
+    }
+    _tpoll_cmd_drain (tp);
+    rc = _tpoll_set_fd (tp, fd, events);
+
+    if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to unlock tpoll mutex");
+    }
+    return (rc);
+}
+
+
+int
+tpoll_set_arg (tpoll_t tp, int fd, void *arg)
+{
+/*  Assigns [arg] to the file descriptor [fd] within the tpoll object [tp].
+ *    This [arg] will be returned by tpoll_get_ready() whenever [fd] is ready.
+ *  The [fd] must already have events specified via tpoll_set(); its [arg]
+ *    will be reset to NULL once all of its events have been cleared.
+ *  If called by a thread other than the owner, the change is queued for
+ *    the owner to apply after any previously-queued tpoll_set() for [fd].
+ *  Returns 0 on success, or -1 on error.
+ */
+    int rc;
+    int e;
+
+    if (!tp) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (fd < 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (_tpoll_lock_or_push (tp, TPOLL_CMD_SET_ARG, fd, 0, arg) == 0) {
+        return (0);
+    }
+    _tpoll_cmd_drain (tp);
+    rc = _tpoll_set_fd_arg (tp, fd, arg);
+
+    if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to unlock tpoll mutex");
+    }
+    return (rc);
+}
+
+
+int
+tpoll_get_ready (tpoll_t tp, tpoll_ready_t *ready, int len)
+{
+/*  Fills the [ready] array (of length [len]) with the file descriptors
+ *    within the tpoll object [tp] that had I/O ready after the last call
+ *    to tpoll().  Each entry contains the fd, its revents, and the arg
+ *    assigned to it via tpoll_set_arg().
+ *  When using epoll, the cost of this is proportional to the number of
+ *    ready file descriptors; o/w, it is proportional to the maximum fd.
+ *  Returns the number of entries filled in, or -1 on error.
+ */
+    int fd;
+    int i;
+    int n = 0;
+    int e;
+
+    if (!tp) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (!ready || (len < 0)) {
+        errno = EINVAL;
+        return (-1);
+    }
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
-    if ((fd >= tp->num_fds_alloc) && (_tpoll_grow (tp, fd + 1) < 0)) {
-        rc = -1;
-    }
-    else {
-        if (tp->fd_array[ fd ].fd < 0) {
-            assert (tp->fd_array[ fd ].events == 0);
-            assert (tp->fd_array[ fd ].revents == 0);
-            tp->fd_array[ fd ].fd = fd;
-            tp->num_fds_used++;
-            if (fd > tp->max_fd) {
-                tp->max_fd = fd;
+    /*  Apply fd changes queued since tpoll() returned so an fd cleared in
+     *    the meantime is not handed back with its old arg.
+     */
+    _tpoll_cmd_drain (tp);
+
+#if HAVE_SYS_EPOLL_H
+    if (tp->fd_epoll > -1) {
+        for (i = 0; (i < tp->num_ep_ready) && (n < len); i++) {
+            fd = tp->ep_array[ i ].data.fd;
+            if ((fd == tp->fd_signal[ 0 ]) || (fd >= tp->num_fds_alloc)) {
+                continue;
             }
-            events_new = events;
+            if ((tp->fd_array[ fd ].fd < 0) || !tp->fd_array[ fd ].revents) {
+                continue;
+            }
+            ready[ n ].fd = fd;
+            ready[ n ].revents = tp->fd_array[ fd ].revents;
+            ready[ n ].arg = tp->fd_args[ fd ];
+            n++;
         }
-        else {
-            events_new = tp->fd_array[ fd ].events | events;
+        for (i = 0; (i < tp->num_ep_files) && (n < len); i++) {
+            fd = tp->ep_files[ i ];
+            if (!tp->fd_array[ fd ].revents) {
+                continue;
+            }
+            ready[ n ].fd = fd;
+            ready[ n ].revents = tp->fd_array[ fd ].revents;
+            ready[ n ].arg = tp->fd_args[ fd ];
+            n++;
         }
-        if (tp->fd_array[ fd ].events != events_new) {
-            tp->fd_array[ fd ].events = events_new;
-            _tpoll_signal_send (tp);
+    }
+    else
+#endif /* HAVE_SYS_EPOLL_H */
+    {
+        for (fd = 0; (fd <= tp->max_fd) && (n < len); fd++) {
+            if ((fd == tp->fd_signal[ 0 ]) || (tp->fd_array[ fd ].fd < 0)) {
+                continue;
+            }
+            if (!tp->fd_array[ fd ].revents) {
+                continue;
+            }
+            ready[ n ].fd = fd;
+            ready[ n ].revents = tp->fd_array[ fd ].revents;
+            ready[ n ].arg = tp->fd_args[ fd ];
+            n++;
         }
-        rc = 0;
     }
-    DPRINTF((21, "tpoll_set fd=%d e=0x%02x r=0x%02x.\n",
-        fd, events, events_new));
+    DPRINTF((21, "tpoll_get_ready n=%d.\n", n));
     if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to unlock tpoll mutex");
     }
-    return (rc);
+    return (n);
 }
 
 
@@ -439,7 +690,6 @@ tpoll_timeout_absolute (tpoll_t tp, callback_f cb, void *arg,
  *  Returns a timer ID > 0 for use with tpoll_timeout_cancel(), or -1 on error.
  */
     _tpoll_timer_t  t;
-    _tpoll_timer_t *t_ptr;
     int             rc;
     int             e;
 
@@ -465,21 +715,21 @@ tpoll_timeout_absolute (tpoll_t tp, callback_f cb, void *arg,
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
-    rc = t->id = tp->timers_next_id++;
+    t->id = tp->timers_next_id++;
     if (tp->timers_next_id <= 0) {
         tp->timers_next_id = 1;
     }
-    t_ptr = &tp->timers_active;
-    while (*t_ptr && !timercmp (tvp, &(*t_ptr)->tv, <)) {
-        t_ptr = &((*t_ptr)->next);
+    if (_tpoll_timer_insert (tp, t) < 0) {
+        free (t);
+        rc = -1;
     }
-    if (*t_ptr == tp->timers_active) {
-        _tpoll_signal_send (tp);
+    else {
+        if (t->heap_idx == 0) {
+            _tpoll_signal_send (tp);
+        }
+        rc = t->id;
+        DPRINTF((22, "tpoll timer set id=%d.\n", t->id));
     }
-    t->next = *t_ptr;
-    *t_ptr = t;
-
-    DPRINTF((22, "tpoll timer set id=%d.\n", t->id));
     if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to unlock tpoll mutex");
     }
@@ -510,7 +760,6 @@ tpoll_timeout_cancel (tpoll_t tp, int id)
  *    or -1 on error.
  */
     _tpoll_timer_t  t;
-    _tpoll_timer_t *t_ptr;
     int             rc;
     int             e;
 
@@ -525,20 +774,15 @@ tpoll_timeout_cancel (tpoll_t tp, int id)
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
-    t_ptr = &tp->timers_active;
-    while (*t_ptr && (id != (*t_ptr)->id)) {
-        t_ptr = &((*t_ptr)->next);
-    }
-    if (!*t_ptr) {
+    if (!(t = _tpoll_timer_find (tp, id))) {
         rc = 0;
     }
     else {
-        DPRINTF((22, "tpoll timer cancel id=%d.\n", (*t_ptr)->id));
-        if (*t_ptr == tp->timers_active) {
+        DPRINTF((22, "tpoll timer cancel id=%d.\n", t->id));
+        if (t->heap_idx == 0) {
             _tpoll_signal_send (tp);
         }
-        t = *t_ptr;
-        *t_ptr = t->next;
+        _tpoll_timer_remove (tp, t);
         free (t);
         rc = 1;
     }
@@ -549,6 +793,39 @@ tpoll_timeout_cancel (tpoll_t tp, int id)
 }
 
 
+int
+tpoll_timeout_count (tpoll_t tp)
+{
+/*  Returns the number of timer events pending in the tpoll object [tp],
+ *    or -1 on error.
+ *  When atomics are available, the count is read without acquiring the
+ *    tpoll mutex so it can be sampled by another thread without contending
+ *    with tpoll(); it is only a snapshot and may be momentarily stale.
+ */
+    int n;
+#if ! TPOLL_CMD_QUEUE
+    int e;
+#endif /* !TPOLL_CMD_QUEUE */
+
+    if (!tp) {
+        errno = EINVAL;
+        return (-1);
+    }
+#if TPOLL_CMD_QUEUE
+    n = _tpoll_load (&tp->num_timers);
+#else  /* !TPOLL_CMD_QUEUE */
+    if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to lock tpoll mutex");
+    }
+    n = tp->num_timers;
+    if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to unlock tpoll mutex");
+    }
+#endif /* !TPOLL_CMD_QUEUE */
+    return (n);
+}
+
+
 int
 tpoll (tpoll_t tp, int ms)
 {
@@ -571,6 +848,7 @@ tpoll (tpoll_t tp, int ms)
     int             timeout;
     int             ms_diff;
     int             n;
+    int             i;
     int             e;
 
     if (!tp) {
@@ -583,19 +861,27 @@ tpoll (tpoll_t tp, int ms)
     if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
         log_err (errno = e, "Unable to lock tpoll mutex");
     }
+    if (!tp->has_owner) {
+        tp->owner = pthread_self ();
+        _tpoll_store (&tp->has_owner, true);
+    }
     DPRINTF((23, "tpoll enter ms=%d nfd=%d mfd=%d.\n",
         ms, tp->num_fds_used, tp->max_fd));
     _tpoll_get_timeval (&tv_now, 0);
 
     for (;;) {
+        /*
+         *  Apply fd changes queued by other threads.
+         */
+        _tpoll_cmd_drain (tp);
         /*
          *  Dispatch timer events that have expired.
          */
-        while (tp->timers_active
-                && !timercmp (&tp->timers_active->tv, &tv_now, >)) {
+        while ((tp->num_timers > 0)
+                && !timercmp (&tp->timers_heap[ 0 ]->tv, &tv_now, >)) {
 
-            t = tp->timers_active;
-            tp->timers_active = t->next;
+            t = tp->timers_heap[ 0 ];
+            _tpoll_timer_remove (tp, t);
             DPRINTF((22, "tpoll timer dispatch id=%d.\n", t->id));
             /*
              *  Release the mutex while performing the callback function
@@ -616,7 +902,7 @@ tpoll (tpoll_t tp, int ms)
         if (ms == 0) {
             timeout = 0;
         }
-        else if ((ms < 0) && !tp->timers_active) {
+        else if ((ms < 0) && !tp->num_timers) {
             if (tp->num_fds_used > 0) {
                 timeout = -1;           /* fd events but no more timers */
             }
@@ -628,19 +914,19 @@ tpoll (tpoll_t tp, int ms)
             _tpoll_get_timeval (&tv_now, 0);
 
             if (ms < 0) {
-                assert (tp->timers_active != NULL);
+                assert (tp->num_timers > 0);
                 ms_diff =
-                    _tpoll_diff_timeval (&tp->timers_active->tv, &tv_now);
+                    _tpoll_diff_timeval (&tp->timers_heap[ 0 ]->tv, &tv_now);
             }
-            else if (!tp->timers_active) {
+            else if (!tp->num_timers) {
                 assert (ms > 0);
                 ms_diff =
                     _tpoll_diff_timeval (&tv_timeout, &tv_now);
             }
-            else if (!timercmp (&tp->timers_active->tv, &tv_timeout, >)) {
+            else if (!timercmp (&tp->timers_heap[ 0 ]->tv, &tv_timeout, >)) {
                 assert (ms > 0);
                 ms_diff =
-                    _tpoll_diff_timeval (&tp->timers_active->tv, &tv_now);
+                    _tpoll_diff_timeval (&tp->timers_heap[ 0 ]->tv, &tv_now);
             }
             else {
                 assert (ms > 0);
@@ -649,10 +935,39 @@ tpoll (tpoll_t tp, int ms)
             }
             timeout = (ms_diff > 0) ? ms_diff : 0;
         }
-        /*  Poll for events, discarding any on the "signaling pipe".
+        /*  Poll for events, discarding any on the "signaling fd".
+         *  The cmd stack is re-checked after is_blocked is set since a
+         *    producer that pushed a cmd before then will not have signaled.
          */
-        tp->is_blocked = true;
+        _tpoll_store (&tp->is_blocked, true);
+        if (_tpoll_load (&tp->cmd_stack) != NULL) {
+            timeout = 0;
+        }
 
+        if (tp->fd_epoll > -1) {
+            /*
+             *  The mutex is released and re-acquired within.
+             */
+            n = _tpoll_epoll_wait (tp, timeout);
+            _tpoll_store (&tp->is_blocked, false);
+
+            if (n < 0) {
+                break;
+            }
+            if (n > 0) {
+                assert (tp->num_fds_used > 0);
+                break;
+            }
+            if ((ms == 0)
+                    || ((ms < 0) && !tp->num_fds_used && !tp->num_timers)) {
+                break;
+            }
+            _tpoll_get_timeval (&tv_now, 0);
+            if ((ms > 0) && !timercmp (&tv_timeout, &tv_now, >)) {
+                break;
+            }
+            continue;
+        }
         if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
             log_err (errno = e, "Unable to unlock tpoll mutex");
         }
@@ -663,7 +978,7 @@ tpoll (tpoll_t tp, int ms)
         if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
             log_err (errno = e, "Unable to lock tpoll mutex");
         }
-        tp->is_blocked = false;
+        _tpoll_store (&tp->is_blocked, false);
 
         if (n < 0) {
             break;
@@ -674,16 +989,27 @@ tpoll (tpoll_t tp, int ms)
             _tpoll_signal_recv (tp);
             continue;
         }
-        if (tp->fd_array[ tp->fd_pipe[ 0 ] ].revents & POLLIN) {
+        if (tp->fd_array[ tp->fd_signal[ 0 ] ].revents & POLLIN) {
             _tpoll_signal_recv (tp);
             n--;
         }
+        /*  Apply fd changes queued while poll() was blocked.  Clearing an
+         *    fd resets its revents, so the ready fds must then be recounted.
+         */
+        if (_tpoll_cmd_drain (tp) > 0) {
+            for (n = 0, i = 0; i <= tp->max_fd; i++) {
+                if ((i != tp->fd_signal[ 0 ]) && (tp->fd_array[ i ].fd > -1)
+                        && tp->fd_array[ i ].revents) {
+                    n++;
+                }
+            }
+        }
         if (n > 0) {
             assert (tp->num_fds_used > 0);
             break;
         }
         if ((ms == 0)
-                || ((ms < 0) && !tp->num_fds_used && !tp->timers_active)) {
+                || ((ms < 0) && !tp->num_fds_used && !tp->num_timers)) {
             break;
         }
         _tpoll_get_timeval (&tv_now, 0);
@@ -710,68 +1036,250 @@ _tpoll_init (tpoll_t tp, tpoll_zero_t how)
  *  This routine assumes the [tp] mutex is already locked.
  */
     int            i;
-    _tpoll_timer_t t;
 
     assert (tp != NULL);
-    assert (tp->fd_pipe[ 0 ] > -1);
+    assert (tp->fd_signal[ 0 ] > -1);
     assert (tp->num_fds_alloc > 0);
     assert ((how & ~TPOLL_ZERO_ALL) == 0);
 
     if (how & TPOLL_ZERO_FDS) {
+        if (tp->fd_epoll > -1) {
+            for (i = 0; i <= tp->max_fd; i++) {
+                if ((i != tp->fd_signal[ 0 ]) && (tp->fd_array[ i ].fd > -1)) {
+                    (void) _tpoll_epoll_update (tp, i,
+                        tp->fd_array[ i ].events, 0);
+                }
+            }
+#if HAVE_SYS_EPOLL_H
+            tp->num_ep_ready = 0;
+            assert (tp->num_ep_files == 0);
+#endif /* HAVE_SYS_EPOLL_H */
+        }
         memset (tp->fd_array, 0, tp->num_fds_alloc * sizeof (struct pollfd));
         for (i = 0; i < tp->num_fds_alloc; i++) {
             tp->fd_array[ i ].fd = -1;
+            tp->fd_args[ i ] = NULL;
         }
-        tp->fd_array[ tp->fd_pipe[ 0 ] ].fd = tp->fd_pipe[ 0 ];
-        tp->fd_array[ tp->fd_pipe[ 0 ] ].events = POLLIN;
-        tp->max_fd = tp->fd_pipe[ 0 ];
+        tp->fd_array[ tp->fd_signal[ 0 ] ].fd = tp->fd_signal[ 0 ];
+        tp->fd_array[ tp->fd_signal[ 0 ] ].events = POLLIN;
+        tp->max_fd = tp->fd_signal[ 0 ];
         tp->num_fds_used = 0;
     }
     if (how & TPOLL_ZERO_TIMERS) {
-        while (tp->timers_active) {
-            t = tp->timers_active;
-            tp->timers_active = t->next;
-            free (t);
+        for (i = 0; i < tp->num_timers; i++) {
+            free (tp->timers_heap[ i ]);
         }
+        tp->num_timers = 0;
+        memset (tp->timers_hash, 0,
+            tp->num_timers_hash * sizeof (_tpoll_timer_t));
         tp->timers_next_id = 1;
     }
     return;
 }
 
 
-static void
-_tpoll_signal_send (tpoll_t tp)
+static int
+_tpoll_set_fd (tpoll_t tp, int fd, short int events)
 {
-/*  Signals the tpoll object [tp] that an fd or timer or somesuch has changed
- *    and poll() needs to unblock and re-examine its state.
+/*  Adds the bitwise-OR'd [events] to any existing events for file descriptor
+ *    [fd] within the tpoll object [tp].
+ *  Returns 0 on success, or -1 on error.
  *  This routine assumes the [tp] mutex is already locked.
  */
-    int           n;
-    unsigned char c = 0;
-
-    assert (tp != NULL);
-    assert (tp->fd_pipe[ 1 ] > -1);
+    int       rc;
+    short int events_new = 0;
 
-    if (tp->is_signaled || !tp->is_blocked) {
-        return;
+    if ((fd >= tp->num_fds_alloc) && (_tpoll_grow (tp, fd + 1) < 0)) {
+        rc = -1;
     }
-    for (;;) {
-        n = write (tp->fd_pipe[ 1 ], &c, 1);
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                break;
+    else {
+        if (tp->fd_array[ fd ].fd < 0) {
+            assert (tp->fd_array[ fd ].events == 0);
+            assert (tp->fd_array[ fd ].revents == 0);
+            tp->fd_array[ fd ].fd = fd;
+            tp->num_fds_used++;
+            if (fd > tp->max_fd) {
+                tp->max_fd = fd;
             }
-            log_err (errno, "Unable to write signal to tpoll");
+            events_new = events;
         }
-        else if (n == 0) {
-            log_err (0, "Got an unexpected 0 writing to tpoll's pipe");
+        else {
+            events_new = tp->fd_array[ fd ].events | events;
         }
-        break;
+        if (tp->fd_array[ fd ].events != events_new) {
+            if (_tpoll_epoll_update (tp, fd,
+                    tp->fd_array[ fd ].events, events_new)) {
+                _tpoll_signal_send (tp);
+            }
+            tp->fd_array[ fd ].events = events_new;
+        }
+        rc = 0;
+    }
+    DPRINTF((21, "tpoll_set fd=%d e=0x%02x r=0x%02x.\n",
+        fd, events, events_new));
+    return (rc);
+}
+
+
+static void
+_tpoll_clear_fd (tpoll_t tp, int fd, short int events)
+{
+/*  Removes the bitwise-OR'd [events] from any existing events for file
+ *    descriptor [fd] within the tpoll object [tp].
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    short int events_new = 0;
+    int       is_signal_needed;
+    int       i;
+
+    if ((fd <= tp->max_fd) && (tp->fd_array[ fd ].fd > -1)) {
+
+        assert (tp->fd_array[ fd ].fd == fd);
+        events_new = tp->fd_array[ fd ].events & ~events;
+        if (tp->fd_array[ fd ].events != events_new) {
+
+            is_signal_needed = _tpoll_epoll_update (tp, fd,
+                tp->fd_array[ fd ].events, events_new);
+            tp->fd_array[ fd ].events = events_new;
+
+            if (events_new == 0) {
+                tp->fd_array[ fd ].revents = 0;
+                tp->fd_array[ fd ].fd = -1;
+                tp->fd_args[ fd ] = NULL;
+                tp->num_fds_used--;
+
+                if (tp->max_fd == fd) {
+                    for (i = fd - 1; i >= 0; i--) {
+                        if (tp->fd_array[ i ].fd > -1) {
+                            break;
+                        }
+                    }
+                    tp->max_fd = i;
+                }
+            }
+            if (is_signal_needed) {
+                _tpoll_signal_send (tp);
+            }
+        }
+    }
+    DPRINTF((21, "tpoll_clear fd=%d e=0x%02x r=0x%02x.\n",
+        fd, events, events_new));
+    return;
+}
+
+
+static int
+_tpoll_set_fd_arg (tpoll_t tp, int fd, void *arg)
+{
+/*  Assigns [arg] to the file descriptor [fd] within the tpoll object [tp].
+ *  Returns 0 on success, or -1 on error.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    int rc;
+
+    if ((fd > tp->max_fd) || (tp->fd_array[ fd ].fd < 0)) {
+        errno = ENOENT;
+        rc = -1;
+    }
+    else {
+        tp->fd_args[ fd ] = arg;
+        rc = 0;
+    }
+    DPRINTF((21, "tpoll_set_arg fd=%d rc=%d.\n", fd, rc));
+    return (rc);
+}
+
+
+
+static int
+_tpoll_signal_create (tpoll_t tp)
+{
+/*  Creates the "signaling fd" used to unblock the tpoll object [tp].
+ *  An eventfd is preferred since it needs only a single descriptor and any
+ *    number of pending signals can be drained with a single read(); if it
+ *    is not available, a pipe is used instead.
+ *  Returns 0 on success, or -1 on error.
+ */
+    int i;
+    int fval;
+
+    assert (tp != NULL);
+    assert (tp->fd_signal[ 0 ] < 0);
+
+#if HAVE_SYS_EVENTFD_H
+    if ((tp->fd_signal[ 0 ] = eventfd (0, 0)) > -1) {
+        tp->fd_signal[ 1 ] = tp->fd_signal[ 0 ];
+        DPRINTF((21, "tpoll signaling via eventfd.\n"));
+    }
+    else
+#endif /* HAVE_SYS_EVENTFD_H */
+    if (pipe (tp->fd_signal) < 0) {
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        if ((fval = fcntl (tp->fd_signal[ i ], F_GETFL, 0)) < 0) {
+            return (-1);
+        }
+        if (fcntl (tp->fd_signal[ i ], F_SETFL, fval | O_NONBLOCK) < 0) {
+            return (-1);
+        }
+        if (fcntl (tp->fd_signal[ i ], F_SETFD, FD_CLOEXEC) < 0) {
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+
+static void
+_tpoll_signal_send (tpoll_t tp)
+{
+/*  Signals the tpoll object [tp] that an fd or timer or somesuch has changed
+ *    and poll() needs to unblock and re-examine its state.
+ *  Only a blocked owner is signaled, and only once until it wakes.
+ *  This routine does not require the [tp] mutex to be locked unless
+ *    atomic builtins are unavailable.
+ */
+    int      n;
+    uint64_t c = 1;
+    size_t   len;
+
+    assert (tp != NULL);
+    assert (tp->fd_signal[ 1 ] > -1);
+
+    if (!_tpoll_load (&tp->is_blocked)) {
+        return;
+    }
+#if TPOLL_CMD_QUEUE
+    if (_tpoll_exchange (&tp->is_signaled, true)) {
+        return;
+    }
+#else  /* !TPOLL_CMD_QUEUE */
+    if (tp->is_signaled) {
+        return;
     }
     tp->is_signaled = true;
+#endif /* !TPOLL_CMD_QUEUE */
+
+    /*  An eventfd requires an 8-byte counter; a pipe only needs a byte.
+     */
+    len = (tp->fd_signal[ 1 ] == tp->fd_signal[ 0 ]) ? sizeof (c) : 1;
+    for (;;) {
+        n = write (tp->fd_signal[ 1 ], &c, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            log_err (errno, "Unable to write signal to tpoll");
+        }
+        else if (n == 0) {
+            log_err (0, "Got an unexpected 0 writing to tpoll's signal fd");
+        }
+        break;
+    }
     DPRINTF((24, "tpoll signal sent.\n"));
     return;
 }
@@ -781,20 +1289,21 @@ static void
 _tpoll_signal_recv (tpoll_t tp)
 {
 /*  Drains all signals sent to the tpoll object [tp].
+ *  The is_signaled flag is reset before draining so a signal sent while
+ *    draining is never lost; at worst, it causes one spurious wakeup.
  *  This routine assumes the [tp] mutex is already locked.
  */
-    int           n;
-    unsigned char c[ 2 ];
+    int      n;
+    uint64_t c;
 
     assert (tp != NULL);
-    assert (tp->fd_pipe[ 0 ] > -1);
-    assert (tp->fd_array[ tp->fd_pipe[ 0 ] ].fd == tp->fd_pipe[ 0 ]);
+    assert (tp->fd_signal[ 0 ] > -1);
+    assert (tp->fd_array[ tp->fd_signal[ 0 ] ].fd == tp->fd_signal[ 0 ]);
+
+    _tpoll_store (&tp->is_signaled, false);
 
-    if (!tp->is_signaled) {
-        return;
-    }
     for (;;) {
-        n = read (tp->fd_pipe[ 0 ], &c, sizeof (c));
+        n = read (tp->fd_signal[ 0 ], &c, sizeof (c));
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -807,18 +1316,141 @@ _tpoll_signal_recv (tpoll_t tp)
         else if (n == 0) {
             log_err (0, "Got an unexpected EOF reading from tpoll's pipe");
         }
-        else if (n == sizeof (c)) {
-            assert (0);                 /* is_signaled should prevent this */
-            continue;
+        else if ((n == sizeof (c))
+                && (tp->fd_signal[ 0 ] != tp->fd_signal[ 1 ])) {
+            continue;                   /* pipe may hold more signals */
         }
         break;
     }
-    tp->is_signaled = false;
     DPRINTF((24, "tpoll signal received.\n"));
     return;
 }
 
 
+static int
+_tpoll_lock_or_push (tpoll_t tp, _tpoll_cmd_op_t op, int fd,
+    short int events, void *arg)
+{
+/*  Prepares to apply an fd change [op] to the tpoll object [tp].
+ *  The owner (or any thread before the owner is known) locks the mutex.
+ *    Other threads only take the mutex if it is free; o/w, the change is
+ *    queued on the cmd stack for the owner to apply so the caller never
+ *    waits on the mutex.
+ *  Returns 0 if the change was queued, or 1 if the [tp] mutex is now locked
+ *    and the caller must apply the change and unlock it.
+ */
+#if TPOLL_CMD_QUEUE
+    _tpoll_cmd_t cmd;
+    _tpoll_cmd_t head;
+#endif /* TPOLL_CMD_QUEUE */
+    int          e;
+
+    assert (tp != NULL);
+
+#if TPOLL_CMD_QUEUE
+    if (_tpoll_load (&tp->has_owner)
+            && !pthread_equal (tp->owner, pthread_self ())) {
+
+        if ((e = pthread_mutex_trylock (&tp->mutex)) == 0) {
+            return (1);
+        }
+        if (e != EBUSY) {
+            log_err (errno = e, "Unable to lock tpoll mutex");
+        }
+        if ((cmd = malloc (sizeof (struct tpoll_cmd)))) {
+            cmd->op = op;
+            cmd->fd = fd;
+            cmd->events = events;
+            cmd->arg = arg;
+
+            head = _tpoll_load (&tp->cmd_stack);
+            do {
+                cmd->next = head;
+            } while (!_tpoll_cas (&tp->cmd_stack, &head, cmd));
+
+            DPRINTF((21, "tpoll cmd queued op=%d fd=%d.\n", op, fd));
+            _tpoll_signal_send (tp);
+            return (0);
+        }
+    }
+#endif /* TPOLL_CMD_QUEUE */
+
+    if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to lock tpoll mutex");
+    }
+    return (1);
+}
+
+
+static int
+_tpoll_cmd_drain (tpoll_t tp)
+{
+/*  Applies the fd changes queued on the cmd stack of the tpoll object [tp]
+ *    in the order in which they were queued.
+ *  Returns the number of changes applied.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    int          n = 0;
+#if TPOLL_CMD_QUEUE
+    _tpoll_cmd_t cmd;
+    _tpoll_cmd_t next;
+    _tpoll_cmd_t fifo = NULL;
+
+    assert (tp != NULL);
+
+    if (_tpoll_load (&tp->cmd_stack) == NULL) {
+        return (0);
+    }
+    cmd = _tpoll_exchange (&tp->cmd_stack, NULL);
+
+    /*  Reverse the LIFO stack into FIFO order.
+     */
+    while (cmd) {
+        next = cmd->next;
+        cmd->next = fifo;
+        fifo = cmd;
+        cmd = next;
+    }
+    for (cmd = fifo; cmd; cmd = next) {
+        next = cmd->next;
+        switch (cmd->op) {
+        case TPOLL_CMD_SET:
+            if (_tpoll_set_fd (tp, cmd->fd, cmd->events) < 0) {
+                log_msg (LOG_WARNING,
+                    "Unable to set tpoll events for fd=%d: %s",
+                    cmd->fd, strerror (errno));
+            }
+            break;
+        case TPOLL_CMD_CLEAR:
+            _tpoll_clear_fd (tp, cmd->fd, cmd->events);
+            break;
+        case TPOLL_CMD_SET_ARG:
+            (void) _tpoll_set_fd_arg (tp, cmd->fd, cmd->arg);
+            break;
+        }
+        free (cmd);
+        n++;
+    }
+#endif /* TPOLL_CMD_QUEUE */
+    return (n);
+}
+
+
+static void
+_tpoll_cmd_free (_tpoll_cmd_t cmd)
+{
+/*  Frees the list of cmds [cmd] without applying them.
+ */
+    _tpoll_cmd_t next;
+
+    while (cmd) {
+        next = cmd->next;
+        free (cmd);
+        cmd = next;
+    }
+    return;
+}
+
 static int
 _tpoll_grow (tpoll_t tp, int num_fds_req)
 {
@@ -828,6 +1460,7 @@ _tpoll_grow (tpoll_t tp, int num_fds_req)
  */
     struct pollfd *fd_array_tmp;
     struct pollfd *fd_array_new;
+    void         **fd_args_tmp;
     int            num_fds_tmp;
     int            num_fds_new;
     int            i;
@@ -848,25 +1481,570 @@ _tpoll_grow (tpoll_t tp, int num_fds_req)
     /*  Force tpoll()'s poll() to unblock before we realloc the fd_array.
      *  Then tpoll() will have to re-acquire the mutex before continuing.
      *  Since we currently have the mutex, we can now safely realloc fd_array.
+     *  This is not needed for epoll since the kernel never sees fd_array.
      */
-    _tpoll_signal_send (tp);
+    if (tp->fd_epoll < 0) {
+        _tpoll_signal_send (tp);
+    }
     if (!(fd_array_tmp =
             realloc (tp->fd_array, num_fds_tmp * sizeof (struct pollfd)))) {
         return (-1);
     }
+    tp->fd_array = fd_array_tmp;
+    if (tp->fd_epoll < 0) {
+        tp->is_realloced = true;
+    }
+    if (!(fd_args_tmp = realloc (tp->fd_args, num_fds_tmp * sizeof (void *)))) {
+        return (-1);
+    }
+    tp->fd_args = fd_args_tmp;
+
     fd_array_new = fd_array_tmp + tp->num_fds_alloc;
     num_fds_new = num_fds_tmp - tp->num_fds_alloc;
     memset (fd_array_new, 0, num_fds_new * sizeof (struct pollfd));
     for (i = tp->num_fds_alloc; i < num_fds_tmp; i++) {
         fd_array_tmp[ i ].fd = -1;
+        fd_args_tmp[ i ] = NULL;
     }
-    tp->is_realloced = true;
-    tp->fd_array = fd_array_tmp;
+#if HAVE_SYS_EPOLL_H
+    if (tp->fd_epoll > -1) {
+        if (_tpoll_epoll_grow (tp, tp->num_fds_alloc, num_fds_tmp) < 0) {
+            return (-1);
+        }
+    }
+#endif /* HAVE_SYS_EPOLL_H */
     tp->num_fds_alloc = num_fds_tmp;
     return (0);
 }
 
 
+static void
+_tpoll_epoll_init (tpoll_t tp)
+{
+/*  Attempts to create an epoll instance for the tpoll object [tp].
+ *  On failure (or if epoll is not supported), [tp] falls back to poll().
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    assert (tp != NULL);
+    assert (tp->fd_signal[ 0 ] > -1);
+    assert (tp->fd_epoll < 0);
+
+#ifdef TPOLL_NO_EPOLL
+    DPRINTF((21, "tpoll epoll disabled at compile-time.\n"));
+    return;
+#endif /* TPOLL_NO_EPOLL */
+    if ((tp->fd_epoll = epoll_create (TPOLL_ALLOC)) < 0) {
+        DPRINTF((21, "tpoll epoll unavailable: %s.\n", strerror (errno)));
+        return;
+    }
+    if (fcntl (tp->fd_epoll, F_SETFD, FD_CLOEXEC) < 0) {
+        goto err;
+    }
+    if (!(tp->ep_array = malloc (TPOLL_ALLOC * sizeof (struct epoll_event)))) {
+        goto err;
+    }
+    tp->num_ep_alloc = TPOLL_ALLOC;
+    tp->num_ep_ready = 0;
+
+    if (_tpoll_epoll_grow (tp, 0, tp->num_fds_alloc) < 0) {
+        goto err;
+    }
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = tp->fd_signal[ 0 ];
+    if (epoll_ctl (tp->fd_epoll, EPOLL_CTL_ADD, tp->fd_signal[ 0 ], &ev) < 0) {
+        goto err;
+    }
+    DPRINTF((21, "tpoll using epoll.\n"));
+    return;
+
+err:
+    DPRINTF((21, "tpoll epoll unavailable: %s.\n", strerror (errno)));
+    if (tp->ep_array) {
+        free (tp->ep_array);
+        tp->ep_array = NULL;
+    }
+    tp->num_ep_alloc = 0;
+    if (tp->ep_file_idx) {
+        free (tp->ep_file_idx);
+        tp->ep_file_idx = NULL;
+    }
+    if (tp->ep_files) {
+        free (tp->ep_files);
+        tp->ep_files = NULL;
+    }
+    (void) close (tp->fd_epoll);
+    tp->fd_epoll = -1;
+#endif /* HAVE_SYS_EPOLL_H */
+    return;
+}
+
+
+#if HAVE_SYS_EPOLL_H
+static int
+_tpoll_epoll_grow (tpoll_t tp, int num_fds_old, int num_fds_new)
+{
+/*  Grows [tp]'s epoll file tables from [num_fds_old] to [num_fds_new] fds.
+ *  Returns 0 if the request is successful, -1 if not.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    int *ep_file_idx_tmp;
+    int *ep_files_tmp;
+    int  i;
+
+    assert (tp != NULL);
+    assert (num_fds_new > num_fds_old);
+
+    if (!(ep_file_idx_tmp =
+            realloc (tp->ep_file_idx, num_fds_new * sizeof (int)))) {
+        return (-1);
+    }
+    tp->ep_file_idx = ep_file_idx_tmp;
+    for (i = num_fds_old; i < num_fds_new; i++) {
+        tp->ep_file_idx[ i ] = -1;
+    }
+    if (!(ep_files_tmp = realloc (tp->ep_files, num_fds_new * sizeof (int)))) {
+        return (-1);
+    }
+    tp->ep_files = ep_files_tmp;
+    return (0);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+
+static int
+_tpoll_epoll_update (tpoll_t tp, int fd,
+    short int events_old, short int events_new)
+{
+/*  Updates the epoll interest set of the tpoll object [tp] for file
+ *    descriptor [fd] whose poll events are changing from [events_old]
+ *    to [events_new].
+ *  Since epoll_ctl() operates on the kernel's interest set directly, a thread
+ *    blocked in epoll_wait() does not need to be signaled for the change.
+ *  This routine is a no-op if [tp] is using poll().
+ *  Returns non-zero if a thread blocked in tpoll() must be signaled for the
+ *    change to take effect (ie, if [tp] is using poll(), or if [fd] is a
+ *    regular file that epoll cannot monitor), or 0 otherwise.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    int                op;
+    int                i;
+
+    assert (tp != NULL);
+    assert (fd >= 0);
+
+    if (tp->fd_epoll < 0) {
+        return (1);
+    }
+    /*  Regular files are always ready for I/O, but epoll refuses to monitor
+     *    them.  These fds are tracked separately and reported as ready by
+     *    _tpoll_epoll_wait() whenever they have events of interest.
+     */
+    if ((i = tp->ep_file_idx[ fd ]) > -1) {
+        if (events_new == 0) {
+            tp->num_ep_files--;
+            tp->ep_files[ i ] = tp->ep_files[ tp->num_ep_files ];
+            tp->ep_file_idx[ tp->ep_files[ i ] ] = i;
+            tp->ep_file_idx[ fd ] = -1;
+        }
+        return (events_new != 0);
+    }
+    memset (&ev, 0, sizeof (ev));
+    ev.data.fd = fd;
+    if (events_new & POLLIN) {
+        ev.events |= EPOLLIN;
+    }
+    if (events_new & POLLPRI) {
+        ev.events |= EPOLLPRI;
+    }
+    if (events_new & POLLOUT) {
+        ev.events |= EPOLLOUT;
+    }
+    if (events_new == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+    else if (events_old == 0) {
+        op = EPOLL_CTL_ADD;
+    }
+    else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl (tp->fd_epoll, op, fd, &ev) == 0) {
+        return (0);
+    }
+    /*  The fd may have been closed and re-opened without being cleared,
+     *    in which case the kernel will have silently dropped it from the
+     *    interest set.
+     */
+    if ((op == EPOLL_CTL_MOD) && (errno == ENOENT)) {
+        if (epoll_ctl (tp->fd_epoll, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            return (0);
+        }
+    }
+    else if ((op == EPOLL_CTL_ADD) && (errno == EPERM)) {
+        assert (fd < tp->num_fds_alloc);
+        tp->ep_files[ tp->num_ep_files ] = fd;
+        tp->ep_file_idx[ fd ] = tp->num_ep_files;
+        tp->num_ep_files++;
+        return (1);
+    }
+    else if ((op == EPOLL_CTL_ADD) && (errno == EEXIST)) {
+        if (epoll_ctl (tp->fd_epoll, EPOLL_CTL_MOD, fd, &ev) == 0) {
+            return (0);
+        }
+    }
+    else if ((op == EPOLL_CTL_DEL) && ((errno == ENOENT) || (errno == EBADF))) {
+        return (0);
+    }
+    log_msg (LOG_WARNING, "Unable to update epoll for fd=%d: %s",
+        fd, strerror (errno));
+    return (0);
+
+#else  /* !HAVE_SYS_EPOLL_H */
+    return (1);
+#endif /* !HAVE_SYS_EPOLL_H */
+}
+
+
+static int
+_tpoll_epoll_wait (tpoll_t tp, int timeout)
+{
+/*  Waits up to [timeout] milliseconds for I/O events on the tpoll object [tp]
+ *    via epoll_wait(), updating the revents in fd_array[] accordingly.
+ *  The revents of file descriptors that were ready after the previous call
+ *    are reset first, so only those fds reported now will be ready.
+ *  Returns the number of file descriptors with I/O ready (excluding the
+ *    "signaling pipe"), 0 on timeout, or -1 on error.
+ *  This routine assumes the [tp] mutex is already locked; it will be released
+ *    while blocked in epoll_wait() and re-acquired before returning.
+ */
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event *ep_array_tmp;
+    int                 num_ep_tmp;
+    int                 fd;
+    short int           revents;
+    int                 i;
+    int                 n;
+    int                 e;
+
+    assert (tp != NULL);
+    assert (tp->fd_epoll > -1);
+
+    for (i = 0; i < tp->num_ep_ready; i++) {
+        fd = tp->ep_array[ i ].data.fd;
+        if (fd < tp->num_fds_alloc) {
+            tp->fd_array[ fd ].revents = 0;
+        }
+    }
+    tp->num_ep_ready = 0;
+
+    for (i = 0; i < tp->num_ep_files; i++) {
+        tp->fd_array[ tp->ep_files[ i ] ].revents = 0;
+    }
+    if (tp->num_ep_files > 0) {
+        timeout = 0;
+    }
+    /*  The ep_array is only accessed by the thread in tpoll(), so it can be
+     *    safely resized here before the mutex is released.
+     */
+    if (tp->num_ep_alloc <= tp->num_fds_used) {
+        num_ep_tmp = tp->num_ep_alloc;
+        while (num_ep_tmp <= tp->num_fds_used) {
+            num_ep_tmp *= 2;
+        }
+        ep_array_tmp = realloc (tp->ep_array,
+            num_ep_tmp * sizeof (struct epoll_event));
+        if (ep_array_tmp) {
+            tp->ep_array = ep_array_tmp;
+            tp->num_ep_alloc = num_ep_tmp;
+        }
+    }
+    if ((e = pthread_mutex_unlock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to unlock tpoll mutex");
+    }
+    DPRINTF((25, "tpoll epoll enter ms=%d nfd=%d.\n",
+        timeout, tp->num_fds_used));
+    n = epoll_wait (tp->fd_epoll, tp->ep_array, tp->num_ep_alloc, timeout);
+    DPRINTF((25, "tpoll epoll return n=%d.\n", n));
+
+    if ((e = pthread_mutex_lock (&tp->mutex)) != 0) {
+        log_err (errno = e, "Unable to lock tpoll mutex");
+    }
+    if (n < 0) {
+        return (-1);
+    }
+    /*  Apply fd changes queued while epoll_wait() was blocked before the
+     *    events are recorded, so events for fds cleared in the meantime
+     *    are discarded below.
+     */
+    _tpoll_cmd_drain (tp);
+
+    tp->num_ep_ready = n;
+
+    for (i = 0; i < tp->num_ep_ready; i++) {
+        fd = tp->ep_array[ i ].data.fd;
+        if (fd == tp->fd_signal[ 0 ]) {
+            _tpoll_signal_recv (tp);
+            n--;
+            continue;
+        }
+        /*  Discard events for fds that were cleared while epoll_wait() was
+         *    blocked, either directly or via the cmd stack drained above.
+         */
+        if ((fd >= tp->num_fds_alloc) || (tp->fd_array[ fd ].fd < 0)) {
+            n--;
+            continue;
+        }
+        revents = 0;
+        if (tp->ep_array[ i ].events & EPOLLIN) {
+            revents |= POLLIN;
+        }
+        if (tp->ep_array[ i ].events & EPOLLPRI) {
+            revents |= POLLPRI;
+        }
+        if (tp->ep_array[ i ].events & EPOLLOUT) {
+            revents |= POLLOUT;
+        }
+        if (tp->ep_array[ i ].events & EPOLLERR) {
+            revents |= POLLERR;
+        }
+        if (tp->ep_array[ i ].events & EPOLLHUP) {
+            revents |= POLLHUP;
+        }
+        tp->fd_array[ fd ].revents = revents;
+    }
+    for (i = 0; i < tp->num_ep_files; i++) {
+        fd = tp->ep_files[ i ];
+        revents = tp->fd_array[ fd ].events & (POLLIN | POLLOUT);
+        if (revents) {
+            tp->fd_array[ fd ].revents = revents;
+            n++;
+        }
+    }
+    return (n);
+
+#else  /* !HAVE_SYS_EPOLL_H */
+    errno = ENOSYS;
+    return (-1);
+#endif /* !HAVE_SYS_EPOLL_H */
+}
+
+
+static int
+_tpoll_timer_insert (tpoll_t tp, _tpoll_timer_t t)
+{
+/*  Inserts the timer [t] into [tp]'s timer heap and timer hash.
+ *  The heap and hash will grow as needed.
+ *  Returns 0 on success, or -1 on error.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    _tpoll_timer_t *heap_tmp;
+    _tpoll_timer_t *hash_tmp;
+    _tpoll_timer_t  u;
+    int             num_tmp;
+    int             i;
+    int             j;
+
+    assert (tp != NULL);
+    assert (t != NULL);
+    assert (t->id > 0);
+
+    if (tp->num_timers >= tp->num_timers_alloc) {
+        num_tmp = tp->num_timers_alloc * 2;
+        if (!(heap_tmp = realloc (tp->timers_heap,
+                num_tmp * sizeof (_tpoll_timer_t)))) {
+            return (-1);
+        }
+        tp->timers_heap = heap_tmp;
+        tp->num_timers_alloc = num_tmp;
+    }
+    /*  Rehash once the load factor exceeds 1.  A failure here is not fatal
+     *    since it only affects the length of the hash chains.
+     */
+    if (tp->num_timers >= tp->num_timers_hash) {
+        num_tmp = tp->num_timers_hash * 2;
+        if ((hash_tmp = calloc (num_tmp, sizeof (_tpoll_timer_t)))) {
+            for (i = 0; i < tp->num_timers_hash; i++) {
+                while ((u = tp->timers_hash[ i ])) {
+                    tp->timers_hash[ i ] = u->hash_next;
+                    j = u->id & (num_tmp - 1);
+                    u->hash_next = hash_tmp[ j ];
+                    hash_tmp[ j ] = u;
+                }
+            }
+            free (tp->timers_hash);
+            tp->timers_hash = hash_tmp;
+            tp->num_timers_hash = num_tmp;
+        }
+    }
+    j = t->id & (tp->num_timers_hash - 1);
+    t->hash_next = tp->timers_hash[ j ];
+    tp->timers_hash[ j ] = t;
+
+    t->heap_idx = tp->num_timers++;
+    tp->timers_heap[ t->heap_idx ] = t;
+    _tpoll_timer_sift_up (tp, t->heap_idx);
+    return (0);
+}
+
+
+static void
+_tpoll_timer_remove (tpoll_t tp, _tpoll_timer_t t)
+{
+/*  Removes the timer [t] from [tp]'s timer heap and timer hash.
+ *  The timer itself is not freed.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    _tpoll_timer_t *t_ptr;
+    _tpoll_timer_t  u;
+    int             i;
+
+    assert (tp != NULL);
+    assert (t != NULL);
+    assert (t->heap_idx >= 0);
+    assert (t->heap_idx < tp->num_timers);
+    assert (tp->timers_heap[ t->heap_idx ] == t);
+
+    t_ptr = &tp->timers_hash[ t->id & (tp->num_timers_hash - 1) ];
+    while (*t_ptr != t) {
+        assert (*t_ptr != NULL);
+        t_ptr = &((*t_ptr)->hash_next);
+    }
+    *t_ptr = t->hash_next;
+    t->hash_next = NULL;
+
+    /*  Replace the removed timer with the last timer in the heap, then
+     *    restore the heap property in whichever direction is needed.
+     */
+    i = t->heap_idx;
+    t->heap_idx = -1;
+    tp->num_timers--;
+    if (i < tp->num_timers) {
+        u = tp->timers_heap[ tp->num_timers ];
+        tp->timers_heap[ i ] = u;
+        u->heap_idx = i;
+        if ((i > 0)
+                && (_tpoll_timer_cmp (u, tp->timers_heap[ (i - 1) / 2 ]) < 0)) {
+            _tpoll_timer_sift_up (tp, i);
+        }
+        else {
+            _tpoll_timer_sift_down (tp, i);
+        }
+    }
+    return;
+}
+
+
+static _tpoll_timer_t
+_tpoll_timer_find (tpoll_t tp, int id)
+{
+/*  Returns the active timer [id] within the tpoll object [tp],
+ *    or NULL if not found.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    _tpoll_timer_t t;
+
+    assert (tp != NULL);
+    assert (id > 0);
+
+    t = tp->timers_hash[ id & (tp->num_timers_hash - 1) ];
+    while (t && (t->id != id)) {
+        t = t->hash_next;
+    }
+    return (t);
+}
+
+
+static int
+_tpoll_timer_cmp (_tpoll_timer_t t1, _tpoll_timer_t t2)
+{
+/*  Returns <0, 0, or >0 if timer [t1] expires before, at the same time as,
+ *    or after timer [t2].  Ties are broken by timer ID.
+ */
+    assert (t1 != NULL);
+    assert (t2 != NULL);
+
+    if (timercmp (&t1->tv, &t2->tv, <)) {
+        return (-1);
+    }
+    if (timercmp (&t1->tv, &t2->tv, >)) {
+        return (1);
+    }
+    return ((t1->id > t2->id) - (t1->id < t2->id));
+}
+
+
+static void
+_tpoll_timer_sift_up (tpoll_t tp, int i)
+{
+/*  Moves the timer at heap index [i] towards the root until its parent
+ *    expires no later than it does.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    _tpoll_timer_t t;
+    int            parent;
+
+    assert (tp != NULL);
+    assert ((i >= 0) && (i < tp->num_timers));
+
+    t = tp->timers_heap[ i ];
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (_tpoll_timer_cmp (tp->timers_heap[ parent ], t) <= 0) {
+            break;
+        }
+        tp->timers_heap[ i ] = tp->timers_heap[ parent ];
+        tp->timers_heap[ i ]->heap_idx = i;
+        i = parent;
+    }
+    tp->timers_heap[ i ] = t;
+    t->heap_idx = i;
+    return;
+}
+
+
+static void
+_tpoll_timer_sift_down (tpoll_t tp, int i)
+{
+/*  Moves the timer at heap index [i] towards the leaves until both of its
+ *    children expire no earlier than it does.
+ *  This routine assumes the [tp] mutex is already locked.
+ */
+    _tpoll_timer_t t;
+    int            child;
+
+    assert (tp != NULL);
+    assert ((i >= 0) && (i < tp->num_timers));
+
+    t = tp->timers_heap[ i ];
+    for (;;) {
+        child = (2 * i) + 1;
+        if (child >= tp->num_timers) {
+            break;
+        }
+        if ((child + 1 < tp->num_timers)
+                && (_tpoll_timer_cmp (tp->timers_heap[ child + 1 ],
+                    tp->timers_heap[ child ]) < 0)) {
+            child++;
+        }
+        if (_tpoll_timer_cmp (t, tp->timers_heap[ child ]) <= 0) {
+            break;
+        }
+        tp->timers_heap[ i ] = tp->timers_heap[ child ];
+        tp->timers_heap[ i ]->heap_idx = i;
+        i = child;
+    }
+    tp->timers_heap[ i ] = t;
+    t->heap_idx = i;
+    return;
+}
+
+
 static void
 _tpoll_get_timeval (struct timeval *tvp, int ms)
 {
@@ -43,6 +43,15 @@ typedef void (*callback_f) (void *arg);
  *  Function prototype for a timer callback function.
  */
 
+typedef struct tpoll_ready {
+/*
+ *  Data type for a file descriptor returned by tpoll_get_ready().
+ */
+    int              fd;                /* file descriptor with I/O ready    */
+    short int        revents;           /* events that occurred for fd       */
+    void            *arg;               /* arg assigned via tpoll_set_arg()  */
+} tpoll_ready_t;
+
 typedef enum {
 /*
  *  Data type for tpoll_zero() [how] parameter.
@@ -69,6 +78,10 @@ int tpoll_is_set (tpoll_t tp, int fd, short int events);
 
 int tpoll_set (tpoll_t tp, int fd, short int events);
 
+int tpoll_set_arg (tpoll_t tp, int fd, void *arg);
+
+int tpoll_get_ready (tpoll_t tp, tpoll_ready_t *ready, int len);
+
 int tpoll_timeout_absolute (tpoll_t tp, callback_f cb, void *arg,
     const struct timeval *tvp);
 
@@ -76,6 +89,8 @@ int tpoll_timeout_relative (tpoll_t tp, callback_f cb, void *arg, int ms);
 
 int tpoll_timeout_cancel (tpoll_t tp, int id);
 
+int tpoll_timeout_count (tpoll_t tp);
+
 int tpoll (tpoll_t tp, int ms);
 
 
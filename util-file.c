@@ -34,6 +34,7 @@
 #include <limits.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "log.h"
 #include "util-file.h"
@@ -205,6 +206,38 @@ ssize_t write_n(int fd, void *buf, size_t n)
 }
 
 
+ssize_t writev_n(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                return(-1);
+        }
+        n += nwritten;
+        while ((iovcnt > 0) && ((size_t) nwritten >= iov->iov_len)) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (nwritten > 0) {
+            iov->iov_base = (char *) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return(n);
+}
+
+
 ssize_t read_line(int fd, void *buf, size_t maxlen)
 {
     size_t n;